@@ -16,11 +16,13 @@
 #include <sstream>
 #include <iostream>
 #include <chrono>
+#include <random>
 #include <omp.h>
 
 const unsigned int MB = 1024*1024;
 
 std::vector<std::vector<float>> read_glove(const std::string& filename);
+uint32_t universe_size(const std::vector<std::vector<uint32_t>> & dataset);
 
 void bench_api_simhash(
     const std::vector<std::vector<float>> & dataset
@@ -57,6 +59,45 @@ void bench_api_simhash(
     });
 }
 
+void bench_api_minhash(
+    const std::vector<std::vector<uint32_t>> & dataset
+) {
+    auto bencher = ankerl::nanobench::Bench()
+        .title("MinHash computations")
+        .minEpochIterations(10)
+        .batch(dataset.size())
+        .timeUnit(std::chrono::nanoseconds(1), "ns");
+
+    puffinn::Dataset<puffinn::SetFormat> dat(universe_size(dataset));
+    for (auto v : dataset) { dat.insert(v); }
+    size_t n = dataset.size();
+
+    const unsigned int NUM_TABLES = 100;
+    auto source = puffinn::IndependentHashArgs<puffinn::MinHash>().build(
+        dat.get_description(), NUM_TABLES, 24
+    );
+    std::vector<std::unique_ptr<puffinn::Hash>> hash_fns;
+    for (unsigned int i=0; i < NUM_TABLES; i++) {
+        hash_fns.push_back(source->sample());
+    }
+
+    bencher.run("old API (per function)", [&] {
+        for (size_t i=0; i<n; i++) {
+            auto state = source->reset(dat[i], false);
+            for (auto& hash_fn : hash_fns) {
+                ankerl::nanobench::doNotOptimizeAway((*hash_fn)(state.get()));
+            }
+        }
+    });
+
+    std::vector<uint32_t> hashes;
+    bencher.run("new API (one pass over the tokens)", [&] {
+        for (size_t i=0; i<n; i++) {
+            source->hash_repetitions(dat[i], hashes);
+        }
+    });
+}
+
 template<typename THash, typename THashSourceArgs>
 void do_build_index(ankerl::nanobench::Bench * bencher, const char * name, const std::vector<std::vector<float>> & dataset, double index_memory) {
     auto dimensions = dataset[0].size(); 
@@ -167,6 +208,165 @@ void bench_query(const std::vector<std::vector<float>> & dataset) {
     });
 }
 
+void bench_search_batch(const std::vector<std::vector<float>> & dataset) {
+    auto dimensions = dataset[0].size();
+    const size_t NUM_QUERIES = 256;
+    auto index_memory = 100*MB;
+
+    puffinn::Index<puffinn::CosineSimilarity> index(
+        dimensions,
+        index_memory
+    );
+    for (auto v : dataset) { index.insert(v); }
+    index.rebuild();
+
+    std::vector<std::vector<float>> queries;
+    for (size_t i=0; i < NUM_QUERIES; i++) {
+        queries.push_back(dataset[(i*7919)%dataset.size()]);
+    }
+
+    auto bencher = ankerl::nanobench::Bench()
+        .title("Search a batch of queries")
+        .minEpochIterations(10)
+        .batch(NUM_QUERIES)
+        .timeUnit(std::chrono::microseconds(1), "us");
+
+    bencher.run("search (one query at a time)", [&] {
+        for (auto& q : queries) {
+            ankerl::nanobench::doNotOptimizeAway(index.search(q, 10, 0.9));
+        }
+    });
+    // Separates the gain of finding the starting points table by table from that of
+    // searching the queries in parallel.
+    auto max_threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    bencher.run("search_batch (1 thread)", [&] {
+        ankerl::nanobench::doNotOptimizeAway(index.search_batch(queries, 10, 0.9));
+    });
+    omp_set_num_threads(max_threads);
+    bencher.run("search_batch (max threads: " + std::to_string(max_threads) + ")", [&] {
+        ankerl::nanobench::doNotOptimizeAway(index.search_batch(queries, 10, 0.9));
+    });
+}
+
+// Walk the prefixes of a query in a PrefixMap as PrefixMap::get_next_range does, for the
+// given number of levels, reading the hashes and indices through the given functions.
+template <typename H, typename I>
+uint64_t walk_prefixes(
+    puffinn::LshDatatype query,
+    const puffinn::PrefixMap<puffinn::SimHash>& map,
+    H hash_at,
+    I index_at,
+    unsigned int levels
+) {
+    auto prefix = query >> (map.hash_length-map.prefix_index_bits);
+    size_t start = map.prefix_index[prefix];
+    size_t half = map.prefix_index[prefix+1]-start;
+    while (half != 0) {
+        half /= 2;
+        start = (hash_at(start+half) < query ? start+half+1 : start);
+    }
+    size_t end = start;
+    size_t padding_start = map.hashes.size()-puffinn::SEGMENT_SIZE;
+    puffinn::LshDatatype mask = 0xffffffff;
+    uint64_t sum = 0;
+    for (unsigned int level=0; level < levels; level++) {
+        puffinn::LshDatatype prev_mask = mask >> 1;
+        puffinn::LshDatatype removed_bit = prev_mask & (-prev_mask);
+        puffinn::LshDatatype hash_prefix = query & mask;
+        if ((query & removed_bit) == 0) {
+            size_t next = end;
+            while (next < padding_start && (hash_at(next) & mask) == hash_prefix) {
+                next += puffinn::SEGMENT_SIZE;
+            }
+            for (; end < std::min(next, padding_start); end++) {
+                sum += index_at(end);
+            }
+        } else {
+            size_t next = start;
+            while (next > puffinn::SEGMENT_SIZE && (hash_at(next-1) & mask) == hash_prefix) {
+                next = std::max<size_t>(next, puffinn::SEGMENT_SIZE+puffinn::SEGMENT_SIZE)-puffinn::SEGMENT_SIZE;
+            }
+            for (; start > next; start--) {
+                sum += index_at(start-1);
+            }
+        }
+        mask <<= 1;
+    }
+    return sum;
+}
+
+// Compare the layout of PrefixMap, where hashes and indices are separate arrays, to blocks
+// of 16 hashes followed by their 16 indices that together fill two cache lines.
+void bench_prefixmap_layout() {
+    const size_t NUM_MAPS = 50;
+    const size_t MAP_SIZE = 1000000;
+    const size_t NUM_QUERIES = 2000;
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<puffinn::LshDatatype> hash_distribution(0, (1 << puffinn::MAX_HASHBITS)-1);
+    std::vector<puffinn::PrefixMap<puffinn::SimHash>> maps;
+    // The blocks start at a multiple of 128 bytes, which is 32 values, in the storage.
+    std::vector<std::vector<uint32_t>> block_storage(NUM_MAPS);
+    std::vector<uint32_t*> blocks(NUM_MAPS);
+    for (size_t i=0; i < NUM_MAPS; i++) {
+        maps.emplace_back(puffinn::MAX_HASHBITS);
+        for (uint32_t idx=0; idx < MAP_SIZE; idx++) {
+            maps[i].insert(0, idx, hash_distribution(rng));
+        }
+        maps[i].rebuild();
+        auto len = maps[i].hashes.size();
+        block_storage[i].assign((len+15)/16*32+32, 0xffffffff);
+        auto offset = reinterpret_cast<uintptr_t>(block_storage[i].data())/sizeof(uint32_t)%32;
+        blocks[i] = block_storage[i].data()+(32-offset)%32;
+        for (size_t pos=0; pos < len; pos++) {
+            blocks[i][pos/16*32+pos%16] = maps[i].hashes[pos];
+            blocks[i][pos/16*32+16+pos%16] = maps[i].indices[pos];
+        }
+    }
+    std::vector<puffinn::LshDatatype> queries(NUM_QUERIES*NUM_MAPS);
+    for (auto& query : queries) {
+        query = hash_distribution(rng);
+    }
+
+    auto bencher = ankerl::nanobench::Bench()
+        .title("PrefixMap layout (per query and map)")
+        .batch(NUM_QUERIES*NUM_MAPS)
+        .minEpochIterations(10)
+        .timeUnit(std::chrono::nanoseconds(1), "ns");
+    for (unsigned int levels : { 2, 5, 8, 14 }) {
+        auto suffix = " (" + std::to_string(levels) + " levels)";
+        bencher.run("separate arrays" + suffix, [&] {
+            uint64_t sum = 0;
+            for (size_t q=0; q < NUM_QUERIES; q++) {
+                for (size_t i=0; i < NUM_MAPS; i++) {
+                    auto& map = maps[i];
+                    sum += walk_prefixes(
+                        queries[q*NUM_MAPS+i], map,
+                        [&](size_t pos) { return map.hashes[pos]; },
+                        [&](size_t pos) { return map.indices[pos]; },
+                        levels);
+                }
+            }
+            ankerl::nanobench::doNotOptimizeAway(sum);
+        });
+        bencher.run("blocks of 16 hashes and indices" + suffix, [&] {
+            uint64_t sum = 0;
+            for (size_t q=0; q < NUM_QUERIES; q++) {
+                for (size_t i=0; i < NUM_MAPS; i++) {
+                    auto block = blocks[i];
+                    sum += walk_prefixes(
+                        queries[q*NUM_MAPS+i], maps[i],
+                        [&](size_t pos) { return block[pos/16*32+pos%16]; },
+                        [&](size_t pos) { return block[pos/16*32+16+pos%16]; },
+                        levels);
+                }
+            }
+            ankerl::nanobench::doNotOptimizeAway(sum);
+        });
+    }
+}
+
 template<typename THash>
 void run_with_indirection(ankerl::nanobench::Bench * bencher, const char * name, const puffinn::Dataset<puffinn::UnitVectorFormat> & dataset) {
     auto hash_args = puffinn::IndependentHashArgs<THash>();
@@ -205,6 +405,24 @@ void run_single_hash(ankerl::nanobench::Bench * bencher, const char * name, cons
     });
 }
 
+template<typename THash>
+void run_block(ankerl::nanobench::Bench * bencher, const char * name, const puffinn::Dataset<puffinn::UnitVectorFormat> & dataset) {
+    // Number of vectors hashed together, as in Index::rebuild.
+    const size_t BLOCK_SIZE = 16;
+    auto hash_args = puffinn::IndependentHashArgs<THash>();
+    auto hash_source = hash_args.build(
+        dataset.get_description(),
+        1,
+        puffinn::MAX_HASHBITS);
+    auto storage_len = dataset.get_description().storage_len;
+    std::vector<uint32_t> hashes;
+    bencher->batch(BLOCK_SIZE).run(name, [&] {
+        hash_source->hash_repetitions_block(dataset[0], BLOCK_SIZE, storage_len, hashes);
+        ankerl::nanobench::doNotOptimizeAway(hashes[0]);
+    });
+    bencher->batch(1);
+}
+
 void bench_hash(const std::vector<std::vector<float>> & vectors) {
     auto dimensions = vectors[0].size(); 
 
@@ -225,10 +443,12 @@ void bench_hash(const std::vector<std::vector<float>> & vectors) {
     run_single_hash<puffinn::FHTCrossPolytopeHash>(&bencher, "FHT Cross polytope (single)", dataset);
     run_with_indirection<puffinn::FHTCrossPolytopeHash>(&bencher, "FHT cross polytope (indirection)", dataset);
     run_static<puffinn::FHTCrossPolytopeHash>(&bencher, "FHT cross polytope (static)", dataset);
+    run_block<puffinn::FHTCrossPolytopeHash>(&bencher, "FHT cross polytope (block, per vector)", dataset);
 
     run_single_hash<puffinn::SimHash>(&bencher, "SimHash (single)", dataset);
     run_with_indirection<puffinn::SimHash>(&bencher, "SimHash (indirection)", dataset);
     run_static<puffinn::SimHash>(&bencher, "SimHash (static)", dataset);
+    run_block<puffinn::SimHash>(&bencher, "SimHash (block, per vector)", dataset);
 }
 
 void bench_cosine(const std::vector<std::vector<float>> & vectors) {
@@ -250,6 +470,30 @@ void bench_cosine(const std::vector<std::vector<float>> & vectors) {
         ankerl::nanobench::doNotOptimizeAway(
             puffinn::CosineSimilarity::compute_similarity(dataset[0], dataset[1], desc));
     });
+
+    std::vector<std::pair<std::string, puffinn::DotProductI16>> kernels {
+        {"dot_product_i16 (scalar)", puffinn::dot_product_i16_simple},
+        {"dot_product_i16_exact (scalar)", puffinn::dot_product_i16_exact_simple}
+    };
+    #ifdef PUFFINN_RUNTIME_DISPATCH
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back({"dot_product_i16 (AVX2)", puffinn::dot_product_i16_avx2});
+            kernels.push_back({"dot_product_i16_exact (AVX2)", puffinn::dot_product_i16_exact_avx2});
+        }
+        if (__builtin_cpu_supports("avx512bw")) {
+            kernels.push_back({"dot_product_i16 (AVX-512BW)", puffinn::dot_product_i16_avx512});
+            kernels.push_back({"dot_product_i16_exact (AVX-512BW)", puffinn::dot_product_i16_exact_avx512});
+        }
+        if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+            kernels.push_back({"dot_product_i16_exact (VNNI)", puffinn::dot_product_i16_exact_vnni});
+        }
+    #endif
+    for (auto& kernel : kernels) {
+        auto f = kernel.second;
+        bencher.run(kernel.first, [&] {
+            ankerl::nanobench::doNotOptimizeAway(f(dataset[0], dataset[1], dimensions));
+        });
+    }
 }
 
 
@@ -269,6 +513,7 @@ void bench_jaccard(const std::vector<std::vector<uint32_t>> & vectors) {
         dataset.insert(v);
     }
     size_t n = dataset.get_size();
+    auto desc = dataset.get_description();
 
     auto bencher = ankerl::nanobench::Bench()
         .title("Jaccard")
@@ -315,6 +560,36 @@ void bench_jaccard(const std::vector<std::vector<uint32_t>> & vectors) {
             puffinn::JaccardSimilarity::compute_similarity_gallop(dataset[n/4+1], dataset[n/4]));
     });
 
+    bencher.run("Jaccard similarity (simd), long-long", [&] {
+        ankerl::nanobench::doNotOptimizeAway(
+            puffinn::JaccardSimilarity::compute_similarity(dataset[n-1], dataset[n-2], desc));
+    });
+
+    bencher.run("Jaccard similarity (simd), longish-longish", [&] {
+        ankerl::nanobench::doNotOptimizeAway(
+            puffinn::JaccardSimilarity::compute_similarity(dataset[n-100], dataset[n-101], desc));
+    });
+
+    bencher.run("Jaccard similarity (simd), long-short", [&] {
+        ankerl::nanobench::doNotOptimizeAway(
+            puffinn::JaccardSimilarity::compute_similarity(dataset[n-1], dataset[n/4], desc));
+    });
+
+    bencher.run("Jaccard similarity (simd), short-short", [&] {
+        ankerl::nanobench::doNotOptimizeAway(
+            puffinn::JaccardSimilarity::compute_similarity(dataset[n/4+1], dataset[n/4], desc));
+    });
+
+    bencher.run("Jaccard intersection (simd merge), long-short", [&] {
+        ankerl::nanobench::doNotOptimizeAway(puffinn::intersection_size_merge(
+            dataset[n/4]->data(), dataset[n/4]->size(), dataset[n-1]->data(), dataset[n-1]->size()));
+    });
+
+    bencher.run("Jaccard intersection (simd gallop), long-short", [&] {
+        ankerl::nanobench::doNotOptimizeAway(puffinn::intersection_size_gallop(
+            dataset[n/4]->data(), dataset[n/4]->size(), dataset[n-1]->data(), dataset[n-1]->size()));
+    });
+
 }
 
 std::vector<std::vector<uint32_t>> read_int_vectors_hdf5(std::string path) {
@@ -434,7 +709,10 @@ int main(int argc, char ** argv) {
     auto cosine_dataset = read_float_vectors_hdf5(argv[1], true);
 
     // bench_api_simhash(dataset);
+    // bench_api_minhash(jaccard_dataset);
     // bench_query(dataset);
+    // bench_search_batch(cosine_dataset);
+    // bench_prefixmap_layout();
     // bench_index_build(dataset);
     // bench_hash(dataset);
     // bench_join(dataset);
@@ -3,6 +3,7 @@
 #include "puffinn/collection.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/similarity_measure/l2.hpp"
+#include "puffinn/similarity_measure/quantized_cosine.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/hash_source/tensor.hpp"
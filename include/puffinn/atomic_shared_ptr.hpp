@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace puffinn {
+    // A shared pointer that can be loaded and replaced concurrently from multiple threads.
+    //
+    // Uses std::atomic<std::shared_ptr> when the standard library provides it (C++20).
+    // Otherwise it falls back to the atomic functions for shared_ptr, which libstdc++ implements
+    // using a global pool of mutexes that is shared with unrelated pointers.
+    // Neither is lock-free in libstdc++, but std::atomic<std::shared_ptr> only locks the pointer
+    // itself while the reference count is incremented.
+    template <typename T>
+    class AtomicSharedPtr {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        std::atomic<std::shared_ptr<T>> ptr;
+#else
+        std::shared_ptr<T> ptr;
+#endif
+
+    public:
+        AtomicSharedPtr(std::shared_ptr<T> value)
+          : ptr(std::move(value))
+        {
+        }
+
+        // Moving is not atomic, so no other thread can access either pointer meanwhile.
+        AtomicSharedPtr(AtomicSharedPtr&& other)
+          : AtomicSharedPtr(other.load())
+        {
+        }
+
+        AtomicSharedPtr& operator=(AtomicSharedPtr&& rhs) {
+            store(rhs.load());
+            return *this;
+        }
+
+        std::shared_ptr<T> load() const {
+#if defined(__cpp_lib_atomic_shared_ptr)
+            return ptr.load(std::memory_order_acquire);
+#else
+            return std::atomic_load_explicit(&ptr, std::memory_order_acquire);
+#endif
+        }
+
+        void store(std::shared_ptr<T> value) {
+#if defined(__cpp_lib_atomic_shared_ptr)
+            ptr.store(std::move(value), std::memory_order_release);
+#else
+            std::atomic_store_explicit(&ptr, std::move(value), std::memory_order_release);
+#endif
+        }
+    };
+}
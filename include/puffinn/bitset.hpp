@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "puffinn/typedefs.hpp"
+
+namespace puffinn {
+    // A fixed size set of flags packed into 64-bit words.
+    //
+    // Flags can be set and cleared concurrently from multiple threads, even when they
+    // share a word. Counting and iterating looks at whole words, so it is cheap when
+    // most flags are cleared.
+    class AtomicBitset {
+        size_t len;
+        size_t num_words;
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+    public:
+        static const size_t WORD_BITS = 64;
+
+        AtomicBitset(size_t len, bool value = false)
+          : len(len),
+            num_words((len+WORD_BITS-1)/WORD_BITS),
+            words(new std::atomic<uint64_t>[num_words])
+        {
+            for (size_t w=0; w < num_words; w++) {
+                uint64_t word = value ? ~0ull : 0;
+                if (value && w == num_words-1 && len%WORD_BITS != 0) {
+                    // Bits past the end are always cleared.
+                    word = (1ull << (len%WORD_BITS))-1;
+                }
+                words[w].store(word, std::memory_order_relaxed);
+            }
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+        size_t get_num_words() const {
+            return num_words;
+        }
+
+        // The flags at [w*WORD_BITS, (w+1)*WORD_BITS), where the lowest bit is the first flag.
+        uint64_t get_word(size_t w) const {
+            return words[w].load(std::memory_order_relaxed);
+        }
+
+        bool operator[](size_t idx) const {
+            return (get_word(idx/WORD_BITS) >> (idx%WORD_BITS)) & 1;
+        }
+
+        void set(size_t idx) {
+            words[idx/WORD_BITS].fetch_or(1ull << (idx%WORD_BITS), std::memory_order_relaxed);
+        }
+
+        void reset(size_t idx) {
+            words[idx/WORD_BITS].fetch_and(~(1ull << (idx%WORD_BITS)), std::memory_order_relaxed);
+        }
+
+        // Clear all flags that are set in the mask for the given word.
+        void reset_word(size_t w, uint64_t mask) {
+            words[w].fetch_and(~mask, std::memory_order_relaxed);
+        }
+
+        // Number of flags that are set.
+        size_t count() const {
+            size_t res = 0;
+            #pragma omp parallel for reduction(+: res) if(num_words >= (1 << 16))
+            for (size_t w=0; w < num_words; w++) {
+                res += popcountll(get_word(w));
+            }
+            return res;
+        }
+
+        // Call f(idx) for each flag that is set, in increasing order of index.
+        template <typename F>
+        void for_each_set(F f) const {
+            for (size_t w=0; w < num_words; w++) {
+                for_each_bit(w, get_word(w), f);
+            }
+        }
+
+        // Call f(idx) for each bit that is set in a word taken from the given position.
+        template <typename F>
+        static void for_each_bit(size_t w, uint64_t word, F f) {
+            while (word != 0) {
+                f(w*WORD_BITS+__builtin_ctzll(word));
+                word &= word-1;
+            }
+        }
+    };
+}
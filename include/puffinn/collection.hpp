@@ -1,29 +1,35 @@
 #pragma once
 
+#include "puffinn/atomic_shared_ptr.hpp"
+#include "puffinn/bitset.hpp"
 #include "puffinn/dataset.hpp"
 #include "puffinn/filterer.hpp"
 #include "puffinn/hash_source/deserialize.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
 #include "puffinn/hash_source/independent.hpp"
+#include "puffinn/logging.hpp"
+#include "puffinn/mapped_file.hpp"
 #include "puffinn/maxbuffer.hpp"
 #include "puffinn/maxbuffercollection.hpp"
 #include "puffinn/maxpairbuffer.hpp"
 #include "puffinn/prefixmap.hpp"
 #include "puffinn/typedefs.hpp"
 #include "puffinn/deduplicator.hpp"
+#include "puffinn/performance.hpp"
 
 #include "omp.h"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <istream>
 #include <iostream>
 #include <memory>
 #include <ostream>
+#include <sstream>
+#include <string>
 #include <unordered_set>
 #include <vector>
 
-// for debugging
-#include <chrono>
-
 namespace puffinn {
     /// Approaches to filtering candidates.
     enum class FilterType {
@@ -40,6 +46,30 @@ namespace puffinn {
         Simple
     };
 
+    // Version of the format written by Index::serialize.
+    // Increase it whenever the format changes, including changes to how the stored
+    // hashes are computed, since queries would otherwise be hashed differently.
+    // Data written before the format was versioned has no header and is rejected.
+    // Its hashes differ from version 1 in two ways: MinHash permuted the minimum hash
+    // instead of the minimum token, and SimHash used a rounded dot product.
+    const static uint32_t SERIALIZED_FORMAT_VERSION = 1;
+    const static char SERIALIZED_FORMAT_MAGIC[8] = {'P', 'U', 'F', 'F', 'I', 'N', 'N', 'S'};
+
+    // Read the header written by Index::serialize and check that the format is supported.
+    inline std::istream& read_serialized_header(std::istream& in) {
+        char magic[8];
+        uint32_t version = 0;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+        if (!in || std::memcmp(magic, SERIALIZED_FORMAT_MAGIC, sizeof(magic)) != 0) {
+            throw std::invalid_argument("not a serialized PUFFINN index");
+        }
+        if (version != SERIALIZED_FORMAT_VERSION) {
+            throw std::invalid_argument("unsupported serialized index version");
+        }
+        return in;
+    }
+
     class ChunkSerializable {
     public:
         virtual void serialize_chunk(std::ostream&, size_t) const = 0;
@@ -68,16 +98,6 @@ namespace puffinn {
         }
     };
 
-    size_t count_true(const std::vector<bool> & flags) {
-        size_t cnt = 0;
-        for (bool f : flags) {
-            if (f) {
-                cnt += 1;
-            }
-        }
-        return cnt;
-    }
-
     /// An index constructed over a dataset which supports approximate
     /// near-neighbor queries for a specific similarity measure.
     /// 
@@ -105,18 +125,45 @@ namespace puffinn {
         typename TSketch = typename TSim::DefaultSketch
     >
     class Index : ChunkSerializable {
+        // The structures built by ``rebuild``.
+        struct IndexTables {
+            // Hash tables used by LSH.
+            std::vector<PrefixMap<THash>> lsh_maps;
+            // Shared between versions since it is not modified after the first rebuild.
+            std::shared_ptr<HashSource<THash>> hash_source;
+            // Container of sketches. Also needs to be reset.
+            Filterer<TSketch> filterer;
+            Deduplicator deduplicator;
+            // Number of values inserted the last time rebuild was called.
+            uint32_t last_rebuild = 0;
+
+            IndexTables(Filterer<TSketch> filterer)
+              : filterer(std::move(filterer))
+            {
+            }
+        };
+
+        // File that the large structures refer to if the index was opened using ``open_mmap``.
+        std::shared_ptr<MappedFile> mapped_file;
         Dataset<typename TSim::Format> dataset;
-        // Hash tables used by LSH.
-        std::vector<PrefixMap<THash>> lsh_maps;
-        std::unique_ptr<HashSource<THash>> hash_source;
-        // Container of sketches. Also needs to be reset.
-        Filterer<TSketch> filterer;
-        Deduplicator deduplicator;
+        // The current version of the tables.
+        // ``rebuild`` builds a new version next to it, only reading the current one,
+        // and then replaces the pointer, so that searches can keep running.
+        // Each search holds a reference to the version it started with,
+        // which frees an old version once the last search using it has returned.
+        // Only the tables are versioned. ``insert``, ``remove`` and ``compact`` modify the
+        // dataset and removed_points in place, which searches read without synchronization,
+        // so they require exclusive access. ``compact`` also modifies the current version.
+        AtomicSharedPtr<IndexTables> tables;
 
         // Number of bytes allowed to be used.
         uint64_t memory_limit;
-        // Number of values inserted the last time rebuild was called.
-        uint32_t last_rebuild = 0;
+        // Number of bits in the hashes stored in the tables.
+        unsigned int hash_length = MAX_HASHBITS;
+        // Bitmap of removed points, which are kept in the structures until ``compact`` is called.
+        std::vector<uint64_t> removed_points;
+        // Number of bits set in removed_points.
+        uint32_t num_removed = 0;
         // Construction of the hash source is delayed until the
         // first rebuild so that we know how many tables are at most used.
         std::unique_ptr<HashSourceArgs<THash>> hash_args;
@@ -136,57 +183,76 @@ namespace puffinn {
         /// It is recommended to use the default value.
         /// @param sketch_args Similar to ``hash_args``, but for the hash family specified in ``TSketch``.
         /// It is recommended to use the default value.
+        /// @param hash_length The number of bits in the hashes stored in each table,
+        /// between 16 and 31.
+        /// Longer hashes keep the number of points sharing a hash small in large datasets,
+        /// at the cost of sorting and searching the tables with more passes.
+        /// Defaults to 24.
         Index(
             typename TSim::Format::Args dataset_args,
             uint64_t memory_limit,
             const HashSourceArgs<THash>& hash_args = IndependentHashArgs<THash>(),
-            const HashSourceArgs<TSketch>& sketch_args = IndependentHashArgs<TSketch>()
+            const HashSourceArgs<TSketch>& sketch_args = IndependentHashArgs<TSketch>(),
+            unsigned int hash_length = MAX_HASHBITS
         )
           : dataset(Dataset<typename TSim::Format>(dataset_args)),
-            filterer(sketch_args, dataset.get_description()),
+            tables(std::make_shared<IndexTables>(
+                Filterer<TSketch>(sketch_args, dataset.get_description()))),
             memory_limit(memory_limit),
+            hash_length(hash_length),
             hash_args(hash_args.copy())
         {
             static_assert(
                 std::is_same<TSim, typename THash::Sim>::value
                 && std::is_same<TSim, typename TSketch::Sim>::value,
                 "Hash function not applicable to similarity measure");
+            if (hash_length < MIN_HASH_LENGTH || hash_length > MAX_HASH_LENGTH) {
+                throw std::invalid_argument("hash_length");
+            }
         }
 
         /// Deserialize an index.
         ///
-        /// It is assumed that the input data is a serialized index
-        /// using the same version of PUFFINN.
+        /// Throws ``std::invalid_argument`` if the data was not written by ``serialize``
+        /// in the format of this version of PUFFINN.
         Index(std::istream& in)
-          : dataset(in),
-            filterer(in)
+          : dataset(read_serialized_header(in)),
+            tables(std::make_shared<IndexTables>(Filterer<TSketch>(in)))
         {
             hash_args = deserialize_hash_args<THash>(in);
             bool has_hash_source;
             in.read(reinterpret_cast<char*>(&has_hash_source), sizeof(bool));
+            auto& current = *tables.load();
             if (has_hash_source) {
-                hash_source = hash_args->deserialize_source(in);
+                current.hash_source = hash_args->deserialize_source(in);
             }
             size_t num_maps;
             in.read(reinterpret_cast<char*>(&num_maps), sizeof(size_t));
-            lsh_maps.reserve(num_maps);
+            current.lsh_maps.reserve(num_maps);
             bool use_chunks;
             in.read(reinterpret_cast<char*>(&use_chunks), sizeof(bool));
             if (!use_chunks) {
                 for (size_t i=0; i < num_maps; i++) {
                     // if num_maps is non-zero, hash_source is non-null
-                    lsh_maps.emplace_back(in, *hash_source);
+                    current.lsh_maps.emplace_back(in, *current.hash_source);
                 }
             }
             in.read(reinterpret_cast<char*>(&memory_limit), sizeof(uint64_t));
-            in.read(reinterpret_cast<char*>(&last_rebuild), sizeof(uint32_t));
+            in.read(reinterpret_cast<char*>(&hash_length), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&current.last_rebuild), sizeof(uint32_t));
+            size_t removed_len;
+            in.read(reinterpret_cast<char*>(&removed_len), sizeof(size_t));
+            removed_points.resize(removed_len);
+            in.read(reinterpret_cast<char*>(removed_points.data()), removed_len*sizeof(uint64_t));
+            in.read(reinterpret_cast<char*>(&num_removed), sizeof(uint32_t));
         }
 
         /// Deserialize a single chunk.
         void deserialize_chunk(std::istream& in) {
             // Assumes that hash_source is non-null,
             // which it will be if there were any chunks during serialization.
-            lsh_maps.emplace_back(in, *hash_source);
+            auto current = tables.load();
+            current->lsh_maps.emplace_back(in, *current->hash_source);
         }
 
         /// Serialize the index to the output stream to be loaded later.
@@ -197,45 +263,193 @@ namespace puffinn {
         ///
         /// @param use_chunks Whether to split the serialized index into chunks. Defaults to false.
         void serialize(std::ostream& out, bool use_chunks = false) const {
+            auto snapshot = tables.load();
+            out.write(SERIALIZED_FORMAT_MAGIC, sizeof(SERIALIZED_FORMAT_MAGIC));
+            out.write(
+                reinterpret_cast<const char*>(&SERIALIZED_FORMAT_VERSION),
+                sizeof(uint32_t));
             dataset.serialize(out);
-            filterer.serialize(out);
+            snapshot->filterer.serialize(out);
             hash_args->serialize(out);
-            bool has_hash_source = hash_source.get() != nullptr;
+            bool has_hash_source = snapshot->hash_source.get() != nullptr;
             out.write(reinterpret_cast<char*>(&has_hash_source), sizeof(bool));
             if (has_hash_source) {
-                hash_source->serialize(out);
+                snapshot->hash_source->serialize(out);
             }
-            size_t num_maps = lsh_maps.size();
+            size_t num_maps = snapshot->lsh_maps.size();
             out.write(reinterpret_cast<char*>(&num_maps), sizeof(size_t));
             out.write(reinterpret_cast<char*>(&use_chunks), sizeof(bool));
             if (!use_chunks) {
-                for (auto& m : lsh_maps) {
+                for (auto& m : snapshot->lsh_maps) {
                     m.serialize(out);
                 }
             }
             out.write(reinterpret_cast<const char*>(&memory_limit), sizeof(uint64_t));
-            out.write(reinterpret_cast<const char*>(&last_rebuild), sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(&hash_length), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&snapshot->last_rebuild), sizeof(uint32_t));
+            size_t removed_len = removed_points.size();
+            out.write(reinterpret_cast<const char*>(&removed_len), sizeof(size_t));
+            out.write(reinterpret_cast<const char*>(removed_points.data()), removed_len*sizeof(uint64_t));
+            out.write(reinterpret_cast<const char*>(&num_removed), sizeof(uint32_t));
         }
 
         /// Get an iterator over serialized chunks in the dataset.
         /// See ``serialize`` for its use.
         SerializeIter serialize_chunks() const {
-            return SerializeIter(*this, lsh_maps.size());
+            return SerializeIter(*this, tables.load()->lsh_maps.size());
+        }
+
+        /// Write the index to a file that can be opened using ``open_mmap``.
+        ///
+        /// The dataset, sketches and hash tables are stored as aligned sections,
+        /// so that they can be used directly from the file.
+        /// Points inserted since the last call to ``rebuild`` are stored,
+        /// but ``rebuild`` needs to be called again before they can be found.
+        ///
+        /// @param path Location of the file, which is overwritten if it exists.
+        void save_mmap(const std::string& path) const {
+            auto snapshot = tables.load();
+            MappedFileWriter file(path);
+            std::ostringstream meta;
+            dataset.serialize_mapped(meta, file);
+            snapshot->filterer.serialize_mapped(meta, file);
+            hash_args->serialize(meta);
+            bool has_hash_source = snapshot->hash_source.get() != nullptr;
+            meta.write(reinterpret_cast<char*>(&has_hash_source), sizeof(bool));
+            if (has_hash_source) {
+                snapshot->hash_source->serialize(meta);
+            }
+            size_t num_maps = snapshot->lsh_maps.size();
+            meta.write(reinterpret_cast<char*>(&num_maps), sizeof(size_t));
+            for (auto& m : snapshot->lsh_maps) {
+                m.serialize_mapped(meta, file);
+            }
+            meta.write(reinterpret_cast<const char*>(&memory_limit), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&hash_length), sizeof(unsigned int));
+            meta.write(reinterpret_cast<const char*>(&snapshot->last_rebuild), sizeof(uint32_t));
+            size_t removed_len = removed_points.size();
+            meta.write(reinterpret_cast<const char*>(&removed_len), sizeof(size_t));
+            meta.write(reinterpret_cast<const char*>(removed_points.data()), removed_len*sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&num_removed), sizeof(uint32_t));
+            file.finish(meta.str());
+        }
+
+        /// Open an index written by ``save_mmap``.
+        ///
+        /// The file is memory-mapped and queries are answered directly from the mapping,
+        /// so opening is fast regardless of the size of the index and
+        /// processes opening the same file share its pages.
+        /// Only the metadata, such as the parameters of the hash functions, is copied.
+        /// Modifying the index is supported, but copies the affected structures into memory.
+        ///
+        /// It is assumed that the file was written by an index of the same type
+        /// using the same version of PUFFINN.
+        ///
+        /// @param path Location of the file.
+        static Index open_mmap(const std::string& path) {
+            auto file = std::make_shared<MappedFile>(path);
+            auto buffer = file->metadata();
+            std::istream meta(&buffer);
+            return Index(file, meta);
         }
 
         /// Insert a value into the index.
         ///
         /// Before the value can be found using the ``search`` method,
         /// ``rebuild`` must be called.
+        ///
+        /// The dataset is modified in place and can be reallocated,
+        /// so no other method can be called concurrently.
         /// 
         /// @param value The value to insert.
         /// The type must be supported by the format used by ``TSim``.
         template <typename T>
         void insert(const T& value) {
             dataset.insert(value);
+            removed_points.resize((dataset.get_size()+63)/64, 0);
             // Dont insert into the hash tables as it would be in linear time.
         }
 
+        /// Remove a value from the index.
+        ///
+        /// The value is no longer returned by searches and joins,
+        /// but it still uses memory until ``compact`` is called.
+        /// Indices of other values are not affected.
+        ///
+        /// The removed values are not part of the versions built by ``rebuild``,
+        /// so no other method can be called concurrently.
+        ///
+        /// @param idx The index of the value to remove.
+        void remove(uint32_t idx) {
+            if (idx >= dataset.get_size()) {
+                throw std::invalid_argument("index out of range");
+            }
+            if (!is_removed_unchecked(idx)) {
+                removed_points[idx/64] |= (1ull << (idx%64));
+                num_removed++;
+            }
+        }
+
+        /// Check whether the value with the given index has been removed.
+        ///
+        /// @param idx The index of the value, which must be less than ``get_size()``.
+        bool is_removed(uint32_t idx) const {
+            if (idx >= dataset.get_size()) {
+                throw std::invalid_argument("index out of range");
+            }
+            return is_removed_unchecked(idx);
+        }
+
+        /// Discard the removed values from the index to reclaim their memory.
+        ///
+        /// The remaining values are assigned new indices,
+        /// which are contiguous and keep the order of insertion.
+        /// Values inserted since the last ``rebuild`` are kept and still require a ``rebuild``.
+        ///
+        /// Unlike ``rebuild``, the tables are modified in place,
+        /// so no other method can be called concurrently.
+        ///
+        /// @return For each index before the compaction, the new index of the value,
+        /// or ``REMOVED_INDEX`` if it was discarded.
+        std::vector<uint32_t> compact() {
+            auto& current = *tables.load();
+            size_t n = dataset.get_size();
+            std::vector<uint32_t> new_ids(n);
+            uint32_t kept = 0;
+            uint32_t kept_before_rebuild = 0;
+            for (size_t idx=0; idx < n; idx++) {
+                if (is_removed_unchecked(idx)) {
+                    new_ids[idx] = REMOVED_INDEX;
+                } else {
+                    new_ids[idx] = kept;
+                    kept++;
+                }
+                if (idx+1 == current.last_rebuild) {
+                    kept_before_rebuild = kept;
+                }
+            }
+            if (num_removed == 0) {
+                return new_ids;
+            }
+
+            auto& lsh_maps = current.lsh_maps;
+            size_t n_maps = lsh_maps.size();
+            #pragma omp parallel for
+            for (size_t map_idx = 0; map_idx < n_maps; map_idx++) {
+                lsh_maps[map_idx].compact(new_ids);
+            }
+            if (current.filterer.size() != 0) {
+                current.filterer.compact(new_ids);
+            }
+            current.deduplicator.compact(new_ids);
+            dataset.compact(new_ids);
+
+            current.last_rebuild = kept_before_rebuild;
+            removed_points.assign((kept+63)/64, 0);
+            num_removed = 0;
+            return new_ids;
+        }
+
         /// Retrieve the n'th value inserted into the index.
         ///
         /// Since the value is converted back from the internal storage format,
@@ -253,19 +467,36 @@ namespace puffinn {
         /// This is done in parallel by default.
         /// The number of threads used can be specified using the
         /// OMP_NUM_THREADS environment variable.
+        ///
+        /// The new tables are built next to the current ones, which are only read
+        /// and keep being used until the rebuild is done.
+        /// Therefore searches can run concurrently with ``rebuild``.
+        /// The other methods that modify the index, ``insert``, ``remove`` and ``compact``,
+        /// modify the dataset in place and require exclusive access.
+        /// Until the old tables are freed, both versions are kept in memory,
+        /// so the tables use up to twice as much memory as allowed by ``memory_limit``.
         void rebuild(bool with_sketches = true, bool deduplicate = false) {
             TIMER_START(index_build);
-            g_performance_metrics.start_timer(Computation::Indexing);
+            thread_performance_metrics().start_timer(Computation::Indexing);
+            auto current = tables.load();
+            auto last_rebuild = current->last_rebuild;
+            std::shared_ptr<IndexTables> next;
             if (with_sketches) {
-                std::cerr << "Building sketches" << std::endl;
-                // Compute sketches for the new vectors.
-                g_performance_metrics.start_timer(Computation::IndexSketching);
-                filterer.add_sketches(dataset, last_rebuild);
-                g_performance_metrics.store_time(Computation::IndexSketching);
+                PUFFINN_LOG(LogLevel::Debug, "Building sketches");
+                // Copy the sketches of the old vectors and compute them for the new vectors.
+                thread_performance_metrics().start_timer(Computation::IndexSketching);
+                next = std::make_shared<IndexTables>(
+                    Filterer<TSketch>(current->filterer, dataset, last_rebuild));
+                thread_performance_metrics().store_time(Computation::IndexSketching);
+            } else {
+                next = std::make_shared<IndexTables>(current->filterer);
             }
+            auto& lsh_maps = next->lsh_maps;
+            auto& filterer = next->filterer;
+            auto& deduplicator = next->deduplicator;
 
             auto desc = dataset.get_description();
-            auto table_bytes = PrefixMap<THash>::memory_usage(dataset.get_size(), hash_args->function_memory_usage(desc, MAX_HASHBITS));
+            auto table_bytes = PrefixMap<THash>::memory_usage(dataset.get_size(), hash_args->function_memory_usage(desc, hash_length));
             auto dedup_bytes = (deduplicate)? Deduplicator::repetition_memory_usage(dataset.get_size()) : 0;
             auto filterer_bytes = filterer.memory_usage(desc);
 
@@ -274,7 +505,7 @@ namespace puffinn {
             uint64_t table_mem = 0;
             while (required_mem + table_mem < memory_limit) {
                 num_tables++;
-                table_mem = hash_args->memory_usage(desc, num_tables, MAX_HASHBITS)
+                table_mem = hash_args->memory_usage(desc, num_tables, hash_length)
                     + num_tables * table_bytes
                     + num_tables * dedup_bytes;
             }
@@ -287,70 +518,85 @@ namespace puffinn {
                 throw std::invalid_argument("insufficient memory");
             }
 
-            std::cerr << "Number of tables: " << num_tables << std::endl;
+            PUFFINN_LOG(LogLevel::Info, "Number of tables: " << num_tables);
 
             // if rebuild has been called before
-            if (hash_source) {
-                // Resize the number of tables
-                while (lsh_maps.size() > num_tables) {
-                    // Discard the last tables. Since values are never deleted,
-                    // the number of tables is not going to increase again.
-                    lsh_maps.pop_back();
-                    // FIXME: support removing repetitions from the deduplicator
+            if (current->hash_source) {
+                next->hash_source = current->hash_source;
+                // Discard the last tables if there are too many. The hash source is built for
+                // the number of tables in the first rebuild, so tables are never added again.
+                num_tables = std::min<size_t>(num_tables, current->lsh_maps.size());
+                // FIXME: support removing repetitions from the deduplicator
+                if (deduplicate) {
+                    deduplicator = Deduplicator(current->deduplicator, dataset.get_size());
+                } else {
+                    deduplicator = current->deduplicator;
                 }
             } else {
-                hash_source = hash_args->build(
+                next->hash_source = hash_args->build(
                     dataset.get_description(),
                     num_tables,
-                    MAX_HASHBITS);
-                // Construct the prefixmaps.
-                lsh_maps.reserve(num_tables);
-                for (unsigned int repetition=0; repetition < num_tables; repetition++) {
-                    lsh_maps.emplace_back(MAX_HASHBITS);
-                }
+                    hash_length);
                 if (deduplicate) {
-                    deduplicator = Deduplicator(num_tables);
+                    deduplicator = Deduplicator(num_tables, hash_length);
+                    deduplicator.resize(dataset.get_size());
                 }
             }
 
-            for (auto& map : lsh_maps) {
-                map.reserve(dataset.get_size());
-            }
-            if (deduplicate) {
-                deduplicator.resize(dataset.get_size());
+            // Construct empty prefixmaps, into which the current ones are merged
+            // together with the new vectors.
+            lsh_maps.reserve(num_tables);
+            for (unsigned int repetition=0; repetition < num_tables; repetition++) {
+                lsh_maps.emplace_back(hash_length);
+                lsh_maps.back().reserve(dataset.get_size()-last_rebuild);
             }
 
-            g_performance_metrics.start_timer(Computation::IndexHashing);
+            thread_performance_metrics().start_timer(Computation::IndexHashing);
+            // Number of vectors that are hashed together.
+            const static size_t HASH_BLOCK_SIZE = 16;
             // Compute hashes for the new vectors in order, so that caching works.
-            // Hash a vector in all the different ways needed.
+            // Hash a block of vectors in all the different ways needed.
             std::vector<std::vector<LshDatatype>> tl_hash_values;
             tl_hash_values.resize(omp_get_max_threads());
-            for (size_t i=0; i < tl_hash_values.size(); i++) {
-                tl_hash_values[i].resize(lsh_maps.size());
-            }
+            auto storage_len = dataset.get_description().storage_len;
+            size_t num_blocks =
+                (dataset.get_size()-last_rebuild+HASH_BLOCK_SIZE-1)/HASH_BLOCK_SIZE;
             #pragma omp parallel for schedule(dynamic)
-            for (size_t idx=last_rebuild; idx < dataset.get_size(); idx++) {
+            for (size_t block=0; block < num_blocks; block++) {
                 auto tid = omp_get_thread_num();
                 auto & hash_values = tl_hash_values[tid];
+                size_t begin = last_rebuild+block*HASH_BLOCK_SIZE;
+                size_t end = std::min<size_t>(begin+HASH_BLOCK_SIZE, dataset.get_size());
                 // Write the hash values in the vector
-                this->hash_source->hash_repetitions(dataset[idx], hash_values);
-                // Copy the hash values in the appropriate prefix maps
-                for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
-                    lsh_maps[map_idx].insert(tid, idx, hash_values[map_idx]);
-                    if (deduplicate) {
-                        deduplicator.insert(idx, map_idx, hash_values[map_idx]);
+                next->hash_source->hash_repetitions_block(
+                    dataset[begin], end-begin, storage_len, hash_values);
+                // The source can have more tables than are used.
+                size_t source_tables = hash_values.size()/(end-begin);
+                for (size_t idx=begin; idx < end; idx++) {
+                    auto values = &hash_values[(idx-begin)*source_tables];
+                    // Copy the hash values in the appropriate prefix maps
+                    for (size_t map_idx = 0; map_idx < lsh_maps.size(); map_idx++) {
+                        lsh_maps[map_idx].insert(tid, idx, values[map_idx]);
+                        if (deduplicate) {
+                            deduplicator.insert(idx, map_idx, values[map_idx]);
+                        }
                     }
                 }
             }
-            g_performance_metrics.store_time(Computation::IndexHashing);
+            thread_performance_metrics().store_time(Computation::IndexHashing);
 
             size_t n_maps = lsh_maps.size();
             #pragma omp parallel for
             for (size_t map_idx = 0; map_idx < n_maps; map_idx++) {
-                lsh_maps[map_idx].rebuild();
+                if (map_idx < current->lsh_maps.size()) {
+                    lsh_maps[map_idx].rebuild(current->lsh_maps[map_idx]);
+                } else {
+                    lsh_maps[map_idx].rebuild();
+                }
             }
-            last_rebuild = dataset.get_size();
-            g_performance_metrics.store_time(Computation::Indexing);
+            next->last_rebuild = dataset.get_size();
+            tables.store(next);
+            thread_performance_metrics().store_time(Computation::Indexing);
             TIMER_STOP(index_build);
         }
 
@@ -366,6 +612,8 @@ namespace puffinn {
         /// This is given as a number between 0 and 1.
         /// @param filter_type The approach used to filter candidates.
         /// Unless the expected recall needs to be strictly above the ``recall`` parameter, the default should be used.
+        /// @param stats If given, metrics about the query are stored here.
+        /// They are collected even if ``set_performance_metrics_enabled`` has not been called.
         /// @return The indices of the ``k`` nearest found neighbors.
         /// Indices are assigned incrementally to each point in the order they are inserted into the dataset, starting at 0.
         /// The result is ordered so that the most similar neighbor is first.
@@ -374,15 +622,17 @@ namespace puffinn {
             const T& query,
             unsigned int k,
             float recall,
-            FilterType filter_type = FilterType::Default
+            FilterType filter_type = FilterType::Default,
+            QueryMetrics* stats = nullptr
         ) const {
-            if (filter_type != FilterType::None && filterer.size() != NUM_SKETCHES * dataset.get_size()) {
-                std::cerr << "Filterer size " << filterer.size() << " dataset size " << dataset.get_size() << std::endl;
+            auto snapshot = tables.load();
+            if (filter_type != FilterType::None && !has_all_sketches(*snapshot)) {
                 throw std::invalid_argument("Asked for a filtered search, but sketches have not been computed in the `rebuild` call.");
             }
             auto desc = dataset.get_description();
             auto stored_query = to_stored_type<typename TSim::Format>(query, desc);
-            return search_formatted_query(stored_query.get(), k, recall, filter_type);
+            return search_formatted_query(
+                *snapshot, stored_query.get(), k, recall, filter_type, stats);
         }
 
         /// Search for the approximate ``k`` nearest neighbors to a value already inserted into the index.
@@ -394,10 +644,13 @@ namespace puffinn {
             uint32_t idx,
             unsigned int k,
             float recall,
-            FilterType filter_type = FilterType::Default
+            FilterType filter_type = FilterType::Default,
+            QueryMetrics* stats = nullptr
         ) const {
             // search for one more as the query will be part of the result set.
-            auto res = search_formatted_query(dataset[idx], k+1, recall, filter_type);
+            auto snapshot = tables.load();
+            auto res = search_formatted_query(
+                *snapshot, dataset[idx], k+1, recall, filter_type, stats);
             if (res.size() != 0 && res[0] == idx) {
                 res.erase(res.begin());
             } else {
@@ -406,6 +659,53 @@ namespace puffinn {
             return res;
         }
 
+        /// Search for the approximate ``k`` nearest neighbors to each query in a batch.
+        ///
+        /// All queries are hashed up front, after which their starting points are found
+        /// table by table in a single pass over each table.
+        /// The queries are then searched in parallel using OpenMP, each in the same way as
+        /// by ``search``, so the results and the recall guarantee are the same.
+        /// Each thread searches queries that are close in the first table one after another,
+        /// so that they reuse the regions of the tables that are already in cache.
+        /// Metrics are collected for each query separately, as if it had been passed to ``search``
+        /// from the thread that searched it.
+        ///
+        /// @param queries The query values.
+        /// They follow the same constraints as when inserting a value.
+        /// @param k The number of neighbors to search for.
+        /// @param recall The expected recall of each result.
+        /// @param filter_type The approach used to filter candidates.
+        /// ``FilterType::Default`` and ``FilterType::Simple`` both filter using sketches.
+        /// @param stats If given, it is resized to the number of queries and
+        /// the metrics about each query are stored at the same position as the query.
+        /// They are collected even if ``set_performance_metrics_enabled`` has not been called.
+        /// @return For each query, in the same order as the input,
+        /// the indices of the ``k`` nearest found neighbors ordered so that the most similar neighbor is first.
+        template <typename T>
+        std::vector<std::vector<uint32_t>> search_batch(
+            const std::vector<T>& queries,
+            unsigned int k,
+            float recall,
+            FilterType filter_type = FilterType::Default,
+            std::vector<QueryMetrics>* stats = nullptr
+        ) const {
+            auto snapshot = tables.load();
+            if (filter_type != FilterType::None && !has_all_sketches(*snapshot)) {
+                throw std::invalid_argument("Asked for a filtered search, but sketches have not been computed in the `rebuild` call.");
+            }
+            auto desc = dataset.get_description();
+            std::vector<AlignedStorage<typename TSim::Format>> stored_queries;
+            std::vector<typename TSim::Format::Type*> query_ptrs;
+            stored_queries.reserve(queries.size());
+            query_ptrs.reserve(queries.size());
+            for (auto& query : queries) {
+                stored_queries.push_back(to_stored_type<typename TSim::Format>(query, desc));
+                query_ptrs.push_back(stored_queries.back().get());
+            }
+            return search_batch_formatted_queries(
+                *snapshot, query_ptrs, k, recall, filter_type, stats);
+        }
+
         /// Compute a bruteforce per-point top-K self-join on the current index.
         ///
         /// 
@@ -415,6 +715,10 @@ namespace puffinn {
         ) const {
             std::vector<std::vector<uint32_t>> res;
             for (size_t i = 0; i < dataset.get_size(); i++) {
+                if (is_removed_unchecked(i)) {
+                    res.emplace_back();
+                    continue;
+                }
                 res.push_back(search_bf_formatted_query(dataset[i], k));
             }
             return res;
@@ -423,18 +727,16 @@ namespace puffinn {
         bool check_active_counts(const std::vector<uint32_t>& indices, const std::vector<uint32_t>& segments,
             const bool* active, const std::vector<uint32_t>& active_counts) {
 
-            std::cerr << active_counts.size() << std::endl;
-            std::cerr << segments.size() - 1 << std::endl;
-            std::cerr << segments[segments.size() - 1] << std::endl;
+            PUFFINN_LOG(LogLevel::Debug, "Checking " << active_counts.size() << " active counts of "
+                << segments.size() - 1 << " segments ending at " << segments[segments.size() - 1]);
             for (uint32_t j = 2; j < segments.size(); j++) {
                 auto left = segments[j - 1];
                 auto right = segments[j] - 1;
                 auto cnt = 0;
 
-                std::cerr << j << " (" << left << " --- " << right << ") of " << segments.size() - 1 << std::endl;
                 for (size_t l = left; l <= right; l++) {
                     if (l <= 0 || l >= indices.size()) {
-                        std::cerr << l << std::endl;
+                        PUFFINN_LOG(LogLevel::Warning, "Segment " << j << " contains invalid position " << l);
                     }
                     if (active[indices[l]]) {
                         cnt++;
@@ -445,11 +747,11 @@ namespace puffinn {
                     }
                 }
                 if (cnt != active_counts[j-1]) {
-                    std::cerr << "error at " << j << ": " << cnt << " " << active_counts[j-1] << std::endl;
+                    PUFFINN_LOG(LogLevel::Warning, "Segment " << j << " has " << cnt
+                        << " active points, expected " << active_counts[j-1]);
                     return false;
                 }
             }
-            std::cerr << "Finished check!" << std::endl;
             return true;
         }
         
@@ -461,45 +763,314 @@ namespace puffinn {
             float recall,
             FilterType filter_type = FilterType::Default
         ) const {
-            if (filterer.size() == 0) {
-                throw std::runtime_error("Sketches are required");
+            auto snapshot = tables.load();
+            if (filter_type != FilterType::None && !has_all_sketches(*snapshot)) {
+                throw std::invalid_argument("Asked for a filtered search, but sketches have not been computed in the `rebuild` call.");
             }
             std::vector<std::vector<uint32_t>> res(dataset.get_size());
             #pragma omp parallel for schedule(dynamic)
             for (size_t i = 0; i < dataset.get_size(); i++) {
-                res[i] = search_formatted_query(dataset[i], k + 1, recall, filter_type);
+                if (is_removed_unchecked(i)) {
+                    continue;
+                }
+                res[i] = search_formatted_query(*snapshot, dataset[i], k + 1, recall, filter_type, nullptr);
                 res[i].erase(res[i].begin());
             }
             return res;
         }
 
-        void brute_force_some(std::vector<bool> & active, MaxBufferCollection & output) {
-            size_t n = dataset.get_size();
-            std::vector<size_t> indices;
-            for (size_t i=0; i<n; i++) {
-                if (active[i]) {
-                    indices.push_back(i);
+        // Compute the similarity between each point in left and each point in right using
+        // the block kernel of the similarity measure, and call insert(l, r, similarity) for each pair.
+        // sims is used as scratch space.
+        template <typename F>
+        void compare_blocks(
+            const uint32_t* left,
+            size_t n_left,
+            const uint32_t* right,
+            size_t n_right,
+            std::vector<float>& sims,
+            F insert
+        ) const {
+            // Limits the scratch space and keeps each block of right points in the cache
+            // while it is compared to a block of left points.
+            const size_t LEFT_BLOCK_SIZE = 32;
+            const size_t RIGHT_BLOCK_SIZE = 1024;
+            sims.resize(LEFT_BLOCK_SIZE*RIGHT_BLOCK_SIZE);
+            for (size_t left_start=0; left_start < n_left; left_start += LEFT_BLOCK_SIZE) {
+                size_t left_len = std::min(LEFT_BLOCK_SIZE, n_left-left_start);
+                for (size_t right_start=0; right_start < n_right; right_start += RIGHT_BLOCK_SIZE) {
+                    size_t right_len = std::min(RIGHT_BLOCK_SIZE, n_right-right_start);
+                    TSim::compute_similarity_block(
+                        dataset,
+                        &left[left_start],
+                        left_len,
+                        &right[right_start],
+                        right_len,
+                        sims.data());
+                    for (size_t l=0; l < left_len; l++) {
+                        for (size_t r=0; r < right_len; r++) {
+                            insert(left[left_start+l], right[right_start+r], sims[l*right_len+r]);
+                        }
+                    }
                 }
             }
-            if (indices.size() == 0) {
-                return;
+        }
+
+        // Compare the points at positions [left_begin, left_end) in the map with those at
+        // [right_begin, right_end), which must not overlap, skipping pairs where neither point is active.
+        // Active points on the left are compared to all points on the right, and inactive
+        // points on the left to the active points on the right.
+        // Returns the number of compared pairs.
+        template <typename F>
+        size_t join_segments_blocked(
+            const PrefixMap<THash>& map,
+            size_t left_begin,
+            size_t left_end,
+            size_t right_begin,
+            size_t right_end,
+            const AtomicBitset& active,
+            std::vector<float>& sims,
+            F insert
+        ) const {
+            std::vector<uint32_t> left_active, left_inactive, right_all, right_active;
+            for (size_t pos=left_begin; pos < left_end; pos++) {
+                auto idx = map.indices[pos];
+                if (!is_removed_unchecked(idx)) {
+                    (active[idx] ? left_active : left_inactive).push_back(idx);
+                }
+            }
+            for (size_t pos=right_begin; pos < right_end; pos++) {
+                auto idx = map.indices[pos];
+                if (!is_removed_unchecked(idx)) {
+                    right_all.push_back(idx);
+                    if (active[idx]) {
+                        right_active.push_back(idx);
+                    }
+                }
             }
-            std::cerr << "Brute forcing " << indices.size() << " vectors" << std::endl;
+            compare_blocks(
+                left_active.data(), left_active.size(),
+                right_all.data(), right_all.size(),
+                sims, insert);
+            compare_blocks(
+                left_inactive.data(), left_inactive.size(),
+                right_active.data(), right_active.size(),
+                sims, insert);
+            return left_active.size()*right_all.size()+left_inactive.size()*right_active.size();
+        }
 
-            #pragma omp parallel for
-            for(size_t i=0; i<indices.size(); i++) {
-                size_t r = indices[i];
-                for (size_t s=0; s<n; s++) {
-                    if (r != s) {
-                        auto dist = TSim::compute_similarity(
-                            dataset[r],
-                            dataset[s],
-                            dataset.get_description());
-                        output.insert(r, s, dist);
+        // Boundaries of the runs of equal hashes in the map, excluding the padding.
+        // The points at positions segments[j-1], ..., segments[j]-1 share the same hash
+        // for 0 < j < segments.size().
+        static std::vector<uint32_t> equal_hash_segments(const PrefixMap<THash>& map) {
+            std::vector<uint32_t> segments;
+            if (map.hashes.size() < 2*SEGMENT_SIZE) {
+                return segments;
+            }
+            uint32_t end = map.hashes.size()-SEGMENT_SIZE;
+            segments.reserve((end-SEGMENT_SIZE) / 5 + 2);
+            segments.push_back(SEGMENT_SIZE);
+            for (uint32_t pos = SEGMENT_SIZE+1; pos < end; pos++) {
+                if (map.hashes[pos] != map.hashes[pos-1]) {
+                    segments.push_back(pos);
+                }
+            }
+            segments.push_back(end);
+            return segments;
+        }
+
+        // The positions in a table of the points that are still active in lsh_join_stream,
+        // in increasing order, so that segments without active points can be skipped
+        // without looking at them.
+        struct ActiveLists {
+            std::vector<uint32_t> positions;
+
+            // Collect the active points in the map, excluding the padding.
+            void init(const PrefixMap<THash>& map, const AtomicBitset& active) {
+                positions.clear();
+                for (uint32_t pos = SEGMENT_SIZE; pos+SEGMENT_SIZE < map.indices.size(); pos++) {
+                    if (active[map.indices[pos]]) {
+                        positions.push_back(pos);
+                    }
+                }
+            }
+
+            // Remove the points that are no longer active.
+            // Only the previously active points are looked at.
+            void compact(const PrefixMap<THash>& map, const AtomicBitset& active) {
+                size_t write = 0;
+                for (auto pos : positions) {
+                    if (active[map.indices[pos]]) {
+                        positions[write++] = pos;
                     }
                 }
-                active[i] = false;
+                positions.resize(write);
+            }
+
+            // Number of active points at positions [begin, end).
+            uint32_t count(uint32_t begin, uint32_t end) const {
+                auto first = std::lower_bound(positions.begin(), positions.end(), begin);
+                return std::lower_bound(first, positions.end(), end)-first;
+            }
+        };
+
+        // Number of pairs of points that the work in lsh_join_stream is split into tiles of.
+        const static uint64_t JOIN_TILE_PAIRS = 1 << 16;
+
+        // A unit of work in lsh_join_stream in the table with index `table`.
+        //
+        // Small segments are grouped into runs, which cover the segments with indices in
+        // [first_segment, last_segment). In the initial self join these index the segments of
+        // equal hashes, and otherwise the splits of the table at the depth of the level.
+        // Large segments are split into tiles that compare the points at positions
+        // [left_begin, left_end) to those at [right_begin, right_end).
+        // If the two ranges are equal, each pair in the range is compared once.
+        struct JoinTile {
+            uint32_t table;
+            uint32_t first_segment;
+            uint32_t last_segment;
+            uint32_t left_begin;
+            uint32_t left_end;
+            uint32_t right_begin;
+            uint32_t right_end;
+            // Number of pairs that are compared, which is an upper bound for runs.
+            uint64_t pairs;
+
+            bool is_run() const {
+                return last_segment != 0;
+            }
+        };
+
+        // Groups consecutive small segments of a table into runs of about JOIN_TILE_PAIRS pairs.
+        class JoinRun {
+            uint32_t table;
+            uint32_t first_segment = 0;
+            uint64_t pairs = 0;
+
+        public:
+            JoinRun(uint32_t table) : table(table) {}
+
+            // Add the segment with the given index, closing the run once it is large enough.
+            void add(uint32_t segment, uint64_t segment_pairs, std::vector<JoinTile>& tiles) {
+                if (segment_pairs == 0) {
+                    return;
+                }
+                if (pairs == 0) {
+                    first_segment = segment;
+                }
+                pairs += segment_pairs;
+                if (pairs >= JOIN_TILE_PAIRS) {
+                    close(segment+1, tiles);
+                }
+            }
+
+            // End the run before the segment with the given index.
+            void close(uint32_t segment, std::vector<JoinTile>& tiles) {
+                if (pairs != 0) {
+                    tiles.push_back(JoinTile { table, first_segment, segment, 0, 0, 0, 0, pairs });
+                    pairs = 0;
+                }
+            }
+        };
+
+        // Split the comparison of the points at positions [left_begin, left_end) to those at
+        // [right_begin, right_end) into tiles of at most JOIN_TILE_PAIRS pairs.
+        // Equal ranges are split into triangles along the diagonal and rectangles above it.
+        static void add_join_tiles(
+            std::vector<JoinTile>& tiles,
+            uint32_t table,
+            uint32_t left_begin,
+            uint32_t left_end,
+            uint32_t right_begin,
+            uint32_t right_end
+        ) {
+            if (left_begin == right_begin) {
+                // Square root of JOIN_TILE_PAIRS.
+                const uint32_t SIDE = 256;
+                for (uint32_t l=left_begin; l < left_end; l += SIDE) {
+                    uint32_t l_end = std::min(l+SIDE, left_end);
+                    uint64_t l_len = l_end-l;
+                    tiles.push_back(JoinTile { table, 0, 0, l, l_end, l, l_end, l_len*(l_len-1)/2 });
+                    for (uint32_t r=l_end; r < right_end; r += SIDE) {
+                        uint32_t r_end = std::min(r+SIDE, right_end);
+                        tiles.push_back(JoinTile { table, 0, 0, l, l_end, r, r_end, l_len*(r_end-r) });
+                    }
+                }
+            } else {
+                uint64_t right_len = right_end-right_begin;
+                uint32_t right_step = (right_len < JOIN_TILE_PAIRS ? right_len : JOIN_TILE_PAIRS);
+                uint32_t left_step = std::max<uint64_t>(1, JOIN_TILE_PAIRS/right_step);
+                for (uint32_t l=left_begin; l < left_end; l += left_step) {
+                    uint32_t l_end = std::min(l+left_step, left_end);
+                    for (uint32_t r=right_begin; r < right_end; r += right_step) {
+                        uint32_t r_end = std::min(r+right_step, right_end);
+                        tiles.push_back(JoinTile {
+                            table, 0, 0, l, l_end, r, r_end, uint64_t(l_end-l)*(r_end-r) });
+                    }
+                }
+            }
+        }
+
+        // Combine the tiles of all tables with the largest first, so that the threads
+        // finish at about the same time when the tiles are handed out dynamically.
+        static std::vector<JoinTile> order_join_tiles(
+            const std::vector<std::vector<JoinTile>>& table_tiles
+        ) {
+            std::vector<JoinTile> tiles;
+            for (auto& t : table_tiles) {
+                tiles.insert(tiles.end(), t.begin(), t.end());
+            }
+            std::stable_sort(tiles.begin(), tiles.end(), [](const JoinTile& a, const JoinTile& b) {
+                return a.pairs > b.pairs;
+            });
+            return tiles;
+        }
+
+        // Compute the neighbors of the active points by comparing them to all other points
+        // and mark them as inactive.
+        // Returns the points that were active.
+        std::vector<uint32_t> brute_force_some(AtomicBitset& active, MaxBufferCollection & output) {
+            size_t n = dataset.get_size();
+            std::vector<uint32_t> indices;
+            active.for_each_set([&](size_t i) {
+                indices.push_back(i);
+            });
+            if (indices.size() == 0) {
+                return indices;
+            }
+            PUFFINN_LOG(LogLevel::Debug, "Brute forcing " << indices.size() << " vectors");
+
+            std::vector<uint32_t> candidates;
+            for (size_t s=0; s<n; s++) {
+                if (!is_removed_unchecked(s)) {
+                    candidates.push_back(s);
+                }
+            }
+
+            // Each thread compares a block of active points to all candidates.
+            const size_t BLOCK_SIZE = 32;
+            #pragma omp parallel
+            {
+                std::vector<float> sims;
+                #pragma omp for schedule(dynamic)
+                for (size_t start=0; start < indices.size(); start += BLOCK_SIZE) {
+                    compare_blocks(
+                        &indices[start],
+                        std::min(BLOCK_SIZE, indices.size()-start),
+                        candidates.data(),
+                        candidates.size(),
+                        sims,
+                        [&](uint32_t r, uint32_t s, float sim) {
+                            if (r != s) {
+                                output.insert(r, s, sim);
+                            }
+                        });
+                }
+            }
+            for (auto r : indices) {
+                active.reset(r);
             }
+            return indices;
         }
 
 
@@ -512,9 +1083,14 @@ namespace puffinn {
             float recall,
             FilterType /*filter_type*/ = FilterType::Default
         ) {
-            g_performance_metrics.clear();
-            g_performance_metrics.new_query();
-            g_performance_metrics.start_timer(Computation::Total);
+            // The metrics of a join are only used for logging and are not recorded
+            // in the histograms, which describe single queries. Hence no end_query.
+            thread_performance_metrics().new_query();
+            thread_performance_metrics().start_timer(Computation::Total);
+            // Keeps the tables alive if the index is rebuilt during the join.
+            auto snapshot = tables.load();
+            auto& lsh_maps = snapshot->lsh_maps;
+            auto& hash_source = snapshot->hash_source;
 
             size_t nthreads = omp_get_max_threads();
             
@@ -531,27 +1107,24 @@ namespace puffinn {
             // share the same hash code.
             std::vector<std::vector<uint32_t>> segments (lsh_maps.size());
 
-            g_performance_metrics.start_timer(Computation::SearchInit);
+            thread_performance_metrics().start_timer(Computation::SearchInit);
 
             TIMER_START(segment_self_join);
             // Set up data structures. Create segments for initial hash codes.
             #pragma omp parallel for
             for (size_t i = 0; i < lsh_maps.size(); i++) {
                 int tid = omp_get_thread_num();
-                segments[i].push_back(0);
-                for (size_t j = 1; j < lsh_maps[i].hashes.size(); j++) {
-                    if (lsh_maps[i].hashes[j] != lsh_maps[i].hashes[j-1]) {
-                        segments[i].push_back(j);
-                    }
-                }                
+                segments[i] = equal_hash_segments(lsh_maps[i]);
                 // Carry out initial all-to-all comparisons within a segment.
-                // We leave out the first and last segment since it's filled up with filler elements.
-                for (size_t j = 2; j < segments[i].size() - 1; j++) { 
+                for (size_t j = 1; j < segments[i].size(); j++) {
                     auto range = lsh_maps[i].get_segment(segments[i][j-1], segments[i][j]);
                     for (auto r = range.first; r < range.second; r++) {
                         for (auto s = r + 1; s < range.second; s++) {
                             auto R = *r;
                             auto S = *s;
+                            if (is_removed_unchecked(R) || is_removed_unchecked(S)) {
+                                continue;
+                            }
                             // std::cerr << "Comparing " << R << " and " << S << std::endl;
                             // comparisons++;
                             auto dist = TSim::compute_similarity(
@@ -563,46 +1136,42 @@ namespace puffinn {
                     }
                 }            
             }
-            g_performance_metrics.store_time(Computation::SearchInit);
+            thread_performance_metrics().store_time(Computation::SearchInit);
             TIMER_STOP(segment_self_join);
 
-            uint32_t prefix_mask = 0xffffffff;
-            for (int depth = MAX_HASHBITS; depth >= 0; depth--) {
+            for (int depth = hash_length; depth >= 0; depth--) {
                 // check current level
-                g_performance_metrics.start_timer(Computation::Search);
-                std::cerr << "Checking level " << depth << std::endl;
-                std::vector<std::vector<uint32_t>> new_segments (lsh_maps.size());
-                std::cerr << "Current k-th NN distance: " << tl_maxbuffer[0].smallest_value() << std::endl;
+                thread_performance_metrics().start_timer(Computation::Search);
+                PUFFINN_LOG(LogLevel::Debug, "Checking level " << depth
+                    << ", current k-th NN similarity " << tl_maxbuffer[0].smallest_value());
 
                 TIMER_START(segments_join);
                 #pragma omp parallel for
                 for (size_t i = 0; i < lsh_maps.size(); i++) {
                     int tid = omp_get_thread_num();
-                    new_segments[i].push_back(0);
-
-                    // check each pair of adjacent segments in lsh_maps[i] in ``depth``.
-                    for (size_t j = 2; j < segments[i].size() - 1; j++) {
-                        auto left = (lsh_maps[i].hashes[segments[i][j - 1]]) & prefix_mask;
-                        auto actual = (lsh_maps[i].hashes[segments[i][j]]) & prefix_mask;
-                        if (left == actual) {
-                            for (uint32_t r = segments[i][j-1]; r < segments[i][j]; r++) {
-                                for (uint32_t s = segments[i][j]; s < segments[i][j + 1]; s++) {
-                                    auto R = lsh_maps[i].indices[r];
-                                    auto S = lsh_maps[i].indices[s];
-
-                                    auto dist = TSim::compute_similarity(
-                                        dataset[R], 
-                                        dataset[S], 
-                                        dataset.get_description());
-                                    tl_maxbuffer[tid].insert(std::make_pair(R, S), dist);
+
+                    // check each pair of sibling segments in lsh_maps[i] that are merged in ``depth``.
+                    auto splits_end = lsh_maps[i].splits_end(depth);
+                    for (auto j = lsh_maps[i].splits_begin(depth); j < splits_end; j++) {
+                        auto split = lsh_maps[i].get_split(depth, j);
+                        for (uint32_t r = split.begin; r < split.split; r++) {
+                            for (uint32_t s = split.split; s < split.end; s++) {
+                                auto R = lsh_maps[i].indices[r];
+                                auto S = lsh_maps[i].indices[s];
+                                if (is_removed_unchecked(R) || is_removed_unchecked(S)) {
+                                    continue;
                                 }
+
+                                auto dist = TSim::compute_similarity(
+                                    dataset[R], 
+                                    dataset[S], 
+                                    dataset.get_description());
+                                tl_maxbuffer[tid].insert(std::make_pair(R, S), dist);
                             }
-                        } else {
-                            new_segments[i].push_back(segments[i][j]);
                         }
                     }
                 } 
-                g_performance_metrics.store_time(Computation::Search);   
+                thread_performance_metrics().store_time(Computation::Search);   
                 TIMER_STOP(segments_join);
 
                 TIMER_START(reconcile_maxbuffers);
@@ -610,41 +1179,42 @@ namespace puffinn {
                     tl_maxbuffer[0].add_all(tl_maxbuffer[tid]);
                 }
                 TIMER_STOP(reconcile_maxbuffers);
-            
 
-                std::cerr << " Check termination." << std::endl;
 
                 // remove inactive nodes
                 auto kth_similarity = tl_maxbuffer[0].smallest_value();
                 auto table_idx = lsh_maps.size();
-                auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
+                auto last_tables = (depth == static_cast<int>(hash_length) ? table_idx : lsh_maps.size());
                 float failure_prob = hash_source->failure_probability(
                     depth,
                     table_idx,
                     last_tables,
                     kth_similarity
                 );
-                std::cerr <<  failure_prob << std::endl;
-                // g_performance_metrics.store_time(Computation::CheckTermination);
+                PUFFINN_LOG(LogLevel::Debug, "Failure probability " << failure_prob);
+                // thread_performance_metrics().store_time(Computation::CheckTermination);
                 if (failure_prob <= 1-recall) {
                     break;
                 }
-
-                // prepare next round
-                segments = new_segments;
-                prefix_mask <<= 1;
             }
-            g_performance_metrics.store_time(Computation::Total);
-            std::cerr << k << "-th largest similarity: " << tl_maxbuffer[0].smallest_value() << std::endl;
+            thread_performance_metrics().store_time(Computation::Total);
+            PUFFINN_LOG(LogLevel::Info, k << "-th largest similarity: " << tl_maxbuffer[0].smallest_value());
             return tl_maxbuffer[0];//.best_indices();
         }
 
         MaxPairBuffer global_bf_join(unsigned int k) {
             MaxPairBuffer maxbuffer(k);
-            g_performance_metrics.new_query();
-            g_performance_metrics.start_timer(Computation::Total);
+            // Not recorded in the histograms, see global_lsh_join.
+            thread_performance_metrics().new_query();
+            thread_performance_metrics().start_timer(Computation::Total);
             for (size_t r = 0; r < dataset.get_size(); r++) {
+                if (is_removed_unchecked(r)) {
+                    continue;
+                }
                 for (size_t s = r + 1; s < dataset.get_size(); s++) {
+                    if (is_removed_unchecked(s)) {
+                        continue;
+                    }
                     auto dist = TSim::compute_similarity(
                         dataset[r], 
                         dataset[s], 
@@ -652,53 +1222,91 @@ namespace puffinn {
                     maxbuffer.insert(std::make_pair(r, s), dist);
                 }
             }
-            g_performance_metrics.store_time(Computation::Total);
+            thread_performance_metrics().store_time(Computation::Total);
             return maxbuffer;//.best_indices();
         }
 
         /// Compute a per-point top-K self-join on the current index with ``recall``.
         ///
-        /// 
+        /// The result is collected from ``lsh_join_stream``.
         std::vector<std::vector<uint32_t>> lsh_join(
             unsigned int k,
             float recall,
             float brute_force_perc,
+            FilterType filter_type = FilterType::Default
+        ) {
+            std::vector<std::vector<uint32_t>> res(dataset.get_size());
+            lsh_join_stream(
+                k,
+                recall,
+                brute_force_perc,
+                [&](uint32_t idx, std::vector<uint32_t>&& neighbors) {
+                    res[idx] = std::move(neighbors);
+                },
+                filter_type);
+            return res;
+        }
+
+        /// Compute a per-point top-K self-join on the current index with ``recall``,
+        /// passing the neighbors of each point on as soon as they are known.
+        ///
+        /// The join proceeds by decreasing the length of the hashes,
+        /// and the neighbors of a point are known once the probability of having missed one of them
+        /// is below ``1-recall``.
+        /// Points that are hard to confirm are compared to all other points at the end,
+        /// once their number is at most ``brute_force_perc`` times the size of the dataset.
+        /// Neighbors found for a point after it has been passed on are discarded.
+        /// Progress is reported to the logger after every level, see ``set_logger``.
+        ///
+        /// @param emit Called as ``emit(idx, neighbors)`` exactly once for each value that has not been removed,
+        /// where ``neighbors`` is a ``std::vector<uint32_t>&&`` of the indices of the ``k`` nearest found neighbors
+        /// ordered so that the most similar neighbor is first.
+        /// It is always called from the thread that started the join.
+        template <typename F>
+        void lsh_join_stream(
+            unsigned int k,
+            float recall,
+            float brute_force_perc,
+            F emit,
             FilterType /*filter_type*/ = FilterType::Default
         ) {
             TIMER_START(pre_initialization);
-            std::vector<std::vector<uint32_t>> res;
 
             // the number of pairs that would be evaluated by the brute force algorithm.
             size_t n = dataset.get_size();
             size_t brute_force_evaluations = (n * (n-1)) / 2;
-            std::cerr << "Dataset of size " << n
-                      << " overall pairs " << brute_force_evaluations
-                      << std::endl;
-
+            // Pairs of segments with at least this many pairs are compared using
+            // join_segments_blocked.
+            const size_t MIN_BLOCK_PAIRS = 4096;
+            PUFFINN_LOG(LogLevel::Info, "Dataset of size " << n
+                << " overall pairs " << brute_force_evaluations);
+
+            // Keeps the tables alive if the index is rebuilt during the join.
+            auto snapshot = tables.load();
+            auto& lsh_maps = snapshot->lsh_maps;
+            auto& hash_source = snapshot->hash_source;
+            auto& filterer = snapshot->filterer;
+            auto& deduplicator = snapshot->deduplicator;
             bool has_sketches = filterer.size() > 0;
             bool deduplicate = !deduplicator.is_empty();
 
-            g_performance_metrics.new_query();
-            g_performance_metrics.start_timer(Computation::Total);
+            // Not recorded in the histograms, see global_lsh_join.
+            thread_performance_metrics().new_query();
+            thread_performance_metrics().start_timer(Computation::Total);
             
-            size_t nthreads = omp_get_max_threads();
-            
-            // Allocate a buffer for each data point, for each thread
-#define BUFFCOLL // use the buffer collection
-#ifdef BUFFCOLL
-            std::vector<MaxBufferCollection> tl_maxbuffers(nthreads);
-#else
-            std::vector<std::vector<MaxBuffer>> tl_maxbuffers(nthreads);
-#endif
+            // A buffer for each data point, which is shared by all threads.
+            MaxBufferCollection maxbuffers;
 
             // Is a point still active?
-            // This vector is only written to in the `remove inactive nodes` phase,
+            // This is only written to in the `remove inactive nodes` phase,
             // so it is safe to parallelize reads in the repetitions 
             // loop where we check distances
-            std::vector<bool> active;
-            active.resize(dataset.get_size());
+            AtomicBitset active(dataset.get_size(), true);
             for (size_t i = 0; i < dataset.get_size(); i++) {
-                active[i] = true;
+                // Removed points need no neighbors
+                if (is_removed_unchecked(i)) {
+                    active.reset(i);
+                }
             }
 
             // Store the maximum number of allowed bits of difference in 64-bits sketches
@@ -706,16 +1314,7 @@ namespace puffinn {
             TIMER_STOP(pre_initialization);
             
             TIMER_START(maxbuffer_population);
-            #pragma omp parallel for schedule(static, 1)
-            for (size_t tid = 0; tid < nthreads; tid++) {
-#ifdef BUFFCOLL
-                tl_maxbuffers[tid].init(dataset.get_size(), k);
-#else
-                for (size_t i=0; i<dataset.get_size(); i++) {
-                    tl_maxbuffers[tid].emplace_back(k);
-                }
-#endif
-            }
+            maxbuffers.init(dataset.get_size(), k);
             TIMER_STOP(maxbuffer_population);
 
             size_t sketch_discarded_cnt = 0;
@@ -726,340 +1325,364 @@ namespace puffinn {
             // Store segments efficiently (?).
             // indices in segments[i][j-1], ..., segments[i][j]-1 in lsh_maps[i]
             // share the same hash code.
+            // Only used in the initial self join, after which the segments that are merged
+            // in each level are found using the splits of the tables.
             std::vector<std::vector<uint32_t>> segments (lsh_maps.size());
+            // The active points in each table.
+            std::vector<ActiveLists> active_lists (lsh_maps.size());
+
+            auto insert_pair = [&](uint32_t R, uint32_t S, float sim) {
+                maxbuffers.insert(R, S, sim);
+                maxbuffers.insert(S, R, sim);
+            };
+
+            // Compare the points at positions [left_begin, left_end) to those at
+            // [right_begin, right_end) in lsh_maps[i], only comparing each pair once if the
+            // ranges overlap. Pairs where neither point is active are skipped.
+            auto compare_positions = [&](
+                size_t i,
+                int depth,
+                uint32_t left_begin,
+                uint32_t left_end,
+                uint32_t right_begin,
+                uint32_t right_end,
+                size_t& tl_collision_cnt,
+                size_t& tl_sketch_discarded_cnt
+            ) {
+                for (auto r = left_begin; r < left_end; r++) {
+                    for (auto s = std::max(right_begin, r+1); s < right_end; s++) {
+                        // NOTE: profiling using perf shows that a lot of time (like 11%) in later iterations
+                        // is spent waiting for these two accesses. This is also the hottest spot in terms of cache misses.
+                        // As prefixes get shorter and segments get larger the problem is exacerbated,
+                        // since we are doing a lot of waiting on the memory for fewer and fewer actual distance
+                        // computations, so much that for the smallest prefixes the throughput (in terms of
+                        // distances per second) is orders of magnitude smaller than the throughput 
+                        // for longer prefixes.
+                        auto R = lsh_maps[i].indices[r];
+                        auto S = lsh_maps[i].indices[s];
+
+                        if (R == S) {
+                            // skip trivial matches
+                            continue;
+                        }
+                        if (!active[R] && !active[S]) {
+                            continue;
+                        }
+                        if (is_removed_unchecked(R) || is_removed_unchecked(S)) {
+                            continue;
+                        }
+                        if (deduplicate && deduplicator.compute_at(R, S, depth) != i) {
+                            // skip comparison if we should compute this in another repetition
+                            continue;
+                        }
 
-            g_performance_metrics.start_timer(Computation::SearchInit);
+                        tl_collision_cnt++;
+                        if (has_sketches) {
+                            size_t sketch_idx = i % NUM_SKETCHES;
 
-            TIMER_START(initial_scan);
-            // Set up data structures. Create segments for initial hash codes.
-            #pragma omp parallel for schedule(dynamic)
-            for (size_t i = 0; i < lsh_maps.size(); i++) {
-                size_t tl_sketch_discarded_cnt = 0;
-                size_t tl_collision_cnt = 0;
-                int tid = omp_get_thread_num();
-                segments[i].reserve(dataset.get_size() / 5); // Preallocate for efficiency
-
-                segments[i].push_back(0);
-                size_t largest_bucket = 0;
-                size_t self_join_pairs = 0;
-                for (size_t j = 1; j < lsh_maps[i].hashes.size(); j++) {
-                    if (lsh_maps[i].hashes[j] != lsh_maps[i].hashes[j-1]) {
-                        size_t size = j - segments[i][segments[i].size() - 1];
-                        segments[i].push_back(j);
-                        if (size > largest_bucket) {
-                            largest_bucket = size ;
+                            size_t R_threshold = sketch_diff_threshold[R];
+                            size_t S_threshold = sketch_diff_threshold[S];
+
+                            auto R_sketch = filterer.get_sketch(R, sketch_idx);
+                            auto S_sketch = filterer.get_sketch(S, sketch_idx);
+
+                            size_t hd = popcountll(R_sketch ^ S_sketch);
+
+                            if (hd > R_threshold && hd > S_threshold) {
+                                tl_sketch_discarded_cnt++;
+                                continue;
+                            }
                         }
-                        self_join_pairs += (size * (size-1)) / 2;
+                        auto sim = TSim::compute_similarity(
+                            dataset[R], 
+                            dataset[S], 
+                            dataset.get_description());
+                        insert_pair(R, S, sim);
                     }
                 }
-
-                size_t dcnt = 0;
-
-                std::cerr << "Start self join of "
-                        << segments[i].size() 
-                        <<  " segments with largest of size "
-                        << largest_bucket
-                        << " pairs to check "
-                        << self_join_pairs
-                        << std::endl;
-                // Carry out initial all-to-all comparisons within a segment.
-                // We leave out the first and last segment since it's filled up with filler elements.
-                for (size_t j = 2; j < segments[i].size() - 1; j++) { 
-                    auto range = lsh_maps[i].get_segment(segments[i][j-1], segments[i][j]);
-                    for (auto r = range.first; r < range.second; r++) {
-                        for (auto s = r+1; s < range.second; s++) {
-                            auto R = *r;
-                            auto S = *s;
-                            tl_collision_cnt++;
-                            if (deduplicate && deduplicator.compute_at(R, S, MAX_HASHBITS) != i) {
-                                // skip comparison if this pair should be computed in another repetition
+            };
+
+            // Compare the pairs in each tile, handing out the tiles to the threads as they
+            // become idle.
+            // In the initial self join the points within each segment are compared,
+            // and otherwise the two sides of each split at the given depth.
+            auto join_tiles = [&](
+                const std::vector<JoinTile>& tiles,
+                bool self_join,
+                int depth
+            ) {
+                #pragma omp parallel
+                {
+                    size_t tl_sketch_discarded_cnt = 0;
+                    size_t tl_collision_cnt = 0;
+                    std::vector<float> block_sims;
+                    #pragma omp for schedule(dynamic, 1)
+                    for (size_t t = 0; t < tiles.size(); t++) {
+                        auto& tile = tiles[t];
+                        auto i = tile.table;
+                        if (!tile.is_run()) {
+                            if (tile.left_begin != tile.right_begin && tile.pairs >= MIN_BLOCK_PAIRS) {
+                                // For large segments the scattered accesses in compare_positions dominate,
+                                // so the points are gathered and compared as a block instead.
+                                // Sketches and deduplication are not used, as looking them up
+                                // costs more than computing the similarities in the block.
+                                tl_collision_cnt += join_segments_blocked(
+                                    lsh_maps[i],
+                                    tile.left_begin,
+                                    tile.left_end,
+                                    tile.right_begin,
+                                    tile.right_end,
+                                    active,
+                                    block_sims,
+                                    insert_pair);
+                            } else {
+                                compare_positions(
+                                    i, depth,
+                                    tile.left_begin, tile.left_end,
+                                    tile.right_begin, tile.right_end,
+                                    tl_collision_cnt, tl_sketch_discarded_cnt);
+                            }
+                            continue;
+                        }
+                        for (auto j = tile.first_segment; j < tile.last_segment; j++) {
+                            if (self_join) {
+                                auto& seg = segments[i];
+                                compare_positions(
+                                    i, depth,
+                                    seg[j-1], seg[j], seg[j-1], seg[j],
+                                    tl_collision_cnt, tl_sketch_discarded_cnt);
                                 continue;
                             }
-                            dcnt++;
-                            auto dist = TSim::compute_similarity(
-                                dataset[R], 
-                                dataset[S], 
-                                dataset.get_description());
-#ifdef BUFFCOLL
-                            tl_maxbuffers[tid].insert(R, S, dist);
-                            tl_maxbuffers[tid].insert(S, R, dist);
-#else
-                            tl_maxbuffers[tid][R].insert(S, dist);
-                            tl_maxbuffers[tid][S].insert(R, dist);
-#endif
+                            auto split = lsh_maps[i].get_split(depth, j);
+                            if (active_lists[i].count(split.begin, split.end) == 0) {
+                                continue;
+                            }
+                            size_t block_pairs = (split.split-split.begin)*(split.end-split.split);
+                            if (block_pairs >= MIN_BLOCK_PAIRS) {
+                                tl_collision_cnt += join_segments_blocked(
+                                    lsh_maps[i],
+                                    split.begin,
+                                    split.split,
+                                    split.split,
+                                    split.end,
+                                    active,
+                                    block_sims,
+                                    insert_pair);
+                            } else {
+                                compare_positions(
+                                    i, depth,
+                                    split.begin, split.split, split.split, split.end,
+                                    tl_collision_cnt, tl_sketch_discarded_cnt);
+                            }
                         }
                     }
+                    #pragma omp atomic
+                    sketch_discarded_cnt += tl_sketch_discarded_cnt;
+                    #pragma omp atomic
+                    collision_cnt += tl_collision_cnt;
                 }
-                std::cerr << "Computed " << dcnt << " sims" << std::endl;
-                #pragma omp atomic
-                collision_cnt += tl_collision_cnt;
+            };
+
+            thread_performance_metrics().start_timer(Computation::SearchInit);
+
+            TIMER_START(initial_scan);
+            // Set up data structures. Create segments for initial hash codes.
+            std::vector<std::vector<JoinTile>> table_tiles(lsh_maps.size());
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i = 0; i < lsh_maps.size(); i++) {
+                segments[i] = equal_hash_segments(lsh_maps[i]);
+                active_lists[i].init(lsh_maps[i], active);
+
+                // Carry out initial all-to-all comparisons within a segment.
+                JoinRun run(i);
+                for (size_t j = 1; j < segments[i].size(); j++) {
+                    uint64_t size = segments[i][j] - segments[i][j-1];
+                    uint64_t pairs = size*(size-1)/2;
+                    if (pairs >= JOIN_TILE_PAIRS) {
+                        run.close(j, table_tiles[i]);
+                        add_join_tiles(
+                            table_tiles[i], i,
+                            segments[i][j-1], segments[i][j],
+                            segments[i][j-1], segments[i][j]);
+                    } else {
+                        run.add(j, pairs, table_tiles[i]);
+                    }
+                }
+                run.close(segments[i].size(), table_tiles[i]);
             }
-            g_performance_metrics.store_time(Computation::SearchInit);
+            join_tiles(order_join_tiles(table_tiles), true, hash_length);
+            segments.clear();
+            segments.shrink_to_fit();
+            thread_performance_metrics().store_time(Computation::SearchInit);
             TIMER_STOP(initial_scan);
 
-            uint32_t prefix_mask = 0xffffffff;
-            for (int depth = MAX_HASHBITS; depth >= 0; depth--) {
+            for (int depth = hash_length; depth >= 0; depth--) {
                 // check current level
-                g_performance_metrics.start_timer(Computation::Search);
+                thread_performance_metrics().start_timer(Computation::Search);
                 TIMER_START(count_active);
-                std::cerr << "----------------- Level " << depth << std::endl;
-                size_t active_count = count_true(active);
+                size_t active_count = active.count();
                 TIMER_STOP(count_active);
-                std::cerr << "Active nodes: " << active_count << std::endl;
+                PUFFINN_LOG(LogLevel::Debug, "Level " << depth << " active nodes: " << active_count);
                 if (active_count == 0) {
                     break;
                 }
                 if (active_count <= brute_force_perc * dataset.get_size()) {
-                    brute_force_some(active, tl_maxbuffers[0]);
+                    for (auto v : brute_force_some(active, maxbuffers)) {
+                        emit(v, maxbuffers.best_indices(v));
+                    }
                     break;
                 }
                 if (largest_unconfirmed_similarity < 0.05) {
-                    std::cerr << "Brute forcing last points with dissimilar nearest neighbors" << std::endl;
-                    brute_force_some(active, tl_maxbuffers[0]);
+                    PUFFINN_LOG(LogLevel::Debug,
+                        "Brute forcing last points with dissimilar nearest neighbors");
+                    for (auto v : brute_force_some(active, maxbuffers)) {
+                        emit(v, maxbuffers.best_indices(v));
+                    }
                     break;
                 }
-                std::vector<std::vector<uint32_t>> new_segments (lsh_maps.size());
-
-                // Count the number of pairs to be checked at this depth. If comparable to
-                // the number of distance evaluations that would be carried out by the 
-                // brute force, stop.
-                size_t n_pairs_to_check = 0;
+                // Find the pairs of segments to join, which are split into tiles of similar
+                // size, as the sizes of the segments are very skewed.
+                // These are the two sides of each split at this depth.
+                // Count the number of pairs to be checked at this depth.
+                std::vector<size_t> table_pairs_to_check(lsh_maps.size(), 0);
+                #pragma omp parallel for schedule(dynamic)
                 for (size_t i = 0; i < lsh_maps.size(); i++) {
-                    for (size_t j = 2; j < segments[i].size() - 1; j++) {
-                        auto left = (lsh_maps[i].hashes[segments[i][j - 1]]) & prefix_mask;
-                        auto actual = (lsh_maps[i].hashes[segments[i][j]]) & prefix_mask;
-                        if (left == actual) {
-                            size_t n_left = segments[i][j] - segments[i][j-1];
-                            size_t n_actual = segments[i][j+1] - segments[i][j];
-                            n_pairs_to_check += n_left * n_actual;
+                    table_tiles[i].clear();
+                    JoinRun run(i);
+                    auto splits_end = lsh_maps[i].splits_end(depth);
+                    for (auto j = lsh_maps[i].splits_begin(depth); j < splits_end; j++) {
+                        auto split = lsh_maps[i].get_split(depth, j);
+                        if (active_lists[i].count(split.begin, split.end) == 0) {
+                            // Neither side has active points, so the pairs are not checked.
+                            continue;
+                        }
+                        uint64_t n_left = split.split - split.begin;
+                        uint64_t n_right = split.end - split.split;
+                        table_pairs_to_check[i] += n_left * n_right;
+                        if (n_left * n_right >= JOIN_TILE_PAIRS) {
+                            run.close(j, table_tiles[i]);
+                            add_join_tiles(
+                                table_tiles[i], i,
+                                split.begin, split.split,
+                                split.split, split.end);
+                        } else {
+                            run.add(j, n_left * n_right, table_tiles[i]);
                         }
                     }
+                    run.close(splits_end, table_tiles[i]);
+                }
+                size_t n_pairs_to_check = 0;
+                for (auto pairs : table_pairs_to_check) {
+                    n_pairs_to_check += pairs;
                 }
-                std::cerr << "Prefix " << depth << " checking " 
-                          << n_pairs_to_check 
-                          << " ("
-                          << (100.0 * n_pairs_to_check / brute_force_evaluations)
-                          << "% of brute force: " << brute_force_evaluations << ")" << std::endl;
+                PUFFINN_LOG(LogLevel::Debug, "Prefix " << depth << " checking "
+                    << n_pairs_to_check
+                    << " (" << (100.0 * n_pairs_to_check / brute_force_evaluations)
+                    << "% of brute force: " << brute_force_evaluations << ")");
 
                 size_t old_collision_cnt = collision_cnt;
                 TIMER_START(join_segments);
-                #pragma omp parallel for schedule(dynamic)
-                for (size_t i = 0; i < lsh_maps.size(); i++) {
-                    /* #pragma omp critical */
-                    /* std::cerr << "Segments for repetition " << i */ 
-                    /*           << ": " << segments[i].size() << std::endl; */
-
-                    size_t tl_sketch_discarded_cnt = 0;
-                    size_t tl_collision_cnt = 0;
-                    int tid = omp_get_thread_num();
-                    // This push is safe to do in parallel because each entry of `new_segments` is touched by only one thread
-                    new_segments[i].push_back(0); 
-
-                    /* std::stringstream ss; */
-                    /* ss << "segments: [ " */
-                    /* for (auto seg : segments[i]) { */
-                    /*     ss << seg << " "; */
-                    /* } */
-                    /* ss << "]"; */
-                    /* std::cerr << ss << std::endl; */
-
-                    // check each pair of adjacent segments in lsh_maps[i] in ``depth``.
-                    for (size_t j = 2; j < segments[i].size() - 1; j++) {
-                        auto left = (lsh_maps[i].hashes[segments[i][j - 1]]) & prefix_mask;
-                        auto actual = (lsh_maps[i].hashes[segments[i][j]]) & prefix_mask;
-                        if (left == actual) {
-                            // count active nodes in the two segments
-                            size_t left_active = 0;
-                            for (auto r = segments[i][j-1]; r < segments[i][j]; r++) {
-                                if (active[lsh_maps[i].indices[r]]) {
-                                    left_active++;
-                                }
-                            }
-                            size_t actual_active = 0;
-                            for (auto  s = segments[i][j]; s < segments[i][j + 1]; s++) {
-                                if (active[lsh_maps[i].indices[s]]) {
-                                    actual_active++;
-                                }
-                            }
-                            /* std::cerr << "Active left: " << left_active */
-                            /*           << "Active actual: " << actual_active */
-                            /*           << std::endl; */
-                            if (left_active > 0 || actual_active > 0) {
-                                for (auto r = segments[i][j-1]; r < segments[i][j]; r++) {
-                                    for (auto  s = segments[i][j]; s < segments[i][j + 1]; s++) {
-                                        // NOTE: profiling using perf shows that a lot of time (like 11%) in later iterations
-                                        // is spent waiting for these two accesses. This is also the hottest spot in terms of cache misses.
-                                        // As prefixes get shorter and segments get larger the problem is exacerbated,
-                                        // since we are doing a lot of waiting on the memory for fewer and fewer actual distance
-                                        // computations, so much that for the smallest prefixes the throughput (in terms of
-                                        // distances per second) is orders of magnitude smaller than the throughput 
-                                        // for longer prefixes.
-                                        auto R = lsh_maps[i].indices[r];
-                                        auto S = lsh_maps[i].indices[s];
-
-                                        if (R == S) {
-                                            // skip trivial matches
-                                            continue;
-                                        }
-                                        if (!active[R] && !active[S]) {
-                                            continue;
-                                        }
-                                        if (deduplicate && deduplicator.compute_at(R, S, depth) != i) {
-                                            // skip comparison if we should compute this in another repetition
-                                            continue;
-                                        }
-
-                                        tl_collision_cnt++;
-                                        if (has_sketches) {
-                                            size_t sketch_idx = i % NUM_SKETCHES;
-
-                                            size_t R_threshold = sketch_diff_threshold[R];
-                                            size_t S_threshold = sketch_diff_threshold[S];
-
-                                            auto R_sketch = filterer.get_sketch(R, sketch_idx);
-                                            auto S_sketch = filterer.get_sketch(S, sketch_idx);
-
-                                            size_t hd = popcountll(R_sketch ^ S_sketch);
-
-                                            if (hd <= R_threshold || hd <= S_threshold) {
-                                                auto sim = TSim::compute_similarity(
-                                                    dataset[R], 
-                                                    dataset[S], 
-                                                    dataset.get_description());
-#ifdef BUFFCOLL
-                                                tl_maxbuffers[tid].insert(R, S, sim);
-                                                tl_maxbuffers[tid].insert(S, R, sim);
-#else
-                                                tl_maxbuffers[tid][R].insert(S, sim);
-                                                tl_maxbuffers[tid][S].insert(R, sim);
-#endif
-                                            } else {
-                                                tl_sketch_discarded_cnt++;
-                                            }
-                                        } else {
-                                            auto sim = TSim::compute_similarity(
-                                                dataset[R], 
-                                                dataset[S], 
-                                                dataset.get_description());
-#ifdef BUFFCOLL
-                                            tl_maxbuffers[tid].insert(R, S, sim);
-                                            tl_maxbuffers[tid].insert(S, R, sim);
-#else
-                                            tl_maxbuffers[tid][R].insert(S, sim);
-                                            tl_maxbuffers[tid][S].insert(R, sim);
-#endif
-                                        }
-                                    }
-                                }
-                            } 
-                        } else {
-                            new_segments[i].push_back(segments[i][j]);
-                        }
-                    }
-                    #pragma omp atomic
-                    sketch_discarded_cnt += tl_sketch_discarded_cnt;
-                    #pragma omp atomic
-                    collision_cnt += tl_collision_cnt;
-                }
+                join_tiles(order_join_tiles(table_tiles), false, depth);
                 TIMER_STOP(join_segments);
-                std::cerr << "Collisions checked " 
-                          << collision_cnt
-                          << " in this iteration "
-                          << (collision_cnt - old_collision_cnt)
-                          << std::endl;
-
-                TIMER_START(reconcile_buffers);
-                // accumulate all the information of a node in the first thread local buffer,
-                // which will be used for all subsequent evaluations about deactivation
-                // of single nodes
-                for(size_t tid = 1; tid < nthreads; tid++) {
-#ifdef BUFFCOLL
-                    tl_maxbuffers[0].add_all(tl_maxbuffers[tid]);
-#else
-                    for (size_t i=0; i<dataset.get_size(); i++) {
-                        tl_maxbuffers[0][i].add_all(tl_maxbuffers[tid][i]);
-                    }
-#endif
-                }
-                TIMER_STOP(reconcile_buffers);
+                PUFFINN_LOG(LogLevel::Debug, "Collisions checked " << collision_cnt
+                    << " in this iteration " << (collision_cnt - old_collision_cnt));
 
-                g_performance_metrics.store_time(Computation::Search);   
+
+                thread_performance_metrics().store_time(Computation::Search);   
 
                 TIMER_START(inactive_nodes_removal);
                 size_t removed_nodes = 0;
                 largest_unconfirmed_similarity = 0.0;
                 largest_unconfirmed_failure_prob = 0.0;
-                g_performance_metrics.start_timer(Computation::Filtering);
+                thread_performance_metrics().start_timer(Computation::Filtering);
                 // remove inactive nodes
-                for (size_t v=0; v < dataset.get_size(); v++) {
-                    if (active[v]) {
-                        // we have reconciled the thread local max buffers, so we can look at the first
-#ifdef BUFFCOLL
-                        auto kth_similarity = tl_maxbuffers[0].smallest_value(v);
-#else
-                        auto kth_similarity = tl_maxbuffers[0][v].smallest_value();
-#endif
-                        if (kth_similarity > 0.0) { // the similarity is negative if we have yet to collect k neighbors for v
+                // The points are checked in parallel, but they are passed on afterwards as emit
+                // is only called from this thread.
+                std::vector<uint64_t> removed_words(active.get_num_words(), 0);
+                #pragma omp parallel
+                {
+                    size_t tl_removed_nodes = 0;
+                    float tl_largest_similarity = 0.0;
+                    float tl_largest_failure_prob = 0.0;
+                    #pragma omp for schedule(dynamic, 64)
+                    for (size_t w=0; w < active.get_num_words(); w++) {
+                        uint64_t removed = 0;
+                        AtomicBitset::for_each_bit(w, active.get_word(w), [&](size_t v) {
+                            auto kth_similarity = maxbuffers.smallest_value(v);
+                            if (kth_similarity <= 0.0) {
+                                // the similarity is zero if we have yet to collect k neighbors for v
+                                return;
+                            }
                             auto table_idx = lsh_maps.size();
-                            auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
+                            auto last_tables = (depth == static_cast<int>(hash_length) ? table_idx : lsh_maps.size());
                             float failure_prob = hash_source->failure_probability(
                                 depth,
                                 table_idx,
                                 last_tables,
                                 kth_similarity
                             );
-                            /* printf("Failure probability %f, similarity %f\n", failure_prob, kth_similarity); */
                             if (has_sketches) {
                                 sketch_diff_threshold[v] = filterer.get_max_sketch_diff(kth_similarity);
                             }
                             if (failure_prob <= 1-recall) {
-                                active[v] = false;
-                                removed_nodes++;
-                            } else if (kth_similarity > largest_unconfirmed_similarity) {
-                                largest_unconfirmed_similarity = kth_similarity;
-                                largest_unconfirmed_failure_prob = failure_prob;
+                                removed |= 1ull << (v%AtomicBitset::WORD_BITS);
+                                tl_removed_nodes++;
+                            } else if (kth_similarity > tl_largest_similarity) {
+                                tl_largest_similarity = kth_similarity;
+                                tl_largest_failure_prob = failure_prob;
                             }
+                        });
+                        active.reset_word(w, removed);
+                        removed_words[w] = removed;
+                    }
+                    #pragma omp critical
+                    {
+                        removed_nodes += tl_removed_nodes;
+                        if (tl_largest_similarity > largest_unconfirmed_similarity) {
+                            largest_unconfirmed_similarity = tl_largest_similarity;
+                            largest_unconfirmed_failure_prob = tl_largest_failure_prob;
                         }
                     }
                 }
-                std::cerr << "Removed " << removed_nodes << " points." 
-                          << " Largest unconfirmed " << largest_unconfirmed_similarity
-                          << " with failure probability " << largest_unconfirmed_failure_prob
-                          << std::endl;
+                for (size_t w=0; w < removed_words.size(); w++) {
+                    AtomicBitset::for_each_bit(w, removed_words[w], [&](size_t v) {
+                        emit(v, maxbuffers.best_indices(v));
+                    });
+                }
+                PUFFINN_LOG(LogLevel::Debug, "Removed " << removed_nodes << " points."
+                    << " Largest unconfirmed " << largest_unconfirmed_similarity
+                    << " with failure probability " << largest_unconfirmed_failure_prob);
                 TIMER_STOP(inactive_nodes_removal);
-                g_performance_metrics.store_time(Computation::Filtering);
+                thread_performance_metrics().store_time(Computation::Filtering);
+                report_join_progress(JoinProgress {
+                    static_cast<unsigned int>(depth),
+                    active_count-removed_nodes,
+                    collision_cnt
+                });
 
                 // prepare next round
-                segments = new_segments;
-                prefix_mask <<= 1;
+                #pragma omp parallel for schedule(dynamic)
+                for (size_t i = 0; i < lsh_maps.size(); i++) {
+                    active_lists[i].compact(lsh_maps[i], active);
+                }
             }
-            size_t active_count = count_true(active);
+            size_t active_count = active.count();
             if (active_count > 0) {
-                std::cerr << "FATAL: There are still " << active_count
-                          << " active nodes " << std::endl;
-                throw 1;
+                throw std::logic_error(
+                    "join finished with " + std::to_string(active_count) + " active points");
             }
             
-            g_performance_metrics.store_time(Computation::Total);
-            std::cerr << "total time " << g_performance_metrics.get_total_time(Computation::Total)
-                      << " of which: " 
-                      << std::endl << "  init:      " << g_performance_metrics.get_total_time(Computation::SearchInit)
-                      << std::endl << "  search:    " << g_performance_metrics.get_total_time(Computation::Search)
-                      << std::endl << "  filtering: " << g_performance_metrics.get_total_time(Computation::Filtering)
-                      << std::endl << "  max buffer filter: " << g_performance_metrics.get_total_time(Computation::MaxbufferFilter)
-                      << std::endl;
-            std::cerr << "collisions " << collision_cnt << " sketch discarded " << sketch_discarded_cnt
-                      << " i.e. " << (100.0 * sketch_discarded_cnt / collision_cnt) << "%" << std::endl;
-
-            for (size_t i = 0; i < dataset.get_size(); i++) {
-#ifdef BUFFCOLL
-                auto best = tl_maxbuffers[0].best_indices(i);
-#else
-                auto best = tl_maxbuffers[0][i].best_indices();
-#endif
-                res.push_back(best);
-            }
-            return res;
+            thread_performance_metrics().store_time(Computation::Total);
+            auto& join_metrics = thread_performance_metrics().get_query_metrics();
+            PUFFINN_LOG(LogLevel::Debug, "total cycles " << join_metrics.get_cycles(Computation::Total)
+                << " of which:"
+                << " init " << join_metrics.get_cycles(Computation::SearchInit)
+                << " search " << join_metrics.get_cycles(Computation::Search)
+                << " filtering " << join_metrics.get_cycles(Computation::Filtering)
+                << " max buffer filter " << join_metrics.get_cycles(Computation::MaxbufferFilter));
+            PUFFINN_LOG(LogLevel::Info, "collisions " << collision_cnt
+                << " sketch discarded " << sketch_discarded_cnt
+                << " i.e. " << (100.0 * sketch_discarded_cnt / collision_cnt) << "%");
         }
 
 
@@ -1091,22 +1714,70 @@ namespace puffinn {
 
         // Retrieve the number of tables used internally.
         size_t get_repetitions() const {
-            return lsh_maps.size();
+            return tables.load()->lsh_maps.size();
         }
 
     private:
+        // Same as is_removed for an index that is known to be in range.
+        bool is_removed_unchecked(uint32_t idx) const {
+            return (removed_points[idx/64] >> (idx%64)) & 1;
+        }
+
+        // Whether the sketches of every point in the tables have been computed.
+        static bool has_all_sketches(const IndexTables& snapshot) {
+            return snapshot.filterer.size() == NUM_SKETCHES * snapshot.last_rebuild;
+        }
+
+        Index(std::shared_ptr<MappedFile> file, std::istream& meta)
+          : mapped_file(file),
+            dataset(meta, *file),
+            tables(std::make_shared<IndexTables>(Filterer<TSketch>(meta, *file)))
+        {
+            hash_args = deserialize_hash_args<THash>(meta);
+            bool has_hash_source;
+            meta.read(reinterpret_cast<char*>(&has_hash_source), sizeof(bool));
+            auto& current = *tables.load();
+            if (has_hash_source) {
+                current.hash_source = hash_args->deserialize_source(meta);
+            }
+            size_t num_maps;
+            meta.read(reinterpret_cast<char*>(&num_maps), sizeof(size_t));
+            current.lsh_maps.reserve(num_maps);
+            for (size_t i=0; i < num_maps; i++) {
+                current.lsh_maps.emplace_back(meta, *file);
+            }
+            meta.read(reinterpret_cast<char*>(&memory_limit), sizeof(uint64_t));
+            meta.read(reinterpret_cast<char*>(&hash_length), sizeof(unsigned int));
+            meta.read(reinterpret_cast<char*>(&current.last_rebuild), sizeof(uint32_t));
+            size_t removed_len;
+            meta.read(reinterpret_cast<char*>(&removed_len), sizeof(size_t));
+            removed_points.resize(removed_len);
+            meta.read(reinterpret_cast<char*>(removed_points.data()), removed_len*sizeof(uint64_t));
+            meta.read(reinterpret_cast<char*>(&num_removed), sizeof(uint32_t));
+            if (!meta) {
+                throw std::invalid_argument("corrupt index file");
+            }
+        }
+
         std::vector<unsigned int> search_bf_formatted_query(
             typename TSim::Format::Type* query,
             unsigned int k
         ) const {
             MaxBuffer res(k);
+            unsigned int num_computed = 0;
             for (size_t i=0; i < dataset.get_size(); i++) {
+                if (is_removed_unchecked(i)) {
+                    continue;
+                }
                 float sim = TSim::compute_similarity(
                     query,
                     dataset[i],
                     dataset.get_description());
                 res.insert(i, sim);
+                num_computed++;
             }
+            thread_performance_metrics().add_candidates(num_computed);
+            thread_performance_metrics().add_distance_computations(num_computed);
             std::vector<uint32_t> res_indices;
             for (auto p : res.best_entries()) {
                 res_indices.push_back(p.first);
@@ -1115,55 +1786,161 @@ namespace puffinn {
         }
 
         std::vector<uint32_t> search_formatted_query(
+            const IndexTables& snapshot,
             typename TSim::Format::Type* query,
             unsigned int k,
             float recall,
-            FilterType filter_type
+            FilterType filter_type,
+            QueryMetrics* stats
         ) const {
-            if (dataset.get_size() < 100) {
+            auto& metrics = thread_performance_metrics();
+            metrics.new_query(stats != nullptr);
+            metrics.start_timer(Computation::Total);
+            std::vector<uint32_t> res;
+            if (snapshot.last_rebuild < 100) {
                 // Due to optimizations values near the edges in prefixmaps are discarded.
                 // When there are fewer total values than SEGMENT_SIZE, all values will be skipped.
                 // However at that point, brute force is likely to be faster regardless.
-                return search_bf_formatted_query(query, k);
+                res = search_bf_formatted_query(query, k);
+            } else {
+                res = search_formatted_query_tables(snapshot, query, k, recall, filter_type);
+            }
+            metrics.store_time(Computation::Total);
+            metrics.end_query();
+            if (stats != nullptr) {
+                *stats = metrics.get_query_metrics();
             }
-            g_performance_metrics.new_query();
-            g_performance_metrics.start_timer(Computation::Total);
+            return res;
+        }
 
-            MaxBuffer maxbuffer(k);
-            g_performance_metrics.start_timer(Computation::Hashing);
+        std::vector<uint32_t> search_formatted_query_tables(
+            const IndexTables& snapshot,
+            typename TSim::Format::Type* query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type
+        ) const {
+            thread_performance_metrics().start_timer(Computation::Hashing);
             std::vector<LshDatatype> query_hashes;
-            hash_source->hash_repetitions(query, query_hashes);
-            g_performance_metrics.store_time(Computation::Hashing);
+            snapshot.hash_source->hash_repetitions(query, query_hashes);
+            thread_performance_metrics().store_time(Computation::Hashing);
+            return search_hashed_query(snapshot, query, query_hashes, k, recall, filter_type);
+        }
 
-            g_performance_metrics.start_timer(Computation::Sketching);
-            auto sketches = filterer.reset(query);
-            g_performance_metrics.store_time(Computation::Sketching);
+        // Search the tables for a query whose hashes have already been computed.
+        std::vector<uint32_t> search_hashed_query(
+            const IndexTables& snapshot,
+            typename TSim::Format::Type* query,
+            std::vector<LshDatatype>& query_hashes,
+            unsigned int k,
+            float recall,
+            FilterType filter_type
+        ) const {
+            thread_performance_metrics().start_timer(Computation::Sketching);
+            auto sketches = snapshot.filterer.reset(query);
+            thread_performance_metrics().store_time(Computation::Sketching);
+
+            thread_performance_metrics().start_timer(Computation::Search);
+            SearchBuffers buffers(snapshot.lsh_maps, std::move(sketches), query_hashes);
+            auto res = search_buffers(snapshot, query, k, recall, filter_type, buffers);
+            thread_performance_metrics().store_time(Computation::Search);
+            return res;
+        }
 
-            g_performance_metrics.start_timer(Computation::Search);
-            switch (filter_type) {
-                case FilterType::None:
-                    search_maps_no_filter(
-                        query,
-                        maxbuffer,
-                        recall,
-                        sketches,
-                        query_hashes);
-                    break;
-                case FilterType::Simple:
-                    search_maps_simple_filter(
-                        query,
-                        maxbuffer,
-                        recall,
-                        sketches,
-                        query_hashes);
-                    break;
-                default:
-                    search_maps(query, maxbuffer, recall, sketches, query_hashes);
+        std::vector<std::vector<uint32_t>> search_batch_formatted_queries(
+            const IndexTables& snapshot,
+            const std::vector<typename TSim::Format::Type*>& queries,
+            unsigned int k,
+            float recall,
+            FilterType filter_type,
+            std::vector<QueryMetrics>* stats
+        ) const {
+            // Number of consecutive queries in the search order that a thread takes at a time.
+            const static int QUERY_CHUNK_SIZE = 16;
+
+            size_t num_queries = queries.size();
+            size_t num_maps = snapshot.lsh_maps.size();
+            std::vector<std::vector<uint32_t>> res(num_queries);
+            if (stats != nullptr) {
+                stats->assign(num_queries, QueryMetrics());
+            }
+            // See search_formatted_query.
+            bool use_tables = (snapshot.last_rebuild >= 100);
+
+            std::vector<uint32_t> order(num_queries);
+            for (size_t q=0; q < num_queries; q++) {
+                order[q] = q;
             }
-            g_performance_metrics.store_time(Computation::Search);
+            std::vector<std::vector<LshDatatype>> query_hashes(num_queries);
+            std::vector<uint64_t> hashing_cycles(num_queries, 0);
+            // Position of query q in table i, at positions[q*num_maps+i].
+            std::vector<uint32_t> positions;
+            if (use_tables) {
+                #pragma omp parallel for schedule(dynamic, QUERY_CHUNK_SIZE)
+                for (size_t q=0; q < num_queries; q++) {
+                    auto hashing_start = read_cycle_counter();
+                    snapshot.hash_source->hash_repetitions(queries[q], query_hashes[q]);
+                    hashing_cycles[q] = read_cycle_counter()-hashing_start;
+                }
 
-            auto res = maxbuffer.best_indices();
-            g_performance_metrics.store_time(Computation::Total);
+                // Find the starting point of every query in a table in one pass over it,
+                // instead of a separate binary search per query.
+                positions.resize(num_queries*num_maps);
+                #pragma omp parallel
+                {
+                    std::vector<std::pair<LshDatatype, uint32_t>> sorted(num_queries);
+                    #pragma omp for schedule(dynamic)
+                    for (size_t i=0; i < num_maps; i++) {
+                        for (size_t q=0; q < num_queries; q++) {
+                            sorted[q] = std::make_pair(query_hashes[q][i], q);
+                        }
+                        std::sort(sorted.begin(), sorted.end());
+                        snapshot.lsh_maps[i].find_positions(sorted, &positions[i], num_maps);
+                    }
+                }
+
+                // Queries that share a prefix in the first table are likely to share prefixes
+                // in the other tables too, so searching them one after another keeps the
+                // regions of the tables that they have in common in cache.
+                if (num_maps != 0) {
+                    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                        return query_hashes[a][0] < query_hashes[b][0];
+                    });
+                }
+            }
+
+            #pragma omp parallel
+            {
+                // Reused for every query searched by this thread.
+                SearchBuffers buffers(num_maps);
+                auto& metrics = thread_performance_metrics();
+                #pragma omp for schedule(dynamic, QUERY_CHUNK_SIZE)
+                for (size_t order_idx=0; order_idx < num_queries; order_idx++) {
+                    auto q = order[order_idx];
+                    metrics.new_query(stats != nullptr);
+                    metrics.start_timer(Computation::Total);
+                    if (use_tables) {
+                        metrics.add_time(Computation::Hashing, hashing_cycles[q]);
+                        metrics.add_time(Computation::Total, hashing_cycles[q]);
+
+                        metrics.start_timer(Computation::Sketching);
+                        auto sketches = snapshot.filterer.reset(queries[q]);
+                        metrics.store_time(Computation::Sketching);
+
+                        metrics.start_timer(Computation::Search);
+                        buffers.reset(std::move(sketches), query_hashes[q], &positions[q*num_maps]);
+                        res[q] = search_buffers(snapshot, queries[q], k, recall, filter_type, buffers);
+                        metrics.store_time(Computation::Search);
+                    } else {
+                        res[q] = search_bf_formatted_query(queries[q], k);
+                    }
+                    metrics.store_time(Computation::Total);
+                    metrics.end_query();
+                    if (stats != nullptr) {
+                        (*stats)[q] = metrics.get_query_metrics();
+                    }
+                }
+            }
             return res;
         }
 
@@ -1192,30 +1969,66 @@ namespace puffinn {
 
             QuerySketches sketches;
 
+            // Allocate buffers for searching the given number of maps,
+            // which can be reused for many queries by calling reset.
+            SearchBuffers(size_t num_maps) {
+                ranges =
+                    std::make_unique<std::pair<const uint32_t*, const uint32_t*>[]>(num_maps+1);
+                table_indices =
+                    std::make_unique<uint_fast32_t[]>(num_maps+1);
+                query_objects.reserve(num_maps);
+            }
+
             SearchBuffers(
                 const std::vector<PrefixMap<THash>>& maps,
                 QuerySketches sketches,
                 std::vector<LshDatatype> & hashes
             )
-              : sketches(sketches)
+              : SearchBuffers(maps.size())
             {
-                g_performance_metrics.start_timer(Computation::SearchInit);
+                reset(maps, sketches, hashes);
+            }
 
-                ranges =
-                    std::make_unique<std::pair<const uint32_t*, const uint32_t*>[]>(maps.size()+1);
-                table_indices =
-                    std::make_unique<uint_fast32_t[]>(maps.size()+1);
+            // Prepare the buffers for a new query.
+            void reset(
+                const std::vector<PrefixMap<THash>>& maps,
+                QuerySketches query_sketches,
+                std::vector<LshDatatype> & hashes
+            ) {
+                thread_performance_metrics().start_timer(Computation::SearchInit);
 
-                query_objects.reserve(maps.size());
+                sketches = std::move(query_sketches);
+                query_objects.clear();
+                for (size_t i = 0; i < maps.size(); i++) {
+                    maps[i].prefetch_query(hashes[i]);
+                }
                 for (size_t i = 0; i < maps.size(); i++) {
                     query_objects.push_back(maps[i].create_query(hashes[i]));
                 }
 
-                g_performance_metrics.store_time(Computation::SearchInit);
+                thread_performance_metrics().store_time(Computation::SearchInit);
+            }
+
+            // Prepare the buffers for a new query whose position in each map has already
+            // been found using PrefixMap::find_positions.
+            void reset(
+                QuerySketches query_sketches,
+                const std::vector<LshDatatype> & hashes,
+                const uint32_t* positions
+            ) {
+                thread_performance_metrics().start_timer(Computation::SearchInit);
+
+                sketches = std::move(query_sketches);
+                query_objects.clear();
+                for (size_t i = 0; i < hashes.size(); i++) {
+                    query_objects.push_back(PrefixMapQuery(hashes[i], positions[i]));
+                }
+
+                thread_performance_metrics().store_time(Computation::SearchInit);
             }
 
             void fill_ranges(const std::vector<PrefixMap<THash>>& maps) {
-                g_performance_metrics.start_timer(Computation::ReducePrefix);
+                thread_performance_metrics().start_timer(Computation::ReducePrefix);
 
                 num_ranges = 0;
                 for (uint_fast32_t j=0; j<maps.size(); j++) {
@@ -1230,127 +2043,171 @@ namespace puffinn {
                 ranges[num_ranges] = std::make_pair(&range_end_filler[0], &range_end_filler[2*RING_SIZE*4]);
                 table_indices[num_ranges] = maps.size();
 
-                g_performance_metrics.store_time(Computation::ReducePrefix);
+                thread_performance_metrics().store_time(Computation::ReducePrefix);
             }
         };
 
+        // Search the tables for a query whose buffers have been reset for it.
+        std::vector<uint32_t> search_buffers(
+            const IndexTables& snapshot,
+            typename TSim::Format::Type* query,
+            unsigned int k,
+            float recall,
+            FilterType filter_type,
+            SearchBuffers& buffers
+        ) const {
+            MaxBuffer maxbuffer(k);
+            switch (filter_type) {
+                case FilterType::None:
+                    search_maps_no_filter(snapshot, query, maxbuffer, recall, buffers);
+                    break;
+                case FilterType::Simple:
+                    search_maps_simple_filter(snapshot, query, maxbuffer, recall, buffers);
+                    break;
+                default:
+                    search_maps(snapshot, query, maxbuffer, recall, buffers);
+            }
+            return maxbuffer.best_indices();
+        }
+
         // Search the tables without any filters.
         void search_maps_no_filter(
+            const IndexTables& snapshot,
             typename TSim::Format::Type* query,
             MaxBuffer& maxbuffer,
             float recall,
-            QuerySketches sketches,
-            std::vector<LshDatatype> & query_hashes
+            SearchBuffers& buffers
         ) const {
-            SearchBuffers buffers(lsh_maps, sketches, query_hashes);
-            for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
-                buffers.fill_ranges(lsh_maps);
-                g_performance_metrics.start_timer(Computation::Consider);
+            for (uint_fast8_t depth=hash_length; depth > 0; depth--) {
+                buffers.fill_ranges(snapshot.lsh_maps);
+                thread_performance_metrics().start_timer(Computation::Consider);
+                unsigned int num_candidates = 0;
+                unsigned int num_computed = 0;
                 for (uint_fast32_t range_idx=0; range_idx < buffers.num_ranges; range_idx++) {
                     auto range = buffers.ranges[range_idx];
+                    num_candidates += range.second-range.first;
                     while (range.first != range.second) {
                         auto idx = *range.first;
-                        auto dist = TSim::compute_similarity(
-                            query,
-                            dataset[idx],
-                            dataset.get_description());
-                        maxbuffer.insert(idx, dist);
+                        if (!is_removed_unchecked(idx)) {
+                            auto dist = TSim::compute_similarity(
+                                query,
+                                dataset[idx],
+                                dataset.get_description());
+                            maxbuffer.insert(idx, dist);
+                            num_computed++;
+                        }
                         range.first++;
                     }
                 }
-                g_performance_metrics.store_time(Computation::Consider);
-                g_performance_metrics.start_timer(Computation::CheckTermination);
+                thread_performance_metrics().add_candidates(num_candidates);
+                thread_performance_metrics().add_distance_computations(num_computed);
+                thread_performance_metrics().store_time(Computation::Consider);
+                thread_performance_metrics().start_timer(Computation::CheckTermination);
                 auto kth_similarity = maxbuffer.smallest_value();
-                auto table_idx = lsh_maps.size();
-                auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
-                float failure_prob = hash_source->failure_probability(
+                auto table_idx = snapshot.lsh_maps.size();
+                auto last_tables = (depth == static_cast<int>(hash_length) ? table_idx : snapshot.lsh_maps.size());
+                float failure_prob = snapshot.hash_source->failure_probability(
                     depth,
                     table_idx,
                     last_tables,
                     kth_similarity
                 );
-                g_performance_metrics.store_time(Computation::CheckTermination);
+                thread_performance_metrics().store_time(Computation::CheckTermination);
                 if (failure_prob <= 1-recall) {
-                    g_performance_metrics.set_hash_length(depth);
-                    g_performance_metrics.set_considered_maps(
-                        (MAX_HASHBITS-depth+1)*lsh_maps.size());
+                    thread_performance_metrics().set_hash_length(depth);
+                    thread_performance_metrics().set_considered_maps(
+                        (hash_length-depth+1)*snapshot.lsh_maps.size());
                     return;
                 }
             }
+            // Every table was searched down to prefixes of a single bit.
+            thread_performance_metrics().set_hash_length(1);
+            thread_performance_metrics().set_considered_maps(hash_length*snapshot.lsh_maps.size());
         }
 
+
         // Search maps with a simple implementation of filtering.
         void search_maps_simple_filter(
+            const IndexTables& snapshot,
             typename TSim::Format::Type* query,
             MaxBuffer& maxbuffer,
             float recall,
-            QuerySketches sketches,
-            std::vector<LshDatatype> & query_hashes
+            SearchBuffers& buffers
         ) const {
-            SearchBuffers buffers(lsh_maps, sketches, query_hashes);
-            for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
-                buffers.fill_ranges(lsh_maps);
-                g_performance_metrics.start_timer(Computation::Consider);
+            for (uint_fast8_t depth=hash_length; depth > 0; depth--) {
+                buffers.fill_ranges(snapshot.lsh_maps);
+                thread_performance_metrics().start_timer(Computation::Consider);
+                unsigned int num_candidates = 0;
+                unsigned int num_computed = 0;
                 for (uint_fast32_t range_idx=0; range_idx < buffers.num_ranges; range_idx++) {
                     auto range = buffers.ranges[range_idx];
+                    num_candidates += range.second-range.first;
                     while (range.first != range.second) {
                         auto idx = *range.first;
                         auto sketch_idx = range_idx%NUM_SKETCHES;
-                        auto sketch = filterer.get_sketch(idx, sketch_idx);
-                        if (buffers.sketches.passes_filter(sketch, sketch_idx)) {
+                        auto sketch = snapshot.filterer.get_sketch(idx, sketch_idx);
+                        if (buffers.sketches.passes_filter(sketch, sketch_idx) && !is_removed_unchecked(idx)) {
                             auto dist = TSim::compute_similarity(
                                 query,
                                 dataset[idx],
                                 dataset.get_description());
                             maxbuffer.insert(idx, dist);
+                            num_computed++;
                         }
                         range.first++;
                     }
                     auto kth_similarity = maxbuffer.smallest_value();
-                    buffers.sketches.max_sketch_diff = filterer.get_max_sketch_diff(kth_similarity);
+                    buffers.sketches.max_sketch_diff = snapshot.filterer.get_max_sketch_diff(kth_similarity);
                 }
-                g_performance_metrics.store_time(Computation::Consider);
-                g_performance_metrics.start_timer(Computation::CheckTermination);
+                thread_performance_metrics().add_candidates(num_candidates);
+                thread_performance_metrics().add_distance_computations(num_computed);
+                thread_performance_metrics().store_time(Computation::Consider);
+                thread_performance_metrics().start_timer(Computation::CheckTermination);
                 auto kth_similarity = maxbuffer.smallest_value();
-                auto table_idx = lsh_maps.size();
-                auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
-                float failure_prob = hash_source->failure_probability(
+                auto table_idx = snapshot.lsh_maps.size();
+                auto last_tables = (depth == static_cast<int>(hash_length) ? table_idx : snapshot.lsh_maps.size());
+                float failure_prob = snapshot.hash_source->failure_probability(
                     depth,
                     table_idx,
                     last_tables,
                     kth_similarity
                 );
-                g_performance_metrics.store_time(Computation::CheckTermination);
+                thread_performance_metrics().store_time(Computation::CheckTermination);
                 if (failure_prob <= 1-recall) {
-                    g_performance_metrics.set_hash_length(depth);
-                    g_performance_metrics.set_considered_maps(
-                        (MAX_HASHBITS-depth+1)*lsh_maps.size());
+                    thread_performance_metrics().set_hash_length(depth);
+                    thread_performance_metrics().set_considered_maps(
+                        (hash_length-depth+1)*snapshot.lsh_maps.size());
                     return;
                 }
             }
+            // Every table was searched down to prefixes of a single bit.
+            thread_performance_metrics().set_hash_length(1);
+            thread_performance_metrics().set_considered_maps(hash_length*snapshot.lsh_maps.size());
         }
 
+
         // Search all maps and insert the candidates into the buffer.
         void search_maps(
+            const IndexTables& snapshot,
             typename TSim::Format::Type* query,
             MaxBuffer& maxbuffer,
             float recall,
-            QuerySketches sketches,
-            std::vector<LshDatatype> & query_hashes
+            SearchBuffers& buffers
         ) const {
             const size_t FILTER_BUFFER_SIZE = 128;
 
-            SearchBuffers buffers(lsh_maps, sketches, query_hashes);
             // Buffer for values passing filtering and should have distances computed.
             // 8*RING_SIZE is necessary additional space as that is the maximum that can be added
             // between the last check of the size and it being emptied.
             uint32_t passing_filter[FILTER_BUFFER_SIZE+8*RING_SIZE];
+            // Similarities of the values in passing_filter.
+            float passing_sims[FILTER_BUFFER_SIZE+8*RING_SIZE];
 
             // foreach possible bit in hash
-            for (uint_fast8_t depth=MAX_HASHBITS; depth > 0; depth--) {
+            for (uint_fast8_t depth=hash_length; depth > 0; depth--) {
                 // Find next ranges to consider
-                buffers.fill_ranges(lsh_maps);
-                g_performance_metrics.start_timer(Computation::Filtering);
+                buffers.fill_ranges(snapshot.lsh_maps);
+                thread_performance_metrics().start_timer(Computation::Filtering);
                 // Filter values
                 const static int PREFETCH_DIST = 3;
                 const static int PREREQ_PREFETCH_DIST = 5;
@@ -1380,10 +2237,10 @@ namespace puffinn {
                         for (int_fast32_t ring_idx=0; ring_idx < RING_SIZE; ring_idx++) {
                             auto prefetch_ring_idx = (ring_idx+PREFETCH_DIST)&(RING_SIZE-1);
                             auto prefetch_segment = ring[prefetch_ring_idx];
-                            filterer.prefetch(prefetch_segment[0], prefetch_ring_idx);
-                            filterer.prefetch(prefetch_segment[1], prefetch_ring_idx);
-                            filterer.prefetch(prefetch_segment[2], prefetch_ring_idx);
-                            filterer.prefetch(prefetch_segment[3], prefetch_ring_idx);
+                            snapshot.filterer.prefetch(prefetch_segment[0], prefetch_ring_idx);
+                            snapshot.filterer.prefetch(prefetch_segment[1], prefetch_ring_idx);
+                            snapshot.filterer.prefetch(prefetch_segment[2], prefetch_ring_idx);
+                            snapshot.filterer.prefetch(prefetch_segment[3], prefetch_ring_idx);
 
                             auto prereq_prefetch_segment =
                                 ring[(ring_idx+PREREQ_PREFETCH_DIST)&(RING_SIZE-1)];
@@ -1399,10 +2256,10 @@ namespace puffinn {
                             auto v4 = ring[ring_idx][3];
 
                             // sketches
-                            auto s1 = filterer.get_sketch(v1, ring_idx);
-                            auto s2 = filterer.get_sketch(v2, ring_idx);
-                            auto s3 = filterer.get_sketch(v3, ring_idx);
-                            auto s4 = filterer.get_sketch(v4, ring_idx);
+                            auto s1 = snapshot.filterer.get_sketch(v1, ring_idx);
+                            auto s2 = snapshot.filterer.get_sketch(v2, ring_idx);
+                            auto s3 = snapshot.filterer.get_sketch(v3, ring_idx);
+                            auto s4 = snapshot.filterer.get_sketch(v4, ring_idx);
 
                             // Whether they pass the filtering step
                             auto p1 = buffers.sketches.passes_filter(s1, ring_idx);
@@ -1426,7 +2283,7 @@ namespace puffinn {
                             range.first += 4;
                             range_idx += (range.first == range.second);
                         }
-                        g_performance_metrics.add_candidates(RING_SIZE*4);
+                        thread_performance_metrics().add_candidates(RING_SIZE*4);
                     }
                     // Consider rest of values in ring when it isn't full.
                     // Can again add up to 4*RING_SIZE values to the buffer.
@@ -1434,10 +2291,10 @@ namespace puffinn {
                         auto prefetch_ring_idx = (ring_idx+PREFETCH_DIST)&(RING_SIZE-1);
                         auto prefetch_segment = ring[prefetch_ring_idx];
 
-                        filterer.prefetch(prefetch_segment[0], prefetch_ring_idx);
-                        filterer.prefetch(prefetch_segment[1], prefetch_ring_idx);
-                        filterer.prefetch(prefetch_segment[2], prefetch_ring_idx);
-                        filterer.prefetch(prefetch_segment[3], prefetch_ring_idx);
+                        snapshot.filterer.prefetch(prefetch_segment[0], prefetch_ring_idx);
+                        snapshot.filterer.prefetch(prefetch_segment[1], prefetch_ring_idx);
+                        snapshot.filterer.prefetch(prefetch_segment[2], prefetch_ring_idx);
+                        snapshot.filterer.prefetch(prefetch_segment[3], prefetch_ring_idx);
 
                         auto prereq_prefetch_segment =
                             ring[(ring_idx+PREREQ_PREFETCH_DIST)&(RING_SIZE-1)];
@@ -1465,54 +2322,72 @@ namespace puffinn {
                         passing_filter[num_passing_filter] = v4;
                         num_passing_filter += p4;
                     }
-                    g_performance_metrics.add_candidates(4*(RING_SIZE-missing_ring_vals));
+                    thread_performance_metrics().add_candidates(4*(RING_SIZE-missing_ring_vals));
 
                     // Empty buffer
-                    g_performance_metrics.store_time(Computation::Filtering);
-                    g_performance_metrics.start_timer(Computation::Consider);
+                    thread_performance_metrics().store_time(Computation::Filtering);
+                    thread_performance_metrics().start_timer(Computation::Consider);
+                    if (num_removed != 0) {
+                        uint_fast32_t num_kept = 0;
+                        for (
+                            uint_fast32_t passed_idx=0;
+                            passed_idx < num_passing_filter;
+                            passed_idx++
+                        ) {
+                            auto idx = passing_filter[passed_idx];
+                            passing_filter[num_kept] = idx;
+                            num_kept += !is_removed_unchecked(idx);
+                        }
+                        num_passing_filter = num_kept;
+                    }
+                    TSim::compute_similarity_batch(
+                        query,
+                        dataset,
+                        passing_filter,
+                        num_passing_filter,
+                        passing_sims);
                     for (
                         uint_fast32_t passed_idx=0;
                         passed_idx < num_passing_filter;
                         passed_idx++
                     ) {
-                        auto idx = passing_filter[passed_idx];
-                        auto dist = TSim::compute_similarity(
-                            query,
-                            dataset[idx],
-                            dataset.get_description());
-                        maxbuffer.insert(idx, dist);
+                        maxbuffer.insert(passing_filter[passed_idx], passing_sims[passed_idx]);
                     }
-                    g_performance_metrics.add_distance_computations(num_passing_filter);
+                    thread_performance_metrics().add_distance_computations(num_passing_filter);
                     num_passing_filter = 0;
                     auto kth_similarity = maxbuffer.smallest_value();
-                    buffers.sketches.max_sketch_diff = filterer.get_max_sketch_diff(kth_similarity);
-                    g_performance_metrics.store_time(Computation::Consider);
+                    buffers.sketches.max_sketch_diff = snapshot.filterer.get_max_sketch_diff(kth_similarity);
+                    thread_performance_metrics().store_time(Computation::Consider);
 
                     // Stop if we have seen enough to be confident about the recall guarantee
-                    g_performance_metrics.start_timer(Computation::CheckTermination);
+                    thread_performance_metrics().start_timer(Computation::CheckTermination);
                     size_t table_idx = buffers.table_indices[range_idx];
-                    auto last_tables = (depth == MAX_HASHBITS ? table_idx : lsh_maps.size());
-                    float failure_prob = hash_source->failure_probability(
+                    auto last_tables = (depth == static_cast<int>(hash_length) ? table_idx : snapshot.lsh_maps.size());
+                    float failure_prob = snapshot.hash_source->failure_probability(
                         depth,
                         table_idx,
                         last_tables,
                         kth_similarity
                     );
-                    g_performance_metrics.store_time(Computation::CheckTermination);
+                    thread_performance_metrics().store_time(Computation::CheckTermination);
                     if (failure_prob <= 1-recall) {
-                        g_performance_metrics.set_hash_length(depth);
-                        g_performance_metrics.set_considered_maps(
-                            (MAX_HASHBITS-depth)*lsh_maps.size()+table_idx);
+                        thread_performance_metrics().set_hash_length(depth);
+                        thread_performance_metrics().set_considered_maps(
+                            (hash_length-depth)*snapshot.lsh_maps.size()+table_idx);
                         return;
                     }
-                    g_performance_metrics.start_timer(Computation::Filtering);
+                    thread_performance_metrics().start_timer(Computation::Filtering);
                 }
-                g_performance_metrics.store_time(Computation::Filtering);
+                thread_performance_metrics().store_time(Computation::Filtering);
             }
+            // Every table was searched down to prefixes of a single bit.
+            thread_performance_metrics().set_hash_length(1);
+            thread_performance_metrics().set_considered_maps(hash_length*snapshot.lsh_maps.size());
         }
 
+
         void serialize_chunk(std::ostream& out, size_t idx) const {
-            lsh_maps[idx].serialize(out);
+            tables.load()->lsh_maps[idx].serialize(out);
         }
     };
 }
@@ -1,12 +1,17 @@
 #pragma once
 
 #include "puffinn/format/generic.hpp"
+#include "puffinn/mapped_file.hpp"
 #include "puffinn/typedefs.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <istream>
 #include <memory>
 #include <ostream>
+#include <type_traits>
+#include <vector>
 
 namespace puffinn {
     const unsigned int DEFAULT_CAPACITY = 100;
@@ -85,11 +90,55 @@ namespace puffinn {
             }
         }
 
+        // Construct a dataset whose vectors are stored in a section of a mapped file.
+        // Formats whose values own memory are read from the metadata instead.
+        Dataset(std::istream& meta, const MappedFile& file) {
+            T::deserialize_args(meta, &args);
+            meta.read(reinterpret_cast<char*>(&storage_len), sizeof(unsigned int));
+            meta.read(reinterpret_cast<char*>(&inserted_vectors), sizeof(unsigned int));
+            capacity = inserted_vectors;
+            if constexpr (std::is_trivially_copyable<typename T::Type>::value) {
+                uint64_t offset;
+                meta.read(reinterpret_cast<char*>(&offset), sizeof(uint64_t));
+                data = AlignedStorage<T>::borrow(
+                    file.section<typename T::Type>(offset, inserted_vectors*storage_len));
+            } else {
+                data = allocate_storage<T>(capacity, storage_len);
+                for (size_t i=0; i < inserted_vectors*storage_len; i++) {
+                    T::deserialize_type(meta, &data.get()[i]);
+                }
+            }
+        }
+
+        void serialize_mapped(std::ostream& meta, MappedFileWriter& file) const {
+            T::serialize_args(meta, args);
+            meta.write(reinterpret_cast<const char*>(&storage_len), sizeof(unsigned int));
+            meta.write(reinterpret_cast<const char*>(&inserted_vectors), sizeof(unsigned int));
+            if constexpr (std::is_trivially_copyable<typename T::Type>::value) {
+                uint64_t offset = file.write_section(
+                    data.get(),
+                    inserted_vectors*storage_len*sizeof(typename T::Type));
+                meta.write(reinterpret_cast<const char*>(&offset), sizeof(uint64_t));
+            } else {
+                for (size_t i=0; i < inserted_vectors*storage_len; i++) {
+                    T::serialize_type(meta, data.get()[i]);
+                }
+            }
+        }
+
         // Access the vector at the given position.
         typename T::Type* operator[](unsigned int idx) const {
             return &data.get()[idx*storage_len];
         }
 
+        // Load the vector at the given position into the cache.
+        void prefetch(unsigned int idx) const {
+            auto begin = reinterpret_cast<const char*>(&data.get()[idx*storage_len]);
+            for (size_t offset=0; offset < storage_len*sizeof(typename T::Type); offset += 64) {
+                prefetch_addr(begin+offset);
+            }
+        }
+
         // Retrieve the number of dimensions of vectors inserted into this dataset,
         // as well as the number of dimensions they are stored with.
         DatasetDescription<T> get_description() const {
@@ -108,7 +157,8 @@ namespace puffinn {
         template <typename U>
         void insert(const U& vec) {
             if (inserted_vectors == capacity) {
-                unsigned int new_capacity = std::ceil(capacity*EXPANSION_FACTOR);
+                // A deserialized dataset can have no capacity at all.
+                unsigned int new_capacity = std::ceil(std::max(capacity, 1u)*EXPANSION_FACTOR);
                 auto new_data = allocate_storage<T>(new_capacity, storage_len);
                 for (size_t i=0; i < capacity*storage_len; i++) {
                     new_data.get()[i] = std::move(data.get()[i]);
@@ -133,6 +183,28 @@ namespace puffinn {
             inserted_vectors = 0;
         }
 
+        // Drop the vectors marked with REMOVED_INDEX in new_ids and move the rest
+        // to their new positions, which must preserve their relative order.
+        void compact(const std::vector<uint32_t>& new_ids) {
+            unsigned int kept = 0;
+            for (unsigned int idx=0; idx < inserted_vectors; idx++) {
+                if (new_ids[idx] == REMOVED_INDEX) {
+                    continue;
+                }
+                if (kept != idx) {
+                    for (size_t i=0; i < storage_len; i++) {
+                        data.get()[kept*storage_len+i] = std::move(data.get()[idx*storage_len+i]);
+                    }
+                }
+                kept++;
+            }
+            // Release whatever the dropped vectors still hold.
+            for (size_t i=kept*storage_len; i < inserted_vectors*storage_len; i++) {
+                data.get()[i] = typename T::Type();
+            }
+            inserted_vectors = kept;
+        }
+
         uint64_t memory_usage() const {
             uint64_t inner_memory = 0;
             for (size_t i=0; i < inserted_vectors*storage_len; i++) {
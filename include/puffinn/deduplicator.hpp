@@ -2,6 +2,9 @@
 
 #include "typedefs.hpp"
 
+#include <algorithm>
+#include <vector>
+
 #if defined(__AVX2__) || defined(__AVX__)
     #include <immintrin.h>
 #endif
@@ -19,21 +22,43 @@ class Deduplicator {
     size_t stride;
     //! The number of repetitions
     size_t num_repetitions;
+    //! The number of bits in each hash
+    unsigned int hash_length;
     //! The hashes for each input point, for each repetition.
     //! This is organized as a matrix in row major order: on the rows
     //! we have the points, on the columns we have the repetitions.
     std::vector<LshDatatype> hashes;
 
-    public:
-
-    Deduplicator(): num_repetitions(0), stride(0) {}
-    Deduplicator(size_t num_repetitions)
-    : num_repetitions(num_repetitions)
-    {
-        stride = 0;
+    //! The number of repetitions rounded up to a multiple of WORDS_PER_VEC
+    static size_t padded_stride(size_t num_repetitions) {
+        size_t stride = 0;
         while (stride < num_repetitions) {
             stride += WORDS_PER_VEC;
         }
+        return stride;
+    }
+
+    public:
+
+    Deduplicator(): stride(0), num_repetitions(0), hash_length(MAX_HASHBITS) {}
+    Deduplicator(size_t num_repetitions, unsigned int hash_length = MAX_HASHBITS)
+    : stride(padded_stride(num_repetitions)),
+      num_repetitions(num_repetitions),
+      hash_length(hash_length)
+    {}
+
+    //! A copy of `base` with room for the hashes of `n` points,
+    //! which only reads `base`.
+    Deduplicator(const Deduplicator & base, size_t n)
+    : stride(base.stride),
+      num_repetitions(base.num_repetitions),
+      hash_length(base.hash_length),
+      hashes(n * base.stride)
+    {
+        std::copy(
+            base.hashes.begin(),
+            base.hashes.begin() + std::min(base.hashes.size(), hashes.size()),
+            hashes.begin());
     }
 
     bool is_empty() const {
@@ -49,8 +74,31 @@ class Deduplicator {
         hashes[offset + repetition] = h;
     }
 
+    //! Drop the points marked with REMOVED_INDEX in `new_ids` and move 
+    //! the rest to their new positions.
+    void compact(const std::vector<uint32_t> & new_ids) {
+        if (stride == 0) {
+            return;
+        }
+        size_t kept = 0;
+        for (size_t i=0; i<hashes.size() / stride; i++) {
+            if (new_ids[i] == REMOVED_INDEX) {
+                continue;
+            }
+            if (kept != i) {
+                std::copy(
+                    hashes.begin() + i * stride,
+                    hashes.begin() + (i + 1) * stride,
+                    hashes.begin() + kept * stride);
+            }
+            kept++;
+        }
+        hashes.resize(kept * stride);
+        hashes.shrink_to_fit();
+    }
+
     int32_t first_collision_from_scalar(size_t R, size_t S, size_t prefix, size_t from) const {
-        uint32_t prefix_mask = 0xffffffff << (MAX_HASHBITS - prefix);
+        uint32_t prefix_mask = 0xffffffff << (hash_length - prefix);
         auto offset_i = stride * R;
         auto offset_j = stride * S;
         for (size_t rep=0; rep<num_repetitions; rep++) {
@@ -65,7 +113,7 @@ class Deduplicator {
     #ifdef __AVX2__
     int32_t first_collision_from_avx(size_t R, size_t S, size_t prefix, size_t from) const {
         size_t from_aligned = (from / WORDS_PER_VEC) * WORDS_PER_VEC;
-        uint32_t prefix_mask = 0xffffffff << (MAX_HASHBITS - prefix);
+        uint32_t prefix_mask = 0xffffffff << (hash_length - prefix);
 
         __m256i mask = _mm256_set_epi32(
             prefix_mask,
@@ -119,7 +167,7 @@ class Deduplicator {
 
 
     int32_t first_collision_at_scalar(size_t R, size_t S, size_t prefix) const {
-        uint32_t prefix_mask = 0xffffffff << (MAX_HASHBITS - prefix);
+        uint32_t prefix_mask = 0xffffffff << (hash_length - prefix);
         auto ptr_i = hashes.cbegin() + stride * R;
         auto ptr_j = hashes.cbegin() + stride * S;
         for (size_t rep=0; rep<num_repetitions; rep++) {
@@ -134,7 +182,7 @@ class Deduplicator {
 
     #ifdef __AVX2__
     int32_t first_collision_at_avx(size_t R, size_t S, size_t prefix) const {
-        uint32_t prefix_mask = 0xffffffff << (MAX_HASHBITS - prefix);
+        uint32_t prefix_mask = 0xffffffff << (hash_length - prefix);
 
 
         __m256i mask = _mm256_set_epi32(
@@ -204,7 +252,7 @@ private:
     size_t all_collisions_at_scalar(size_t R, size_t S, size_t prefix, std::vector<size_t> & out) const {
         assert(out.size() == num_repetitions);
         size_t oidx = 0;
-        uint32_t prefix_mask = 0xffffffff << (MAX_HASHBITS - prefix);
+        uint32_t prefix_mask = 0xffffffff << (hash_length - prefix);
         auto ptr_i = hashes.cbegin() + stride * R;
         auto ptr_j = hashes.cbegin() + stride * S;
         for (size_t rep=0; rep<num_repetitions; rep++) {
@@ -4,6 +4,7 @@
 #include "puffinn/typedefs.hpp"
 #include "puffinn/hash_source/deserialize.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/mapped_file.hpp"
 #include "puffinn/performance.hpp"
 
 #include <algorithm>
@@ -31,15 +32,19 @@ namespace puffinn {
         }
     };
 
+    // Sketches of every point in the dataset along with the hash functions used to compute them.
+    //
+    // Copies share the hash functions, which are never modified after construction,
+    // but have their own sketches.
     template <typename T>
     class Filterer {
-        std::unique_ptr<HashSource<T>> hash_source;
+        std::shared_ptr<HashSource<T>> hash_source;
         // Filter hash functions
-        std::vector<std::unique_ptr<Hash>> hash_functions;
+        std::vector<std::shared_ptr<Hash>> hash_functions;
 
         // Filters are stored with sketches for the same value adjacent.
-        std::vector<FilterLshDatatype> sketches;
-        std::unique_ptr<HashSourceArgs<T>> sketch_args;
+        MappableVector<FilterLshDatatype> sketches;
+        std::shared_ptr<HashSourceArgs<T>> sketch_args;
 
     public:
         Filterer(const HashSourceArgs<T>& args, DatasetDescription<typename T::Sim::Format> dataset)
@@ -55,6 +60,30 @@ namespace puffinn {
             }
         }
 
+        // Construct a filterer with the same hash functions as base, containing the sketches
+        // of base for the values before first_index and the sketches of the remaining values
+        // in the dataset.
+        // base is only read, so it can be used concurrently.
+        Filterer(
+            const Filterer& base,
+            const Dataset<typename T::Sim::Format>& dataset,
+            uint32_t first_index
+        )
+          : hash_source(base.hash_source),
+            hash_functions(base.hash_functions),
+            sketch_args(base.sketch_args)
+        {
+            // Values that were not sketched by base are sketched here.
+            first_index = std::min<size_t>(first_index, base.sketches.size()/NUM_SKETCHES);
+            std::vector<FilterLshDatatype> values(dataset.get_size()*NUM_SKETCHES);
+            std::copy(
+                base.sketches.begin(),
+                base.sketches.begin()+first_index*NUM_SKETCHES,
+                values.begin());
+            sketches = std::move(values);
+            add_sketches(dataset, first_index);
+        }
+
         Filterer(std::istream& in) {
             sketch_args = deserialize_hash_args<T>(in);
             hash_source = sketch_args->deserialize_source(in);
@@ -68,6 +97,32 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(sketches.data()), len*sizeof(FilterLshDatatype));
         }
 
+        // Construct a filterer whose sketches are stored in a section of a mapped file.
+        Filterer(std::istream& meta, const MappedFile& file) {
+            sketch_args = deserialize_hash_args<T>(meta);
+            hash_source = sketch_args->deserialize_source(meta);
+            hash_functions.reserve(NUM_SKETCHES);
+            for (size_t i=0; i < NUM_SKETCHES; i++) {
+                hash_functions.push_back(hash_source->deserialize_hash(meta));
+            }
+            uint64_t len, offset;
+            meta.read(reinterpret_cast<char*>(&len), sizeof(uint64_t));
+            meta.read(reinterpret_cast<char*>(&offset), sizeof(uint64_t));
+            sketches = MappableVector<FilterLshDatatype>::mapped(file, offset, len);
+        }
+
+        void serialize_mapped(std::ostream& meta, MappedFileWriter& file) const {
+            sketch_args->serialize(meta);
+            hash_source->serialize(meta);
+            for (auto& h : hash_functions) {
+                h->serialize(meta);
+            }
+            uint64_t len = sketches.size();
+            uint64_t offset = file.write_section(sketches.data(), len*sizeof(FilterLshDatatype));
+            meta.write(reinterpret_cast<const char*>(&len), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&offset), sizeof(uint64_t));
+        }
+
         void serialize(std::ostream& out) const {
             sketch_args->serialize(out);
             hash_source->serialize(out);
@@ -93,16 +148,49 @@ namespace puffinn {
             const Dataset<typename T::Sim::Format>& dataset,
             uint32_t first_index
         ) {
+            // Number of points that are sketched together.
+            const static size_t BLOCK_SIZE = 16;
+
             sketches.resize(dataset.get_size()*NUM_SKETCHES);
+            auto storage_len = dataset.get_description().storage_len;
+            size_t num_points = dataset.get_size()-first_index;
+            size_t num_blocks = (num_points+BLOCK_SIZE-1)/BLOCK_SIZE;
 
+            // Sketches of a point are stored adjacently, in the same layout as hash_block
+            // writes them, so each block is written directly to its final position.
             #pragma omp parallel for schedule(dynamic)
-            for (size_t idx = first_index; idx < dataset.get_size(); idx++) {
-                auto state = hash_source->reset(dataset[idx], true);
-                size_t offset = idx * NUM_SKETCHES;
-                for (size_t sketch_index = 0; sketch_index < NUM_SKETCHES; sketch_index++) {
-                    sketches[offset + sketch_index] = (*hash_functions[sketch_index])(state.get());
+            for (size_t block = 0; block < num_blocks; block++) {
+                size_t begin = first_index+block*BLOCK_SIZE;
+                size_t end = std::min<size_t>(begin+BLOCK_SIZE, dataset.get_size());
+                hash_source->hash_block(
+                    hash_functions,
+                    dataset[begin],
+                    end-begin,
+                    storage_len,
+                    &sketches[begin*NUM_SKETCHES]);
+            }
+        }
+
+        // Drop the sketches of points marked with REMOVED_INDEX in new_ids
+        // and move the rest to their new positions.
+        void compact(const std::vector<uint32_t>& new_ids) {
+            auto sketches = this->sketches.take();
+            size_t kept = 0;
+            for (size_t idx=0; idx < sketches.size()/NUM_SKETCHES; idx++) {
+                if (new_ids[idx] == REMOVED_INDEX) {
+                    continue;
+                }
+                if (kept != idx) {
+                    std::copy(
+                        &sketches[idx*NUM_SKETCHES],
+                        &sketches[(idx+1)*NUM_SKETCHES],
+                        &sketches[kept*NUM_SKETCHES]);
                 }
+                kept++;
             }
+            sketches.resize(kept*NUM_SKETCHES);
+            sketches.shrink_to_fit();
+            this->sketches = std::move(sketches);
         }
 
         QuerySketches reset(typename T::Sim::Format::Type* vec) const {
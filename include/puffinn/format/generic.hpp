@@ -78,6 +78,14 @@ namespace puffinn {
             }
         }
 
+        // Refer to values stored elsewhere, such as in a mapped file, which are never freed.
+        static AlignedStorage borrow(typename T::Type* values) {
+            AlignedStorage res;
+            // len is left at 0 so that the destructor does not touch the values.
+            res.aligned = values;
+            return res;
+        }
+
         AlignedStorage(AlignedStorage&& other)
           : raw_mem(other.raw_mem),
             aligned(other.aligned),
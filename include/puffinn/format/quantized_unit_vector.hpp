@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <vector>
+
+#include "puffinn/format/generic.hpp"
+#include "puffinn/format/unit_vector.hpp"
+#include "puffinn/typedefs.hpp"
+
+namespace puffinn {
+    /// A format for storing real vectors of unit length using 8 bits per number.
+    ///
+    /// Currently, only ``std::vector<float>`` is supported as input type.
+    /// The vectors do not need to be normalized before insertion.
+    ///
+    /// Each vector is scaled so that its largest absolute value is stored as 127,
+    /// and the scale is stored along with the values.
+    /// This uses half the memory of ``UnitVectorFormat``, which leaves more memory for hash tables
+    /// when building an index with a memory limit.
+    struct QuantizedUnitVectorFormat {
+        using Type = int8_t;
+        /// Number of dimensions.
+        using Args = unsigned int;
+
+        const static unsigned int ALIGNMENT = VECTOR256_ALIGNMENT;
+
+        // Largest absolute value that is stored.
+        const static int MAX_VALUE = 127;
+
+        // Position of the scale in a stored vector.
+        static unsigned int scale_offset(Args dimensions) {
+            return ceil_to_multiple(dimensions, sizeof(float));
+        }
+
+        static unsigned int storage_dimensions(Args dimensions) {
+            return scale_offset(dimensions)+sizeof(float);
+        }
+
+        // Retrieve the value that the stored numbers are multiplied by to get the original values.
+        static float get_scale(const Type* vec, Args dimensions) {
+            float scale;
+            std::memcpy(&scale, &vec[scale_offset(dimensions)], sizeof(float));
+            return scale;
+        }
+
+        static uint64_t inner_memory_usage(Type&) {
+            return 0;
+        }
+
+        static void store(
+            const std::vector<float>& input,
+            Type* storage,
+            DatasetDescription<QuantizedUnitVectorFormat> dataset
+        ) {
+            if (input.size() != dataset.args) {
+                throw std::invalid_argument("input.size()");
+            }
+
+            float len_squared = 0.0;
+            float max_abs = 0.0;
+            for (auto v : input) {
+                len_squared += v*v;
+                max_abs = std::max(max_abs, std::abs(v));
+            }
+            auto len = std::sqrt(len_squared);
+            float scale = 0.0;
+            if (len != 0.0) {
+                scale = max_abs/len/MAX_VALUE;
+            }
+
+            for (size_t i=0; i < input.size(); i++) {
+                float val = scale == 0.0 ? 0.0 : input[i]/len/scale;
+                storage[i] = static_cast<Type>(std::max(
+                    -static_cast<float>(MAX_VALUE),
+                    std::min(static_cast<float>(MAX_VALUE), std::round(val))));
+            }
+            for (size_t i=input.size(); i < dataset.storage_len; i++) {
+                storage[i] = 0;
+            }
+            std::memcpy(&storage[scale_offset(dataset.args)], &scale, sizeof(float));
+        }
+
+        // Convert a stored vector to the 16 bit fixed point representation of ``UnitVectorFormat``.
+        // The output needs space for the padded number of dimensions used by that format.
+        static void to_unit_vector(
+            const Type* vec,
+            DatasetDescription<QuantizedUnitVectorFormat> dataset,
+            int16_t* out
+        ) {
+            auto scale = get_scale(vec, dataset.args);
+            for (size_t i=0; i < dataset.args; i++) {
+                float val = std::max(-1.0f, std::min(1.0f, vec[i]*scale));
+                out[i] = UnitVectorFormat::to_16bit_fixed_point(val);
+            }
+            for (size_t i=dataset.args; i < pad_dimensions<UnitVectorFormat>(dataset.args); i++) {
+                out[i] = 0;
+            }
+        }
+
+        static void free(Type&) {}
+
+        static std::vector<float> generate_random(unsigned int dimensions) {
+            return UnitVectorFormat::generate_random(dimensions);
+        }
+
+        static void serialize_args(std::ostream& out, const Args& args) {
+            out.write(reinterpret_cast<const char*>(&args), sizeof(Args));
+        }
+
+        static void deserialize_args(std::istream& in, Args* args) {
+            in.read(reinterpret_cast<char*>(args), sizeof(Args));
+        }
+
+        static void serialize_type(std::ostream& out, const Type& type) {
+            out.write(reinterpret_cast<const char*>(&type), sizeof(Type));
+        }
+
+        static void deserialize_type(std::istream& in, Type* type) {
+            in.read(reinterpret_cast<char*>(type), sizeof(Type));
+        }
+    };
+
+    template <>
+    std::vector<float> convert_stored_type<QuantizedUnitVectorFormat, std::vector<float>>(
+        typename QuantizedUnitVectorFormat::Type* storage,
+        DatasetDescription<QuantizedUnitVectorFormat> dataset
+    ) {
+        auto scale = QuantizedUnitVectorFormat::get_scale(storage, dataset.args);
+        std::vector<float> res;
+        res.reserve(dataset.args);
+        for (size_t i=0; i < dataset.args; i++) {
+            res.push_back(storage[i]*scale);
+        }
+        return res;
+    }
+}
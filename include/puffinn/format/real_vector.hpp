@@ -1,8 +1,12 @@
 #pragma once
 
+#include <istream>
+#include <ostream>
+#include <random>
 #include <vector>
 
 #include "puffinn/format/generic.hpp"
+#include "puffinn/typedefs.hpp"
 
 namespace puffinn {
     struct RealVectorFormat {
@@ -15,6 +19,10 @@ namespace puffinn {
             return dimensions;
         }
 
+        static uint64_t inner_memory_usage(Type&) {
+            return 0;
+        }
+
         static void store(
             const std::vector<float>& input,
             Type* storage,
@@ -42,5 +50,29 @@ namespace puffinn {
             }
             return values;
         }
+
+        static void serialize_args(std::ostream& out, const Args& args) {
+            out.write(reinterpret_cast<const char*>(&args), sizeof(Args));
+        }
+
+        static void deserialize_args(std::istream& in, Args* args) {
+            in.read(reinterpret_cast<char*>(args), sizeof(Args));
+        }
+
+        static void serialize_type(std::ostream& out, const Type& type) {
+            out.write(reinterpret_cast<const char*>(&type), sizeof(Type));
+        }
+
+        static void deserialize_type(std::istream& in, Type* type) {
+            in.read(reinterpret_cast<char*>(type), sizeof(Type));
+        }
     };
+
+    template <>
+    std::vector<float> convert_stored_type<RealVectorFormat, std::vector<float>>(
+        typename RealVectorFormat::Type* storage,
+        DatasetDescription<RealVectorFormat> dataset
+    ) {
+        return std::vector<float>(storage, storage+dataset.args);
+    }
 }
@@ -1,20 +1,129 @@
 #pragma once
 
-#include <vector>
+#include <algorithm>
 #include <istream>
 #include <ostream>
+#include <vector>
 
+#include "puffinn/dataset.hpp"
 #include "puffinn/format/generic.hpp"
+#include "puffinn/mapped_file.hpp"
+#include "puffinn/typedefs.hpp"
 
 namespace puffinn {
+    // A sorted set of tokens.
+    //
+    // Sets stored in a Dataset refer to its contiguous array of tokens,
+    // while sets stored elsewhere, such as queries, own their tokens.
+    class TokenSet {
+        const uint32_t* tokens;
+        uint32_t len;
+        // Whether the tokens were allocated for this set.
+        bool owned;
+
+    public:
+        TokenSet()
+          : tokens(nullptr),
+            len(0),
+            owned(false)
+        {
+        }
+
+        // Refer to tokens that are stored elsewhere.
+        TokenSet(const uint32_t* tokens, uint32_t len)
+          : tokens(tokens),
+            len(len),
+            owned(false)
+        {
+        }
+
+        // Take ownership of the given tokens, which must be sorted.
+        explicit TokenSet(const std::vector<uint32_t>& values)
+          : tokens(nullptr),
+            len(values.size()),
+            owned(true)
+        {
+            auto copy = new uint32_t[len];
+            std::copy(values.begin(), values.end(), copy);
+            tokens = copy;
+        }
+
+        TokenSet(const TokenSet&) = delete;
+        TokenSet& operator=(const TokenSet&) = delete;
+
+        TokenSet(TokenSet&& other) noexcept
+          : tokens(other.tokens),
+            len(other.len),
+            owned(other.owned)
+        {
+            other.tokens = nullptr;
+            other.len = 0;
+            other.owned = false;
+        }
+
+        TokenSet& operator=(TokenSet&& rhs) noexcept {
+            if (this != &rhs) {
+                release();
+                tokens = rhs.tokens;
+                len = rhs.len;
+                owned = rhs.owned;
+                rhs.tokens = nullptr;
+                rhs.len = 0;
+                rhs.owned = false;
+            }
+            return *this;
+        }
+
+        ~TokenSet() {
+            release();
+        }
+
+        // Free the tokens if they are owned and make the set empty.
+        void release() {
+            if (owned) {
+                delete[] tokens;
+            }
+            tokens = nullptr;
+            len = 0;
+            owned = false;
+        }
+
+        bool is_owned() const {
+            return owned;
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+        const uint32_t* data() const {
+            return tokens;
+        }
+
+        const uint32_t* begin() const {
+            return tokens;
+        }
+
+        const uint32_t* end() const {
+            return tokens+len;
+        }
+
+        uint32_t operator[](size_t idx) const {
+            return tokens[idx];
+        }
+    };
+
     /// A format for storing sets.
     ///
     /// Currently, only ``std::vector<uint32_t>`` is supported as input type.
     /// Each integer in this set represents a token and must be
     /// between 0 and the number of dimensions specified when constructing the ``LSHTable``.
+    /// Repeated tokens are only stored once.
+    ///
+    /// The tokens of all sets in a dataset are stored in a single contiguous array.
     struct SetFormat {
-        // Stored in sorted order.
-        using Type = std::vector<uint32_t>;
+        // Stored in sorted order without duplicates.
+        using Type = TokenSet;
         /// Size of the universe.
         using Args = unsigned int;
         const static unsigned int ALIGNMENT = 0;
@@ -23,13 +132,13 @@ namespace puffinn {
             return 1;
         }
 
-        static uint64_t inner_memory_usage(Type& vec) {
-            return vec.capacity()*sizeof(uint32_t);
+        static uint64_t inner_memory_usage(Type& set) {
+            return set.is_owned() ? set.size()*sizeof(uint32_t) : 0;
         }
 
-        static void store(
+        // Check that every token is in the universe.
+        static void check_tokens(
             const std::vector<uint32_t>& set,
-            std::vector<uint32_t>* storage,
             DatasetDescription<SetFormat> dataset
         ) {
             for (auto v : set) {
@@ -37,18 +146,22 @@ namespace puffinn {
                     throw std::invalid_argument("invalid token");
                 }
             }
-            // Placement-new
-            free(*storage);
-            auto vec = new(storage) std::vector<uint32_t>; 
-            vec->reserve(set.size());
-            for (auto i : set) {
-                vec->push_back(i);
-            }
-            std::sort(vec->begin(), vec->end());
         }
 
-        static void free(Type& vec) {
-            vec.~vector();
+        static void store(
+            const std::vector<uint32_t>& set,
+            Type* storage,
+            DatasetDescription<SetFormat> dataset
+        ) {
+            check_tokens(set, dataset);
+            std::vector<uint32_t> sorted(set);
+            std::sort(sorted.begin(), sorted.end());
+            sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+            *storage = TokenSet(sorted);
+        }
+
+        static void free(Type& set) {
+            set.release();
         }
 
         static std::vector<uint32_t> generate_random(unsigned int dimensions) {
@@ -78,21 +191,15 @@ namespace puffinn {
         static void serialize_type(std::ostream& out, const Type& type) {
             size_t len = type.size();
             out.write(reinterpret_cast<char*>(&len), sizeof(size_t));
-            for (size_t i=0; i < len; i++) {
-                out.write(reinterpret_cast<const char*>(&type[i]), sizeof(uint32_t));
-            }
+            out.write(reinterpret_cast<const char*>(type.data()), len*sizeof(uint32_t));
         }
 
         static void deserialize_type(std::istream& in, Type* type) {
-            auto vec = new(type) std::vector<uint32_t>;
             size_t len;
             in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
-            vec->reserve(len);
-            for (size_t i=0; i < len; i++) {
-                uint32_t v;
-                in.read(reinterpret_cast<char*>(&v), sizeof(uint32_t));
-                vec->push_back(v);
-            }
+            std::vector<uint32_t> values(len);
+            in.read(reinterpret_cast<char*>(values.data()), len*sizeof(uint32_t));
+            *type = TokenSet(values);
         }
     };
 
@@ -101,6 +208,224 @@ namespace puffinn {
         typename SetFormat::Type* storage,
         DatasetDescription<SetFormat>
     ) {
-        return *storage;
+        return std::vector<uint32_t>(storage->begin(), storage->end());
     }
+
+    // Container for sets, which stores the tokens of all sets in one contiguous array
+    // along with the offset of each set in it.
+    //
+    // This avoids an allocation per set and keeps the sets close together in memory.
+    template <>
+    class Dataset<SetFormat> {
+        // Size of the universe.
+        SetFormat::Args args;
+        // Number of stored values per set, which is always 1.
+        unsigned int storage_len;
+        // Tokens of all sets, where each set is sorted.
+        MappableVector<uint32_t> tokens;
+        // The tokens of set i are at positions offsets[i] until offsets[i+1].
+        MappableVector<uint64_t> offsets;
+        // The set at each position, referring to the tokens.
+        std::vector<SetFormat::Type> sets;
+
+        // Recreate the sets after the tokens have moved.
+        void update_sets() {
+            size_t n = offsets.size()-1;
+            sets.clear();
+            sets.reserve(n);
+            for (size_t i=0; i < n; i++) {
+                sets.emplace_back(
+                    tokens.data()+offsets[i],
+                    static_cast<uint32_t>(offsets[i+1]-offsets[i]));
+            }
+        }
+
+    public:
+        // Create an empty storage for sets from a universe of the given size.
+        Dataset(SetFormat::Args args) : Dataset(args, DEFAULT_CAPACITY)
+        {
+        }
+
+        // Create an empty storage for sets from a universe of the given size.
+        // Allocates enough space for the given number of sets before needing to reallocate.
+        Dataset(SetFormat::Args args, unsigned int capacity)
+          : args(args),
+            storage_len(SetFormat::storage_dimensions(args)),
+            offsets(std::vector<uint64_t>{0})
+        {
+            sets.reserve(capacity);
+        }
+
+        Dataset(Dataset&& other) = default;
+        Dataset& operator=(Dataset&& rhs) = default;
+
+        Dataset(std::istream& in) {
+            SetFormat::deserialize_args(in, &args);
+            in.read(reinterpret_cast<char*>(&storage_len), sizeof(unsigned int));
+            unsigned int inserted_sets;
+            in.read(reinterpret_cast<char*>(&inserted_sets), sizeof(unsigned int));
+            std::vector<uint64_t> read_offsets(inserted_sets+1);
+            in.read(
+                reinterpret_cast<char*>(read_offsets.data()),
+                read_offsets.size()*sizeof(uint64_t));
+            std::vector<uint32_t> read_tokens(read_offsets.back());
+            in.read(
+                reinterpret_cast<char*>(read_tokens.data()),
+                read_tokens.size()*sizeof(uint32_t));
+            offsets = std::move(read_offsets);
+            tokens = std::move(read_tokens);
+            update_sets();
+        }
+
+        void serialize(std::ostream& out) const {
+            SetFormat::serialize_args(out, args);
+            out.write(reinterpret_cast<const char*>(&storage_len), sizeof(unsigned int));
+            unsigned int inserted_sets = get_size();
+            out.write(reinterpret_cast<const char*>(&inserted_sets), sizeof(unsigned int));
+            out.write(
+                reinterpret_cast<const char*>(offsets.data()),
+                offsets.size()*sizeof(uint64_t));
+            out.write(
+                reinterpret_cast<const char*>(tokens.data()),
+                tokens.size()*sizeof(uint32_t));
+        }
+
+        // Construct a dataset whose tokens and offsets are stored in sections of a mapped file.
+        Dataset(std::istream& meta, const MappedFile& file) {
+            SetFormat::deserialize_args(meta, &args);
+            meta.read(reinterpret_cast<char*>(&storage_len), sizeof(unsigned int));
+            unsigned int inserted_sets;
+            meta.read(reinterpret_cast<char*>(&inserted_sets), sizeof(unsigned int));
+            uint64_t offsets_offset, tokens_offset, num_tokens;
+            meta.read(reinterpret_cast<char*>(&offsets_offset), sizeof(uint64_t));
+            meta.read(reinterpret_cast<char*>(&tokens_offset), sizeof(uint64_t));
+            meta.read(reinterpret_cast<char*>(&num_tokens), sizeof(uint64_t));
+            offsets = MappableVector<uint64_t>::mapped(file, offsets_offset, inserted_sets+1);
+            tokens = MappableVector<uint32_t>::mapped(file, tokens_offset, num_tokens);
+            update_sets();
+        }
+
+        void serialize_mapped(std::ostream& meta, MappedFileWriter& file) const {
+            SetFormat::serialize_args(meta, args);
+            meta.write(reinterpret_cast<const char*>(&storage_len), sizeof(unsigned int));
+            unsigned int inserted_sets = get_size();
+            meta.write(reinterpret_cast<const char*>(&inserted_sets), sizeof(unsigned int));
+            uint64_t offsets_offset = file.write_section(
+                offsets.data(),
+                offsets.size()*sizeof(uint64_t));
+            uint64_t tokens_offset = file.write_section(
+                tokens.data(),
+                tokens.size()*sizeof(uint32_t));
+            uint64_t num_tokens = tokens.size();
+            meta.write(reinterpret_cast<const char*>(&offsets_offset), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&tokens_offset), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&num_tokens), sizeof(uint64_t));
+        }
+
+        // Access the set at the given position.
+        SetFormat::Type* operator[](unsigned int idx) const {
+            // The set is only read through the returned pointer.
+            return const_cast<SetFormat::Type*>(&sets[idx]);
+        }
+
+        // Load the set at the given position into the cache.
+        void prefetch(unsigned int idx) const {
+            prefetch_addr(&sets[idx]);
+            auto begin = reinterpret_cast<const char*>(tokens.data()+offsets[idx]);
+            auto end = reinterpret_cast<const char*>(tokens.data()+offsets[idx+1]);
+            for (auto addr=begin; addr < end; addr += 64) {
+                prefetch_addr(addr);
+            }
+        }
+
+        // Retrieve the size of the universe as well as the number of values each set
+        // is stored with.
+        DatasetDescription<SetFormat> get_description() const {
+            DatasetDescription<SetFormat> res;
+            res.args = args;
+            res.storage_len = storage_len;
+            return res;
+        }
+
+        // Retrieve the number of inserted sets.
+        unsigned int get_size() const {
+            return sets.size();
+        }
+
+        // Insert a set.
+        void insert(const std::vector<uint32_t>& set) {
+            SetFormat::check_tokens(set, get_description());
+            auto all_tokens = tokens.take();
+            auto all_offsets = offsets.take();
+            auto old_data = all_tokens.data();
+            auto begin = all_tokens.size();
+            all_tokens.insert(all_tokens.end(), set.begin(), set.end());
+            std::sort(all_tokens.begin()+begin, all_tokens.end());
+            all_tokens.erase(std::unique(all_tokens.begin()+begin, all_tokens.end()), all_tokens.end());
+            all_offsets.push_back(all_tokens.size());
+            bool moved = (all_tokens.data() != old_data);
+            tokens = std::move(all_tokens);
+            offsets = std::move(all_offsets);
+            if (moved) {
+                update_sets();
+            } else {
+                sets.emplace_back(
+                    tokens.data()+begin,
+                    static_cast<uint32_t>(tokens.size()-begin));
+            }
+        }
+
+        // Retrieve the capacity of the dataset
+        unsigned int get_capacity() const {
+            return sets.capacity();
+        }
+
+        // Remove all sets from the dataset.
+        void clear() {
+            auto all_tokens = tokens.take();
+            all_tokens.clear();
+            tokens = std::move(all_tokens);
+            offsets = std::vector<uint64_t>{0};
+            sets.clear();
+        }
+
+        // Drop the sets marked with REMOVED_INDEX in new_ids and move the rest
+        // to their new positions, which must preserve their relative order.
+        void compact(const std::vector<uint32_t>& new_ids) {
+            auto all_tokens = tokens.take();
+            auto all_offsets = offsets.take();
+            size_t n = all_offsets.size()-1;
+            size_t kept = 0;
+            uint64_t kept_tokens = 0;
+            for (size_t idx=0; idx < n; idx++) {
+                if (new_ids[idx] == REMOVED_INDEX) {
+                    continue;
+                }
+                auto begin = all_offsets[idx];
+                auto end = all_offsets[idx+1];
+                // Sets only move towards the front, so the tokens are not overwritten
+                // before they are copied.
+                std::copy(
+                    all_tokens.begin()+begin,
+                    all_tokens.begin()+end,
+                    all_tokens.begin()+kept_tokens);
+                all_offsets[kept] = kept_tokens;
+                kept_tokens += end-begin;
+                kept++;
+            }
+            all_offsets[kept] = kept_tokens;
+            all_offsets.resize(kept+1);
+            all_tokens.resize(kept_tokens);
+            tokens = std::move(all_tokens);
+            offsets = std::move(all_offsets);
+            update_sets();
+        }
+
+        uint64_t memory_usage() const {
+            return sizeof(Dataset<SetFormat>)
+                + tokens.size()*sizeof(uint32_t)
+                + offsets.size()*sizeof(uint64_t)
+                + sets.capacity()*sizeof(SetFormat::Type);
+        }
+    };
 }
@@ -3,6 +3,7 @@
 #include "puffinn/dataset.hpp"
 #include "external/ffht/fht_header_only.h"
 #include "puffinn/format/unit_vector.hpp"
+#include "puffinn/hash_source/hash_source.hpp"
 #include "puffinn/math.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include <chrono>
@@ -119,6 +120,153 @@ namespace puffinn {
         }
     };
 
+    // Number of vectors whose cross-polytope hashes are computed together.
+    const static unsigned int FHT_BLOCK_LEN = 8;
+
+    using CrossPolytopeBlock =
+        void (*)(const float*, const int8_t*, unsigned int, int, float*, LshDatatype*);
+
+    static void crosspolytope_block_simple(
+        const float* vectors,
+        const int8_t* random_signs,
+        unsigned int num_rotations,
+        int log_dimensions,
+        float* buf,
+        LshDatatype* out
+    ) {
+        const int n = 1 << log_dimensions;
+        std::copy(vectors, vectors+n*FHT_BLOCK_LEN, buf);
+        for (unsigned int rotation = 0; rotation < num_rotations; rotation++) {
+            const int8_t* signs = &random_signs[rotation*n];
+            for (int i=0; i < n; i++) {
+                for (unsigned int v=0; v < FHT_BLOCK_LEN; v++) {
+                    buf[i*FHT_BLOCK_LEN+v] *= signs[i];
+                }
+            }
+            for (int h=1; h < n; h *= 2) {
+                for (int i=0; i < n; i += 2*h) {
+                    for (int j=i; j < i+h; j++) {
+                        for (unsigned int v=0; v < FHT_BLOCK_LEN; v++) {
+                            float x = buf[j*FHT_BLOCK_LEN+v];
+                            float y = buf[(j+h)*FHT_BLOCK_LEN+v];
+                            buf[j*FHT_BLOCK_LEN+v] = x+y;
+                            buf[(j+h)*FHT_BLOCK_LEN+v] = x-y;
+                        }
+                    }
+                }
+            }
+        }
+
+        float max_sim[FHT_BLOCK_LEN] = {};
+        LshDatatype res[FHT_BLOCK_LEN] = {};
+        for (int i=0; i < n; i++) {
+            for (unsigned int v=0; v < FHT_BLOCK_LEN; v++) {
+                float val = buf[i*FHT_BLOCK_LEN+v];
+                if (val > max_sim[v]) {
+                    res[v] = i;
+                    max_sim[v] = val;
+                } else if (-val > max_sim[v]) {
+                    res[v] = i+n;
+                    max_sim[v] = -val;
+                }
+            }
+        }
+        std::copy(res, res+FHT_BLOCK_LEN, out);
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        PUFFINN_TARGET("avx2")
+        static void crosspolytope_block_avx2(
+            const float* vectors,
+            const int8_t* random_signs,
+            unsigned int num_rotations,
+            int log_dimensions,
+            float* buf,
+            LshDatatype* out
+        ) {
+            const int n = 1 << log_dimensions;
+            std::copy(vectors, vectors+n*FHT_BLOCK_LEN, buf);
+            for (unsigned int rotation = 0; rotation < num_rotations; rotation++) {
+                const int8_t* signs = &random_signs[rotation*n];
+                for (int i=0; i < n; i++) {
+                    __m256 row = _mm256_loadu_ps(&buf[i*FHT_BLOCK_LEN]);
+                    row = _mm256_mul_ps(row, _mm256_set1_ps(signs[i]));
+                    _mm256_storeu_ps(&buf[i*FHT_BLOCK_LEN], row);
+                }
+                for (int h=1; h < n; h *= 2) {
+                    for (int i=0; i < n; i += 2*h) {
+                        for (int j=i; j < i+h; j++) {
+                            __m256 x = _mm256_loadu_ps(&buf[j*FHT_BLOCK_LEN]);
+                            __m256 y = _mm256_loadu_ps(&buf[(j+h)*FHT_BLOCK_LEN]);
+                            _mm256_storeu_ps(&buf[j*FHT_BLOCK_LEN], _mm256_add_ps(x, y));
+                            _mm256_storeu_ps(&buf[(j+h)*FHT_BLOCK_LEN], _mm256_sub_ps(x, y));
+                        }
+                    }
+                }
+            }
+
+            // The index of the closest axis is kept as a float, which is exact for the
+            // supported dimensions.
+            const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+            const __m256 zero = _mm256_setzero_ps();
+            __m256 max_sim = _mm256_setzero_ps();
+            __m256 res = _mm256_setzero_ps();
+            for (int i=0; i < n; i++) {
+                __m256 val = _mm256_loadu_ps(&buf[i*FHT_BLOCK_LEN]);
+                __m256 abs_val = _mm256_andnot_ps(sign_bit, val);
+                __m256 closer = _mm256_cmp_ps(abs_val, max_sim, _CMP_GT_OQ);
+                __m256 axis = _mm256_blendv_ps(
+                    _mm256_set1_ps(i),
+                    _mm256_set1_ps(i+n),
+                    _mm256_cmp_ps(val, zero, _CMP_LT_OQ));
+                max_sim = _mm256_blendv_ps(max_sim, abs_val, closer);
+                res = _mm256_blendv_ps(res, axis, closer);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_cvtps_epi32(res));
+        }
+    #endif
+
+    // Select the fastest version of crosspolytope_block supported by the cpu.
+    static CrossPolytopeBlock select_crosspolytope_block() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return crosspolytope_block_avx2;
+            }
+            return crosspolytope_block_simple;
+        #elif defined(__AVX2__)
+            return crosspolytope_block_avx2;
+        #else
+            return crosspolytope_block_simple;
+        #endif
+    }
+
+    // Compute the FHT cross-polytope hash of FHT_BLOCK_LEN vectors, where value i of vector v
+    // is stored at vectors[i*FHT_BLOCK_LEN+v]. The rotated vectors are stored in buf, which
+    // has room for as many values.
+    //
+    // The butterflies of the transform are applied in the same order as by fht, so the hashes
+    // are the same as those of FHTCrossPolytopeHashFunction.
+    static void crosspolytope_block(
+        const float* vectors,
+        const int8_t* random_signs,
+        unsigned int num_rotations,
+        int log_dimensions,
+        float* buf,
+        LshDatatype* out
+    ) {
+        #if defined(__AVX2__)
+            crosspolytope_block_avx2(
+                vectors, random_signs, num_rotations, log_dimensions, buf, out);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const CrossPolytopeBlock kernel = select_crosspolytope_block();
+            kernel(vectors, random_signs, num_rotations, log_dimensions, buf, out);
+        #else
+            crosspolytope_block_simple(
+                vectors, random_signs, num_rotations, log_dimensions, buf, out);
+        #endif
+    }
+
     class FHTCrossPolytopeHashFunction {
         int dimensions;
         int log_dimensions;
@@ -184,6 +332,23 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&random_signs[0]), random_signs.size()*sizeof(int8_t));
         }
 
+        int get_dimensions() const {
+            return dimensions;
+        }
+
+        int get_log_dimensions() const {
+            return log_dimensions;
+        }
+
+        unsigned int get_num_rotations() const {
+            return num_rotations;
+        }
+
+        // Signs of the diagonal matrices, stored consecutively for each rotation.
+        const int8_t* get_random_signs() const {
+            return random_signs.data();
+        }
+
         // Hash the given vector
         LshDatatype operator()(int16_t* vec) const {
             float rotated_vec[1 << log_dimensions];
@@ -477,4 +642,84 @@ namespace puffinn {
         }
 
     };
+
+    // Hash a block of vectors FHT_BLOCK_LEN at a time using crosspolytope_block,
+    // where get_function(f) retrieves function f.
+    template <typename F>
+    void fht_crosspolytope_block(
+        F get_function,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        unsigned int bits_per_function,
+        int16_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        if (num_vectors == 0 || num_hashes == 0) {
+            return;
+        }
+        // All functions hash vectors of the same dimensions.
+        const FHTCrossPolytopeHashFunction& first = get_function(0);
+        int dimensions = first.get_dimensions();
+        int log_dimensions = first.get_log_dimensions();
+        std::vector<float> interleaved(FHT_BLOCK_LEN << log_dimensions);
+        std::vector<float> buf(FHT_BLOCK_LEN << log_dimensions);
+
+        for (size_t first_vec=0; first_vec < num_vectors; first_vec += FHT_BLOCK_LEN) {
+            unsigned int block_len = std::min<size_t>(FHT_BLOCK_LEN, num_vectors-first_vec);
+            // Unused lanes and padding are zero.
+            std::fill(interleaved.begin(), interleaved.end(), 0.0f);
+            for (unsigned int v=0; v < block_len; v++) {
+                const int16_t* vec = &vectors[(first_vec+v)*storage_len];
+                for (int i=0; i < dimensions; i++) {
+                    interleaved[i*FHT_BLOCK_LEN+v] = UnitVectorFormat::from_16bit_fixed_point(vec[i]);
+                }
+            }
+
+            for (size_t h=0; h < num_hashes; h++) {
+                uint64_t res[FHT_BLOCK_LEN] = {};
+                for (unsigned int i=0; i < functions_per_hash; i++) {
+                    const FHTCrossPolytopeHashFunction& function =
+                        get_function(h*functions_per_hash+i);
+                    LshDatatype values[FHT_BLOCK_LEN];
+                    crosspolytope_block(
+                        interleaved.data(),
+                        function.get_random_signs(),
+                        function.get_num_rotations(),
+                        log_dimensions,
+                        buf.data(),
+                        values);
+                    for (unsigned int v=0; v < FHT_BLOCK_LEN; v++) {
+                        res[v] = (res[v] << bits_per_function) | values[v];
+                    }
+                }
+                for (unsigned int v=0; v < block_len; v++) {
+                    out[(first_vec+v)*num_hashes+h] = res[v];
+                }
+            }
+        }
+    }
+
+    template <>
+    inline void hash_functions_block<FHTCrossPolytopeHash>(
+        const FHTCrossPolytopeHashFunction* functions,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        unsigned int bits_per_function,
+        int16_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        fht_crosspolytope_block(
+            [functions](size_t f) -> const FHTCrossPolytopeHashFunction& { return functions[f]; },
+            num_hashes,
+            functions_per_hash,
+            bits_per_function,
+            vectors,
+            num_vectors,
+            storage_len,
+            out);
+    }
 }
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "puffinn/format/set.hpp"
+#include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/math.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
 
 #include <istream>
+#include <limits>
 #include <ostream>
 #include <random>
 
@@ -63,6 +66,17 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&t4[0]), 256*sizeof(uint64_t));
         }
 
+        // Retrieve the table used for the given byte of the hashed value,
+        // where byte 0 is the least significant one.
+        const uint64_t* get_table(unsigned int byte) const {
+            switch (byte) {
+                case 0: return t1;
+                case 1: return t2;
+                case 2: return t3;
+                default: return t4;
+            }
+        }
+
         uint64_t operator()(uint32_t val) const {
             return (
                 t1[val & 0xFF] ^
@@ -138,7 +152,16 @@ namespace puffinn {
             permutation.serialize(out);
         }
 
-        LshDatatype operator()(std::vector<uint32_t>* vec) const {
+        const TabulationHash& get_hash() const {
+            return hash;
+        }
+
+        // Hash the token with the smallest hash.
+        LshDatatype finalize(uint32_t min_token) const {
+            return permutation(min_token);
+        }
+
+        LshDatatype operator()(SetFormat::Type* vec) const {
             uint64_t min_hash = 0xFFFFFFFFFFFFFFFF; // 2^64-1
             uint32_t min_token = 0;
             for (uint32_t i : *vec) {
@@ -148,7 +171,241 @@ namespace puffinn {
                     min_token = i;
                 }
             }
-            return permutation(min_hash);
+            return finalize(min_token);
+        }
+    };
+
+    // Number of functions whose minima are computed together by the minhash_group kernels.
+    // The tables of a group take up 128KB, so they stay in the L2 cache while the tokens
+    // of a set are processed.
+    const static unsigned int MINHASH_GROUP_SIZE = 16;
+
+    using MinHashGroup = void (*)(const uint64_t*, const uint32_t*, size_t, uint32_t*);
+
+    // Rows of the interleaved tables of a group that are combined to hash the token.
+    static void minhash_rows(const uint64_t* tables, uint32_t token, const uint64_t* rows[4]) {
+        for (unsigned int byte=0; byte < 4; byte++) {
+            rows[byte] = &tables[(byte*256+((token >> (8*byte)) & 0xFF))*MINHASH_GROUP_SIZE];
+        }
+    }
+
+    static void minhash_group_simple(
+        const uint64_t* tables,
+        const uint32_t* tokens,
+        size_t num_tokens,
+        uint32_t* out
+    ) {
+        int64_t min_hash[MINHASH_GROUP_SIZE];
+        uint32_t min_token[MINHASH_GROUP_SIZE];
+        for (unsigned int f=0; f < MINHASH_GROUP_SIZE; f++) {
+            min_hash[f] = std::numeric_limits<int64_t>::max();
+            min_token[f] = 0;
+        }
+        for (size_t i=0; i < num_tokens; i++) {
+            const uint64_t* rows[4];
+            minhash_rows(tables, tokens[i], rows);
+            for (unsigned int f=0; f < MINHASH_GROUP_SIZE; f++) {
+                auto h = static_cast<int64_t>(rows[0][f]^rows[1][f]^rows[2][f]^rows[3][f]);
+                if (h < min_hash[f]) {
+                    min_hash[f] = h;
+                    min_token[f] = tokens[i];
+                }
+            }
+        }
+        std::copy(min_token, min_token+MINHASH_GROUP_SIZE, out);
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        PUFFINN_TARGET("avx2")
+        static void minhash_group_avx2(
+            const uint64_t* tables,
+            const uint32_t* tokens,
+            size_t num_tokens,
+            uint32_t* out
+        ) {
+            const static unsigned int VECS = MINHASH_GROUP_SIZE/4;
+
+            __m256i min_hash[VECS];
+            __m256i min_token[VECS];
+            for (unsigned int v=0; v < VECS; v++) {
+                min_hash[v] = _mm256_set1_epi64x(std::numeric_limits<int64_t>::max());
+                min_token[v] = _mm256_setzero_si256();
+            }
+            for (size_t i=0; i < num_tokens; i++) {
+                const uint64_t* rows[4];
+                minhash_rows(tables, tokens[i], rows);
+                __m256i token = _mm256_set1_epi64x(tokens[i]);
+                for (unsigned int v=0; v < VECS; v++) {
+                    __m256i h = _mm256_xor_si256(
+                        _mm256_xor_si256(
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&rows[0][4*v])),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&rows[1][4*v]))),
+                        _mm256_xor_si256(
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&rows[2][4*v])),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&rows[3][4*v]))));
+                    __m256i smaller = _mm256_cmpgt_epi64(min_hash[v], h);
+                    min_hash[v] = _mm256_blendv_epi8(min_hash[v], h, smaller);
+                    min_token[v] = _mm256_blendv_epi8(min_token[v], token, smaller);
+                }
+            }
+            uint64_t res[MINHASH_GROUP_SIZE];
+            for (unsigned int v=0; v < VECS; v++) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(&res[4*v]), min_token[v]);
+            }
+            std::copy(res, res+MINHASH_GROUP_SIZE, out);
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512F__)
+        PUFFINN_TARGET("avx512f")
+        static void minhash_group_avx512(
+            const uint64_t* tables,
+            const uint32_t* tokens,
+            size_t num_tokens,
+            uint32_t* out
+        ) {
+            const static unsigned int VECS = MINHASH_GROUP_SIZE/8;
+
+            __m512i min_hash[VECS];
+            __m512i min_token[VECS];
+            for (unsigned int v=0; v < VECS; v++) {
+                min_hash[v] = _mm512_set1_epi64(std::numeric_limits<int64_t>::max());
+                min_token[v] = _mm512_setzero_si512();
+            }
+            for (size_t i=0; i < num_tokens; i++) {
+                const uint64_t* rows[4];
+                minhash_rows(tables, tokens[i], rows);
+                __m512i token = _mm512_set1_epi64(tokens[i]);
+                for (unsigned int v=0; v < VECS; v++) {
+                    __m512i h = _mm512_xor_si512(
+                        _mm512_xor_si512(
+                            _mm512_loadu_si512(&rows[0][8*v]),
+                            _mm512_loadu_si512(&rows[1][8*v])),
+                        _mm512_xor_si512(
+                            _mm512_loadu_si512(&rows[2][8*v]),
+                            _mm512_loadu_si512(&rows[3][8*v])));
+                    __mmask8 smaller = _mm512_cmplt_epi64_mask(h, min_hash[v]);
+                    min_hash[v] = _mm512_mask_mov_epi64(min_hash[v], smaller, h);
+                    min_token[v] = _mm512_mask_mov_epi64(min_token[v], smaller, token);
+                }
+            }
+            for (unsigned int v=0; v < VECS; v++) {
+                // Truncating store, since _mm512_cvtepi64_epi32 causes spurious warnings
+                // about uninitialized values in GCC 12.
+                _mm512_mask_cvtepi64_storeu_epi32(&out[8*v], 0xff, min_token[v]);
+            }
+        }
+    #endif
+
+    // Select the fastest version of minhash_group supported by the cpu.
+    static MinHashGroup select_minhash_group() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) {
+                return minhash_group_avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return minhash_group_avx2;
+            }
+            return minhash_group_simple;
+        #elif defined(__AVX512F__)
+            return minhash_group_avx512;
+        #elif defined(__AVX2__)
+            return minhash_group_avx2;
+        #else
+            return minhash_group_simple;
+        #endif
+    }
+
+    // Find the token with the smallest hash for each function in a group.
+    //
+    // The tables of the group are interleaved so that the values of the functions for
+    // a byte are stored consecutively, and the highest bit of the first table is flipped
+    // so that the hashes can be compared as signed integers.
+    // Ties are broken by the first token, as in MinHashFunction.
+    static void minhash_group(
+        const uint64_t* tables,
+        const uint32_t* tokens,
+        size_t num_tokens,
+        uint32_t* out
+    ) {
+        #if defined(__AVX512F__)
+            minhash_group_avx512(tables, tokens, num_tokens, out);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const MinHashGroup kernel = select_minhash_group();
+            kernel(tables, tokens, num_tokens, out);
+        #elif defined(__AVX2__)
+            minhash_group_avx2(tables, tokens, num_tokens, out);
+        #else
+            minhash_group_simple(tables, tokens, num_tokens, out);
+        #endif
+    }
+
+    // Computes many minhash functions with a single pass over the tokens
+    // for each group of MINHASH_GROUP_SIZE functions.
+    class MinHashBlock {
+        size_t num_functions = 0;
+        std::vector<uint64_t> tables;
+
+    public:
+        MinHashBlock() = default;
+
+        // Copy the tables of the given tabulation hashes, where get_hash(f) retrieves the
+        // hash of function f.
+        template <typename F>
+        MinHashBlock(F get_hash, size_t num_functions)
+          : num_functions(num_functions)
+        {
+            size_t num_groups = (num_functions+MINHASH_GROUP_SIZE-1)/MINHASH_GROUP_SIZE;
+            // Unused functions in the last group hash every token to 0.
+            tables.resize(num_groups*4*256*MINHASH_GROUP_SIZE, 0);
+            for (size_t f=0; f < num_functions; f++) {
+                const TabulationHash& hash = get_hash(f);
+                auto group_tables = &tables[(f/MINHASH_GROUP_SIZE)*4*256*MINHASH_GROUP_SIZE];
+                for (unsigned int byte=0; byte < 4; byte++) {
+                    uint64_t flip = (byte == 0) ? (1ull << 63) : 0;
+                    for (unsigned int val=0; val < 256; val++) {
+                        group_tables[(byte*256+val)*MINHASH_GROUP_SIZE+f%MINHASH_GROUP_SIZE] =
+                            hash.get_table(byte)[val]^flip;
+                    }
+                }
+            }
+        }
+
+        // Compute hashes that each concatenate a group of consecutive functions as in
+        // FunctionBlock::hash. The functions must be those whose hashes the block was
+        // constructed from and need to provide finalize(min_token).
+        template <typename F>
+        void hash(
+            const F* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            SetFormat::Type* vec,
+            uint64_t* out
+        ) const {
+            // Reused between calls to avoid an allocation per set.
+            static thread_local std::vector<uint32_t> min_tokens;
+
+            size_t used_functions = std::min(num_hashes*functions_per_hash, num_functions);
+            size_t num_groups = (used_functions+MINHASH_GROUP_SIZE-1)/MINHASH_GROUP_SIZE;
+            min_tokens.resize(num_groups*MINHASH_GROUP_SIZE);
+            for (size_t g=0; g < num_groups; g++) {
+                minhash_group(
+                    &tables[g*4*256*MINHASH_GROUP_SIZE],
+                    vec->data(),
+                    vec->size(),
+                    &min_tokens[g*MINHASH_GROUP_SIZE]);
+            }
+            for (size_t h=0; h < num_hashes; h++) {
+                uint64_t res = 0;
+                for (unsigned int i=0; i < functions_per_hash; i++) {
+                    auto f = h*functions_per_hash+i;
+                    res <<= bits_per_function;
+                    res |= functions[f].finalize(min_tokens[f]);
+                }
+                out[h] = res;
+            }
         }
     };
 
@@ -183,7 +440,8 @@ namespace puffinn {
         uint64_t memory_usage(DatasetDescription<SetFormat> dataset) const {
             auto perm_len = std::min(dataset.args, (1u << randomized_bits));
             uint64_t perm_mem = perm_len * sizeof(uint32_t);
-            return sizeof(MinHashFunction)+perm_mem;
+            // The tables of the tabulation hash are copied into a MinHashBlock.
+            return sizeof(MinHashFunction)+sizeof(TabulationHash)+perm_mem;
         }
     };
 
@@ -267,7 +525,15 @@ namespace puffinn {
             hash.serialize(out);
         }
 
-        LshDatatype operator()(std::vector<uint32_t>* vec) const {
+        const MinHashFunction& get_minhash() const {
+            return hash;
+        }
+
+        LshDatatype finalize(uint32_t min_token) const {
+            return hash.finalize(min_token)%2;
+        }
+
+        LshDatatype operator()(SetFormat::Type* vec) const {
             return hash(vec)%2;
         }
     };
@@ -314,4 +580,103 @@ namespace puffinn {
             return 2.0 * p - 1.0;
         }
     };
+
+    // The tokens of a set are iterated once for every MINHASH_GROUP_SIZE functions.
+    template <>
+    class FunctionBlock<MinHash> {
+        MinHashBlock block;
+
+    public:
+        FunctionBlock() = default;
+
+        FunctionBlock(const MinHashFunction* functions, size_t num_functions)
+          : block(
+                [functions](size_t f) -> const TabulationHash& {
+                    return functions[f].get_hash();
+                },
+                num_functions)
+        {
+        }
+
+        void hash(
+            const MinHashFunction* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            SetFormat::Type* vec,
+            uint64_t* out
+        ) const {
+            block.hash(functions, num_hashes, functions_per_hash, bits_per_function, vec, out);
+        }
+
+        void hash_block(
+            const MinHashFunction* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            SetFormat::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            uint64_t* out
+        ) const {
+            for (size_t v=0; v < num_vectors; v++) {
+                block.hash(
+                    functions,
+                    num_hashes,
+                    functions_per_hash,
+                    bits_per_function,
+                    &vectors[v*storage_len],
+                    &out[v*num_hashes]);
+            }
+        }
+    };
+
+    template <>
+    class FunctionBlock<MinHash1Bit> {
+        MinHashBlock block;
+
+    public:
+        FunctionBlock() = default;
+
+        FunctionBlock(const MinHash1BitFunction* functions, size_t num_functions)
+          : block(
+                [functions](size_t f) -> const TabulationHash& {
+                    return functions[f].get_minhash().get_hash();
+                },
+                num_functions)
+        {
+        }
+
+        void hash(
+            const MinHash1BitFunction* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            SetFormat::Type* vec,
+            uint64_t* out
+        ) const {
+            block.hash(functions, num_hashes, functions_per_hash, bits_per_function, vec, out);
+        }
+
+        void hash_block(
+            const MinHash1BitFunction* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            SetFormat::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            uint64_t* out
+        ) const {
+            for (size_t v=0; v < num_vectors; v++) {
+                block.hash(
+                    functions,
+                    num_hashes,
+                    functions_per_hash,
+                    bits_per_function,
+                    &vectors[v*storage_len],
+                    &out[v*num_hashes]);
+            }
+        }
+    };
 }
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/real_vector.hpp"
+#include "puffinn/math.hpp"
+#include "puffinn/similarity_measure/l2.hpp"
+
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <random>
+
+namespace puffinn {
+    // Probability that two points at distance `distance` are assigned buckets that are equal
+    // modulo `modulus` by a p-stable hash function with the given bucket width and an offset
+    // that is uniform modulo the bucket width.
+    //
+    // The difference between the projections of the points, measured in bucket widths,
+    // is normally distributed with standard deviation s = distance/width.
+    // Given a difference of d, the buckets differ by m with probability max(0, 1-|d-m|),
+    // which is summed over every multiple of the modulus.
+    static double pstable_collision_probability(
+        double distance,
+        double width,
+        uint64_t modulus
+    ) {
+        if (modulus == 1 || distance == 0.0) {
+            return 1.0;
+        }
+        const double m = static_cast<double>(modulus);
+        const double s = distance/width;
+        if (s >= m/2) {
+            // When the projections are spread over many buckets, the Fourier series of the
+            // periodic sum converges in a few terms.
+            double res = 1.0/m;
+            for (uint64_t n=1; ; n++) {
+                double x = M_PI*n/m;
+                double decay = std::exp(-2.0*(x*s)*(x*s));
+                if (decay < 1e-12) {
+                    break;
+                }
+                double sinc = std::sin(x)/x;
+                res += 2.0/m*sinc*sinc*decay;
+            }
+            return res;
+        }
+        // Expected value of max(0, D-a) for a normally distributed D.
+        auto partial_expectation = [s](double a) {
+            double z = a/s;
+            double pdf = std::exp(-z*z/2)/std::sqrt(2*M_PI);
+            double upper_tail = std::erfc(z/std::sqrt(2.0))/2;
+            return s*pdf-a*upper_tail;
+        };
+        int64_t max_k = static_cast<int64_t>(std::ceil((8*s+1)/m));
+        double res = 0.0;
+        for (int64_t k=-max_k; k <= max_k; k++) {
+            double a = k*m;
+            res += partial_expectation(a-1)
+                - 2*partial_expectation(a)
+                + partial_expectation(a+1);
+        }
+        return res;
+    }
+
+    class PStableHashFunction {
+        AlignedStorage<RealVectorFormat> hash_vec;
+        unsigned int dimensions;
+        float bucket_width;
+        // Stored in double precision, since it spans up to 2^bits buckets
+        // and needs to be precise within a single bucket.
+        double offset;
+        unsigned int bits;
+
+    public:
+        PStableHashFunction(
+            DatasetDescription<RealVectorFormat> dataset,
+            float bucket_width,
+            unsigned int bits
+        )
+          : hash_vec(allocate_storage<RealVectorFormat>(1, dataset.storage_len)),
+            dimensions(dataset.storage_len),
+            bucket_width(bucket_width),
+            bits(bits)
+        {
+            auto vec = RealVectorFormat::generate_random(dataset.args);
+            RealVectorFormat::store(vec, hash_vec.get(), dataset);
+            // The offset covers every bucket that can be distinguished,
+            // so that it is also uniform when fewer bits are used.
+            std::uniform_real_distribution<double> offset_distribution(
+                0.0,
+                static_cast<double>(bucket_width)*(1ull << bits));
+            offset = offset_distribution(get_default_random_generator());
+        }
+
+        PStableHashFunction(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&dimensions), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&bucket_width), sizeof(float));
+            in.read(reinterpret_cast<char*>(&offset), sizeof(double));
+            in.read(reinterpret_cast<char*>(&bits), sizeof(unsigned int));
+            hash_vec = allocate_storage<RealVectorFormat>(1, dimensions);
+            in.read(
+                reinterpret_cast<char*>(hash_vec.get()),
+                dimensions*sizeof(typename RealVectorFormat::Type));
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&dimensions), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&bucket_width), sizeof(float));
+            out.write(reinterpret_cast<const char*>(&offset), sizeof(double));
+            out.write(reinterpret_cast<const char*>(&bits), sizeof(unsigned int));
+            out.write(
+                reinterpret_cast<const char*>(hash_vec.get()),
+                dimensions*sizeof(typename RealVectorFormat::Type));
+        }
+
+        // Hash the given vector.
+        LshDatatype operator()(float* vec) const {
+            auto dot = dot_product_float(hash_vec.get(), vec, dimensions);
+            auto bucket = static_cast<int64_t>(
+                std::floor((static_cast<double>(dot)+offset)/bucket_width));
+            // Only the lowest bits are kept, which is well defined for negative buckets.
+            return static_cast<uint64_t>(bucket) & ((1ull << bits)-1);
+        }
+    };
+
+    /// Arguments for ``PStableHash``.
+    struct PStableHashArgs {
+        /// Width of the buckets that the random projections are divided into.
+        ///
+        /// Points whose distance is small relative to the width are likely to collide.
+        float bucket_width;
+        /// Number of bits of the bucket index that is used.
+        /// Buckets that are equal modulo ``2^bits`` collide.
+        unsigned int bits;
+
+        constexpr PStableHashArgs()
+          : bucket_width(4.0),
+            bits(4)
+        {
+        }
+
+        PStableHashArgs(std::istream& in) {
+            in.read(reinterpret_cast<char*>(&bucket_width), sizeof(float));
+            in.read(reinterpret_cast<char*>(&bits), sizeof(unsigned int));
+        }
+
+        void serialize(std::ostream& out) const {
+            out.write(reinterpret_cast<const char*>(&bucket_width), sizeof(float));
+            out.write(reinterpret_cast<const char*>(&bits), sizeof(unsigned int));
+        }
+
+        uint64_t memory_usage(DatasetDescription<RealVectorFormat> dataset) const {
+            return sizeof(PStableHashFunction) + dataset.storage_len*sizeof(RealVectorFormat::Type);
+        }
+
+        void set_no_preprocessing() {}
+    };
+
+    /// A multi-bit hash function for euclidean distance, which projects points onto a random
+    /// line and divides the line into buckets of equal width.
+    ///
+    /// The line is given by a vector of independent standard normal values, which makes
+    /// the difference between projections of two points normally distributed with a
+    /// standard deviation equal to their distance.
+    /// When fewer bits are used, the buckets are merged in groups of equal size.
+    class PStableHash {
+    public:
+        using Args = PStableHashArgs;
+        using Sim = L2Distance;
+        using Function = PStableHashFunction;
+
+    private:
+        DatasetDescription<RealVectorFormat> dataset;
+        Args args;
+
+    public:
+        PStableHash(DatasetDescription<RealVectorFormat> dataset, Args args)
+          : dataset(dataset),
+            args(args)
+        {
+            if (args.bucket_width <= 0.0 || args.bits == 0 || args.bits > 32) {
+                throw std::invalid_argument("args");
+            }
+        }
+
+        PStableHash(std::istream& in)
+          : dataset(in),
+            args(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+            args.serialize(out);
+        }
+
+        Function sample() {
+            return Function(dataset, args.bucket_width, args.bits);
+        }
+
+        unsigned int bits_per_function() const {
+            return args.bits;
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            if (num_bits <= 0) {
+                return 1.0;
+            }
+            unsigned int used_bits = std::min(static_cast<unsigned int>(num_bits), args.bits);
+            // Using the top bits is the same as using wider buckets.
+            double width = args.bucket_width*static_cast<double>(1ull << (args.bits-used_bits));
+            double distance = std::sqrt(std::max(1.0/similarity-1.0, 0.0));
+            return pstable_collision_probability(distance, width, 1ull << used_bits);
+        }
+
+        float icollision_probability(float p) const {
+            // The collision probability is decreasing in the distance,
+            // so the distance is found by bisection.
+            if (p >= 1.0) {
+                return 1.0;
+            }
+            double low = 0.0;
+            double high = args.bucket_width;
+            while (pstable_collision_probability(high, args.bucket_width, 1ull << args.bits) > p) {
+                high *= 2;
+                if (high > 1e9) {
+                    return 0.0;
+                }
+            }
+            for (int i=0; i < 50; i++) {
+                double mid = (low+high)/2;
+                if (pstable_collision_probability(mid, args.bucket_width, 1ull << args.bits) > p) {
+                    low = mid;
+                } else {
+                    high = mid;
+                }
+            }
+            return 1.0/(low*low+1.0);
+        }
+    };
+
+    class PStableHash1BitFunction {
+        PStableHashFunction hash;
+
+    public:
+        PStableHash1BitFunction(PStableHashFunction hash)
+          : hash(std::move(hash))
+        {
+        }
+
+        PStableHash1BitFunction(std::istream& in)
+          : hash(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            hash.serialize(out);
+        }
+
+        LshDatatype operator()(float* vec) const {
+            return hash(vec)%2;
+        }
+    };
+
+    /// ``PStableHash``, but only use the parity of the bucket to make it suitable for sketching.
+    class PStableHash1Bit {
+    public:
+        using Args = PStableHash::Args;
+        using Sim = PStableHash::Sim;
+        using Function = PStableHash1BitFunction;
+
+    private:
+        PStableHash pstable;
+
+        static Args one_bit(Args args) {
+            args.bits = 1;
+            return args;
+        }
+
+    public:
+        PStableHash1Bit(DatasetDescription<RealVectorFormat> dataset, Args args)
+          : pstable(dataset, one_bit(args))
+        {
+        }
+
+        PStableHash1Bit(std::istream& in)
+          : pstable(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            pstable.serialize(out);
+        }
+
+        Function sample() {
+            return Function(pstable.sample());
+        }
+
+        unsigned int bits_per_function() const {
+            return 1;
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            if (num_bits > 1) { num_bits = 1; }
+            return pstable.collision_probability(similarity, num_bits);
+        }
+
+        float icollision_probability(float p) const {
+            return pstable.icollision_probability(p);
+        }
+    };
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/quantized_unit_vector.hpp"
+#include "puffinn/format/unit_vector.hpp"
+#include "puffinn/hash/crosspolytope.hpp"
+#include "puffinn/hash/simhash.hpp"
+#include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/similarity_measure/quantized_cosine.hpp"
+
+#include <istream>
+#include <ostream>
+
+namespace puffinn {
+    // Description of the vectors that a quantized dataset is converted to before hashing.
+    static DatasetDescription<UnitVectorFormat> unit_vector_description(
+        DatasetDescription<QuantizedUnitVectorFormat> dataset
+    ) {
+        DatasetDescription<UnitVectorFormat> res;
+        res.args = dataset.args;
+        res.storage_len = pad_dimensions<UnitVectorFormat>(dataset.args);
+        return res;
+    }
+
+    template <typename T>
+    class QuantizedHashFunction {
+        typename T::Function hash;
+        DatasetDescription<QuantizedUnitVectorFormat> dataset;
+
+    public:
+        QuantizedHashFunction(
+            typename T::Function hash,
+            DatasetDescription<QuantizedUnitVectorFormat> dataset
+        )
+          : hash(std::move(hash)),
+            dataset(dataset)
+        {
+        }
+
+        QuantizedHashFunction(std::istream& in)
+          : hash(in),
+            dataset(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            hash.serialize(out);
+            dataset.serialize(out);
+        }
+
+        // Retrieve the description of the dataset that is hashed.
+        DatasetDescription<QuantizedUnitVectorFormat> get_dataset() const {
+            return dataset;
+        }
+
+        // Retrieve the wrapped hash function.
+        const typename T::Function& get_hash() const {
+            return hash;
+        }
+
+        // Hash the given vector.
+        LshDatatype operator()(int8_t* vec) const {
+            // Reused between calls to avoid an allocation per hash.
+            static thread_local AlignedStorage<UnitVectorFormat> converted;
+            static thread_local unsigned int converted_len = 0;
+
+            auto unit_desc = unit_vector_description(dataset);
+            if (converted_len < unit_desc.storage_len) {
+                converted = allocate_storage<UnitVectorFormat>(1, unit_desc.storage_len);
+                converted_len = unit_desc.storage_len;
+            }
+            QuantizedUnitVectorFormat::to_unit_vector(vec, dataset, converted.get());
+            return hash(converted.get());
+        }
+    };
+
+    /// Arguments for ``QuantizedHash``, which are the same as those of the wrapped family.
+    template <typename T>
+    struct QuantizedHashArgs : public T::Args {
+        using T::Args::Args;
+
+        QuantizedHashArgs(const typename T::Args& args)
+          : T::Args(args)
+        {
+        }
+
+        uint64_t memory_usage(DatasetDescription<QuantizedUnitVectorFormat> dataset) const {
+            return T::Args::memory_usage(unit_vector_description(dataset));
+        }
+    };
+
+    /// Adapts an LSH family for ``CosineSimilarity`` to vectors stored using
+    /// ``QuantizedUnitVectorFormat``.
+    ///
+    /// Vectors are converted to the format of ``UnitVectorFormat`` before being hashed,
+    /// so the hashes and their collision probabilities are those of the wrapped family.
+    template <typename T>
+    class QuantizedHash {
+    public:
+        using Args = QuantizedHashArgs<T>;
+        using Sim = QuantizedCosineSimilarity;
+        using Function = QuantizedHashFunction<T>;
+
+    private:
+        DatasetDescription<QuantizedUnitVectorFormat> dataset;
+        T family;
+
+    public:
+        QuantizedHash(DatasetDescription<QuantizedUnitVectorFormat> dataset, Args args)
+          : dataset(dataset),
+            family(unit_vector_description(dataset), args)
+        {
+        }
+
+        QuantizedHash(std::istream& in)
+          : dataset(in),
+            family(in)
+        {
+        }
+
+        void serialize(std::ostream& out) const {
+            dataset.serialize(out);
+            family.serialize(out);
+        }
+
+        Function sample() {
+            return Function(family.sample(), dataset);
+        }
+
+        unsigned int bits_per_function() {
+            return family.bits_per_function();
+        }
+
+        float collision_probability(float similarity, int_fast8_t num_bits) const {
+            return family.collision_probability(similarity, num_bits);
+        }
+
+        float icollision_probability(float p) const {
+            return family.icollision_probability(p);
+        }
+    };
+
+    // Convert a block of quantized vectors to the format of UnitVectorFormat.
+    static AlignedStorage<UnitVectorFormat> to_unit_vector_block(
+        DatasetDescription<QuantizedUnitVectorFormat> dataset,
+        int8_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len
+    ) {
+        auto unit_desc = unit_vector_description(dataset);
+        auto converted = allocate_storage<UnitVectorFormat>(num_vectors, unit_desc.storage_len);
+        for (size_t v=0; v < num_vectors; v++) {
+            QuantizedUnitVectorFormat::to_unit_vector(
+                &vectors[v*storage_len],
+                dataset,
+                &converted.get()[v*unit_desc.storage_len]);
+        }
+        return converted;
+    }
+
+    // The block is converted once, after which it is hashed in the same way as by SimHash.
+    template <>
+    inline void hash_functions_block<QuantizedHash<SimHash>>(
+        const QuantizedHashFunction<SimHash>* functions,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        unsigned int /*bits_per_function*/,
+        int8_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        if (num_vectors == 0 || num_hashes == 0) {
+            return;
+        }
+        // All functions share the description of the dataset.
+        auto dataset = functions[0].get_dataset();
+        auto unit_desc = unit_vector_description(dataset);
+        auto converted = to_unit_vector_block(dataset, vectors, num_vectors, storage_len);
+        simhash_block(
+            [functions](size_t f) { return functions[f].get_hash().get_vector(); },
+            num_hashes,
+            functions_per_hash,
+            converted.get(),
+            num_vectors,
+            unit_desc.storage_len,
+            out);
+    }
+
+    // The block is converted once, after which it is hashed in the same way as by
+    // FHTCrossPolytopeHash.
+    template <>
+    inline void hash_functions_block<QuantizedHash<FHTCrossPolytopeHash>>(
+        const QuantizedHashFunction<FHTCrossPolytopeHash>* functions,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        unsigned int bits_per_function,
+        int8_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        if (num_vectors == 0 || num_hashes == 0) {
+            return;
+        }
+        auto dataset = functions[0].get_dataset();
+        auto unit_desc = unit_vector_description(dataset);
+        auto converted = to_unit_vector_block(dataset, vectors, num_vectors, storage_len);
+        fht_crosspolytope_block(
+            [functions](size_t f) -> const FHTCrossPolytopeHashFunction& {
+                return functions[f].get_hash();
+            },
+            num_hashes,
+            functions_per_hash,
+            bits_per_function,
+            converted.get(),
+            num_vectors,
+            unit_desc.storage_len,
+            out);
+    }
+}
@@ -2,11 +2,14 @@
 
 #include "puffinn/dataset.hpp"
 #include "puffinn/format/unit_vector.hpp"
+#include "puffinn/hash_source/hash_source.hpp"
 #include "puffinn/math.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 
+#include <algorithm>
 #include <istream>
 #include <ostream>
+#include <vector>
 
 namespace puffinn {
     class SimHashFunction {
@@ -39,9 +42,14 @@ namespace puffinn {
 
         // Hash the given vector.
         LshDatatype operator()(int16_t* vec) const {
-            auto dot = dot_product_i16(hash_vec.get(), vec, dimensions);
+            auto dot = dot_product_i16_exact(hash_vec.get(), vec, dimensions);
             return dot >= UnitVectorFormat::to_16bit_fixed_point(0.0);
         }
+
+        // Retrieve the normal vector of the hyperplane.
+        const int16_t* get_vector() const {
+            return hash_vec.get();
+        }
     };
 
     /// ``SimHash`` does not take any arguments.
@@ -105,4 +113,76 @@ namespace puffinn {
             return (std::cos(M_PI * (1-p)) + 1.0) / 2.0;
         }
     };
+
+    // Compute hashes that each concatenate a group of consecutive SimHash functions,
+    // where get_vector(f) is the hash vector of function f, as described in hash_functions_block.
+    //
+    // The hash vectors are multiplied with 16 vectors at a time, whose values are
+    // interleaved so that each lane of the result holds one dot product.
+    // This gives the same hashes as SimHashFunction.
+    template <typename F>
+    void simhash_block(
+        F get_vector,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        int16_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        std::vector<int16_t> interleaved(16*storage_len);
+        for (size_t first_vec=0; first_vec < num_vectors; first_vec += 16) {
+            unsigned int block_len = std::min<size_t>(16, num_vectors-first_vec);
+            const int16_t* block[16];
+            for (unsigned int v=0; v < block_len; v++) {
+                block[v] = &vectors[(first_vec+v)*storage_len];
+            }
+            interleave_i16_x16(block, block_len, storage_len, interleaved.data());
+
+            for (size_t h=0; h < num_hashes; h++) {
+                size_t first_function = h*functions_per_hash;
+                uint64_t res[16] = {};
+                for (unsigned int f=0; f < functions_per_hash; f += 4) {
+                    // The last function is repeated when fewer than four are left.
+                    const int16_t* hash_vecs[4];
+                    for (unsigned int i=0; i < 4; i++) {
+                        hash_vecs[i] = get_vector(
+                            first_function+std::min(f+i, functions_per_hash-1));
+                    }
+                    uint16_t signs[4];
+                    dot_product_i16_exact_signs_x16(
+                        hash_vecs, interleaved.data(), storage_len, signs);
+                    for (unsigned int i=0; i < 4 && f+i < functions_per_hash; i++) {
+                        for (unsigned int v=0; v < 16; v++) {
+                            res[v] = (res[v] << 1) | ((signs[i] >> v) & 1);
+                        }
+                    }
+                }
+                for (unsigned int v=0; v < block_len; v++) {
+                    out[(first_vec+v)*num_hashes+h] = res[v];
+                }
+            }
+        }
+    }
+
+    template <>
+    inline void hash_functions_block<SimHash>(
+        const SimHashFunction* functions,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        unsigned int /*bits_per_function*/,
+        int16_t* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        simhash_block(
+            [functions](size_t f) { return functions[f].get_vector(); },
+            num_hashes,
+            functions_per_hash,
+            vectors,
+            num_vectors,
+            storage_len,
+            out);
+    }
 }
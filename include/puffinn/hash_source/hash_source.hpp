@@ -1,10 +1,100 @@
 #pragma once
 
+#include "puffinn/typedefs.hpp"
+
+#include <memory>
 #include <ostream>
+#include <vector>
 
 namespace puffinn {
     class Hash;
 
+    // Compute hashes that each concatenate a group of consecutive functions for each of the
+    // vectors, which are stored consecutively with the given length.
+    // Hash h uses functions [h*functions_per_hash, (h+1)*functions_per_hash), where the first
+    // function gives the highest bits. The hash of vector v is written to out[v*num_hashes+h].
+    //
+    // Families can specialize this to share work between the functions.
+    template <typename T>
+    void hash_functions_block(
+        const typename T::Function* functions,
+        size_t num_hashes,
+        unsigned int functions_per_hash,
+        unsigned int bits_per_function,
+        typename T::Sim::Format::Type* vectors,
+        size_t num_vectors,
+        unsigned int storage_len,
+        uint64_t* out
+    ) {
+        for (size_t v=0; v < num_vectors; v++) {
+            for (size_t h=0; h < num_hashes; h++) {
+                uint64_t res = 0;
+                for (unsigned int i=0; i < functions_per_hash; i++) {
+                    res <<= bits_per_function;
+                    res |= functions[h*functions_per_hash+i](&vectors[v*storage_len]);
+                }
+                out[v*num_hashes+h] = res;
+            }
+        }
+    }
+
+    // Evaluates a fixed sequence of functions sampled from the family T.
+    //
+    // It is constructed once the functions are sampled, after which the functions are
+    // supplied again whenever they are evaluated. Families can specialize this to precompute
+    // data that lets all the functions be evaluated together, such as in a single pass
+    // over the input.
+    template <typename T>
+    class FunctionBlock {
+    public:
+        FunctionBlock() = default;
+
+        FunctionBlock(const typename T::Function* /*functions*/, size_t /*num_functions*/) {
+        }
+
+        // Compute hashes that each concatenate a group of consecutive functions for one vector.
+        // Hash h is written to out[h] as in hash_functions_block.
+        void hash(
+            const typename T::Function* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            typename T::Sim::Format::Type* vec,
+            uint64_t* out
+        ) const {
+            for (size_t h=0; h < num_hashes; h++) {
+                uint64_t res = 0;
+                for (unsigned int i=0; i < functions_per_hash; i++) {
+                    res <<= bits_per_function;
+                    res |= functions[h*functions_per_hash+i](vec);
+                }
+                out[h] = res;
+            }
+        }
+
+        // Same as hash_functions_block using the functions that the block was constructed with.
+        void hash_block(
+            const typename T::Function* functions,
+            size_t num_hashes,
+            unsigned int functions_per_hash,
+            unsigned int bits_per_function,
+            typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            uint64_t* out
+        ) const {
+            hash_functions_block<T>(
+                functions,
+                num_hashes,
+                functions_per_hash,
+                bits_per_function,
+                vectors,
+                num_vectors,
+                storage_len,
+                out);
+        }
+    };
+
     class HashSourceState {};
 
     enum class HashSourceType {
@@ -35,6 +125,23 @@ namespace puffinn {
             std::vector<LshDatatype> & output
         ) const = 0;
 
+        // Compute the LSH values for all tables for each of the vectors, which are stored
+        // consecutively with the given length.
+        // The value for table t of vector v is written to output[v*num_tables+t].
+        virtual void hash_repetitions_block(
+            typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            std::vector<LshDatatype>& output
+        ) const {
+            std::vector<LshDatatype> hashes;
+            output.clear();
+            for (size_t v=0; v < num_vectors; v++) {
+                hash_repetitions(&vectors[v*storage_len], hashes);
+                output.insert(output.end(), hashes.begin(), hashes.end());
+            }
+        }
+
         // Initialize the state necessary to compute the hashes of the given vector.
         virtual std::unique_ptr<HashSourceState> reset(
             typename T::Sim::Format::Type* vec,
@@ -74,6 +181,26 @@ namespace puffinn {
             return std::pow(whole_hashes_prob, whole_hashes)*remaining_prob;
         }
 
+        // Compute the given hashes, which must be sampled from this source, for each of the
+        // vectors, which are stored consecutively with the given length.
+        // The value of hash h for vector v is written to out[v*hashes.size()+h].
+        //
+        // Runs on the calling thread only.
+        virtual void hash_block(
+            const std::vector<std::shared_ptr<Hash>>& hashes,
+            typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            uint64_t* out
+        ) const {
+            for (size_t v=0; v < num_vectors; v++) {
+                auto state = reset(&vectors[v*storage_len], false);
+                for (size_t h=0; h < hashes.size(); h++) {
+                    out[v*hashes.size()+h] = (*hashes[h])(state.get());
+                }
+            }
+        }
+
         // Whether hashes are computed when calling reset.
         virtual bool precomputed_hashes() const = 0;
 
@@ -22,6 +22,7 @@ namespace puffinn {
     class IndependentHashSource : public HashSource<T> {
         T hash_family;
         std::vector<typename T::Function> hash_functions;
+        FunctionBlock<T> function_block;
         unsigned int num_hashers;
         unsigned int functions_per_hasher;
         uint_fast8_t bits_per_function;
@@ -48,6 +49,7 @@ namespace puffinn {
             for (unsigned int i=0; i < num_functions; i++) {
                 hash_functions.push_back(hash_family.sample());
             }
+            function_block = FunctionBlock<T>(hash_functions.data(), hash_functions.size());
         }
 
         IndependentHashSource(std::istream& in)
@@ -64,6 +66,7 @@ namespace puffinn {
             in.read(reinterpret_cast<char*>(&bits_per_function), sizeof(uint_fast8_t));
             in.read(reinterpret_cast<char*>(&next_function), sizeof(unsigned int));
             in.read(reinterpret_cast<char*>(&bits_to_cut), sizeof(unsigned int));
+            function_block = FunctionBlock<T>(hash_functions.data(), hash_functions.size());
         }
 
         void serialize(std::ostream& out) const {
@@ -87,16 +90,42 @@ namespace puffinn {
             std::vector<LshDatatype> & output
         ) const {
             output.resize(num_hashers);
-            // Iterate through all the functions, accumulating bits
+            // Reused between calls to avoid an allocation per vector.
+            static thread_local std::vector<uint64_t> values;
+            values.resize(num_hashers);
+            function_block.hash(
+                hash_functions.data(),
+                num_hashers,
+                functions_per_hasher,
+                bits_per_function,
+                input,
+                values.data());
             for (size_t rep = 0; rep < num_hashers; rep++) {
-                size_t offset = rep * functions_per_hasher;
-                LshDatatype res = 0;
-                for (unsigned int i=0; i < functions_per_hasher; i++) {
-                    res <<= bits_per_function;
-                    res |= hash_functions[offset+i](input);
-                }
-                res >>= bits_to_cut;
-                output[rep] = res;
+                output[rep] = values[rep] >> bits_to_cut;
+            }
+        }
+
+        void hash_repetitions_block(
+            typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            std::vector<LshDatatype>& output
+        ) const {
+            // Reused between calls to avoid an allocation per block.
+            static thread_local std::vector<uint64_t> values;
+            values.resize(num_vectors*num_hashers);
+            function_block.hash_block(
+                hash_functions.data(),
+                num_hashers,
+                functions_per_hasher,
+                bits_per_function,
+                vectors,
+                num_vectors,
+                storage_len,
+                values.data());
+            output.resize(num_vectors*num_hashers);
+            for (size_t i=0; i < values.size(); i++) {
+                output[i] = values[i] >> bits_to_cut;
             }
         }
 
@@ -112,6 +141,36 @@ namespace puffinn {
             return res >> bits_to_cut;
         }
 
+        void hash_block(
+            const std::vector<std::shared_ptr<Hash>>& hashes,
+            typename T::Sim::Format::Type* vectors,
+            size_t num_vectors,
+            unsigned int storage_len,
+            uint64_t* out
+        ) const {
+            // The hashes of every hasher in the source are computed for the whole block,
+            // after which the requested ones are selected.
+            auto num_hashers = hash_functions.size()/functions_per_hasher;
+            std::vector<uint64_t> values(num_vectors*num_hashers);
+            function_block.hash_block(
+                hash_functions.data(),
+                num_hashers,
+                functions_per_hasher,
+                bits_per_function,
+                vectors,
+                num_vectors,
+                storage_len,
+                values.data());
+            for (size_t v=0; v < num_vectors; v++) {
+                for (size_t h=0; h < hashes.size(); h++) {
+                    auto first_function =
+                        static_cast<const IndependentHasher<T>&>(*hashes[h]).get_first_function();
+                    out[v*hashes.size()+h] =
+                        values[v*num_hashers+first_function/functions_per_hasher] >> bits_to_cut;
+                }
+            }
+        }
+
         std::unique_ptr<HashSourceState> reset(
                 typename T::Sim::Format::Type* vec,
                 bool /*parallelize*/
@@ -191,6 +250,11 @@ namespace puffinn {
             out.write(reinterpret_cast<const char*>(&first_function), sizeof(unsigned int));
         }
 
+        // Position of the first function used by this hash in the source.
+        unsigned int get_first_function() const {
+            return first_function;
+        }
+
         uint64_t operator()(HashSourceState* state) const {
             auto independent_state = static_cast<IndependentHashSourceState<T>*>(state); 
             return source->hash(first_function, independent_state->hashed_vec);
@@ -23,6 +23,7 @@ namespace puffinn {
     class HashPool : public HashSource<T> {
         T hash_family;
         std::vector<typename T::Function> hash_functions;
+        FunctionBlock<T> function_block;
         std::vector<std::vector<unsigned int>> indices;
         unsigned int num_tables;
         uint_fast8_t bits_per_function;
@@ -48,6 +49,7 @@ namespace puffinn {
             for (unsigned int i=0; i < num_functions; i++) {
                 hash_functions.push_back(hash_family.sample());
             }
+            function_block = FunctionBlock<T>(hash_functions.data(), hash_functions.size());
 
             auto& rand_gen = get_default_random_generator();
             std::uniform_int_distribution<unsigned int> random_idx(0, num_functions-1);
@@ -78,6 +80,7 @@ namespace puffinn {
             for (size_t i=0; i < len; i++) {
                 hash_functions.emplace_back(in);
             }
+            function_block = FunctionBlock<T>(hash_functions.data(), hash_functions.size());
             size_t len_indices;
             in.read(reinterpret_cast<char*>(&len_indices), sizeof(size_t));
             for (size_t i=0; i < len_indices; i++) {
@@ -158,13 +161,16 @@ namespace puffinn {
         ) const {
             output.clear();
 
-            // TODO: remove this allocation and reuse the scratch space
-            std::vector<LshDatatype> pool;
-            pool.reserve(hash_functions.size());
-
-            for (size_t i = 0; i < hash_functions.size(); i++) {
-                pool.push_back(hash_functions[i](input));
-            }
+            // Reused between calls to avoid an allocation per vector.
+            static thread_local std::vector<uint64_t> pool;
+            pool.resize(hash_functions.size());
+            function_block.hash(
+                hash_functions.data(),
+                hash_functions.size(),
+                1,
+                bits_per_function,
+                input,
+                pool.data());
 
             for (size_t rep = 0; rep < num_tables; rep++) {
                 // Concatenate the hashes
@@ -190,9 +196,15 @@ namespace puffinn {
                     hashes.get()[i] = hash_functions[i](vec);
                 }
             } else {
-                for (size_t i=0; i<hash_functions.size(); i++) {
-                    hashes.get()[i] = hash_functions[i](vec);
-                }
+                std::vector<uint64_t> values(hash_functions.size());
+                function_block.hash(
+                    hash_functions.data(),
+                    hash_functions.size(),
+                    1,
+                    bits_per_function,
+                    vec,
+                    values.data());
+                std::copy(values.begin(), values.end(), hashes.get());
             }
 
             auto state = std::make_unique<HashPoolState>();
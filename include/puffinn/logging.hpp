@@ -0,0 +1,142 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+namespace puffinn {
+    /// Importance of a message logged by the library.
+    enum class LogLevel {
+        /// Detailed progress, such as timings of the phases of each level of a join.
+        Debug,
+        /// Summaries of longer operations, such as the number of tables chosen by ``rebuild``.
+        Info,
+        /// Unexpected conditions that do not prevent the operation from completing.
+        Warning
+    };
+
+    /// Progress of a join, reported once for every level,
+    /// which is the length of the hash prefixes that are compared.
+    struct JoinProgress {
+        /// The length of the hash prefixes compared in this level.
+        unsigned int level;
+        /// Number of points that still need more neighbors to be confirmed after this level.
+        size_t active_count;
+        /// Number of pairs that have been checked so far, including those discarded by sketches.
+        uint64_t pairs_checked;
+    };
+
+    /// Receives the messages and progress events of the library.
+    ///
+    /// Nothing is reported by default. A logger is installed using ``set_logger``.
+    /// Methods can be called concurrently from multiple threads.
+    class Logger {
+    public:
+        virtual ~Logger() {}
+
+        /// Whether messages of the given level should be passed to ``log``.
+        /// Messages are only formatted if this returns true.
+        virtual bool enabled(LogLevel /*level*/) const {
+            return false;
+        }
+
+        virtual void log(LogLevel /*level*/, const std::string& /*message*/) {
+        }
+
+        /// Called after each level of ``lsh_join`` and ``lsh_join_stream``.
+        virtual void join_progress(const JoinProgress& /*progress*/) {
+        }
+    };
+
+    /// A logger that writes every message of at least the given level to a stream.
+    class StreamLogger : public Logger {
+        std::ostream& out;
+        LogLevel min_level;
+        std::mutex mutex;
+
+    public:
+        StreamLogger(std::ostream& out, LogLevel min_level = LogLevel::Info)
+          : out(out),
+            min_level(min_level)
+        {
+        }
+
+        bool enabled(LogLevel level) const {
+            return level >= min_level;
+        }
+
+        void log(LogLevel /*level*/, const std::string& message) {
+            std::lock_guard<std::mutex> lock(mutex);
+            out << message << std::endl;
+        }
+
+        void join_progress(const JoinProgress& progress) {
+            if (enabled(LogLevel::Debug)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                out << "Level " << progress.level
+                    << " active " << progress.active_count
+                    << " pairs checked " << progress.pairs_checked << std::endl;
+            }
+        }
+    };
+
+    inline std::shared_ptr<Logger>& logger_slot() {
+        static std::shared_ptr<Logger> logger;
+        return logger;
+    }
+
+    /// Set the logger that receives messages from all indexes.
+    ///
+    /// Passing ``nullptr`` disables logging, which is the default.
+    inline void set_logger(std::shared_ptr<Logger> logger) {
+        std::atomic_store(&logger_slot(), logger);
+    }
+
+    /// Retrieve the current logger, which can be ``nullptr``.
+    inline std::shared_ptr<Logger> get_logger() {
+        return std::atomic_load(&logger_slot());
+    }
+
+    inline bool log_enabled(LogLevel level) {
+        auto logger = get_logger();
+        return logger && logger->enabled(level);
+    }
+
+    inline void log_message(LogLevel level, const std::string& message) {
+        auto logger = get_logger();
+        if (logger) {
+            logger->log(level, message);
+        }
+    }
+
+    inline void report_join_progress(const JoinProgress& progress) {
+        auto logger = get_logger();
+        if (logger) {
+            logger->join_progress(progress);
+        }
+    }
+}
+
+// Log the values written to the stream in message, which are only formatted if a logger
+// accepts the level.
+#define PUFFINN_LOG(level, message) \
+    do { \
+        if (puffinn::log_enabled(level)) { \
+            std::ostringstream puffinn_log_stream; \
+            puffinn_log_stream << message; \
+            puffinn::log_message(level, puffinn_log_stream.str()); \
+        } \
+    } while (false)
+
+#define TIMER_START(name) \
+    PUFFINN_LOG(puffinn::LogLevel::Debug, "Starting " << #name); \
+    auto name = std::chrono::steady_clock::now();
+
+#define TIMER_STOP(name) \
+    PUFFINN_LOG(puffinn::LogLevel::Debug, "Done " << #name << " in " \
+        << (std::chrono::duration_cast<std::chrono::milliseconds>( \
+            std::chrono::steady_clock::now() - name).count()) << " ms");
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace puffinn {
+    // Version of the layout written by Index::save_mmap.
+    // Increase it whenever the layout changes, including changes to how the stored
+    // hashes are computed.
+    // Version 1 hashed sets with the old MinHash, which permuted the minimum hash
+    // instead of the minimum token, and vectors with a rounded SimHash.
+    const static uint32_t MAPPED_FORMAT_VERSION = 2;
+    // Alignment of every section in the file, which is enough for any SIMD loads.
+    const static uint64_t SECTION_ALIGNMENT = 64;
+    const static char MAPPED_FORMAT_MAGIC[8] = {'P', 'U', 'F', 'F', 'I', 'N', 'N', '\0'};
+
+    // Fixed size header at the start of a mapped index file.
+    //
+    // The header is followed by the large arrays of the index, each aligned to SECTION_ALIGNMENT.
+    // Last comes the metadata, which is written using the regular stream serialization and
+    // stores everything else, including the offset of each section.
+    struct MappedFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t section_alignment;
+        uint64_t metadata_offset;
+        uint64_t metadata_len;
+    };
+
+    // Read-only stream buffer over memory that is owned elsewhere.
+    class MemoryInputBuffer : public std::streambuf {
+    public:
+        MemoryInputBuffer(const char* data, size_t len) {
+            char* begin = const_cast<char*>(data);
+            setg(begin, begin, begin+len);
+        }
+    };
+
+    // A memory-mapped index file.
+    //
+    // The mapping is private, so pages are shared with other processes mapping the same file
+    // until they are written to, at which point they are copied.
+    class MappedFile {
+        char* addr;
+        size_t len;
+
+    public:
+        MappedFile(const std::string& path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::invalid_argument("cannot open index file");
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                throw std::invalid_argument("cannot open index file");
+            }
+            len = st.st_size;
+            if (len < sizeof(MappedFileHeader)) {
+                close(fd);
+                throw std::invalid_argument("not a PUFFINN index file");
+            }
+            void* mapped = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED) {
+                throw std::runtime_error("cannot map index file");
+            }
+            addr = static_cast<char*>(mapped);
+
+            auto& header = get_header();
+            if (std::memcmp(header.magic, MAPPED_FORMAT_MAGIC, sizeof(MAPPED_FORMAT_MAGIC)) != 0) {
+                munmap(addr, len);
+                throw std::invalid_argument("not a PUFFINN index file");
+            }
+            if (header.version != MAPPED_FORMAT_VERSION
+                || header.section_alignment != SECTION_ALIGNMENT
+                || header.metadata_offset+header.metadata_len > len
+            ) {
+                munmap(addr, len);
+                throw std::invalid_argument("unsupported index file version");
+            }
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            munmap(addr, len);
+        }
+
+        const MappedFileHeader& get_header() const {
+            return *reinterpret_cast<const MappedFileHeader*>(addr);
+        }
+
+        // Retrieve a section of count values starting at the given offset.
+        template <typename T>
+        T* section(uint64_t offset, uint64_t count) const {
+            if (offset % SECTION_ALIGNMENT != 0 || offset+count*sizeof(T) > len) {
+                throw std::invalid_argument("corrupt index file");
+            }
+            return reinterpret_cast<T*>(addr+offset);
+        }
+
+        // Stream buffer over the metadata.
+        MemoryInputBuffer metadata() const {
+            auto& header = get_header();
+            return MemoryInputBuffer(addr+header.metadata_offset, header.metadata_len);
+        }
+    };
+
+    // Writes a file in the format read by MappedFile.
+    class MappedFileWriter {
+        std::ofstream out;
+        uint64_t pos;
+
+        void pad() {
+            while (pos % SECTION_ALIGNMENT != 0) {
+                out.put(0);
+                pos++;
+            }
+        }
+
+    public:
+        MappedFileWriter(const std::string& path)
+          : out(path, std::ios::binary | std::ios::trunc)
+        {
+            if (!out) {
+                throw std::invalid_argument("cannot create index file");
+            }
+            // Written again with the correct values once the metadata is known.
+            MappedFileHeader header = {};
+            out.write(reinterpret_cast<const char*>(&header), sizeof(MappedFileHeader));
+            pos = sizeof(MappedFileHeader);
+        }
+
+        // Write a section and return its offset in the file.
+        uint64_t write_section(const void* data, uint64_t bytes) {
+            pad();
+            uint64_t offset = pos;
+            out.write(static_cast<const char*>(data), bytes);
+            pos += bytes;
+            return offset;
+        }
+
+        // Write the metadata followed by the header.
+        void finish(const std::string& metadata) {
+            pad();
+            MappedFileHeader header;
+            std::memcpy(header.magic, MAPPED_FORMAT_MAGIC, sizeof(MAPPED_FORMAT_MAGIC));
+            header.version = MAPPED_FORMAT_VERSION;
+            header.section_alignment = SECTION_ALIGNMENT;
+            header.metadata_offset = pos;
+            header.metadata_len = metadata.size();
+            out.write(metadata.data(), metadata.size());
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(MappedFileHeader));
+            out.flush();
+            if (!out) {
+                throw std::runtime_error("failed to write index file");
+            }
+        }
+    };
+
+    // A contiguous array that either owns its values or refers to a section of a MappedFile.
+    //
+    // Referenced values are never freed, so the file has to outlive the array.
+    // Operations that change the length always leave the array owning its values.
+    template <typename T>
+    class MappableVector {
+        std::vector<T> owned;
+        T* ptr;
+        size_t len;
+
+    public:
+        MappableVector()
+          : ptr(nullptr),
+            len(0)
+        {
+        }
+
+        MappableVector(std::vector<T>&& values)
+          : owned(std::move(values)),
+            ptr(owned.data()),
+            len(owned.size())
+        {
+        }
+
+        MappableVector(const MappableVector& other)
+          : owned(other.begin(), other.end()),
+            ptr(owned.data()),
+            len(owned.size())
+        {
+        }
+
+        MappableVector(MappableVector&& other) noexcept
+          : owned(std::move(other.owned)),
+            ptr(other.ptr),
+            len(other.len)
+        {
+            other.ptr = nullptr;
+            other.len = 0;
+        }
+
+        MappableVector& operator=(MappableVector other) {
+            std::swap(owned, other.owned);
+            std::swap(ptr, other.ptr);
+            std::swap(len, other.len);
+            return *this;
+        }
+
+        MappableVector& operator=(std::vector<T>&& values) {
+            owned = std::move(values);
+            ptr = owned.data();
+            len = owned.size();
+            return *this;
+        }
+
+        // Refer to values stored in a mapped file.
+        static MappableVector mapped(const MappedFile& file, uint64_t offset, uint64_t count) {
+            MappableVector res;
+            res.ptr = file.section<T>(offset, count);
+            res.len = count;
+            return res;
+        }
+
+        // Move the values out into a vector, copying them if they are not owned.
+        std::vector<T> take() {
+            std::vector<T> res;
+            if (ptr == owned.data()) {
+                res = std::move(owned);
+            } else {
+                res.assign(ptr, ptr+len);
+            }
+            owned.clear();
+            ptr = nullptr;
+            len = 0;
+            return res;
+        }
+
+        void resize(size_t new_len) {
+            auto values = take();
+            values.resize(new_len);
+            *this = std::move(values);
+        }
+
+        T& operator[](size_t idx) {
+            return ptr[idx];
+        }
+
+        const T& operator[](size_t idx) const {
+            return ptr[idx];
+        }
+
+        T* data() {
+            return ptr;
+        }
+
+        const T* data() const {
+            return ptr;
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+        const T* begin() const {
+            return ptr;
+        }
+
+        const T* end() const {
+            return ptr+len;
+        }
+    };
+}
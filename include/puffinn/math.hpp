@@ -1,13 +1,29 @@
 #pragma once
 
-#if defined(__AVX2__) || defined(__AVX__)
-    #include <immintrin.h>
-#endif
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
+#include "puffinn/typedefs.hpp"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // Kernels for instruction sets that are not enabled at compile time are compiled
+    // using target attributes, and the fastest supported one is selected at runtime.
+    #define PUFFINN_RUNTIME_DISPATCH
+    #define PUFFINN_TARGET(isa) __attribute__((target(isa)))
+#else
+    #define PUFFINN_TARGET(isa)
+#endif
+
+#if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__) || defined(__AVX__) || defined(__SSE2__)
+    #include <immintrin.h>
+#endif
 
 namespace puffinn {
-    #ifdef __AVX2__
+    using DotProductI16 = int16_t (*)(const int16_t*, const int16_t*, unsigned int);
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        PUFFINN_TARGET("avx2")
         static int16_t dot_product_i16_avx2(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
             // Number of i16 values that fit into a 256 bit vector.
             const static unsigned int VALUES_PER_VEC = 16;
@@ -34,6 +50,49 @@ namespace puffinn {
         }
     #endif
 
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512F__)
+        // Sum of the 32 bit integers in the vector.
+        // Used instead of _mm512_reduce_add_epi32, whose implementation in GCC 12 causes
+        // spurious warnings about uninitialized values.
+        PUFFINN_TARGET("avx512f")
+        static inline int32_t reduce_add_epi32_avx512(__m512i vec) {
+            alignas(64) int32_t stored[16];
+            _mm512_store_si512(stored, vec);
+            int32_t res = 0;
+            for (unsigned int i=0; i < 16; i++) { res += stored[i]; }
+            return res;
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512BW__)
+        // Same as dot_product_i16_avx2, but with 512 bit vectors.
+        // Vectors are only aligned to 256 bits, and the last one is loaded using a mask.
+        PUFFINN_TARGET("avx512bw")
+        static int16_t dot_product_i16_avx512(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
+            // Number of i16 values that fit into a 512 bit vector.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            __m512i res = _mm512_setzero_si512();
+            unsigned int i = 0;
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                __m512i tmp = _mm512_mulhrs_epi16(
+                    _mm512_loadu_si512(&lhs[i]),
+                    _mm512_loadu_si512(&rhs[i]));
+                res = _mm512_add_epi16(res, tmp);
+            }
+            if (i < dimensions) {
+                __mmask32 mask = (1u << (dimensions-i))-1;
+                __m512i tmp = _mm512_mulhrs_epi16(
+                    _mm512_maskz_loadu_epi16(mask, &lhs[i]),
+                    _mm512_maskz_loadu_epi16(mask, &rhs[i]));
+                res = _mm512_add_epi16(res, tmp);
+            }
+            // The 16 bit sum wraps around, so only the lower bits of the wider sum are needed.
+            res = _mm512_madd_epi16(res, _mm512_set1_epi16(1));
+            return static_cast<int16_t>(reduce_add_epi32_avx512(res));
+        }
+    #endif
+
     static int16_t dot_product_i16_simple(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
         int16_t res = 0;
         for (unsigned int i=0; i < dimensions; i++) {
@@ -43,14 +102,669 @@ namespace puffinn {
         return res;
     }
 
+    // Select the fastest version of dot_product_i16 supported by the cpu.
+    static DotProductI16 select_dot_product_i16() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512bw")) {
+                return dot_product_i16_avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return dot_product_i16_avx2;
+            }
+            return dot_product_i16_simple;
+        #elif defined(__AVX512BW__)
+            return dot_product_i16_avx512;
+        #elif defined(__AVX2__)
+            return dot_product_i16_avx2;
+        #else
+            return dot_product_i16_simple;
+        #endif
+    }
+
+    // Dot product of two vectors in the 16 bit fixed point format,
+    // where each product is rounded before it is added.
+    //
+    // All versions give the same result, so hashes computed on different machines agree.
+    // Switching a hash function between this and dot_product_i16_exact changes its hashes,
+    // so the versions of the serialized formats must be increased along with it.
     static int16_t dot_product_i16(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
-        #ifdef __AVX2__
+        #if defined(__AVX512BW__)
+            return dot_product_i16_avx512(lhs, rhs, dimensions);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const DotProductI16 kernel = select_dot_product_i16();
+            return kernel(lhs, rhs, dimensions);
+        #elif defined(__AVX2__)
             return dot_product_i16_avx2(lhs, rhs, dimensions);
         #else
             return dot_product_i16_simple(lhs, rhs, dimensions);
         #endif
     }
 
+    // Round a sum of products of 16 bit fixed point numbers to the fixed point format,
+    // saturating values outside of it.
+    static int16_t round_fixed_point_sum(int64_t sum) {
+        int64_t rounded = (sum+(1 << 14)) >> 15;
+        return static_cast<int16_t>(std::min<int64_t>(INT16_MAX, std::max<int64_t>(INT16_MIN, rounded)));
+    }
+
+    static int16_t dot_product_i16_exact_simple(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
+        int64_t sum = 0;
+        for (unsigned int i=0; i < dimensions; i++) {
+            sum += static_cast<int32_t>(lhs[i])*static_cast<int32_t>(rhs[i]);
+        }
+        return round_fixed_point_sum(sum);
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        PUFFINN_TARGET("avx2")
+        static int16_t dot_product_i16_exact_avx2(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
+            // Number of i16 values that fit into a 256 bit vector.
+            const static unsigned int VALUES_PER_VEC = 16;
+
+            // Pairs of products are summed into 32 bits, so no precision is lost.
+            __m256i res = _mm256_setzero_si256();
+            for (unsigned int i=0; i < dimensions; i += VALUES_PER_VEC) {
+                __m256i tmp = _mm256_madd_epi16(
+                    _mm256_load_si256((__m256i*)&lhs[i]),
+                    _mm256_load_si256((__m256i*)&rhs[i]));
+                res = _mm256_add_epi32(res, tmp);
+            }
+            alignas(32) int32_t stored[8];
+            _mm256_store_si256((__m256i*)stored, res);
+            int64_t sum = 0;
+            for (unsigned i=0; i < 8; i++) { sum += stored[i]; }
+            return round_fixed_point_sum(sum);
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512BW__)
+        PUFFINN_TARGET("avx512bw")
+        static int16_t dot_product_i16_exact_avx512(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
+            // Number of i16 values that fit into a 512 bit vector.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            __m512i res = _mm512_setzero_si512();
+            unsigned int i = 0;
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                __m512i tmp = _mm512_madd_epi16(
+                    _mm512_loadu_si512(&lhs[i]),
+                    _mm512_loadu_si512(&rhs[i]));
+                res = _mm512_add_epi32(res, tmp);
+            }
+            if (i < dimensions) {
+                __mmask32 mask = (1u << (dimensions-i))-1;
+                __m512i tmp = _mm512_madd_epi16(
+                    _mm512_maskz_loadu_epi16(mask, &lhs[i]),
+                    _mm512_maskz_loadu_epi16(mask, &rhs[i]));
+                res = _mm512_add_epi32(res, tmp);
+            }
+            return round_fixed_point_sum(reduce_add_epi32_avx512(res));
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || (defined(__AVX512BW__) && defined(__AVX512VNNI__))
+        // Same as dot_product_i16_exact_avx512, but the multiplication and addition is fused
+        // into a single vpdpwssds instruction.
+        PUFFINN_TARGET("avx512bw,avx512vnni")
+        static int16_t dot_product_i16_exact_vnni(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
+            // Number of i16 values that fit into a 512 bit vector.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            // Two independent sums to hide the latency of the instruction.
+            __m512i res = _mm512_setzero_si512();
+            __m512i res2 = _mm512_setzero_si512();
+            unsigned int i = 0;
+            for (; i+2*VALUES_PER_VEC <= dimensions; i += 2*VALUES_PER_VEC) {
+                res = _mm512_dpwssds_epi32(
+                    res,
+                    _mm512_loadu_si512(&lhs[i]),
+                    _mm512_loadu_si512(&rhs[i]));
+                res2 = _mm512_dpwssds_epi32(
+                    res2,
+                    _mm512_loadu_si512(&lhs[i+VALUES_PER_VEC]),
+                    _mm512_loadu_si512(&rhs[i+VALUES_PER_VEC]));
+            }
+            res = _mm512_add_epi32(res, res2);
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                res = _mm512_dpwssds_epi32(
+                    res,
+                    _mm512_loadu_si512(&lhs[i]),
+                    _mm512_loadu_si512(&rhs[i]));
+            }
+            if (i < dimensions) {
+                __mmask32 mask = (1u << (dimensions-i))-1;
+                res = _mm512_dpwssds_epi32(
+                    res,
+                    _mm512_maskz_loadu_epi16(mask, &lhs[i]),
+                    _mm512_maskz_loadu_epi16(mask, &rhs[i]));
+            }
+            return round_fixed_point_sum(reduce_add_epi32_avx512(res));
+        }
+    #endif
+
+    // Select the fastest version of dot_product_i16_exact supported by the cpu.
+    static DotProductI16 select_dot_product_i16_exact() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+                return dot_product_i16_exact_vnni;
+            }
+            if (__builtin_cpu_supports("avx512bw")) {
+                return dot_product_i16_exact_avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return dot_product_i16_exact_avx2;
+            }
+            return dot_product_i16_exact_simple;
+        #elif defined(__AVX512BW__) && defined(__AVX512VNNI__)
+            return dot_product_i16_exact_vnni;
+        #elif defined(__AVX512BW__)
+            return dot_product_i16_exact_avx512;
+        #elif defined(__AVX2__)
+            return dot_product_i16_exact_avx2;
+        #else
+            return dot_product_i16_exact_simple;
+        #endif
+    }
+
+    // Dot product of two vectors in the 16 bit fixed point format,
+    // where the products are summed exactly and rounded once.
+    //
+    // This is more precise than dot_product_i16 and allows using VNNI instructions.
+    // The vectors are assumed to have a norm of at most 1.
+    // All versions give the same result.
+    static int16_t dot_product_i16_exact(const int16_t* lhs, const int16_t* rhs, unsigned int dimensions) {
+        #if defined(__AVX512BW__) && defined(__AVX512VNNI__)
+            return dot_product_i16_exact_vnni(lhs, rhs, dimensions);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const DotProductI16 kernel = select_dot_product_i16_exact();
+            return kernel(lhs, rhs, dimensions);
+        #elif defined(__AVX512BW__)
+            return dot_product_i16_exact_avx512(lhs, rhs, dimensions);
+        #elif defined(__AVX2__)
+            return dot_product_i16_exact_avx2(lhs, rhs, dimensions);
+        #else
+            return dot_product_i16_exact_simple(lhs, rhs, dimensions);
+        #endif
+    }
+
+    using DotProductI16x4 = void (*)(const int16_t*, const int16_t* const*, unsigned int, int16_t*);
+
+    // Compute dot_product_i16_exact between lhs and each of the four vectors in rhs.
+    static void dot_product_i16_exact_x4_simple(
+        const int16_t* lhs,
+        const int16_t* const* rhs,
+        unsigned int dimensions,
+        int16_t* out
+    ) {
+        for (unsigned int j=0; j < 4; j++) {
+            out[j] = dot_product_i16_exact_simple(lhs, rhs[j], dimensions);
+        }
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        // Each part of lhs is loaded once and multiplied with all four vectors.
+        PUFFINN_TARGET("avx2")
+        static void dot_product_i16_exact_x4_avx2(
+            const int16_t* lhs,
+            const int16_t* const* rhs,
+            unsigned int dimensions,
+            int16_t* out
+        ) {
+            // Number of i16 values that fit into a 256 bit vector.
+            const static unsigned int VALUES_PER_VEC = 16;
+
+            __m256i res[4];
+            for (unsigned int j=0; j < 4; j++) {
+                res[j] = _mm256_setzero_si256();
+            }
+            for (unsigned int i=0; i < dimensions; i += VALUES_PER_VEC) {
+                __m256i query = _mm256_load_si256((__m256i*)&lhs[i]);
+                for (unsigned int j=0; j < 4; j++) {
+                    res[j] = _mm256_add_epi32(
+                        res[j],
+                        _mm256_madd_epi16(query, _mm256_load_si256((__m256i*)&rhs[j][i])));
+                }
+            }
+            for (unsigned int j=0; j < 4; j++) {
+                alignas(32) int32_t stored[8];
+                _mm256_store_si256((__m256i*)stored, res[j]);
+                int64_t sum = 0;
+                for (unsigned i=0; i < 8; i++) { sum += stored[i]; }
+                out[j] = round_fixed_point_sum(sum);
+            }
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512BW__)
+        PUFFINN_TARGET("avx512bw")
+        static void dot_product_i16_exact_x4_avx512(
+            const int16_t* lhs,
+            const int16_t* const* rhs,
+            unsigned int dimensions,
+            int16_t* out
+        ) {
+            // Number of i16 values that fit into a 512 bit vector.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            __m512i res[4];
+            for (unsigned int j=0; j < 4; j++) {
+                res[j] = _mm512_setzero_si512();
+            }
+            unsigned int i = 0;
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                __m512i query = _mm512_loadu_si512(&lhs[i]);
+                for (unsigned int j=0; j < 4; j++) {
+                    res[j] = _mm512_add_epi32(
+                        res[j],
+                        _mm512_madd_epi16(query, _mm512_loadu_si512(&rhs[j][i])));
+                }
+            }
+            if (i < dimensions) {
+                __mmask32 mask = (1u << (dimensions-i))-1;
+                __m512i query = _mm512_maskz_loadu_epi16(mask, &lhs[i]);
+                for (unsigned int j=0; j < 4; j++) {
+                    res[j] = _mm512_add_epi32(
+                        res[j],
+                        _mm512_madd_epi16(query, _mm512_maskz_loadu_epi16(mask, &rhs[j][i])));
+                }
+            }
+            for (unsigned int j=0; j < 4; j++) {
+                out[j] = round_fixed_point_sum(reduce_add_epi32_avx512(res[j]));
+            }
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || (defined(__AVX512BW__) && defined(__AVX512VNNI__))
+        PUFFINN_TARGET("avx512bw,avx512vnni")
+        static void dot_product_i16_exact_x4_vnni(
+            const int16_t* lhs,
+            const int16_t* const* rhs,
+            unsigned int dimensions,
+            int16_t* out
+        ) {
+            // Number of i16 values that fit into a 512 bit vector.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            // The four sums are independent, which hides the latency of the instruction.
+            __m512i res[4];
+            for (unsigned int j=0; j < 4; j++) {
+                res[j] = _mm512_setzero_si512();
+            }
+            unsigned int i = 0;
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                __m512i query = _mm512_loadu_si512(&lhs[i]);
+                for (unsigned int j=0; j < 4; j++) {
+                    res[j] = _mm512_dpwssds_epi32(res[j], query, _mm512_loadu_si512(&rhs[j][i]));
+                }
+            }
+            if (i < dimensions) {
+                __mmask32 mask = (1u << (dimensions-i))-1;
+                __m512i query = _mm512_maskz_loadu_epi16(mask, &lhs[i]);
+                for (unsigned int j=0; j < 4; j++) {
+                    res[j] = _mm512_dpwssds_epi32(
+                        res[j],
+                        query,
+                        _mm512_maskz_loadu_epi16(mask, &rhs[j][i]));
+                }
+            }
+            for (unsigned int j=0; j < 4; j++) {
+                out[j] = round_fixed_point_sum(reduce_add_epi32_avx512(res[j]));
+            }
+        }
+    #endif
+
+    // Select the fastest version of dot_product_i16_exact_x4 supported by the cpu.
+    static DotProductI16x4 select_dot_product_i16_exact_x4() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+                return dot_product_i16_exact_x4_vnni;
+            }
+            if (__builtin_cpu_supports("avx512bw")) {
+                return dot_product_i16_exact_x4_avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return dot_product_i16_exact_x4_avx2;
+            }
+            return dot_product_i16_exact_x4_simple;
+        #elif defined(__AVX512BW__) && defined(__AVX512VNNI__)
+            return dot_product_i16_exact_x4_vnni;
+        #elif defined(__AVX512BW__)
+            return dot_product_i16_exact_x4_avx512;
+        #elif defined(__AVX2__)
+            return dot_product_i16_exact_x4_avx2;
+        #else
+            return dot_product_i16_exact_x4_simple;
+        #endif
+    }
+
+    // Compute dot_product_i16_exact between lhs and each of the four vectors in rhs,
+    // storing the results in out.
+    static void dot_product_i16_exact_x4(
+        const int16_t* lhs,
+        const int16_t* const* rhs,
+        unsigned int dimensions,
+        int16_t* out
+    ) {
+        #if defined(__AVX512BW__) && defined(__AVX512VNNI__)
+            dot_product_i16_exact_x4_vnni(lhs, rhs, dimensions, out);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const DotProductI16x4 kernel = select_dot_product_i16_exact_x4();
+            kernel(lhs, rhs, dimensions, out);
+        #elif defined(__AVX512BW__)
+            dot_product_i16_exact_x4_avx512(lhs, rhs, dimensions, out);
+        #elif defined(__AVX2__)
+            dot_product_i16_exact_x4_avx2(lhs, rhs, dimensions, out);
+        #else
+            dot_product_i16_exact_x4_simple(lhs, rhs, dimensions, out);
+        #endif
+    }
+
+    // Interleave up to 16 vectors in pairs of values, so that 512 bits hold the same two
+    // dimensions of all 16 vectors. Value i of vector j is stored at out[i/2*32+2*j+i%2].
+    // Missing vectors are zero. The number of dimensions needs to be even.
+    static void interleave_i16_x16(
+        const int16_t* const* vectors,
+        unsigned int num_vectors,
+        unsigned int dimensions,
+        int16_t* out
+    ) {
+        for (unsigned int i=0; i < dimensions; i += 2) {
+            for (unsigned int j=0; j < 16; j++) {
+                out[i*16+2*j] = j < num_vectors ? vectors[j][i] : 0;
+                out[i*16+2*j+1] = j < num_vectors ? vectors[j][i+1] : 0;
+            }
+        }
+    }
+
+    using DotProductSignsI16x16 =
+        void (*)(const int16_t* const*, const int16_t*, unsigned int, uint16_t*);
+
+    // For each of the four vectors in lhs, compute a mask where bit j is set if
+    // dot_product_i16_exact between it and the j'th of the 16 vectors interleaved by
+    // interleave_i16_x16 is non-negative.
+    static void dot_product_i16_exact_signs_x16_simple(
+        const int16_t* const* lhs,
+        const int16_t* rhs,
+        unsigned int dimensions,
+        uint16_t* out
+    ) {
+        for (unsigned int l=0; l < 4; l++) {
+            uint16_t mask = 0;
+            for (unsigned int j=0; j < 16; j++) {
+                int64_t sum = 0;
+                for (unsigned int i=0; i < dimensions; i++) {
+                    sum += static_cast<int32_t>(lhs[l][i])*static_cast<int32_t>(rhs[i/2*32+2*j+i%2]);
+                }
+                if (round_fixed_point_sum(sum) >= 0) {
+                    mask |= 1 << j;
+                }
+            }
+            out[l] = mask;
+        }
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        // Each lane holds the sum for one of the interleaved vectors,
+        // so no horizontal additions are needed.
+        PUFFINN_TARGET("avx2")
+        static void dot_product_i16_exact_signs_x16_avx2(
+            const int16_t* const* lhs,
+            const int16_t* rhs,
+            unsigned int dimensions,
+            uint16_t* out
+        ) {
+            __m256i res[4][2];
+            for (unsigned int l=0; l < 4; l++) {
+                res[l][0] = _mm256_setzero_si256();
+                res[l][1] = _mm256_setzero_si256();
+            }
+            for (unsigned int i=0; i < dimensions; i += 2) {
+                __m256i low = _mm256_loadu_si256((__m256i*)&rhs[i*16]);
+                __m256i high = _mm256_loadu_si256((__m256i*)&rhs[i*16+16]);
+                for (unsigned int l=0; l < 4; l++) {
+                    int32_t pair;
+                    std::memcpy(&pair, &lhs[l][i], sizeof(int32_t));
+                    __m256i broadcast = _mm256_set1_epi32(pair);
+                    res[l][0] = _mm256_add_epi32(res[l][0], _mm256_madd_epi16(low, broadcast));
+                    res[l][1] = _mm256_add_epi32(res[l][1], _mm256_madd_epi16(high, broadcast));
+                }
+            }
+            // Rounding to the fixed point format gives a non-negative value
+            // exactly when the sum is above this threshold.
+            __m256i threshold = _mm256_set1_epi32(-(1 << 14)-1);
+            for (unsigned int l=0; l < 4; l++) {
+                int low = _mm256_movemask_ps(_mm256_castsi256_ps(
+                    _mm256_cmpgt_epi32(res[l][0], threshold)));
+                int high = _mm256_movemask_ps(_mm256_castsi256_ps(
+                    _mm256_cmpgt_epi32(res[l][1], threshold)));
+                out[l] = static_cast<uint16_t>(low | (high << 8));
+            }
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512BW__)
+        PUFFINN_TARGET("avx512bw")
+        static void dot_product_i16_exact_signs_x16_avx512(
+            const int16_t* const* lhs,
+            const int16_t* rhs,
+            unsigned int dimensions,
+            uint16_t* out
+        ) {
+            __m512i res[4];
+            for (unsigned int l=0; l < 4; l++) {
+                res[l] = _mm512_setzero_si512();
+            }
+            for (unsigned int i=0; i < dimensions; i += 2) {
+                __m512i values = _mm512_loadu_si512(&rhs[i*16]);
+                for (unsigned int l=0; l < 4; l++) {
+                    int32_t pair;
+                    std::memcpy(&pair, &lhs[l][i], sizeof(int32_t));
+                    res[l] = _mm512_add_epi32(
+                        res[l],
+                        _mm512_madd_epi16(values, _mm512_set1_epi32(pair)));
+                }
+            }
+            __m512i threshold = _mm512_set1_epi32(-(1 << 14)-1);
+            for (unsigned int l=0; l < 4; l++) {
+                out[l] = _mm512_cmpgt_epi32_mask(res[l], threshold);
+            }
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || (defined(__AVX512BW__) && defined(__AVX512VNNI__))
+        PUFFINN_TARGET("avx512bw,avx512vnni")
+        static void dot_product_i16_exact_signs_x16_vnni(
+            const int16_t* const* lhs,
+            const int16_t* rhs,
+            unsigned int dimensions,
+            uint16_t* out
+        ) {
+            // Two sums per vector to hide the latency of the instruction.
+            __m512i res[4][2];
+            for (unsigned int l=0; l < 4; l++) {
+                res[l][0] = _mm512_setzero_si512();
+                res[l][1] = _mm512_setzero_si512();
+            }
+            unsigned int i = 0;
+            for (; i+4 <= dimensions; i += 4) {
+                __m512i values = _mm512_loadu_si512(&rhs[i*16]);
+                __m512i next_values = _mm512_loadu_si512(&rhs[i*16+32]);
+                for (unsigned int l=0; l < 4; l++) {
+                    int32_t pairs[2];
+                    std::memcpy(pairs, &lhs[l][i], 2*sizeof(int32_t));
+                    res[l][0] = _mm512_dpwssds_epi32(res[l][0], values, _mm512_set1_epi32(pairs[0]));
+                    res[l][1] = _mm512_dpwssds_epi32(
+                        res[l][1],
+                        next_values,
+                        _mm512_set1_epi32(pairs[1]));
+                }
+            }
+            if (i < dimensions) {
+                __m512i values = _mm512_loadu_si512(&rhs[i*16]);
+                for (unsigned int l=0; l < 4; l++) {
+                    int32_t pair;
+                    std::memcpy(&pair, &lhs[l][i], sizeof(int32_t));
+                    res[l][0] = _mm512_dpwssds_epi32(res[l][0], values, _mm512_set1_epi32(pair));
+                }
+            }
+            __m512i threshold = _mm512_set1_epi32(-(1 << 14)-1);
+            for (unsigned int l=0; l < 4; l++) {
+                out[l] = _mm512_cmpgt_epi32_mask(
+                    _mm512_add_epi32(res[l][0], res[l][1]),
+                    threshold);
+            }
+        }
+    #endif
+
+    // Select the fastest version of dot_product_i16_exact_signs_x16 supported by the cpu.
+    static DotProductSignsI16x16 select_dot_product_i16_exact_signs_x16() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+                return dot_product_i16_exact_signs_x16_vnni;
+            }
+            if (__builtin_cpu_supports("avx512bw")) {
+                return dot_product_i16_exact_signs_x16_avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return dot_product_i16_exact_signs_x16_avx2;
+            }
+            return dot_product_i16_exact_signs_x16_simple;
+        #elif defined(__AVX512BW__) && defined(__AVX512VNNI__)
+            return dot_product_i16_exact_signs_x16_vnni;
+        #elif defined(__AVX512BW__)
+            return dot_product_i16_exact_signs_x16_avx512;
+        #elif defined(__AVX2__)
+            return dot_product_i16_exact_signs_x16_avx2;
+        #else
+            return dot_product_i16_exact_signs_x16_simple;
+        #endif
+    }
+
+    // For each of the four vectors in lhs, compute a mask where bit j is set if
+    // dot_product_i16_exact between it and the j'th of the 16 vectors interleaved by
+    // interleave_i16_x16 is non-negative.
+    static void dot_product_i16_exact_signs_x16(
+        const int16_t* const* lhs,
+        const int16_t* rhs,
+        unsigned int dimensions,
+        uint16_t* out
+    ) {
+        #if defined(__AVX512BW__) && defined(__AVX512VNNI__)
+            dot_product_i16_exact_signs_x16_vnni(lhs, rhs, dimensions, out);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const DotProductSignsI16x16 kernel = select_dot_product_i16_exact_signs_x16();
+            kernel(lhs, rhs, dimensions, out);
+        #elif defined(__AVX512BW__)
+            dot_product_i16_exact_signs_x16_avx512(lhs, rhs, dimensions, out);
+        #elif defined(__AVX2__)
+            dot_product_i16_exact_signs_x16_avx2(lhs, rhs, dimensions, out);
+        #else
+            dot_product_i16_exact_signs_x16_simple(lhs, rhs, dimensions, out);
+        #endif
+    }
+
+    using DotProductI8 = int32_t (*)(const int8_t*, const int8_t*, unsigned int);
+
+    // Compute the exact dot product between two vectors of 8 bit integers.
+    static int32_t dot_product_i8_simple(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+        int32_t sum = 0;
+        for (unsigned int i=0; i < dimensions; i++) {
+            sum += static_cast<int32_t>(lhs[i])*static_cast<int32_t>(rhs[i]);
+        }
+        return sum;
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        // The values are sign extended to 16 bits, after which pairs of products are summed
+        // into 32 bits.
+        PUFFINN_TARGET("avx2")
+        static int32_t dot_product_i8_avx2(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+            // Number of i8 values that are extended to a 256 bit vector at a time.
+            const static unsigned int VALUES_PER_VEC = 16;
+
+            __m256i res = _mm256_setzero_si256();
+            unsigned int i = 0;
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                __m256i tmp = _mm256_madd_epi16(
+                    _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i*)&lhs[i])),
+                    _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i*)&rhs[i])));
+                res = _mm256_add_epi32(res, tmp);
+            }
+            alignas(32) int32_t stored[8];
+            _mm256_store_si256((__m256i*)stored, res);
+            int32_t sum = 0;
+            for (unsigned j=0; j < 8; j++) { sum += stored[j]; }
+            for (; i < dimensions; i++) {
+                sum += static_cast<int32_t>(lhs[i])*static_cast<int32_t>(rhs[i]);
+            }
+            return sum;
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX512BW__)
+        PUFFINN_TARGET("avx512bw")
+        static int32_t dot_product_i8_avx512(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+            // Number of i8 values that are extended to a 512 bit vector at a time.
+            const static unsigned int VALUES_PER_VEC = 32;
+
+            __m512i res = _mm512_setzero_si512();
+            unsigned int i = 0;
+            for (; i+VALUES_PER_VEC <= dimensions; i += VALUES_PER_VEC) {
+                __m512i tmp = _mm512_madd_epi16(
+                    _mm512_cvtepi8_epi16(_mm256_loadu_si256((__m256i*)&lhs[i])),
+                    _mm512_cvtepi8_epi16(_mm256_loadu_si256((__m256i*)&rhs[i])));
+                res = _mm512_add_epi32(res, tmp);
+            }
+            if (i < dimensions) {
+                __mmask32 mask = (1u << (dimensions-i))-1;
+                __m512i tmp = _mm512_madd_epi16(
+                    _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(mask, &lhs[i])),
+                    _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(mask, &rhs[i])));
+                res = _mm512_add_epi32(res, tmp);
+            }
+            return reduce_add_epi32_avx512(res);
+        }
+    #endif
+
+    // Select the fastest version of dot_product_i8 supported by the cpu.
+    static DotProductI8 select_dot_product_i8() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512bw")) {
+                return dot_product_i8_avx512;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return dot_product_i8_avx2;
+            }
+            return dot_product_i8_simple;
+        #elif defined(__AVX512BW__)
+            return dot_product_i8_avx512;
+        #elif defined(__AVX2__)
+            return dot_product_i8_avx2;
+        #else
+            return dot_product_i8_simple;
+        #endif
+    }
+
+    // Compute the exact dot product between two vectors of 8 bit integers.
+    // The vectors do not need to be aligned or padded.
+    static int32_t dot_product_i8(const int8_t* lhs, const int8_t* rhs, unsigned int dimensions) {
+        #if defined(__AVX512BW__)
+            return dot_product_i8_avx512(lhs, rhs, dimensions);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const DotProductI8 kernel = select_dot_product_i8();
+            return kernel(lhs, rhs, dimensions);
+        #elif defined(__AVX2__)
+            return dot_product_i8_avx2(lhs, rhs, dimensions);
+        #else
+            return dot_product_i8_simple(lhs, rhs, dimensions);
+        #endif
+    }
+
     #ifdef __AVX__
         // Compute the l2 distance between two floating point vectors without taking the
         // final root.
@@ -101,6 +815,354 @@ namespace puffinn {
         #endif
     }
 
+    #ifdef __AVX__
+        // Compute the dot product between two floating point vectors.
+        static float dot_product_float_avx(const float* lhs, const float* rhs, unsigned int dimensions) {
+            // Number of float values that fit into a 256 bit vector.
+            const static unsigned int VALUES_PER_VEC = 8;
+
+            __m256 res = _mm256_mul_ps(
+                _mm256_load_ps(&lhs[0]),
+                _mm256_load_ps(&rhs[0]));
+
+            for (
+                unsigned int i=VALUES_PER_VEC;
+                i < dimensions;
+                i += VALUES_PER_VEC
+            ) {
+                __m256 tmp = _mm256_mul_ps(
+                    _mm256_load_ps(&lhs[i]),
+                    _mm256_load_ps(&rhs[i]));
+                res = _mm256_add_ps(res, tmp);
+            }
+            alignas(32) float stored[VALUES_PER_VEC];
+            _mm256_store_ps(stored, res);
+            float ret = 0;
+            for (unsigned i=0; i < VALUES_PER_VEC; i++) {
+                ret += stored[i];
+            }
+            return ret;
+        }
+    #endif
+
+    static float dot_product_float_simple(const float* lhs, const float* rhs, unsigned int dimensions) {
+        float res = 0.0;
+        for (unsigned int i=0; i < dimensions; i++) {
+            res += lhs[i]*rhs[i];
+        }
+        return res;
+    }
+
+    static float dot_product_float(const float* lhs, const float* rhs, unsigned int dimensions) {
+        #ifdef __AVX__
+            return dot_product_float_avx(lhs, rhs, dimensions);
+        #else
+            return dot_product_float_simple(lhs, rhs, dimensions);
+        #endif
+    }
+
+    using IntersectionSize = size_t (*)(const uint32_t*, size_t, const uint32_t*, size_t);
+
+    // Count the values that occur in both of two sorted arrays of distinct values
+    // by merging them.
+    static size_t intersection_size_merge_simple(
+        const uint32_t* lhs,
+        size_t lhs_len,
+        const uint32_t* rhs,
+        size_t rhs_len
+    ) {
+        size_t res = 0;
+        size_t i = 0;
+        size_t j = 0;
+        while (i < lhs_len && j < rhs_len) {
+            if (lhs[i] == rhs[j]) {
+                res++;
+                i++;
+                j++;
+            } else if (lhs[i] < rhs[j]) {
+                i++;
+            } else {
+                j++;
+            }
+        }
+        return res;
+    }
+
+    // The merge kernels compare a block of values from each array with every rotation of
+    // the other block. The block whose last value is smallest is then skipped, or both if
+    // they are equal. Since the values are distinct, each common value is found once.
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__SSE2__)
+        PUFFINN_TARGET("sse2")
+        static size_t intersection_size_merge_sse(
+            const uint32_t* lhs,
+            size_t lhs_len,
+            const uint32_t* rhs,
+            size_t rhs_len
+        ) {
+            // Number of u32 values that fit into a 128 bit vector.
+            const static size_t VALUES_PER_VEC = 4;
+
+            size_t res = 0;
+            size_t i = 0;
+            size_t j = 0;
+            while (i+VALUES_PER_VEC <= lhs_len && j+VALUES_PER_VEC <= rhs_len) {
+                __m128i a = _mm_loadu_si128((const __m128i*)&lhs[i]);
+                __m128i b = _mm_loadu_si128((const __m128i*)&rhs[j]);
+                __m128i eq = _mm_cmpeq_epi32(a, b);
+                eq = _mm_or_si128(eq, _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1))));
+                eq = _mm_or_si128(eq, _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2))));
+                eq = _mm_or_si128(eq, _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3))));
+                res += popcountll(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+
+                uint32_t lhs_last = lhs[i+VALUES_PER_VEC-1];
+                uint32_t rhs_last = rhs[j+VALUES_PER_VEC-1];
+                i += (lhs_last <= rhs_last)*VALUES_PER_VEC;
+                j += (rhs_last <= lhs_last)*VALUES_PER_VEC;
+            }
+            return res+intersection_size_merge_simple(&lhs[i], lhs_len-i, &rhs[j], rhs_len-j);
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        PUFFINN_TARGET("avx2")
+        static size_t intersection_size_merge_avx2(
+            const uint32_t* lhs,
+            size_t lhs_len,
+            const uint32_t* rhs,
+            size_t rhs_len
+        ) {
+            // Number of u32 values that fit into a 256 bit vector.
+            const static size_t VALUES_PER_VEC = 8;
+
+            size_t res = 0;
+            size_t i = 0;
+            size_t j = 0;
+            while (i+VALUES_PER_VEC <= lhs_len && j+VALUES_PER_VEC <= rhs_len) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)&lhs[i]);
+                __m256i b = _mm256_loadu_si256((const __m256i*)&rhs[j]);
+                // Rotations within each 128 bit lane, followed by the same rotations
+                // with the lanes swapped.
+                __m256i b_swapped = _mm256_permute2x128_si256(b, b, 1);
+                __m256i eq = _mm256_cmpeq_epi32(a, b);
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1))));
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2))));
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3))));
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, b_swapped));
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b_swapped, _MM_SHUFFLE(0, 3, 2, 1))));
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b_swapped, _MM_SHUFFLE(1, 0, 3, 2))));
+                eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, _mm256_shuffle_epi32(b_swapped, _MM_SHUFFLE(2, 1, 0, 3))));
+                res += popcountll(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+
+                uint32_t lhs_last = lhs[i+VALUES_PER_VEC-1];
+                uint32_t rhs_last = rhs[j+VALUES_PER_VEC-1];
+                i += (lhs_last <= rhs_last)*VALUES_PER_VEC;
+                j += (rhs_last <= lhs_last)*VALUES_PER_VEC;
+            }
+            return res+intersection_size_merge_simple(&lhs[i], lhs_len-i, &rhs[j], rhs_len-j);
+        }
+    #endif
+
+    // Select the fastest version of intersection_size_merge supported by the cpu.
+    static IntersectionSize select_intersection_size_merge() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return intersection_size_merge_avx2;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                return intersection_size_merge_sse;
+            }
+            return intersection_size_merge_simple;
+        #elif defined(__AVX2__)
+            return intersection_size_merge_avx2;
+        #elif defined(__SSE2__)
+            return intersection_size_merge_sse;
+        #else
+            return intersection_size_merge_simple;
+        #endif
+    }
+
+    // Count the values that occur in both of two sorted arrays of distinct values,
+    // which is fastest when they have similar lengths.
+    static size_t intersection_size_merge(
+        const uint32_t* lhs,
+        size_t lhs_len,
+        const uint32_t* rhs,
+        size_t rhs_len
+    ) {
+        #if defined(__AVX2__)
+            return intersection_size_merge_avx2(lhs, lhs_len, rhs, rhs_len);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const IntersectionSize kernel = select_intersection_size_merge();
+            return kernel(lhs, lhs_len, rhs, rhs_len);
+        #else
+            return intersection_size_merge_simple(lhs, lhs_len, rhs, rhs_len);
+        #endif
+    }
+
+    // Number of values in the blocks that the galloping kernels compare at a time.
+    const static size_t GALLOP_BLOCK_LEN = 8;
+
+    // Find the first block of GALLOP_BLOCK_LEN values at or after the given one whose
+    // last value is at least the key, or num_blocks if there is none.
+    // The distance to the block is doubled until it is passed, after which it is
+    // found using binary search.
+    static size_t gallop_blocks(
+        const uint32_t* values,
+        size_t num_blocks,
+        size_t first,
+        uint32_t key
+    ) {
+        auto last = [values](size_t block) {
+            return values[block*GALLOP_BLOCK_LEN+GALLOP_BLOCK_LEN-1];
+        };
+        if (first >= num_blocks || last(first) >= key) {
+            return first;
+        }
+        // The last value of low is always smaller than the key.
+        size_t low = first;
+        size_t step = 1;
+        size_t high = first+1;
+        while (high < num_blocks && last(high) < key) {
+            low = high;
+            step *= 2;
+            high = low+step;
+        }
+        high = std::min(high, num_blocks);
+        while (high-low > 1) {
+            size_t mid = low+(high-low)/2;
+            if (last(mid) < key) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        return high;
+    }
+
+    // The galloping kernels search the large array for each value of the small one.
+    // Since the values of the small array are increasing, every search starts at the block
+    // where the previous one ended. Values after the last full block are merged.
+    static size_t intersection_size_gallop_simple(
+        const uint32_t* small,
+        size_t small_len,
+        const uint32_t* large,
+        size_t large_len
+    ) {
+        size_t num_blocks = large_len/GALLOP_BLOCK_LEN;
+        size_t block = 0;
+        size_t res = 0;
+        size_t i = 0;
+        for (; i < small_len; i++) {
+            block = gallop_blocks(large, num_blocks, block, small[i]);
+            if (block == num_blocks) {
+                break;
+            }
+            for (size_t j=0; j < GALLOP_BLOCK_LEN; j++) {
+                res += (large[block*GALLOP_BLOCK_LEN+j] == small[i]);
+            }
+        }
+        size_t tail = num_blocks*GALLOP_BLOCK_LEN;
+        return res+intersection_size_merge_simple(
+            &small[i], small_len-i, &large[tail], large_len-tail);
+    }
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__SSE2__)
+        PUFFINN_TARGET("sse2")
+        static size_t intersection_size_gallop_sse(
+            const uint32_t* small,
+            size_t small_len,
+            const uint32_t* large,
+            size_t large_len
+        ) {
+            size_t num_blocks = large_len/GALLOP_BLOCK_LEN;
+            size_t block = 0;
+            size_t res = 0;
+            size_t i = 0;
+            for (; i < small_len; i++) {
+                block = gallop_blocks(large, num_blocks, block, small[i]);
+                if (block == num_blocks) {
+                    break;
+                }
+                __m128i key = _mm_set1_epi32(static_cast<int32_t>(small[i]));
+                auto block_values = (const __m128i*)&large[block*GALLOP_BLOCK_LEN];
+                __m128i eq = _mm_or_si128(
+                    _mm_cmpeq_epi32(key, _mm_loadu_si128(block_values)),
+                    _mm_cmpeq_epi32(key, _mm_loadu_si128(block_values+1)));
+                res += (_mm_movemask_ps(_mm_castsi128_ps(eq)) != 0);
+            }
+            size_t tail = num_blocks*GALLOP_BLOCK_LEN;
+            return res+intersection_size_merge_simple(
+                &small[i], small_len-i, &large[tail], large_len-tail);
+        }
+    #endif
+
+    #if defined(PUFFINN_RUNTIME_DISPATCH) || defined(__AVX2__)
+        PUFFINN_TARGET("avx2")
+        static size_t intersection_size_gallop_avx2(
+            const uint32_t* small,
+            size_t small_len,
+            const uint32_t* large,
+            size_t large_len
+        ) {
+            size_t num_blocks = large_len/GALLOP_BLOCK_LEN;
+            size_t block = 0;
+            size_t res = 0;
+            size_t i = 0;
+            for (; i < small_len; i++) {
+                block = gallop_blocks(large, num_blocks, block, small[i]);
+                if (block == num_blocks) {
+                    break;
+                }
+                __m256i eq = _mm256_cmpeq_epi32(
+                    _mm256_set1_epi32(static_cast<int32_t>(small[i])),
+                    _mm256_loadu_si256((const __m256i*)&large[block*GALLOP_BLOCK_LEN]));
+                res += (_mm256_movemask_ps(_mm256_castsi256_ps(eq)) != 0);
+            }
+            size_t tail = num_blocks*GALLOP_BLOCK_LEN;
+            return res+intersection_size_merge_simple(
+                &small[i], small_len-i, &large[tail], large_len-tail);
+        }
+    #endif
+
+    // Select the fastest version of intersection_size_gallop supported by the cpu.
+    static IntersectionSize select_intersection_size_gallop() {
+        #if defined(PUFFINN_RUNTIME_DISPATCH)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return intersection_size_gallop_avx2;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                return intersection_size_gallop_sse;
+            }
+            return intersection_size_gallop_simple;
+        #elif defined(__AVX2__)
+            return intersection_size_gallop_avx2;
+        #elif defined(__SSE2__)
+            return intersection_size_gallop_sse;
+        #else
+            return intersection_size_gallop_simple;
+        #endif
+    }
+
+    // Count the values that occur in both of two sorted arrays of distinct values,
+    // which is fastest when the first array is much shorter than the second.
+    static size_t intersection_size_gallop(
+        const uint32_t* small,
+        size_t small_len,
+        const uint32_t* large,
+        size_t large_len
+    ) {
+        #if defined(__AVX2__)
+            return intersection_size_gallop_avx2(small, small_len, large, large_len);
+        #elif defined(PUFFINN_RUNTIME_DISPATCH)
+            static const IntersectionSize kernel = select_intersection_size_gallop();
+            return kernel(small, small_len, large, large_len);
+        #else
+            return intersection_size_gallop_simple(small, small_len, large, large_len);
+        #endif
+    }
+
     // Round up to nearest power of two.
     constexpr static unsigned int ceil_log(unsigned int value) {
         unsigned int log = 0;
@@ -23,7 +23,7 @@ namespace puffinn {
         // Reorder the values, so that the top `k` elements are stored first.
         // All other values are removed.
         void filter() {
-            g_performance_metrics.start_timer(Computation::MaxbufferFilter);
+            thread_performance_metrics().start_timer(Computation::MaxbufferFilter);
             std::sort(data.begin(), data.begin()+inserted_values,
                 [](const ResultPair& a, const ResultPair& b) {
                     return a.second > b.second
@@ -42,7 +42,7 @@ namespace puffinn {
             if (inserted_values == size && size != 0) {
                 minval = data[inserted_values-1].second;
             }
-            g_performance_metrics.store_time(Computation::MaxbufferFilter);
+            thread_performance_metrics().store_time(Computation::MaxbufferFilter);
         }
 
     public:
@@ -5,7 +5,9 @@
 #include <cassert>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -16,18 +18,54 @@ namespace puffinn {
             || (a.second == b.second && a.first > b.first);
     }
 
+    // A lock that is only held briefly, so waiting threads spin rather than sleep.
+    class SpinLock {
+        std::atomic<bool> locked;
+
+    public:
+        SpinLock() : locked(false) {}
+
+        void lock() {
+            while (locked.exchange(true, std::memory_order_acquire)) {
+                while (locked.load(std::memory_order_relaxed)) {}
+            }
+        }
+
+        void unlock() {
+            locked.store(false, std::memory_order_release);
+        }
+    };
+
     // This class is functionally equivalent to std::vector<MaxBuffer>.
     // The advantage is that it puts less pressure on the memory allocator,
     // thus taking far less time to initialize. Furthermore, it is more cache friendly,
     // since there is less indirection.
+    //
+    // Values can be inserted concurrently from multiple threads, so that a single collection
+    // can be shared by all threads. The buffers are protected by a fixed number of locks,
+    // each shared by the buffers whose index is equal modulo the number of locks.
+    // Insertions that cannot enter the buffer are rejected without locking.
     class MaxBufferCollection {
     public:
         using ResultPair = std::pair<uint32_t, float>;
     private:
+        // Number of locks, which is much larger than the number of threads
+        // to make contention unlikely.
+        const static size_t NUM_SHARDS = 1024;
+
+        // Padded to avoid false sharing between the locks.
+        struct ShardLock {
+            SpinLock lock;
+            char padding[64-sizeof(SpinLock)];
+        };
+
         size_t n;
         size_t k;
         size_t capacity;
         std::vector<ResultPair> data;
+        // The smallest value in each buffer, which can be read without locking.
+        std::unique_ptr<std::atomic<float>[]> smallest_values;
+        std::unique_ptr<ShardLock[]> locks;
 
     public:
 
@@ -49,16 +87,28 @@ namespace puffinn {
             this->k = k;
             this->capacity = k + 1;
             this->data.resize(n*(k+1));
+            smallest_values.reset(new std::atomic<float>[n]);
+            for (size_t idx=0; idx < n; idx++) {
+                smallest_values[idx].store(0.0f, std::memory_order_relaxed);
+            }
+            locks.reset(new ShardLock[NUM_SHARDS]);
         }
 
-        float smallest_value(size_t idx) {
-            return data[idx * capacity].second;
+        float smallest_value(size_t idx) const {
+            return smallest_values[idx].load(std::memory_order_relaxed);
         }
 
         bool insert(size_t idx, size_t neighbor, float similarity) {
             similarity = std::min(1.0f, std::max(0.0f, similarity));
+            if (similarity <= smallest_value(idx)) {
+                return false;
+            }
             size_t offset = idx * capacity;
+            auto& lock = locks[idx % NUM_SHARDS].lock;
+            lock.lock();
+            // The buffer might have changed since the check above.
             if (similarity <= data[offset].second) {
+                lock.unlock();
                 return false;
             }
 
@@ -66,6 +116,7 @@ namespace puffinn {
                 if (data[offset + i].first == neighbor) {
                     // insertion would be a duplicate, return true to signal that
                     // the point is not inserted because it's a duplicate
+                    lock.unlock();
                     return true; 
                 }
             }
@@ -80,6 +131,8 @@ namespace puffinn {
             // on `end` to be overwritten by the next insertion
             std::push_heap(begin, end, cmp_pair);
             std::pop_heap(begin, end, cmp_pair);
+            smallest_values[idx].store(data[offset].second, std::memory_order_relaxed);
+            lock.unlock();
             
             return true;
         }
@@ -98,6 +151,8 @@ namespace puffinn {
             }
         }
 
+        // Retrieve the best entries for the given index.
+        // This should not be called concurrently with insertions into the same buffer.
         std::vector<ResultPair> best_entries(size_t idx) {
             std::vector<std::pair<uint32_t, float>> res;
             size_t offset = idx*capacity;
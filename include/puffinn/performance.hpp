@@ -1,13 +1,17 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <map>
-#include <unordered_map>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
 #include <vector>
 
-#include "puffinn/typedefs.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-const bool PUFFINN_PERFORMANCE = false;
-const bool PUFFINN_PERFORMANCE_TIME = false;
+#include "puffinn/typedefs.hpp"
 
 namespace puffinn {
     const size_t NUM_TIMED_COMPUTATIONS = 16;
@@ -31,113 +35,311 @@ namespace puffinn {
                 CheckTermination
     };
 
+    // Read a cheap counter that increases with time.
+    // This is the time stamp counter where available, which counts in cycles of a fixed
+    // reference frequency, and nanoseconds otherwise.
+    inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // Whether metrics are collected for queries that do not ask for them.
+    inline std::atomic<bool>& performance_metrics_flag() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    /// Enable or disable the collection of metrics for every query.
+    ///
+    /// Metrics are always collected for queries that are given a ``QueryMetrics`` to store them in.
+    /// Collection is disabled by default.
+    inline void set_performance_metrics_enabled(bool enabled) {
+        performance_metrics_flag().store(enabled, std::memory_order_relaxed);
+    }
+
+    /// Whether metrics are collected for every query.
+    inline bool performance_metrics_enabled() {
+        return performance_metrics_flag().load(std::memory_order_relaxed);
+    }
+
+    /// Metrics collected while answering a single query.
     struct QueryMetrics {
-        unsigned int distance_computations;
-        unsigned int candidates;
-        unsigned int considered_maps;
-        unsigned int hash_length;
-        double time[NUM_TIMED_COMPUTATIONS];
+        /// Number of candidates whose similarity to the query was computed.
+        unsigned int distance_computations = 0;
+        /// Number of candidates retrieved from the tables, including those removed by filtering.
+        unsigned int candidates = 0;
+        /// Number of tables searched, counted once for every prefix length that they were searched with.
+        unsigned int considered_maps = 0;
+        /// The length of the hash prefixes when the search stopped.
+        unsigned int hash_length = 0;
+        /// Cycles spent in each phase of the query, see ``read_cycle_counter``.
+        uint64_t cycles[NUM_TIMED_COMPUTATIONS] = {0};
+
+        uint64_t get_cycles(Computation computation) const {
+            return cycles[static_cast<int>(computation)];
+        }
+    };
+
+    /// A histogram of non-negative integers with buckets of exponentially increasing size.
+    ///
+    /// Bucket 0 contains the value 0 and bucket ``i > 0`` contains the values in ``[2^(i-1), 2^i)``.
+    class Histogram {
+    public:
+        static const size_t NUM_BUCKETS = 65;
+
+    private:
+        uint64_t counts[NUM_BUCKETS] = {0};
+
+    public:
+        /// The bucket that the value belongs to.
+        static size_t bucket(uint64_t value) {
+            return value == 0 ? 0 : 64-__builtin_clzll(value);
+        }
+
+        /// The largest value in the given bucket.
+        static uint64_t bucket_upper_bound(size_t bucket) {
+            return bucket == NUM_BUCKETS-1 ? UINT64_MAX : (1ull << bucket)-1;
+        }
+
+        void add(uint64_t value) {
+            counts[bucket(value)]++;
+        }
 
-        double get_time(Computation computation) const {
-            return time[static_cast<int>(computation)];
+        void merge(const Histogram& other) {
+            for (size_t i=0; i < NUM_BUCKETS; i++) {
+                counts[i] += other.counts[i];
+            }
         }
 
+        /// Number of values in the given bucket.
+        uint64_t get_count(size_t bucket) const {
+            return counts[bucket];
+        }
+
+        /// Total number of values added.
+        uint64_t count() const {
+            uint64_t res = 0;
+            for (auto c : counts) {
+                res += c;
+            }
+            return res;
+        }
+
+        /// An upper bound on the value at the given quantile, which is between 0 and 1.
+        ///
+        /// This is the largest value in the bucket that contains the quantile.
+        uint64_t quantile(double q) const {
+            auto total = count();
+            if (total == 0) {
+                return 0;
+            }
+            auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q*total)));
+            uint64_t seen = 0;
+            for (size_t i=0; i < NUM_BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return bucket_upper_bound(i);
+                }
+            }
+            return bucket_upper_bound(NUM_BUCKETS-1);
+        }
     };
 
-    // A globally accessible structure to store performance metrics in.
-    class PerformanceMetrics {
-        std::vector<QueryMetrics> queries;
+    /// Histograms of the metrics of each query for which metrics were collected.
+    struct PerformanceHistograms {
+        Histogram distance_computations;
+        Histogram candidates;
+        Histogram considered_maps;
+        Histogram hash_length;
+        Histogram cycles[NUM_TIMED_COMPUTATIONS];
 
-        // Stores last time start_timer was called.
-        std::chrono::time_point<std::chrono::high_resolution_clock> start_time[NUM_TIMED_COMPUTATIONS];
+        void add(const QueryMetrics& query) {
+            distance_computations.add(query.distance_computations);
+            candidates.add(query.candidates);
+            considered_maps.add(query.considered_maps);
+            hash_length.add(query.hash_length);
+            for (size_t i=0; i < NUM_TIMED_COMPUTATIONS; i++) {
+                cycles[i].add(query.cycles[i]);
+            }
+        }
+
+        void merge(const PerformanceHistograms& other) {
+            distance_computations.merge(other.distance_computations);
+            candidates.merge(other.candidates);
+            considered_maps.merge(other.considered_maps);
+            hash_length.merge(other.hash_length);
+            for (size_t i=0; i < NUM_TIMED_COMPUTATIONS; i++) {
+                cycles[i].merge(other.cycles[i]);
+            }
+        }
 
-        QueryMetrics& current_query() {
-            return queries[queries.size()-1];
+        /// Number of queries recorded.
+        uint64_t num_queries() const {
+            return candidates.count();
         }
 
+        const Histogram& get_cycles(Computation computation) const {
+            return cycles[static_cast<int>(computation)];
+        }
+    };
+
+    class PerformanceMetrics;
+
+    // Tracks the metrics of every thread so that their histograms can be combined.
+    struct PerformanceRegistry {
+        std::mutex mutex;
+        std::vector<PerformanceMetrics*> threads;
+        // Histograms of threads that have exited.
+        PerformanceHistograms retired;
+    };
+
+    inline PerformanceRegistry& performance_registry() {
+        static PerformanceRegistry registry;
+        return registry;
+    }
+
+    // The metrics of the queries run by one thread.
+    //
+    // Only the owning thread modifies the metrics of the current query, so no synchronization
+    // is needed while it runs. Finished queries are added to the histograms under a lock
+    // that is only contended while the histograms are read.
+    class PerformanceMetrics {
+        QueryMetrics current;
+        // Whether metrics are collected for the current query.
+        bool active = false;
+        // Stores last time start_timer was called.
+        uint64_t start_cycles[NUM_TIMED_COMPUTATIONS] = {0};
+
+        std::mutex histograms_mutex;
+        PerformanceHistograms histograms;
+
     public:
         PerformanceMetrics() {
-            clear();
+            auto& registry = performance_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(this);
+        }
+
+        ~PerformanceMetrics() {
+            auto& registry = performance_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.retired.merge(histograms);
+            registry.threads.erase(
+                std::find(registry.threads.begin(), registry.threads.end(), this));
         }
 
+        PerformanceMetrics(const PerformanceMetrics&) = delete;
+        PerformanceMetrics& operator=(const PerformanceMetrics&) = delete;
+
         void clear() {
-            queries.clear();
-            // Add an empty query so that methods can be called without starting a query.
-            // This can happen in tests.
-            queries.push_back(QueryMetrics());
-            new_query();
+            current = QueryMetrics();
+        }
+
+        // Start collecting metrics for a new query.
+        // Metrics are collected if they are enabled or if force is set.
+        void new_query(bool force = false) {
+            active = force || performance_metrics_enabled();
+            clear();
         }
 
-        void new_query() {
-            if (PUFFINN_PERFORMANCE || PUFFINN_PERFORMANCE_TIME) {
-                queries.push_back(QueryMetrics());
+        // Record the current query in the histograms.
+        void end_query() {
+            if (active) {
+                std::lock_guard<std::mutex> lock(histograms_mutex);
+                histograms.add(current);
             }
         }
 
         void add_distance_computations(unsigned int count) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().distance_computations += count;
+            if (active) {
+                current.distance_computations += count;
             }
         }
 
         void add_candidates(unsigned int count) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().candidates += count;
+            if (active) {
+                current.candidates += count;
             }
         }
 
         void set_hash_length(unsigned int len) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().hash_length = len;
+            if (active) {
+                current.hash_length = len;
             }
         }
 
         void set_considered_maps(unsigned int count) {
-            if (PUFFINN_PERFORMANCE) {
-                current_query().considered_maps = count;
+            if (active) {
+                current.considered_maps = count;
             }
         }
 
-        std::vector<QueryMetrics> get_query_metrics() const {
-            std::vector<QueryMetrics> res;
-            for (size_t i=1; i < queries.size(); i++) {
-                res.push_back(queries[i]);
-            }
-            return res;
-        }
-
-        double get_total_time(Computation computation) {
-            double res = 0;
-            for (auto& q : queries) {
-                res += q.get_time(computation);
-            }
-            return res;
+        const QueryMetrics& get_query_metrics() const {
+            return current;
         }
 
         // Start a timer whose result is stored using store_time.
         void start_timer(Computation computation) {
-            if (PUFFINN_PERFORMANCE_TIME) {
-                start_time[static_cast<int>(computation)] = std::chrono::high_resolution_clock::now();
+            if (active) {
+                start_cycles[static_cast<int>(computation)] = read_cycle_counter();
             }
         }
 
         // Store that the given computation has taken the time since last call to start_timer().
         void store_time(Computation computation) {
-            if (PUFFINN_PERFORMANCE_TIME) {
+            if (active) {
                 int computation_idx = static_cast<int>(computation);
-                auto end_time = std::chrono::high_resolution_clock::now();
-                std::chrono::duration<double> duration = end_time-start_time[computation_idx];
-                current_query().time[computation_idx] += duration.count();
+                current.cycles[computation_idx] +=
+                    read_cycle_counter()-start_cycles[computation_idx];
+            }
+        }
+
+        // Add cycles that were measured before the current query started.
+        void add_time(Computation computation, uint64_t cycles) {
+            if (active) {
+                current.cycles[static_cast<int>(computation)] += cycles;
             }
         }
+
+        void add_histograms_to(PerformanceHistograms& res) {
+            std::lock_guard<std::mutex> lock(histograms_mutex);
+            res.merge(histograms);
+        }
+
+        void reset_histograms() {
+            std::lock_guard<std::mutex> lock(histograms_mutex);
+            histograms = PerformanceHistograms();
+        }
     };
 
-    PerformanceMetrics g_performance_metrics;
-}
+    // The metrics of the calling thread.
+    inline PerformanceMetrics& thread_performance_metrics() {
+        static thread_local PerformanceMetrics metrics;
+        return metrics;
+    }
 
-#define TIMER_START(name) \
-    std::cerr << "Starting " << #name << std::endl; \
-    auto name = std::chrono::steady_clock::now();
+    /// Retrieve histograms of the metrics of all queries that collected metrics, across all threads.
+    inline PerformanceHistograms get_performance_histograms() {
+        auto& registry = performance_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        PerformanceHistograms res = registry.retired;
+        for (auto thread : registry.threads) {
+            thread->add_histograms_to(res);
+        }
+        return res;
+    }
 
-#define TIMER_STOP(name) \
-    std::cerr << "Done " << #name << " in " << (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - name).count()) << " ms" << std::endl;
+    /// Remove all queries from the histograms.
+    inline void reset_performance_histograms() {
+        auto& registry = performance_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.retired = PerformanceHistograms();
+        for (auto thread : registry.threads) {
+            thread->reset_histograms();
+        }
+    }
+}
@@ -2,6 +2,7 @@
 
 #include "puffinn/dataset.hpp"
 #include "puffinn/hash_source/hash_source.hpp"
+#include "puffinn/mapped_file.hpp"
 #include "puffinn/typedefs.hpp"
 #include "puffinn/performance.hpp"
 #include "puffinn/sorthash.hpp"
@@ -35,7 +36,7 @@ namespace puffinn {
         // in the map to process.
         PrefixMapQuery(
             LshDatatype hash,
-            const std::vector<LshDatatype>& hashes,
+            const LshDatatype* hashes,
             uint32_t prefix_index_start,
             uint32_t prefix_index_end
         )
@@ -55,9 +56,29 @@ namespace puffinn {
             prefix_end = prefix_start;
             prefix_mask = 0xffffffff;
         }
+
+        // Construct a query whose position in the referenced hashes is already known,
+        // see PrefixMap::find_positions.
+        PrefixMapQuery(LshDatatype hash, uint32_t position)
+          : hash(hash),
+            prefix_mask(0xffffffff),
+            prefix_start(position),
+            prefix_end(position)
+        {
+        }
     };
 
     const static int SEGMENT_SIZE = 12;
+
+    // Two sibling nodes in a binary trie over the hashes of a PrefixMap.
+    // The hashes at positions [begin, split) and [split, end) share the same prefix, after which
+    // the first have a 0-bit and the second a 1-bit.
+    struct PrefixSplit {
+        uint32_t begin;
+        uint32_t split;
+        uint32_t end;
+    };
+
     // A PrefixMap stores all inserted values in sorted order by their hash codes.
     //
     // This allows querying all values that share a common prefix. The length of the prefix
@@ -66,13 +87,17 @@ namespace puffinn {
     template <typename T>
     class PrefixMap {
         using HashedVecIdx = std::pair<uint32_t, LshDatatype>;
-        // Number of bits to precompute locations in the stored vector for.
-        const static int PREFIX_INDEX_BITS = 13;
+        // Smallest number of bits to precompute locations in the stored vector for.
+        const static unsigned int MIN_PREFIX_INDEX_BITS = 13;
+        // Largest average number of hashes that share an entry in the prefix index.
+        // 16 hashes fill a cache line, so the binary search after the lookup in the index
+        // usually only touches one or two cache lines.
+        const static size_t PREFIX_INDEX_BUCKET_SIZE = 16;
 
     public: // TODO private
         // contents
-        std::vector<uint32_t> indices;
-        std::vector<LshDatatype> hashes;
+        MappableVector<uint32_t> indices;
+        MappableVector<LshDatatype> hashes;
         // Scratch space for use when rebuilding. The length and capacity is set to 0 otherwise.
         // std::vector<HashedVecIdx> rebuilding_data;
         std::vector<std::vector<HashedVecIdx>> parallel_rebuilding_data;
@@ -80,10 +105,24 @@ namespace puffinn {
         // Length of the hash values used.
         unsigned int hash_length;
 
+        // Number of bits to precompute locations in the stored vector for.
+        // Grows with the number of stored values, see prefix_index_bits_for.
+        unsigned int prefix_index_bits = MIN_PREFIX_INDEX_BITS;
+
         // index of the first value with each prefix.
         // If there is no such value, it is the first higher prefix instead.
         // Used as a hint for the binary search.
-        uint32_t prefix_index[(1 << PREFIX_INDEX_BITS)+1] = {0};
+        // Contains (1 << prefix_index_bits)+1 values.
+        MappableVector<uint32_t> prefix_index;
+
+        // Positions where the hash differs from the previous one, grouped by the length of the
+        // common prefix of the two hashes, which is the depth of the split in the trie.
+        // The positions with a common prefix of length d are
+        // split_positions[split_offsets[d]..split_offsets[d+1]), in increasing order.
+        // Computed whenever the hashes change, so that joins can find the segments that are
+        // merged when the prefix is shortened without scanning the hashes.
+        std::vector<uint32_t> split_positions;
+        std::vector<uint32_t> split_offsets;
 
     public:
         // Construct a new prefix map over the specified dataset using the given hash functions.
@@ -97,14 +136,17 @@ namespace puffinn {
         }
 
         PrefixMap(std::istream& in, HashSource<T>& source) {
+            parallel_rebuilding_data.resize(omp_get_max_threads());
             size_t len;
             in.read(reinterpret_cast<char*>(&len), sizeof(size_t));
-            indices.resize(len);
-            hashes.resize(len);
+            std::vector<uint32_t> read_indices(len);
+            std::vector<LshDatatype> read_hashes(len);
             if (len != 0) {
-                in.read(reinterpret_cast<char*>(&indices[0]), len*sizeof(uint32_t));
-                in.read(reinterpret_cast<char*>(&hashes[0]), len*sizeof(LshDatatype));
+                in.read(reinterpret_cast<char*>(&read_indices[0]), len*sizeof(uint32_t));
+                in.read(reinterpret_cast<char*>(&read_hashes[0]), len*sizeof(LshDatatype));
             }
+            indices = std::move(read_indices);
+            hashes = std::move(read_hashes);
 
             // TODO Handle serialization
             size_t rebuilding_len;
@@ -119,10 +161,31 @@ namespace puffinn {
             }
 
             in.read(reinterpret_cast<char*>(&hash_length), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&prefix_index_bits), sizeof(unsigned int));
 
+            std::vector<uint32_t> read_prefix_index((1 << prefix_index_bits)+1);
             in.read(
-                reinterpret_cast<char*>(&prefix_index[0]),
-                ((1 << PREFIX_INDEX_BITS)+1)*sizeof(uint32_t));
+                reinterpret_cast<char*>(&read_prefix_index[0]),
+                ((1 << prefix_index_bits)+1)*sizeof(uint32_t));
+            prefix_index = std::move(read_prefix_index);
+            compute_splits();
+        }
+
+        // Construct a map whose contents are stored in sections of a mapped file.
+        PrefixMap(std::istream& in, const MappedFile& file) {
+            parallel_rebuilding_data.resize(omp_get_max_threads());
+            in.read(reinterpret_cast<char*>(&hash_length), sizeof(unsigned int));
+            in.read(reinterpret_cast<char*>(&prefix_index_bits), sizeof(unsigned int));
+            uint64_t len, indices_offset, hashes_offset, prefix_index_offset;
+            in.read(reinterpret_cast<char*>(&len), sizeof(uint64_t));
+            in.read(reinterpret_cast<char*>(&indices_offset), sizeof(uint64_t));
+            in.read(reinterpret_cast<char*>(&hashes_offset), sizeof(uint64_t));
+            in.read(reinterpret_cast<char*>(&prefix_index_offset), sizeof(uint64_t));
+            indices = MappableVector<uint32_t>::mapped(file, indices_offset, len);
+            hashes = MappableVector<LshDatatype>::mapped(file, hashes_offset, len);
+            prefix_index = MappableVector<uint32_t>::mapped(
+                file, prefix_index_offset, (1 << prefix_index_bits)+1);
+            compute_splits();
         }
 
         void serialize(std::ostream& out) const {
@@ -147,10 +210,28 @@ namespace puffinn {
             }
 
             out.write(reinterpret_cast<const char*>(&hash_length), sizeof(unsigned int));
+            out.write(reinterpret_cast<const char*>(&prefix_index_bits), sizeof(unsigned int));
 
             out.write(reinterpret_cast<const char*>(
-                &prefix_index),
-                ((1 << PREFIX_INDEX_BITS)+1)*sizeof(uint32_t));
+                prefix_index.data()),
+                ((1 << prefix_index_bits)+1)*sizeof(uint32_t));
+        }
+
+        // Write the contents as sections of the file and their location to the metadata.
+        // Values inserted since the last rebuild are not included.
+        void serialize_mapped(std::ostream& meta, MappedFileWriter& file) const {
+            meta.write(reinterpret_cast<const char*>(&hash_length), sizeof(unsigned int));
+            meta.write(reinterpret_cast<const char*>(&prefix_index_bits), sizeof(unsigned int));
+            uint64_t len = indices.size();
+            uint64_t indices_offset = file.write_section(indices.data(), len*sizeof(uint32_t));
+            uint64_t hashes_offset = file.write_section(hashes.data(), len*sizeof(LshDatatype));
+            uint64_t prefix_index_offset = file.write_section(
+                prefix_index.data(),
+                ((1 << prefix_index_bits)+1)*sizeof(uint32_t));
+            meta.write(reinterpret_cast<const char*>(&len), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&indices_offset), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&hashes_offset), sizeof(uint64_t));
+            meta.write(reinterpret_cast<const char*>(&prefix_index_offset), sizeof(uint64_t));
         }
 
         // Add a hash value, and associated index, to be included next time rebuild is called. 
@@ -166,8 +247,22 @@ namespace puffinn {
             }
         }
 
+        // Add the values inserted since the last call to rebuild.
+        //
+        // Only the new values are sorted. They are then merged into the already sorted
+        // contents, so the cost is proportional to the number of new values plus a single
+        // linear pass over the table.
         void rebuild() {
-            g_performance_metrics.start_timer(Computation::Rebuilding);
+            rebuild(*this);
+        }
+
+        // Replace the contents of the map with the contents of base merged with the values
+        // inserted since the last call to rebuild.
+        //
+        // base is only read, so it can be searched concurrently, and the merged values are
+        // written to new arrays rather than to a copy of base.
+        void rebuild(const PrefixMap& base) {
+            thread_performance_metrics().start_timer(Computation::Rebuilding);
             // A value whose prefix will never match that of a query vector, as long as less than 32
             // hash bits are used.
             static const LshDatatype IMPOSSIBLE_PREFIX = 0xffffffff;
@@ -176,94 +271,209 @@ namespace puffinn {
             for (auto & rd : parallel_rebuilding_data) {
                 rebuilding_data_size += rd.size();
             }
-
-            std::vector<LshDatatype> tmp_hashes;
-            std::vector<uint32_t> tmp_indices;
-            std::vector<LshDatatype> out_hashes;
-            std::vector<uint32_t> out_indices;
-            tmp_hashes.reserve(hashes.size() + rebuilding_data_size);
-            tmp_indices.reserve(hashes.size() + rebuilding_data_size);
-            out_hashes.reserve(hashes.size() + rebuilding_data_size);
-            out_indices.reserve(hashes.size() + rebuilding_data_size);
-
-            if (hashes.size() != 0) {
-                // Move data to temporary vector for sorting.
-                for (size_t i=SEGMENT_SIZE; i < hashes.size()-SEGMENT_SIZE; i++) {
-                    tmp_hashes.push_back(hashes[i]);
-                    tmp_indices.push_back(indices[i]);
-                }
+            if (rebuilding_data_size == 0 && &base == this && hashes.size() != 0) {
+                // Nothing new to add.
+                thread_performance_metrics().store_time(Computation::Rebuilding);
+                return;
             }
+
+            std::vector<LshDatatype> new_hashes;
+            std::vector<uint32_t> new_indices;
+            std::vector<LshDatatype> sorted_hashes;
+            std::vector<uint32_t> sorted_indices;
+            new_hashes.reserve(rebuilding_data_size);
+            new_indices.reserve(rebuilding_data_size);
             for (auto & rebuilding_data : parallel_rebuilding_data) {
                 for (auto pair : rebuilding_data) {
-                    tmp_indices.push_back(pair.first);
-                    tmp_hashes.push_back(pair.second);
+                    new_indices.push_back(pair.first);
+                    new_hashes.push_back(pair.second);
                 }
+                rebuilding_data.clear();
+                rebuilding_data.shrink_to_fit();
             }
-            
-            g_performance_metrics.start_timer(Computation::Sorting);
-            puffinn::sort_hashes_pairs_24(
-                tmp_hashes,
-                out_hashes,
-                tmp_indices,
-                out_indices
+
+            thread_performance_metrics().start_timer(Computation::Sorting);
+            puffinn::sort_hashes_pairs(
+                new_hashes,
+                sorted_hashes,
+                new_indices,
+                sorted_indices,
+                hash_length
             );
-            g_performance_metrics.store_time(Computation::Sorting);
+            thread_performance_metrics().store_time(Computation::Sorting);
+
+            // Range of the previously sorted values, excluding padding.
+            size_t old_start = 0;
+            size_t old_end = 0;
+            if (base.hashes.size() != 0) {
+                old_start = SEGMENT_SIZE;
+                old_end = base.hashes.size()-SEGMENT_SIZE;
+            }
+            size_t old_size = old_end-old_start;
 
+            // Merge the two sorted sequences.
             // Pad with SEGMENT_SIZE values on each size to remove need for bounds check.
-            hashes.clear();
-            hashes.reserve(out_hashes.size() + 2*SEGMENT_SIZE);
-            indices.clear();
-            indices.reserve(out_hashes.size() + 2*SEGMENT_SIZE);
+            size_t total = old_size+rebuilding_data_size;
+            std::vector<LshDatatype> merged_hashes(total+2*SEGMENT_SIZE, IMPOSSIBLE_PREFIX);
+            std::vector<uint32_t> merged_indices(total+2*SEGMENT_SIZE, 0);
+            size_t old_pos = old_start;
+            size_t new_pos = 0;
+            size_t out_pos = SEGMENT_SIZE;
+            while (old_pos < old_end && new_pos < rebuilding_data_size) {
+                // Previously inserted values go first among equal hashes,
+                // which gives the same order as a stable sort of all values.
+                if (sorted_hashes[new_pos] < base.hashes[old_pos]) {
+                    merged_hashes[out_pos] = sorted_hashes[new_pos];
+                    merged_indices[out_pos] = sorted_indices[new_pos];
+                    new_pos++;
+                } else {
+                    merged_hashes[out_pos] = base.hashes[old_pos];
+                    merged_indices[out_pos] = base.indices[old_pos];
+                    old_pos++;
+                }
+                out_pos++;
+            }
+            for (; old_pos < old_end; old_pos++, out_pos++) {
+                merged_hashes[out_pos] = base.hashes[old_pos];
+                merged_indices[out_pos] = base.indices[old_pos];
+            }
+            for (; new_pos < rebuilding_data_size; new_pos++, out_pos++) {
+                merged_hashes[out_pos] = sorted_hashes[new_pos];
+                merged_indices[out_pos] = sorted_indices[new_pos];
+            }
+
+            hashes = std::move(merged_hashes);
+            indices = std::move(merged_indices);
+            // The number of prefix bits can change with the size, so the index is recomputed.
+            compute_prefix_index();
+            compute_splits();
+
+            thread_performance_metrics().store_time(Computation::Rebuilding);
+        }
 
+        // Drop the values whose index is marked with REMOVED_INDEX in new_ids
+        // and replace the other indices with their new values.
+        // Since hashes are not changed, the order stays the same.
+        void compact(const std::vector<uint32_t>& new_ids) {
+            static const LshDatatype IMPOSSIBLE_PREFIX = 0xffffffff;
+
+            std::vector<LshDatatype> kept_hashes;
+            std::vector<uint32_t> kept_indices;
+            kept_hashes.reserve(hashes.size());
+            kept_indices.reserve(indices.size());
             for (int i=0; i < SEGMENT_SIZE; i++) {
-                hashes.push_back(IMPOSSIBLE_PREFIX);
-                indices.push_back(0);
+                kept_hashes.push_back(IMPOSSIBLE_PREFIX);
+                kept_indices.push_back(0);
             }
-            for (size_t i = 0; i < out_hashes.size(); i++) {
-                indices.push_back(out_indices[i]);
-                hashes.push_back(out_hashes[i]);
+            for (size_t i=SEGMENT_SIZE; i < hashes.size()-SEGMENT_SIZE; i++) {
+                auto new_idx = new_ids[indices[i]];
+                if (new_idx != REMOVED_INDEX) {
+                    kept_hashes.push_back(hashes[i]);
+                    kept_indices.push_back(new_idx);
+                }
             }
             for (int i=0; i < SEGMENT_SIZE; i++) {
-                hashes.push_back(IMPOSSIBLE_PREFIX);
-                indices.push_back(0);
+                kept_hashes.push_back(IMPOSSIBLE_PREFIX);
+                kept_indices.push_back(0);
             }
+            kept_hashes.shrink_to_fit();
+            kept_indices.shrink_to_fit();
+            hashes = std::move(kept_hashes);
+            indices = std::move(kept_indices);
+            compute_prefix_index();
+            compute_splits();
+        }
 
-            // Build prefix_index data structure.
-            // Index of the first occurence of the prefix
-            uint32_t idx = 0;
-            for (unsigned int prefix=0; prefix < (1u << PREFIX_INDEX_BITS); prefix++) {
-                while (
-                    idx < rebuilding_data_size &&
-                    (hashes[SEGMENT_SIZE+idx] >> (hash_length-PREFIX_INDEX_BITS)) < prefix
-                ) {
-                    idx++;
-                }
-                prefix_index[prefix] = SEGMENT_SIZE+idx;
-            }
-            prefix_index[1 << PREFIX_INDEX_BITS] = SEGMENT_SIZE+rebuilding_data_size;
+        // Index of the first split whose common prefix has the given length.
+        uint32_t splits_begin(unsigned int depth) const {
+            return split_offsets[depth];
+        }
 
-            for (auto & rd : parallel_rebuilding_data) {
-                rd.clear();
-                rd.shrink_to_fit();
-            }
+        // Index one past the last split whose common prefix has the given length.
+        uint32_t splits_end(unsigned int depth) const {
+            return split_offsets[depth+1];
+        }
 
-            g_performance_metrics.store_time(Computation::Rebuilding);
+        // Retrieve the split with the given index, whose common prefix has the given length.
+        //
+        // The ends of the siblings are found by a binary search, which is limited to the range
+        // of the first prefix_index_bits of the prefix using prefix_index.
+        PrefixSplit get_split(unsigned int depth, uint32_t idx) const {
+            uint32_t split = split_positions[idx];
+            auto shift = hash_length-depth;
+            auto index_shift = hash_length-prefix_index_bits;
+            uint64_t low = (static_cast<uint64_t>(hashes[split]) >> shift) << shift;
+            uint64_t high = low+(1ull << shift);
+            auto search_begin = prefix_index[low >> index_shift];
+            auto search_end = prefix_index[((high-1) >> index_shift)+1];
+            auto begin = std::lower_bound(&hashes[search_begin], &hashes[split], low);
+            auto end = std::lower_bound(&hashes[split], &hashes[search_end], high);
+            return PrefixSplit {
+                static_cast<uint32_t>(begin-hashes.data()),
+                split,
+                static_cast<uint32_t>(end-hashes.data())
+            };
         }
 
         // Construct a query object to search for the nearest neighbors of the given vector.
         PrefixMapQuery create_query(LshDatatype hash) const {
         // PrefixMapQuery create_query(HashSourceState* hash_state) const {
-            g_performance_metrics.start_timer(Computation::CreateQuery);
-            auto prefix = hash >> (hash_length-PREFIX_INDEX_BITS);
+            thread_performance_metrics().start_timer(Computation::CreateQuery);
+            auto prefix = hash >> (hash_length-prefix_index_bits);
             PrefixMapQuery res(
                 hash,
-                hashes,
+                hashes.data(),
                 prefix_index[prefix],
                 prefix_index[prefix+1]);
-            g_performance_metrics.store_time(Computation::CreateQuery);
+            thread_performance_metrics().store_time(Computation::CreateQuery);
             return res;
         }
 
+        // Find the position that create_query would start at for each of the given hashes,
+        // which must be sorted by hash, in a single pass over the map.
+        // The position of sorted[j].first is stored in positions[sorted[j].second*stride].
+        //
+        // The map is walked in increasing order, so hashes that are close to each other share
+        // the cache lines they read, and equal hashes are only searched for once.
+        // The lookups of the next hashes are prefetched, so that their cache misses overlap.
+        void find_positions(
+            const std::vector<std::pair<LshDatatype, uint32_t>>& sorted,
+            uint32_t* positions,
+            size_t stride
+        ) const {
+            // Number of hashes ahead to prefetch the prefix index for.
+            // The hashes are prefetched half as far ahead, once the prefix index is loaded.
+            const static size_t PREFETCH_DIST = 8;
+            auto index_shift = hash_length-prefix_index_bits;
+            uint32_t pos = 0;
+            for (size_t j=0; j < sorted.size(); j++) {
+                if (j+PREFETCH_DIST < sorted.size()) {
+                    prefetch_addr(&prefix_index[sorted[j+PREFETCH_DIST].first >> index_shift]);
+                }
+                if (j+PREFETCH_DIST/2 < sorted.size()) {
+                    prefetch_query(sorted[j+PREFETCH_DIST/2].first);
+                }
+                auto hash = sorted[j].first;
+                if (j == 0 || hash != sorted[j-1].first) {
+                    pos = PrefixMapQuery(
+                        hash,
+                        hashes.data(),
+                        prefix_index[hash >> index_shift],
+                        prefix_index[(hash >> index_shift)+1]).prefix_start;
+                }
+                positions[sorted[j].second*stride] = pos;
+            }
+        }
+
+        // Start loading the hashes that create_query searches for the given hash.
+        // Used to overlap the cache misses of the queries in many maps.
+        void prefetch_query(LshDatatype hash) const {
+            auto prefix = hash >> (hash_length-prefix_index_bits);
+            auto start = prefix_index[prefix];
+            auto end = prefix_index[prefix+1];
+            prefetch_addr(&hashes[start+(end-start)/2]);
+        }
+
         // Reduce the length of the prefix by one and retrieve the range of indices that should
         // be considered next.
         // Assumes that everything in the current prefix is already searched. This is not true
@@ -312,12 +522,77 @@ namespace puffinn {
             return std::make_pair(&indices[left], &indices[right]);
         }
 
+        // Number of prefix bits in the index of a map with the given number of values.
+        // The index grows so that there are at most PREFIX_INDEX_BUCKET_SIZE values per entry
+        // on average, which keeps it at a quarter of the size of the hashes.
+        static unsigned int prefix_index_bits_for(size_t size, unsigned int hash_length) {
+            unsigned int bits = MIN_PREFIX_INDEX_BITS;
+            while (bits < hash_length && (size >> bits) > PREFIX_INDEX_BUCKET_SIZE) {
+                bits++;
+            }
+            return bits;
+        }
+
         static uint64_t memory_usage(size_t size, uint64_t function_size) {
+            auto index_bits = prefix_index_bits_for(size, MAX_HASH_LENGTH);
             size = size+2*SEGMENT_SIZE;
             return sizeof(PrefixMap)
+                + ((1ull << index_bits)+1)*sizeof(uint32_t)
                 + size*sizeof(uint32_t)
                 + size*sizeof(LshDatatype)
+                // Upper bound on the number of splits.
+                + size*sizeof(uint32_t)
                 + function_size; 
         }
+
+    private:
+        // Choose the number of prefix bits for the current size and find the first value
+        // with each prefix by counting the values with each prefix.
+        void compute_prefix_index() {
+            uint32_t begin = SEGMENT_SIZE;
+            uint32_t end = hashes.size()-SEGMENT_SIZE;
+            prefix_index_bits = prefix_index_bits_for(end-begin, hash_length);
+            auto shift = hash_length-prefix_index_bits;
+            std::vector<uint32_t> res((1 << prefix_index_bits)+1, 0);
+            for (auto pos = begin; pos < end; pos++) {
+                res[(hashes[pos] >> shift)+1]++;
+            }
+            res[0] = begin;
+            for (size_t prefix=1; prefix < res.size(); prefix++) {
+                res[prefix] += res[prefix-1];
+            }
+            prefix_index = std::move(res);
+        }
+
+        // Group the positions where the hash changes by the length of the common prefix,
+        // using a counting sort. The padding is not included.
+        void compute_splits() {
+            split_offsets.assign(hash_length+2, 0);
+            split_positions.clear();
+            if (hashes.size() <= 2*SEGMENT_SIZE) {
+                return;
+            }
+            size_t end = hashes.size()-SEGMENT_SIZE;
+            for (size_t pos = SEGMENT_SIZE+1; pos < end; pos++) {
+                if (hashes[pos] != hashes[pos-1]) {
+                    split_offsets[common_prefix_length(hashes[pos-1], hashes[pos])+1]++;
+                }
+            }
+            for (size_t depth = 1; depth < split_offsets.size(); depth++) {
+                split_offsets[depth] += split_offsets[depth-1];
+            }
+            split_positions.resize(split_offsets.back());
+            std::vector<uint32_t> next(split_offsets.begin(), split_offsets.end()-1);
+            for (size_t pos = SEGMENT_SIZE+1; pos < end; pos++) {
+                if (hashes[pos] != hashes[pos-1]) {
+                    split_positions[next[common_prefix_length(hashes[pos-1], hashes[pos])]++] = pos;
+                }
+            }
+        }
+
+        // Length of the common prefix of two different hashes.
+        unsigned int common_prefix_length(LshDatatype a, LshDatatype b) const {
+            return hash_length-(64-__builtin_clzll(static_cast<uint64_t>(a ^ b)));
+        }
     };
 }
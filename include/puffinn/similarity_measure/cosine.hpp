@@ -1,8 +1,12 @@
 #pragma once
 
+#include "puffinn/dataset.hpp"
 #include "puffinn/format/unit_vector.hpp"
 #include "puffinn/math.hpp"
 
+#include <algorithm>
+#include <cstring>
+
 namespace puffinn {
     class FHTCrossPolytopeHash;
     class SimHash;
@@ -18,9 +22,113 @@ namespace puffinn {
 
         static float compute_similarity(int16_t* lhs, int16_t* rhs, DatasetDescription<Format> desc) {
             float dot = Format::from_16bit_fixed_point(
-                dot_product_i16(lhs, rhs, desc.args));
+                dot_product_i16_exact(lhs, rhs, desc.args));
             return (dot+1)/2; // Ensure the similarity is between 0 and 1.
         }
+
+        // Compute the similarity between the query and the vectors at each of the n given
+        // positions in the dataset.
+        // Four vectors are processed at a time, so that each part of the query is only loaded once.
+        static void compute_similarity_batch(
+            int16_t* query,
+            const Dataset<Format>& dataset,
+            const uint32_t* ids,
+            size_t n,
+            float* out
+        ) {
+            // Number of vectors ahead of the current one to prefetch.
+            const static size_t PREFETCH_DIST = 8;
+            auto desc = dataset.get_description();
+            size_t i = 0;
+            for (; i+4 <= n; i += 4) {
+                for (size_t j=i+PREFETCH_DIST; j < std::min(n, i+PREFETCH_DIST+4); j++) {
+                    dataset.prefetch(ids[j]);
+                }
+                const int16_t* rows[4] = {
+                    dataset[ids[i]],
+                    dataset[ids[i+1]],
+                    dataset[ids[i+2]],
+                    dataset[ids[i+3]]
+                };
+                int16_t dots[4];
+                dot_product_i16_exact_x4(query, rows, desc.args, dots);
+                for (size_t j=0; j < 4; j++) {
+                    out[i+j] = (Format::from_16bit_fixed_point(dots[j])+1)/2;
+                }
+            }
+            for (; i < n; i++) {
+                out[i] = compute_similarity(query, dataset[ids[i]], desc);
+            }
+        }
+
+        // Compute the similarity between every pair of a vector at a position in left and one
+        // at a position in right, storing the similarity of left[l] and right[r]
+        // in out[l*n_right+r].
+        //
+        // The vectors are first copied into contiguous memory, after which the block is computed
+        // in tiles of right vectors that fit in the L1 cache, similar to a matrix product.
+        static void compute_similarity_block(
+            const Dataset<Format>& dataset,
+            const uint32_t* left,
+            size_t n_left,
+            const uint32_t* right,
+            size_t n_right,
+            float* out
+        ) {
+            // Number of right vectors that are compared to each left vector at a time.
+            const static size_t TILE_SIZE = 32;
+            // Reused between calls to avoid an allocation per block.
+            // It only grows, which bounds it by the largest block of the calling thread.
+            static thread_local AlignedStorage<Format> gathered;
+            static thread_local size_t gathered_len = 0;
+
+            auto desc = dataset.get_description();
+            size_t needed_len = (n_left+n_right)*desc.storage_len;
+            if (gathered_len < needed_len) {
+                gathered = allocate_storage<Format>(n_left+n_right, desc.storage_len);
+                gathered_len = needed_len;
+            }
+            auto left_vecs = gathered.get();
+            auto right_vecs = &gathered.get()[n_left*desc.storage_len];
+            auto gather = [&](const uint32_t* ids, size_t n, Format::Type* storage) {
+                for (size_t i=0; i < n; i++) {
+                    std::memcpy(
+                        &storage[i*desc.storage_len],
+                        dataset[ids[i]],
+                        desc.storage_len*sizeof(Format::Type));
+                }
+            };
+            gather(left, n_left, left_vecs);
+            gather(right, n_right, right_vecs);
+
+            for (size_t tile=0; tile < n_right; tile += TILE_SIZE) {
+                size_t tile_end = std::min(n_right, tile+TILE_SIZE);
+                for (size_t l=0; l < n_left; l++) {
+                    auto query = &left_vecs[l*desc.storage_len];
+                    float* row = &out[l*n_right];
+                    size_t r = tile;
+                    for (; r+4 <= tile_end; r += 4) {
+                        const int16_t* rows[4] = {
+                            &right_vecs[r*desc.storage_len],
+                            &right_vecs[(r+1)*desc.storage_len],
+                            &right_vecs[(r+2)*desc.storage_len],
+                            &right_vecs[(r+3)*desc.storage_len]
+                        };
+                        int16_t dots[4];
+                        dot_product_i16_exact_x4(query, rows, desc.args, dots);
+                        for (size_t j=0; j < 4; j++) {
+                            row[r+j] = (Format::from_16bit_fixed_point(dots[j])+1)/2;
+                        }
+                    }
+                    for (; r < tile_end; r++) {
+                        row[r] = compute_similarity(
+                            query,
+                            &right_vecs[r*desc.storage_len],
+                            desc);
+                    }
+                }
+            }
+        }
     };
 }
 
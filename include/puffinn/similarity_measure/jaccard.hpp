@@ -1,6 +1,10 @@
 #pragma once
 
+#include "puffinn/dataset.hpp"
 #include "puffinn/format/set.hpp"
+#include "puffinn/math.hpp"
+
+#include <algorithm>
 
 namespace puffinn {
     class MinHash;
@@ -114,8 +118,78 @@ namespace puffinn {
             return intersection_size;
         }
 
+        // Ratio between the sizes of two sets above which the smaller one is searched for
+        // in the larger one instead of merging them.
+        const static size_t GALLOP_RATIO = 8;
+
+        // Compute the size of the intersection using SIMD kernels,
+        // choosing between merging and galloping depending on the sizes of the sets.
+        static size_t intersection_size(Format::Type* lhs_ptr, Format::Type* rhs_ptr) {
+            auto small = lhs_ptr;
+            auto large = rhs_ptr;
+            if (small->size() > large->size()) {
+                std::swap(small, large);
+            }
+            if (large->size() >= GALLOP_RATIO*small->size()) {
+                return puffinn::intersection_size_gallop(
+                    small->data(), small->size(), large->data(), large->size());
+            } else {
+                return puffinn::intersection_size_merge(
+                    lhs_ptr->data(), lhs_ptr->size(), rhs_ptr->data(), rhs_ptr->size());
+            }
+        }
+
         static float compute_similarity(Format::Type* lhs_ptr, Format::Type* rhs_ptr, DatasetDescription<Format>) {
-            return compute_similarity_linear(lhs_ptr, rhs_ptr);
+            float intersection = intersection_size(lhs_ptr, rhs_ptr);
+            auto divisor = lhs_ptr->size()+rhs_ptr->size()-intersection;
+            if (divisor == 0) {
+                return 0;
+            } else {
+                return intersection/divisor;
+            }
+        }
+
+        // Compute the similarity between the query and the sets at each of the n given
+        // positions in the dataset.
+        static void compute_similarity_batch(
+            Format::Type* query,
+            const Dataset<Format>& dataset,
+            const uint32_t* ids,
+            size_t n,
+            float* out
+        ) {
+            // Number of sets ahead of the current one to prefetch.
+            const static size_t PREFETCH_DIST = 4;
+            auto desc = dataset.get_description();
+            for (size_t i=0; i < std::min(n, PREFETCH_DIST); i++) {
+                dataset.prefetch(ids[i]);
+            }
+            for (size_t i=0; i < n; i++) {
+                if (i+PREFETCH_DIST < n) {
+                    dataset.prefetch(ids[i+PREFETCH_DIST]);
+                }
+                // The tokens of the next set are likely needed before its size is read.
+                if (i+1 < n) {
+                    prefetch_addr(dataset[ids[i+1]]->data());
+                }
+                out[i] = compute_similarity(query, dataset[ids[i]], desc);
+            }
+        }
+
+        // Compute the similarity between every pair of a set at a position in left and one
+        // at a position in right, storing the similarity of left[l] and right[r]
+        // in out[l*n_right+r].
+        static void compute_similarity_block(
+            const Dataset<Format>& dataset,
+            const uint32_t* left,
+            size_t n_left,
+            const uint32_t* right,
+            size_t n_right,
+            float* out
+        ) {
+            for (size_t l=0; l < n_left; l++) {
+                compute_similarity_batch(dataset[left[l]], dataset, right, n_right, &out[l*n_right]);
+            }
         }
 
         static float compute_similarity_linear(Format::Type* lhs_ptr, Format::Type* rhs_ptr) {
@@ -1,17 +1,27 @@
 #pragma once
 
+#include "puffinn/dataset.hpp"
 #include "puffinn/format/real_vector.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/math.hpp"
 
+#include <algorithm>
 #include <cmath>
 
 namespace puffinn {
+    class PStableHash;
+    class PStableHash1Bit;
+
+    /// Measures the euclidean distance between two real vectors.
+    ///
+    /// The distance is converted to a similarity between 0 and 1 as ``1/(d^2+1)``,
+    /// where ``d`` is the distance.
+    /// The supported LSH families are ``PStableHash`` and ``PStableHash1Bit``.
     struct L2Distance {
         using Format = RealVectorFormat;
-//        using DefaultHash = unimplemented;
-//        using DefaultSketch = unimplemented;
+        using DefaultHash = PStableHash;
+        using DefaultSketch = PStableHash1Bit;
 
         static float compute_similarity(float* lhs, float* rhs, DatasetDescription<Format> desc) {
             auto dist = l2_distance_float(lhs, rhs, desc.args);
@@ -19,6 +29,46 @@ namespace puffinn {
             // which is needed to calculate collision probabilities.
             return 1.0/(dist+1.0);
         }
+
+        // Compute the similarity between the query and the vectors at each of the n given
+        // positions in the dataset.
+        static void compute_similarity_batch(
+            float* query,
+            const Dataset<Format>& dataset,
+            const uint32_t* ids,
+            size_t n,
+            float* out
+        ) {
+            // Number of vectors ahead of the current one to prefetch.
+            const static size_t PREFETCH_DIST = 4;
+            auto desc = dataset.get_description();
+            for (size_t i=0; i < std::min(n, PREFETCH_DIST); i++) {
+                dataset.prefetch(ids[i]);
+            }
+            for (size_t i=0; i < n; i++) {
+                if (i+PREFETCH_DIST < n) {
+                    dataset.prefetch(ids[i+PREFETCH_DIST]);
+                }
+                out[i] = compute_similarity(query, dataset[ids[i]], desc);
+            }
+        }
+
+        // Compute the similarity between every pair of a vector at a position in left and one
+        // at a position in right, storing the similarity of left[l] and right[r]
+        // in out[l*n_right+r].
+        static void compute_similarity_block(
+            const Dataset<Format>& dataset,
+            const uint32_t* left,
+            size_t n_left,
+            const uint32_t* right,
+            size_t n_right,
+            float* out
+        ) {
+            for (size_t l=0; l < n_left; l++) {
+                compute_similarity_batch(dataset[left[l]], dataset, right, n_right, &out[l*n_right]);
+            }
+        }
     };
 }
 
+#include "puffinn/hash/pstable.hpp"
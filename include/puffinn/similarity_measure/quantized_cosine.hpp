@@ -0,0 +1,73 @@
+#pragma once
+
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/quantized_unit_vector.hpp"
+#include "puffinn/math.hpp"
+
+#include <algorithm>
+
+namespace puffinn {
+    class FHTCrossPolytopeHash;
+    class SimHash;
+    template <typename T>
+    class QuantizedHash;
+
+    /// Measures the cosine of the angle between two unit vectors stored using
+    /// ``QuantizedUnitVectorFormat``.
+    ///
+    /// This is the same similarity as ``CosineSimilarity``, computed from 8 bit values.
+    /// The supported LSH families are those of ``CosineSimilarity`` wrapped in ``QuantizedHash``.
+    struct QuantizedCosineSimilarity {
+        using Format = QuantizedUnitVectorFormat;
+        using DefaultHash = QuantizedHash<FHTCrossPolytopeHash>;
+        using DefaultSketch = QuantizedHash<SimHash>;
+
+        static float compute_similarity(int8_t* lhs, int8_t* rhs, DatasetDescription<Format> desc) {
+            float dot = dot_product_i8(lhs, rhs, desc.args)
+                *Format::get_scale(lhs, desc.args)
+                *Format::get_scale(rhs, desc.args);
+            return (dot+1)/2; // Ensure the similarity is between 0 and 1.
+        }
+
+        // Compute the similarity between the query and the vectors at each of the n given
+        // positions in the dataset.
+        static void compute_similarity_batch(
+            int8_t* query,
+            const Dataset<Format>& dataset,
+            const uint32_t* ids,
+            size_t n,
+            float* out
+        ) {
+            // Number of vectors ahead of the current one to prefetch.
+            const static size_t PREFETCH_DIST = 8;
+            auto desc = dataset.get_description();
+            for (size_t i=0; i < std::min(n, PREFETCH_DIST); i++) {
+                dataset.prefetch(ids[i]);
+            }
+            for (size_t i=0; i < n; i++) {
+                if (i+PREFETCH_DIST < n) {
+                    dataset.prefetch(ids[i+PREFETCH_DIST]);
+                }
+                out[i] = compute_similarity(query, dataset[ids[i]], desc);
+            }
+        }
+
+        // Compute the similarity between every pair of a vector at a position in left and one
+        // at a position in right, storing the similarity of left[l] and right[r]
+        // in out[l*n_right+r].
+        static void compute_similarity_block(
+            const Dataset<Format>& dataset,
+            const uint32_t* left,
+            size_t n_left,
+            const uint32_t* right,
+            size_t n_right,
+            float* out
+        ) {
+            for (size_t l=0; l < n_left; l++) {
+                compute_similarity_batch(dataset[left[l]], dataset, right, n_right, &out[l*n_right]);
+            }
+        }
+    };
+}
+
+#include "puffinn/hash/quantized.hpp"
@@ -194,4 +194,70 @@ void sort_hashes_pairs_24(
 }
 
 
+//! Sort the given vector of hash values, along with the corresponding vector of 
+//! identifiers, in the same way as sort_hashes_pairs_24.
+//! Assumes that the hash values are stored in the `bits` least significant bits of each
+//! 32 bit integer, and makes one pass over the data for each byte that they use.
+void sort_hashes_pairs(
+    std::vector<uint32_t> & hashes_in,
+    std::vector<uint32_t> & hashes_out,
+    std::vector<uint32_t> & idx_in,
+    std::vector<uint32_t> & idx_out,
+    unsigned int bits
+) {
+    const size_t n = hashes_in.size();
+    const size_t n_bytes = 256;
+    const unsigned int passes = std::max(1u, (bits+7)/8);
+    hashes_out.clear();
+    hashes_out.resize(n, 0);
+    idx_out.clear();
+    idx_out.resize(n, 0);
+
+    // Histograms on the stack
+    uint32_t bx[4][n_bytes];
+    for (unsigned int p = 0; p < passes; p++) {
+        for (size_t i = 0; i < n_bytes; i++) {
+            bx[p][i] = 0;
+        }
+    }
+
+    // One-pass histogram computation
+    for (size_t i = 0; i < n; i++) {
+        const uint32_t hi = hashes_in[i];
+        for (unsigned int p = 0; p < passes; p++) {
+            bx[p][hi >> (8*p) & 0xFF]++;
+        }
+    }
+
+    // Cumulative sum of the histograms, which then keep track 
+    // of the write head position for each byte
+    for (unsigned int p = 0; p < passes; p++) {
+        uint32_t sum = 0;
+        for (size_t i = 0; i < n_bytes; i++) {
+            uint32_t tsum = sum + bx[p][i];
+            bx[p][i] = sum;
+            sum = tsum;
+        }
+    }
+
+    // Alternate between the two pairs of vectors.
+    for (unsigned int p = 0; p < passes; p++) {
+        auto& h_in = (p % 2 == 0) ? hashes_in : hashes_out;
+        auto& h_out = (p % 2 == 0) ? hashes_out : hashes_in;
+        auto& i_in = (p % 2 == 0) ? idx_in : idx_out;
+        auto& i_out = (p % 2 == 0) ? idx_out : idx_in;
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t hi = h_in[i];
+            const uint32_t t = bx[p][hi >> (8*p) & 0xFF]++;
+            h_out[t] = hi;
+            i_out[t] = i_in[i];
+        }
+    }
+    if (passes % 2 == 0) {
+        // The result was written to the input vectors in the last pass.
+        std::swap(hashes_in, hashes_out);
+        std::swap(idx_in, idx_out);
+    }
+}
+
 } // namespace puffinn
@@ -9,14 +9,22 @@ namespace puffinn {
     const static unsigned int NUM_FILTER_HASHBITS = 64;
     using FilterLshDatatype = uint64_t;
 
-    // Number of bits used in hashes.
+    // Number of bits used in hashes, unless a different length is given to the index.
     const static unsigned int MAX_HASHBITS = 24;
+    // Bounds on the number of bits used in hashes.
+    // The highest bit of LshDatatype is never used, so that hashes never share a prefix with
+    // the padding of the tables.
+    const static unsigned int MIN_HASH_LENGTH = 16;
+    const static unsigned int MAX_HASH_LENGTH = 31;
     // The hash_pool concatenates hashes into a type twice as large to avoid overflow errors.
     // TODO: Check how to avoid this "twice as large": using 64 bits to store 24-bits hash values.
     // To me it seems that when inserting into a prefix-map, 64 bits are automatically 
     // truncated to `LshDatatype` when push_back is called on `rebuilding_data`.
     using LshDatatype = uint32_t;
 
+    // Marks a point that is dropped when compacting an index.
+    const static uint32_t REMOVED_INDEX = 0xffffffff;
+
     // std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());
     // for reproducibility, fix the seed of the random number generator
     std::default_random_engine generator(1234);
@@ -68,7 +68,8 @@ void cerr_vec(std::vector<uint32_t> & v) {
   std::cerr << "]\n";
 }
 
-float jaccard(const std::vector<uint32_t> * a, const std::vector<uint32_t> * b) {
+template <typename Set>
+float jaccard(const Set * a, const Set * b) {
     auto& lhs = *a;
     auto& rhs = *b;
     size_t a_len = lhs.size();
@@ -196,6 +196,8 @@ void run() {
 
 int main(void) {
     std::string protocol_line;
+    // Report the progress of the joins.
+    puffinn::set_logger(std::make_shared<puffinn::StreamLogger>(std::cerr, puffinn::LogLevel::Debug));
 
     // Read the dataset
     expect("data");
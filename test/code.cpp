@@ -10,3 +10,4 @@
 #include "filterer_test.hpp"
 #include "math_test.hpp"
 #include "sorthash_test.hpp"
+#include "bitset_test.hpp"
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "catch.hpp"
+#include "puffinn/bitset.hpp"
+
+#include <vector>
+
+namespace bitset {
+    using namespace puffinn;
+
+    TEST_CASE("AtomicBitset set and count") {
+        AtomicBitset bits(130, true);
+        REQUIRE(bits.size() == 130);
+        REQUIRE(bits.get_num_words() == 3);
+        REQUIRE(bits.count() == 130);
+
+        bits.reset(0);
+        bits.reset(64);
+        bits.reset(129);
+        REQUIRE(bits.count() == 127);
+        REQUIRE(!bits[0]);
+        REQUIRE(bits[1]);
+        REQUIRE(!bits[129]);
+
+        bits.reset_word(1, ~0ull);
+        REQUIRE(bits.count() == 64);
+        bits.set(70);
+        REQUIRE(bits[70]);
+        REQUIRE(bits.count() == 65);
+    }
+
+    TEST_CASE("AtomicBitset for_each_set") {
+        AtomicBitset bits(200);
+        REQUIRE(bits.count() == 0);
+        std::vector<size_t> expected = {3, 63, 64, 100, 199};
+        for (auto i : expected) {
+            bits.set(i);
+        }
+        std::vector<size_t> found;
+        bits.for_each_set([&](size_t i) {
+            found.push_back(i);
+        });
+        REQUIRE(found == expected);
+    }
+
+    TEST_CASE("AtomicBitset concurrent reset") {
+        size_t n = 10000;
+        AtomicBitset bits(n, true);
+        // Neighboring flags share a word, so they are cleared by different threads.
+        #pragma omp parallel for schedule(static, 1)
+        for (size_t i = 0; i < n; i += 2) {
+            bits.reset(i);
+        }
+        REQUIRE(bits.count() == n/2);
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(bits[i] == (i%2 == 1));
+        }
+    }
+}
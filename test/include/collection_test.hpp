@@ -4,13 +4,21 @@
 #include "puffinn/collection.hpp"
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
+#include "puffinn/hash/quantized.hpp"
 #include "puffinn/hash_source/pool.hpp"
 #include "puffinn/hash_source/independent.hpp"
 #include "puffinn/hash_source/tensor.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
+#include "puffinn/similarity_measure/l2.hpp"
+#include "puffinn/similarity_measure/quantized_cosine.hpp"
 
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 namespace collection {
     using namespace puffinn;
@@ -250,7 +258,181 @@ namespace collection {
         }
     }
 
-    template <typename T, typename U>
+    TEST_CASE("Index::lsh_join - brute force") {
+        const int DIMENSIONS = 20;
+        const int N = 500;
+        unsigned int k = 10;
+        Index<CosineSimilarity, SimHash, SimHash> table(DIMENSIONS, 10*MB);
+        for (int i=0; i < N; i++) {
+            table.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        table.rebuild(false, true);
+
+        // All points are compared by brute force before any segments are joined.
+        // The brute force join includes the point itself.
+        auto exact = table.bf_join(k+1);
+        auto res = table.lsh_join(k, 0.9, 1.0);
+        REQUIRE(res.size() == N);
+        int num_correct = 0;
+        for (int i=0; i < N; i++) {
+            REQUIRE(res[i].size() == k);
+            for (auto idx : exact[i]) {
+                if (idx != static_cast<uint32_t>(i)) {
+                    num_correct += std::count(res[i].begin(), res[i].end(), idx);
+                }
+            }
+        }
+        // Only neighbors with equal similarities can differ.
+        REQUIRE(num_correct >= 0.99*N*k);
+    }
+
+    TEST_CASE("Index::lsh_join - large segments") {
+        // Points in the same cluster collide in most tables, so the segments are large
+        // enough to be split into tiles.
+        const int DIMENSIONS = 10;
+        const int N = 1500;
+        const int CLUSTERS = 3;
+        unsigned int k = 10;
+        std::vector<std::vector<float>> centers;
+        for (int c=0; c < CLUSTERS; c++) {
+            centers.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        Index<CosineSimilarity, SimHash, SimHash> table(DIMENSIONS, 10*MB);
+        for (int i=0; i < N; i++) {
+            auto noise = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto vec = centers[i%CLUSTERS];
+            for (int d=0; d < DIMENSIONS; d++) {
+                vec[d] += 0.01*noise[d];
+            }
+            table.insert(vec);
+        }
+        table.rebuild();
+
+        auto res = table.lsh_join(k, 0.9, 0.1);
+        REQUIRE(res.size() == N);
+        for (int i=0; i < N; i++) {
+            REQUIRE(res[i].size() == k);
+            for (auto idx : res[i]) {
+                REQUIRE(idx != static_cast<uint32_t>(i));
+                REQUIRE(idx%CLUSTERS == i%CLUSTERS);
+            }
+        }
+    }
+
+    TEST_CASE("Index::lsh_join - bucket with the largest hash") {
+        // The points are so close that they share their hash in every table,
+        // which makes their bucket the one with the largest hash.
+        const int DIMENSIONS = 10;
+        const int N = 100;
+        unsigned int k = 10;
+        auto center = UnitVectorFormat::generate_random(DIMENSIONS);
+        Index<CosineSimilarity, SimHash, SimHash> table(DIMENSIONS, 10*MB);
+        for (int i=0; i < N; i++) {
+            auto noise = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto vec = center;
+            for (int d=0; d < DIMENSIONS; d++) {
+                vec[d] += 0.0001*noise[d];
+            }
+            table.insert(vec);
+        }
+        table.rebuild();
+
+        // Every pair is found without comparing the points by brute force.
+        auto pairs = table.global_lsh_join(N*(N-1)/2, 0.9).best_indices();
+        REQUIRE(pairs.size() == N*(N-1)/2);
+        for (auto& pair : pairs) {
+            REQUIRE(pair.first != pair.second);
+        }
+        auto res = table.lsh_join(k, 0.9, 0.0);
+        REQUIRE(res.size() == N);
+        for (int i=0; i < N; i++) {
+            REQUIRE(res[i].size() == k);
+        }
+    }
+
+    TEST_CASE("Index::lsh_join_stream") {
+        const int DIMENSIONS = 5;
+        const int N = 1000;
+        unsigned int k = 10;
+        Index<CosineSimilarity, SimHash, SimHash> table(DIMENSIONS, 10*MB);
+        for (int i=0; i < N; i++) {
+            table.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        table.rebuild();
+        for (int i=0; i < N; i += 7) {
+            table.remove(i);
+        }
+
+        std::vector<int> times_emitted(N, 0);
+        std::vector<std::vector<uint32_t>> res(N);
+        table.lsh_join_stream(k, 0.9, 0.1, [&](uint32_t idx, std::vector<uint32_t>&& neighbors) {
+            times_emitted[idx]++;
+            res[idx] = std::move(neighbors);
+        });
+        auto expected = table.lsh_join(k, 0.9, 0.1);
+        for (int i=0; i < N; i++) {
+            REQUIRE(times_emitted[i] == (table.is_removed(i) ? 0 : 1));
+            REQUIRE(res[i] == expected[i]);
+            if (!table.is_removed(i)) {
+                REQUIRE(res[i].size() == k);
+            }
+            for (auto idx : res[i]) {
+                REQUIRE(idx != static_cast<uint32_t>(i));
+                REQUIRE(!table.is_removed(idx));
+            }
+        }
+    }
+
+    struct RecordingLogger : Logger {
+        std::mutex mutex;
+        std::vector<std::string> messages;
+        std::vector<JoinProgress> progress;
+
+        bool enabled(LogLevel level) const {
+            return level >= LogLevel::Info;
+        }
+
+        void log(LogLevel level, const std::string& message) {
+            REQUIRE(level >= LogLevel::Info);
+            std::lock_guard<std::mutex> lock(mutex);
+            messages.push_back(message);
+        }
+
+        void join_progress(const JoinProgress& p) {
+            std::lock_guard<std::mutex> lock(mutex);
+            progress.push_back(p);
+        }
+    };
+
+    TEST_CASE("Index::lsh_join logger") {
+        const int DIMENSIONS = 5;
+        const int N = 1000;
+        Index<CosineSimilarity, SimHash, SimHash> table(DIMENSIONS, 10*MB);
+        for (int i=0; i < N; i++) {
+            table.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        auto logger = std::make_shared<RecordingLogger>();
+        set_logger(logger);
+        table.rebuild();
+        REQUIRE(logger->messages.size() > 0);
+
+        table.lsh_join(10, 0.9, 0.1);
+        set_logger(nullptr);
+        REQUIRE(logger->progress.size() > 0);
+        for (size_t i=1; i < logger->progress.size(); i++) {
+            REQUIRE(logger->progress[i].level < logger->progress[i-1].level);
+            REQUIRE(logger->progress[i].active_count <= logger->progress[i-1].active_count);
+            REQUIRE(logger->progress[i].pairs_checked >= logger->progress[i-1].pairs_checked);
+        }
+        REQUIRE(logger->progress[0].active_count <= N);
+
+        // Nothing is reported once the logger is removed.
+        auto num_messages = logger->messages.size();
+        table.lsh_join(10, 0.9, 0.1);
+        REQUIRE(logger->messages.size() == num_messages);
+    }
+
+    template <typename T, typename U, typename S = CosineSimilarity>
     void test_angular_search(
         int n,
         int dimensions,
@@ -266,9 +448,9 @@ namespace collection {
             inserted.push_back(UnitVectorFormat::generate_random(dimensions));
         }
 
-        Index<CosineSimilarity, T, U> table(dimensions, 100*MB);
+        Index<S, T, U> table(dimensions, 100*MB);
         if (hash_source) {
-            table = Index<CosineSimilarity, T, U>(dimensions, 100*MB, *hash_source);
+            table = Index<S, T, U>(dimensions, 100*MB, *hash_source);
         }
         for (auto &vec : inserted) {
             table.insert(vec);
@@ -300,6 +482,94 @@ namespace collection {
         }
     }
 
+    TEST_CASE("Index::search l2") {
+        const int NUM_SAMPLES = 100;
+        const unsigned int DIMENSIONS = 10;
+
+        // Clustered points, so that the nearest neighbors are close relative to the bucket width.
+        std::vector<std::vector<float>> centers;
+        for (int i=0; i < 20; i++) {
+            auto c = RealVectorFormat::generate_random(DIMENSIONS);
+            for (auto& v : c) { v *= 10; }
+            centers.push_back(c);
+        }
+        auto near = [&](const std::vector<float>& c) {
+            auto v = RealVectorFormat::generate_random(DIMENSIONS);
+            for (size_t i=0; i < DIMENSIONS; i++) { v[i] = c[i]+0.3*v[i]; }
+            return v;
+        };
+
+        Index<L2Distance> index(DIMENSIONS, 100*MB);
+        for (int i=0; i < 1000; i++) {
+            index.insert(near(centers[i%centers.size()]));
+        }
+        index.rebuild();
+
+        for (auto recall : {0.5, 0.9}) {
+            unsigned int k = 10;
+            int num_correct = 0;
+            for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                auto query = near(centers[sample%centers.size()]);
+                auto exact = index.search_bf(query, k);
+                auto res = index.search(query, k, recall);
+                REQUIRE(res.size() == k);
+                for (auto i : exact) {
+                    if (std::count(res.begin(), res.end(), i) != 0) {
+                        num_correct++;
+                    }
+                }
+            }
+            REQUIRE(num_correct >= 0.8*recall*k*NUM_SAMPLES);
+        }
+    }
+
+    TEST_CASE("Index::search hash length") {
+        const int NUM_SAMPLES = 100;
+        const unsigned int DIMENSIONS = 50;
+        const unsigned int N = 1000;
+        using SimHashIndex = Index<CosineSimilarity, SimHash>;
+
+        REQUIRE_THROWS_AS(
+            SimHashIndex(
+                DIMENSIONS, 10*MB,
+                IndependentHashArgs<SimHash>(), IndependentHashArgs<SimHash>(),
+                MIN_HASH_LENGTH-1),
+            std::invalid_argument);
+        REQUIRE_THROWS_AS(
+            SimHashIndex(
+                DIMENSIONS, 10*MB,
+                IndependentHashArgs<SimHash>(), IndependentHashArgs<SimHash>(),
+                MAX_HASH_LENGTH+1),
+            std::invalid_argument);
+
+        for (unsigned int hash_length : {MIN_HASH_LENGTH, MAX_HASH_LENGTH}) {
+            SimHashIndex index(
+                DIMENSIONS, 100*MB,
+                IndependentHashArgs<SimHash>(), IndependentHashArgs<SimHash>(),
+                hash_length);
+            for (unsigned int i=0; i < N; i++) {
+                index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+            }
+            index.rebuild();
+
+            unsigned int k = 10;
+            float recall = 0.9;
+            int num_correct = 0;
+            for (int sample=0; sample < NUM_SAMPLES; sample++) {
+                auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+                auto exact = index.search_bf(query, k);
+                auto res = index.search(query, k, recall);
+                REQUIRE(res.size() == k);
+                for (auto i : exact) {
+                    if (std::count(res.begin(), res.end(), i) != 0) {
+                        num_correct++;
+                    }
+                }
+            }
+            REQUIRE(num_correct >= 0.8*recall*k*NUM_SAMPLES);
+        }
+    }
+
     TEST_CASE("Index::search - empty") {
         test_angular_search<SimHash, SimHash>(0, 2);
     }
@@ -341,6 +611,71 @@ namespace collection {
         }
     }
 
+    TEST_CASE("Index::search quantized cosine") {
+        using Hash = QuantizedHash<FHTCrossPolytopeHash>;
+        using Sketch = QuantizedHash<SimHash>;
+        test_angular_search<Hash, Sketch, QuantizedCosineSimilarity>(500, 100);
+        test_angular_search<Hash, Sketch, QuantizedCosineSimilarity>(500, 100,
+            std::unique_ptr<HashSourceArgs<Hash>>(new IndependentHashArgs<Hash>()));
+    }
+
+    TEST_CASE("Index::search_batch") {
+        const int DIMENSIONS = 50;
+        const int NUM_QUERIES = 100;
+        unsigned int k = 10;
+
+        Index<CosineSimilarity> table(DIMENSIONS, 100*MB);
+        for (int i=0; i < 2000; i++) {
+            table.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        table.rebuild();
+
+        std::vector<std::vector<float>> queries;
+        for (int i=0; i < NUM_QUERIES; i++) {
+            queries.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+
+        for (auto filter_type : { FilterType::Default, FilterType::None }) {
+            for (auto recall : { 0.5, 0.95 }) {
+                auto res = table.search_batch(queries, k, recall, filter_type);
+                REQUIRE(res.size() == NUM_QUERIES);
+
+                int num_correct = 0;
+                for (int q=0; q < NUM_QUERIES; q++) {
+                    REQUIRE(res[q].size() == k);
+                    // The batch is searched in the same way as single queries.
+                    REQUIRE(res[q] == table.search(queries[q], k, recall, filter_type));
+                    for (auto i : table.search_bf(queries[q], k)) {
+                        if (std::count(res[q].begin(), res[q].end(), i) != 0) {
+                            num_correct++;
+                        }
+                    }
+                }
+                // Only fail if the recall is far away from the expectation.
+                REQUIRE(num_correct >= 0.8*recall*k*NUM_QUERIES);
+            }
+        }
+    }
+
+    TEST_CASE("Index::search_batch - few values") {
+        const int DIMENSIONS = 5;
+        Index<CosineSimilarity> table(DIMENSIONS, 1*MB);
+        for (int i=0; i < 20; i++) {
+            table.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        table.rebuild();
+
+        std::vector<std::vector<float>> queries;
+        for (int i=0; i < 5; i++) {
+            queries.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        auto res = table.search_batch(queries, 3, 0.9);
+        REQUIRE(res.size() == queries.size());
+        for (size_t q=0; q < queries.size(); q++) {
+            REQUIRE(res[q] == table.search_bf(queries[q], 3));
+        }
+    }
+
     void test_jaccard_search(
         int n,
         int dimensions,
@@ -453,6 +788,179 @@ namespace collection {
         }
     }
 
+    TEST_CASE("Rebuild with sketches after rebuilding without") {
+        const int DIMENSIONS = 20;
+        const int N = 2000;
+        unsigned int k = 10;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 50*MB);
+        for (int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild(false);
+        for (int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+
+        // The points of the first rebuild are sketched too, so they pass the filter.
+        float recall = 0.9;
+        int num_correct = 0;
+        int num_old = 0;
+        for (int sample=0; sample < 100; sample++) {
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto exact = index.search_bf(query, k);
+            auto res = index.search(query, k, recall);
+            for (auto i : exact) {
+                if (i < static_cast<uint32_t>(N)) {
+                    num_old++;
+                    num_correct += (std::count(res.begin(), res.end(), i) != 0);
+                }
+            }
+        }
+        // Only fail if the recall is far away from the expectation.
+        REQUIRE(num_correct >= 0.8*recall*num_old);
+    }
+
+    TEST_CASE("Index::search during rebuild") {
+        const int DIMENSIONS = 20;
+        const int N = 2000;
+        unsigned int k = 10;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 50*MB);
+        for (int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+        for (int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+
+        std::atomic<bool> done(false);
+        std::thread rebuilder([&]() {
+            index.rebuild();
+            done = true;
+        });
+        // Searches use the old tables until the new ones are ready.
+        int searches = 0;
+        while (!done || searches == 0) {
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto res = index.search(query, k, 0.9);
+            REQUIRE(res.size() == k);
+            for (auto idx : res) {
+                REQUIRE(idx < 2*N);
+            }
+            searches++;
+        }
+        rebuilder.join();
+
+        int found = 0;
+        for (int i=N; i < N+20; i++) {
+            auto res = index.search_from_index(i, k, 0.9);
+            auto exact = index.search_bf(index.get<std::vector<float>>(i), 2);
+            found += (std::count(res.begin(), res.end(), exact[1]) != 0);
+        }
+        REQUIRE(found >= 15);
+    }
+
+    TEST_CASE("Index::remove") {
+        const int DIMENSIONS = 20;
+        const int N = 2000;
+        unsigned int k = 10;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 50*MB);
+        std::vector<std::vector<float>> inserted;
+        for (int i=0; i < N; i++) {
+            inserted.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+            index.insert(inserted.back());
+        }
+        index.rebuild();
+
+        // Remove every third point
+        for (int i=0; i < N; i += 3) {
+            index.remove(i);
+        }
+        REQUIRE_THROWS(index.remove(N));
+        REQUIRE_THROWS_AS(index.is_removed(N), std::invalid_argument);
+        REQUIRE(index.is_removed(0));
+        REQUIRE(!index.is_removed(1));
+
+        for (int i=0; i < 50; i++) {
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            for (auto idx : index.search(query, k, 0.9)) {
+                REQUIRE(!index.is_removed(idx));
+            }
+            for (auto idx : index.search_bf(query, k)) {
+                REQUIRE(!index.is_removed(idx));
+            }
+        }
+
+        auto join = index.lsh_join(k, 0.9, 0.0);
+        for (int i=0; i < N; i++) {
+            if (index.is_removed(i)) {
+                REQUIRE(join[i].size() == 0);
+            }
+            for (auto idx : join[i]) {
+                REQUIRE(!index.is_removed(idx));
+            }
+        }
+    }
+
+    TEST_CASE("Index::compact") {
+        const int DIMENSIONS = 20;
+        const int N = 2000;
+        unsigned int k = 10;
+        float recall = 0.9;
+
+        Index<CosineSimilarity> index(DIMENSIONS, 50*MB);
+        for (int i=0; i < N; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+        std::vector<std::vector<float>> stored;
+        for (int i=0; i < N; i++) {
+            stored.push_back(index.get<std::vector<float>>(i));
+        }
+        for (int i=0; i < N; i += 3) {
+            index.remove(i);
+        }
+
+        auto new_ids = index.compact();
+        REQUIRE(new_ids.size() == N);
+        REQUIRE(index.get_size() == N-(N+2)/3);
+        for (int i=0; i < N; i++) {
+            if (i%3 == 0) {
+                REQUIRE(new_ids[i] == REMOVED_INDEX);
+            } else {
+                REQUIRE(index.get<std::vector<float>>(new_ids[i]) == stored[i]);
+                REQUIRE(!index.is_removed(new_ids[i]));
+            }
+        }
+
+        int num_correct = 0;
+        int samples = 100;
+        for (int sample=0; sample < samples; sample++) {
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            auto exact = index.search_bf(query, k);
+            auto res = index.search(query, k, recall);
+            REQUIRE(res.size() == k);
+            for (auto i : exact) {
+                if (std::count(res.begin(), res.end(), i) != 0) {
+                    num_correct++;
+                }
+            }
+        }
+        REQUIRE(num_correct >= 0.8*recall*k*samples);
+
+        // Points inserted after compaction are indexed as usual.
+        auto extra = UnitVectorFormat::generate_random(DIMENSIONS);
+        index.insert(extra);
+        index.rebuild();
+        auto res = index.search(extra, 1, recall);
+        REQUIRE(res.size() == 1);
+        REQUIRE(res[0] == index.get_size()-1);
+    }
+
     template <typename T, typename H, typename S>
     void test_serialize(
         typename T::Format::Args args,
@@ -529,6 +1037,65 @@ namespace collection {
         REQUIRE(s1.str() == s2.str());
     }
 
+    TEST_CASE("Serialize hash length") {
+        int dims = 100;
+        Index<CosineSimilarity> index(
+            dims,
+            50*MB,
+            IndependentHashArgs<FHTCrossPolytopeHash>(),
+            IndependentHashArgs<SimHash>(),
+            30);
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+
+        std::stringstream s1;
+        index.serialize(s1);
+        Index<CosineSimilarity> deserialized(s1);
+        std::stringstream s2;
+        deserialized.serialize(s2);
+        REQUIRE(s1.str() == s2.str());
+
+        auto query = UnitVectorFormat::generate_random(dims);
+        REQUIRE(index.search(query, 10, 0.5) == deserialized.search(query, 10, 0.5));
+    }
+
+    TEST_CASE("Serialize rejects other formats") {
+        int dims = 10;
+        Index<CosineSimilarity> index(dims, 10*MB);
+        for (int i=0; i < 200; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+        std::stringstream s;
+        index.serialize(s);
+        auto serialized = s.str();
+
+        // Data written before the format was versioned has no header.
+        std::stringstream unversioned(serialized.substr(12));
+        REQUIRE_THROWS_AS(Index<CosineSimilarity>(unversioned), std::invalid_argument);
+
+        auto other_version = serialized;
+        other_version[8]++;
+        std::stringstream other(other_version);
+        REQUIRE_THROWS_AS(Index<CosineSimilarity>(other), std::invalid_argument);
+
+        // MinHash values changed before the format was versioned.
+        Index<JaccardSimilarity> set_index(100, 100*MB);
+        for (int i=0; i < 200; i++) {
+            set_index.insert(std::vector<uint32_t>{
+                static_cast<uint32_t>(i%100), static_cast<uint32_t>((7*i)%100)});
+        }
+        set_index.rebuild();
+        std::stringstream set_stream;
+        set_index.serialize(set_stream);
+        std::stringstream unversioned_sets(set_stream.str().substr(12));
+        REQUIRE_THROWS_AS(Index<JaccardSimilarity>(unversioned_sets), std::invalid_argument);
+        std::stringstream versioned_sets(set_stream.str());
+        REQUIRE_NOTHROW(Index<JaccardSimilarity>(versioned_sets));
+    }
+
     TEST_CASE("Serialize no rebuild") {
         int dims = 100;
         Index<CosineSimilarity> index(dims, 50*MB);
@@ -544,6 +1111,49 @@ namespace collection {
         REQUIRE(s1.str() == s2.str());
     }
 
+    TEST_CASE("Index::open_mmap") {
+        const char* path = "puffinn_test_index.bin";
+        int dims = 100;
+        int k = 10;
+        Index<CosineSimilarity> index(dims, 50*MB);
+        for (int i=0; i < 1000; i++) {
+            index.insert(UnitVectorFormat::generate_random(dims));
+        }
+        index.rebuild();
+        index.remove(3);
+        index.save_mmap(path);
+
+        auto opened = Index<CosineSimilarity>::open_mmap(path);
+        for (int q=0; q < 10; q++) {
+            auto query = UnitVectorFormat::generate_random(dims);
+            REQUIRE(opened.search(query, k, 0.9) == index.search(query, k, 0.9));
+        }
+        REQUIRE(opened.is_removed(3));
+
+        // The opened index contains the same data as the original.
+        std::stringstream s1, s2;
+        index.serialize(s1);
+        opened.serialize(s2);
+        REQUIRE(s1.str() == s2.str());
+
+        // Modifying the opened index copies the mapped structures.
+        for (int i=0; i < 100; i++) {
+            auto value = UnitVectorFormat::generate_random(dims);
+            index.insert(value);
+            opened.insert(value);
+        }
+        index.rebuild();
+        opened.rebuild();
+        opened.compact();
+        index.compact();
+        auto query = UnitVectorFormat::generate_random(dims);
+        REQUIRE(opened.search(query, k, 0.9) == index.search(query, k, 0.9));
+
+        std::ofstream(path) << "not an index";
+        REQUIRE_THROWS(Index<CosineSimilarity>::open_mmap(path));
+        std::remove(path);
+    }
+
     TEST_CASE("search_from_index == search") {
         int dims = 100;
         int n = 5000;
@@ -564,4 +1174,80 @@ namespace collection {
         res2.pop_back();
         REQUIRE(res1 == res2);
     }
+
+    TEST_CASE("Index::search stats") {
+        const int DIMENSIONS = 50;
+        Index<CosineSimilarity> index(DIMENSIONS, 100*MB);
+        for (int i=0; i < 2000; i++) {
+            index.insert(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        index.rebuild();
+        reset_performance_histograms();
+
+        for (auto filter_type : { FilterType::Default, FilterType::None, FilterType::Simple }) {
+            QueryMetrics stats;
+            auto query = UnitVectorFormat::generate_random(DIMENSIONS);
+            index.search(query, 10, 0.9, filter_type, &stats);
+            REQUIRE(stats.candidates > 0);
+            REQUIRE(stats.distance_computations > 0);
+            REQUIRE(stats.distance_computations <= stats.candidates);
+            REQUIRE(stats.hash_length > 0);
+            REQUIRE(stats.considered_maps > 0);
+            REQUIRE(stats.get_cycles(Computation::Total) >= stats.get_cycles(Computation::Search));
+        }
+        // Only queries that collect metrics are recorded.
+        index.search(UnitVectorFormat::generate_random(DIMENSIONS), 10, 0.9);
+        REQUIRE(get_performance_histograms().num_queries() == 3);
+
+        // Each query in a batch is recorded on its own.
+        std::vector<std::vector<float>> queries;
+        for (int i=0; i < 4; i++) {
+            queries.push_back(UnitVectorFormat::generate_random(DIMENSIONS));
+        }
+        std::vector<QueryMetrics> batch_stats;
+        index.search_batch(queries, 10, 0.9, FilterType::Default, &batch_stats);
+        REQUIRE(batch_stats.size() == queries.size());
+        for (auto& query_stats : batch_stats) {
+            REQUIRE(query_stats.distance_computations > 0);
+            REQUIRE(query_stats.get_cycles(Computation::Total) >= query_stats.get_cycles(Computation::Hashing));
+        }
+        REQUIRE(get_performance_histograms().num_queries() == 7);
+        reset_performance_histograms();
+        index.search_batch(queries, 10, 0.9);
+        REQUIRE(get_performance_histograms().num_queries() == 0);
+        // Joins are not recorded.
+        set_performance_metrics_enabled(true);
+        index.lsh_join(10, 0.5, 0.1);
+        set_performance_metrics_enabled(false);
+        REQUIRE(get_performance_histograms().num_queries() == 0);
+
+        set_performance_metrics_enabled(true);
+        std::thread([&]() {
+            index.search(UnitVectorFormat::generate_random(DIMENSIONS), 10, 0.9);
+        }).join();
+        index.search_from_index(0, 10, 0.9);
+        set_performance_metrics_enabled(false);
+        auto histograms = get_performance_histograms();
+        REQUIRE(histograms.num_queries() == 2);
+        REQUIRE(histograms.distance_computations.quantile(0.0) > 0);
+        REQUIRE(histograms.get_cycles(Computation::Total).quantile(1.0) > 0);
+
+        reset_performance_histograms();
+        REQUIRE(get_performance_histograms().num_queries() == 0);
+    }
+
+    TEST_CASE("Histogram") {
+        Histogram histogram;
+        REQUIRE(histogram.quantile(0.5) == 0);
+        for (uint64_t v : { 0, 1, 2, 3, 100, 1000 }) {
+            histogram.add(v);
+        }
+        REQUIRE(histogram.count() == 6);
+        REQUIRE(histogram.get_count(Histogram::bucket(2)) == 2);
+        REQUIRE(histogram.quantile(0.0) == 0);
+        REQUIRE(histogram.quantile(0.5) == 3);
+        REQUIRE(histogram.quantile(0.8) == 127);
+        REQUIRE(histogram.quantile(1.0) == 1023);
+        REQUIRE(Histogram::bucket(UINT64_MAX) == Histogram::NUM_BUCKETS-1);
+    }
 }
@@ -3,9 +3,11 @@
 #include "catch.hpp"
 
 #include "puffinn/dataset.hpp"
+#include "puffinn/format/set.hpp"
 #include "puffinn/format/unit_vector.hpp"
 
 #include <cstring>
+#include <sstream>
 
 namespace dataset {
     using namespace puffinn;
@@ -48,4 +50,50 @@ namespace dataset {
         // Initial vector still there.
         REQUIRE(dataset[0][1] == UnitVectorFormat::to_16bit_fixed_point(1.0));
     }
+
+    TEST_CASE("Dataset of sets") {
+        const unsigned int UNIVERSE = 100;
+        const unsigned int SIZE = 1000;
+
+        Dataset<SetFormat> dataset(UNIVERSE);
+        std::vector<std::vector<uint32_t>> sets;
+        for (unsigned int i=0; i < SIZE; i++) {
+            sets.push_back(SetFormat::generate_random(UNIVERSE));
+            std::reverse(sets.back().begin(), sets.back().end());
+            dataset.insert(sets.back());
+            std::sort(sets.back().begin(), sets.back().end());
+        }
+        REQUIRE_THROWS(dataset.insert(std::vector<uint32_t>{UNIVERSE}));
+        REQUIRE(dataset.get_size() == SIZE);
+        // Sets are sorted and still valid after the tokens are moved by later insertions.
+        for (unsigned int i=0; i < SIZE; i++) {
+            REQUIRE(convert_stored_type<SetFormat, std::vector<uint32_t>>(
+                dataset[i], dataset.get_description()) == sets[i]);
+        }
+
+        std::stringstream stream;
+        dataset.serialize(stream);
+        Dataset<SetFormat> deserialized(stream);
+        REQUIRE(deserialized.get_size() == SIZE);
+        for (unsigned int i=0; i < SIZE; i++) {
+            REQUIRE(std::equal(
+                deserialized[i]->begin(), deserialized[i]->end(),
+                sets[i].begin(), sets[i].end()));
+        }
+
+        std::vector<uint32_t> new_ids(SIZE);
+        uint32_t kept = 0;
+        for (unsigned int i=0; i < SIZE; i++) {
+            new_ids[i] = (i%3 == 0) ? REMOVED_INDEX : kept++;
+        }
+        dataset.compact(new_ids);
+        REQUIRE(dataset.get_size() == kept);
+        for (unsigned int i=0; i < SIZE; i++) {
+            if (new_ids[i] != REMOVED_INDEX) {
+                REQUIRE(std::equal(
+                    dataset[new_ids[i]]->begin(), dataset[new_ids[i]]->end(),
+                    sets[i].begin(), sets[i].end()));
+            }
+        }
+    }
 }
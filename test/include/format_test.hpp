@@ -2,6 +2,8 @@
 
 #include "catch.hpp"
 
+#include "puffinn/dataset.hpp"
+#include "puffinn/format/quantized_unit_vector.hpp"
 #include "puffinn/format/unit_vector.hpp"
 
 namespace format {
@@ -31,4 +33,24 @@ namespace format {
         REQUIRE(pad_dimensions<UnitVectorFormat>(16) == 16);
         REQUIRE(pad_dimensions<UnitVectorFormat>(17) == 32);
     }
+
+    TEST_CASE("QuantizedUnitVectorFormat store") {
+        Dataset<QuantizedUnitVectorFormat> dataset(5);
+        auto desc = dataset.get_description();
+        std::vector<float> input{0.4, -0.8, 0.0, 0.2, 0.4};
+        auto stored = to_stored_type<QuantizedUnitVectorFormat>(input, desc);
+        REQUIRE(stored.get()[1] == -QuantizedUnitVectorFormat::MAX_VALUE);
+        REQUIRE(stored.get()[2] == 0);
+
+        auto converted = convert_stored_type<QuantizedUnitVectorFormat, std::vector<float>>(
+            stored.get(), desc);
+        REQUIRE(converted.size() == input.size());
+        for (size_t i=0; i < input.size(); i++) {
+            REQUIRE(std::abs(converted[i]-input[i]) <= 1e-2);
+        }
+
+        // The zero vector is stored without dividing by zero.
+        auto zero = to_stored_type<QuantizedUnitVectorFormat>(std::vector<float>(5, 0.0), desc);
+        REQUIRE(QuantizedUnitVectorFormat::get_scale(zero.get(), desc.args) == 0.0);
+    }
 }
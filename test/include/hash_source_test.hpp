@@ -6,6 +6,8 @@
 #include "puffinn/hash_source/tensor.hpp"
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
+#include "puffinn/hash/minhash.hpp"
+#include "puffinn/hash/quantized.hpp"
 
 using namespace puffinn;
 
@@ -49,6 +51,38 @@ namespace hash_source {
         }
     }
 
+    //! Check that hashing a block of vectors gives the same values as hashing them one by one
+    template <typename T>
+    void test_hash_block(
+        DatasetDescription<typename T::Sim::Format> dimensions,
+        std::unique_ptr<HashSource<T>> source,
+        size_t num_hashes
+    ) {
+        // Not a multiple of the number of vectors that are hashed together.
+        const size_t NUM_VECTORS = 23;
+
+        std::vector<std::shared_ptr<Hash>> hashes;
+        for (size_t i=0; i < num_hashes; i++) {
+            hashes.push_back(source->sample());
+        }
+        auto vectors = allocate_storage<typename T::Sim::Format>(NUM_VECTORS, dimensions.storage_len);
+        for (size_t v=0; v < NUM_VECTORS; v++) {
+            T::Sim::Format::store(
+                T::Sim::Format::generate_random(dimensions.args),
+                &vectors.get()[v*dimensions.storage_len],
+                dimensions);
+        }
+
+        std::vector<uint64_t> block(NUM_VECTORS*num_hashes);
+        source->hash_block(hashes, vectors.get(), NUM_VECTORS, dimensions.storage_len, block.data());
+        for (size_t v=0; v < NUM_VECTORS; v++) {
+            auto state = source->reset(&vectors.get()[v*dimensions.storage_len], false);
+            for (size_t h=0; h < num_hashes; h++) {
+                REQUIRE(block[v*num_hashes+h] == (*hashes[h])(state.get()));
+            }
+        }
+    }
+
     template <typename T>
     void test_hashes(
         DatasetDescription<typename T::Sim::Format> dimensions,
@@ -108,6 +142,158 @@ namespace hash_source {
             IndependentHashArgs<FHTCrossPolytopeHash>().build(dimensions, 2, 20));
     }
 
+    TEST_CASE("HashSource hash_block") {
+        Dataset<UnitVectorFormat> dataset(100);
+        auto dimensions = dataset.get_description();
+        test_hash_block<SimHash>(
+            dimensions,
+            IndependentHashArgs<SimHash>().build(dimensions, 32, 64),
+            32);
+        test_hash_block<SimHash>(
+            dimensions,
+            IndependentHashArgs<SimHash>().build(dimensions, 10, 20),
+            10);
+        test_hash_block<FHTCrossPolytopeHash>(
+            dimensions,
+            IndependentHashArgs<FHTCrossPolytopeHash>().build(dimensions, 10, 20),
+            10);
+        test_hash_block<SimHash>(
+            dimensions,
+            HashPoolArgs<SimHash>(60).build(dimensions, 10, 64),
+            10);
+
+        Dataset<QuantizedUnitVectorFormat> quantized_dataset(100);
+        auto quantized_dimensions = quantized_dataset.get_description();
+        test_hash_block<QuantizedHash<SimHash>>(
+            quantized_dimensions,
+            IndependentHashArgs<QuantizedHash<SimHash>>().build(quantized_dimensions, 10, 20),
+            10);
+        test_hash_block<QuantizedHash<FHTCrossPolytopeHash>>(
+            quantized_dimensions,
+            IndependentHashArgs<QuantizedHash<FHTCrossPolytopeHash>>()
+                .build(quantized_dimensions, 10, 20),
+            10);
+
+        Dataset<SetFormat> set_dataset(1000);
+        auto set_dimensions = set_dataset.get_description();
+        // Not a multiple of the number of functions that are computed together.
+        test_hash_block<MinHash>(
+            set_dimensions,
+            IndependentHashArgs<MinHash>().build(set_dimensions, 7, 24),
+            7);
+        test_hash_block<MinHash1Bit>(
+            set_dimensions,
+            IndependentHashArgs<MinHash1Bit>().build(set_dimensions, 3, 64),
+            3);
+    }
+
+    //! Check that hashing the repetitions of a block of vectors gives the same values as
+    //! hashing them one by one
+    template <typename T>
+    void test_repetitions_block(
+        DatasetDescription<typename T::Sim::Format> dimensions,
+        std::unique_ptr<HashSource<T>> source,
+        size_t num_tables
+    ) {
+        // Not a multiple of the number of vectors that are hashed together.
+        const size_t NUM_VECTORS = 19;
+
+        auto vectors = allocate_storage<typename T::Sim::Format>(NUM_VECTORS, dimensions.storage_len);
+        for (size_t v=0; v < NUM_VECTORS; v++) {
+            T::Sim::Format::store(
+                T::Sim::Format::generate_random(dimensions.args),
+                &vectors.get()[v*dimensions.storage_len],
+                dimensions);
+        }
+        std::vector<uint32_t> block;
+        source->hash_repetitions_block(vectors.get(), NUM_VECTORS, dimensions.storage_len, block);
+        REQUIRE(block.size() == NUM_VECTORS*num_tables);
+        std::vector<uint32_t> hashes;
+        for (size_t v=0; v < NUM_VECTORS; v++) {
+            source->hash_repetitions(&vectors.get()[v*dimensions.storage_len], hashes);
+            for (size_t rep=0; rep < num_tables; rep++) {
+                REQUIRE(block[v*num_tables+rep] == hashes[rep]);
+            }
+        }
+    }
+
+    TEST_CASE("HashSource hash_repetitions_block") {
+        Dataset<UnitVectorFormat> dataset(100);
+        auto dimensions = dataset.get_description();
+        test_repetitions_block<FHTCrossPolytopeHash>(
+            dimensions,
+            IndependentHashArgs<FHTCrossPolytopeHash>().build(dimensions, 10, 24),
+            10);
+        test_repetitions_block<SimHash>(
+            dimensions,
+            IndependentHashArgs<SimHash>().build(dimensions, 10, 24),
+            10);
+        test_repetitions_block<SimHash>(
+            dimensions,
+            HashPoolArgs<SimHash>(60).build(dimensions, 10, 24),
+            10);
+
+        Dataset<QuantizedUnitVectorFormat> quantized_dataset(100);
+        auto quantized_dimensions = quantized_dataset.get_description();
+        test_repetitions_block<QuantizedHash<FHTCrossPolytopeHash>>(
+            quantized_dimensions,
+            IndependentHashArgs<QuantizedHash<FHTCrossPolytopeHash>>()
+                .build(quantized_dimensions, 10, 24),
+            10);
+
+        Dataset<SetFormat> set_dataset(1000);
+        auto set_dimensions = set_dataset.get_description();
+        test_repetitions_block<MinHash>(
+            set_dimensions,
+            IndependentHashArgs<MinHash>().build(set_dimensions, 10, 24),
+            10);
+    }
+
+    //! Check that hash_repetitions gives the same values as the sampled hashes for sets
+    template <typename T>
+    void test_set_repetitions(
+        DatasetDescription<SetFormat> dimensions,
+        std::unique_ptr<HashSource<T>> source,
+        size_t num_tables
+    ) {
+        std::vector<std::unique_ptr<Hash>> hashers;
+        for (size_t rep = 0; rep < num_tables; rep++) {
+            hashers.push_back(source->sample());
+        }
+        std::vector<std::vector<uint32_t>> sets = {
+            {},
+            {5},
+            SetFormat::generate_random(dimensions.args)
+        };
+        for (auto& set : sets) {
+            auto stored = to_stored_type<SetFormat>(set, dimensions);
+            std::vector<uint32_t> hashes;
+            source->hash_repetitions(stored.get(), hashes);
+            REQUIRE(hashes.size() == num_tables);
+            auto state = source->reset(stored.get(), false);
+            for (size_t rep = 0; rep < num_tables; rep++) {
+                REQUIRE(hashes[rep] == (*hashers[rep])(state.get()));
+            }
+        }
+    }
+
+    TEST_CASE("MinHash hash_repetitions") {
+        Dataset<SetFormat> dataset(1000);
+        auto dimensions = dataset.get_description();
+        test_set_repetitions<MinHash>(
+            dimensions,
+            IndependentHashArgs<MinHash>().build(dimensions, 30, 24),
+            30);
+        test_set_repetitions<MinHash>(
+            dimensions,
+            HashPoolArgs<MinHash>(300).build(dimensions, 30, 24),
+            30);
+        test_set_repetitions<MinHash>(
+            dimensions,
+            TensoredHashArgs<MinHash>().build(dimensions, 30, 24),
+            30);
+    }
+
     TEST_CASE("IndependentSource new api") {
         Dataset<UnitVectorFormat> dataset(100);
         auto dimensions = dataset.get_description();
@@ -4,9 +4,11 @@
 #include "puffinn/hash/simhash.hpp"
 #include "puffinn/hash/crosspolytope.hpp"
 #include "puffinn/hash/minhash.hpp"
+#include "puffinn/hash/pstable.hpp"
 #include "puffinn/hash_source/pool.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
+#include "puffinn/similarity_measure/l2.hpp"
 
 #include <cstdlib>
 
@@ -123,6 +125,33 @@ namespace hash {
         test_hash_collision_probability<FHTCrossPolytopeHash, CosineSimilarity>(100);
     }
 
+    TEST_CASE("crosspolytope_block versions equal") {
+        const int LOG_DIMENSIONS = 7;
+        const unsigned int NUM_ROTATIONS = 3;
+        std::mt19937_64 rng(42);
+        std::normal_distribution<float> normal(0, 1);
+        std::vector<float> vectors(FHT_BLOCK_LEN << LOG_DIMENSIONS);
+        for (auto& v : vectors) { v = normal(rng); }
+        std::vector<int8_t> signs(NUM_ROTATIONS << LOG_DIMENSIONS);
+        for (auto& s : signs) { s = (rng() & 1) ? 1 : -1; }
+
+        std::vector<float> buf(vectors.size());
+        std::vector<LshDatatype> simple(FHT_BLOCK_LEN), res(FHT_BLOCK_LEN);
+        crosspolytope_block_simple(
+            vectors.data(), signs.data(), NUM_ROTATIONS, LOG_DIMENSIONS, buf.data(), simple.data());
+        crosspolytope_block(
+            vectors.data(), signs.data(), NUM_ROTATIONS, LOG_DIMENSIONS, buf.data(), res.data());
+        REQUIRE(simple == res);
+        #ifdef PUFFINN_RUNTIME_DISPATCH
+            if (__builtin_cpu_supports("avx2")) {
+                crosspolytope_block_avx2(
+                    vectors.data(), signs.data(), NUM_ROTATIONS, LOG_DIMENSIONS,
+                    buf.data(), res.data());
+                REQUIRE(simple == res);
+            }
+        #endif
+    }
+
     TEST_CASE("MinHash collision probability") {
         Dataset<SetFormat> dataset(100);
         MinHash minhash(dataset.get_description(), MinHashArgs());
@@ -137,6 +166,95 @@ namespace hash {
         test_hash_collision_probability<MinHash1Bit, JaccardSimilarity>(100, 4000, 1, args);
     }
 
+    TEST_CASE("MinHashBlock versions equal") {
+        Dataset<SetFormat> dataset(1000);
+        MinHash minhash(dataset.get_description(), MinHashArgs());
+        std::vector<MinHashFunction> functions;
+        for (unsigned int f=0; f < MINHASH_GROUP_SIZE; f++) {
+            functions.push_back(minhash.sample());
+        }
+        MinHashBlock block(
+            [&](size_t f) -> const TabulationHash& { return functions[f].get_hash(); },
+            functions.size());
+
+        for (int i=0; i < 20; i++) {
+            auto set = to_stored_type<SetFormat>(
+                SetFormat::generate_random(1000),
+                dataset.get_description());
+            std::vector<uint64_t> hashes(MINHASH_GROUP_SIZE);
+            block.hash(functions.data(), MINHASH_GROUP_SIZE, 1, 10, set.get(), hashes.data());
+            for (unsigned int f=0; f < MINHASH_GROUP_SIZE; f++) {
+                REQUIRE(hashes[f] == functions[f](set.get()));
+            }
+        }
+
+        std::mt19937_64 rng(42);
+        std::vector<uint64_t> tables(4*256*MINHASH_GROUP_SIZE);
+        for (auto& v : tables) { v = rng(); }
+        // Few distinct tokens, so that tokens with equal hashes are seen.
+        std::vector<uint32_t> tokens;
+        for (int i=0; i < 200; i++) { tokens.push_back(rng() & 0x03030303); }
+        std::vector<uint32_t> simple(MINHASH_GROUP_SIZE), res(MINHASH_GROUP_SIZE);
+        minhash_group_simple(tables.data(), tokens.data(), tokens.size(), simple.data());
+        minhash_group(tables.data(), tokens.data(), tokens.size(), res.data());
+        REQUIRE(simple == res);
+        #ifdef PUFFINN_RUNTIME_DISPATCH
+            if (__builtin_cpu_supports("avx2")) {
+                minhash_group_avx2(tables.data(), tokens.data(), tokens.size(), res.data());
+                REQUIRE(simple == res);
+            }
+            if (__builtin_cpu_supports("avx512f")) {
+                minhash_group_avx512(tables.data(), tokens.data(), tokens.size(), res.data());
+                REQUIRE(simple == res);
+            }
+        #endif
+    }
+
+    TEST_CASE("PStableHash collision probability") {
+        test_hash_collision_probability<PStableHash, L2Distance>(100);
+        test_hash_collision_probability<PStableHash, L2Distance>(3);
+
+        PStableHashArgs args;
+        args.bucket_width = 1.0;
+        args.bits = 2;
+        test_hash_collision_probability<PStableHash, L2Distance>(3, 10000, 0, args);
+        test_hash_collision_probability<PStableHash1Bit, L2Distance>(3, 10000, 1, args);
+        test_hash_collision_probability<PStableHash1Bit, L2Distance>(20, 10000, 1, args);
+
+        // The offset spans 2^bits buckets, but must still be precise within a single bucket.
+        args.bits = 28;
+        test_hash_collision_probability<PStableHash, L2Distance>(3, 10000, 0, args);
+
+        args.bits = 32;
+        Dataset<RealVectorFormat> dataset(3);
+        PStableHash pstable(dataset.get_description(), args);
+        auto p = pstable.collision_probability(0.5, 32);
+        REQUIRE(p > 0.0);
+        REQUIRE(p < 1.0);
+    }
+
+    TEST_CASE("PStableHash icollision_probability") {
+        Dataset<RealVectorFormat> dataset(10);
+        PStableHash pstable(dataset.get_description(), PStableHashArgs());
+        PStableHash1Bit sketch(dataset.get_description(), PStableHashArgs());
+        for (float dist : {0.5, 1.0, 2.0, 5.0}) {
+            float sim = 1.0/(dist*dist+1.0);
+            float p = pstable.collision_probability(sim, 4);
+            REQUIRE(pstable.icollision_probability(p) == Approx(sim).epsilon(0.01));
+        }
+        // The parity of far apart points is almost independent, so only close points
+        // can be recovered accurately.
+        for (float dist : {0.5, 1.0, 2.0}) {
+            float sim = 1.0/(dist*dist+1.0);
+            float p = sketch.collision_probability(sim, 1);
+            REQUIRE(sketch.icollision_probability(p) == Approx(sim).epsilon(0.01));
+        }
+        // The two ways of computing the probability agree where they meet.
+        REQUIRE(pstable_collision_probability(7.999, 1.0, 16) ==
+            Approx(pstable_collision_probability(8.001, 1.0, 16)).epsilon(1e-3));
+        REQUIRE(pstable_collision_probability(1e6, 1.0, 16) == Approx(1.0/16));
+    }
+
     TEST_CASE("bits_per_function") {
         unsigned int dimensions = 100;
         Dataset<UnitVectorFormat> dataset(dimensions);
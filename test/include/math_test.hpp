@@ -4,9 +4,12 @@
 
 #include "puffinn/dataset.hpp"
 #include "puffinn/math.hpp"
+#include "puffinn/format/quantized_unit_vector.hpp"
 #include "puffinn/format/unit_vector.hpp"
 #include "puffinn/format/real_vector.hpp"
 
+#include <cmath>
+
 namespace math {
     using namespace puffinn;
 
@@ -22,13 +25,133 @@ namespace math {
             auto sb = to_stored_type<UnitVectorFormat>(b, dataset.get_description());
 
             int16_t simple = dot_product_i16_simple(sa.get(), sb.get(), dims);
-            #ifdef __AVX2__
+            REQUIRE(simple == dot_product_i16(sa.get(), sb.get(), dims));
+            #ifdef PUFFINN_RUNTIME_DISPATCH
+                if (__builtin_cpu_supports("avx2")) {
+                    REQUIRE(simple == dot_product_i16_avx2(sa.get(), sb.get(), dims));
+                }
+                if (__builtin_cpu_supports("avx512bw")) {
+                    REQUIRE(simple == dot_product_i16_avx512(sa.get(), sb.get(), dims));
+                }
+            #elif defined(__AVX2__)
                 int16_t avx2 = dot_product_i16_avx2(sa.get(), sb.get(), dims);
                 REQUIRE(simple == avx2);
             #endif
         }
     }
 
+    TEST_CASE("dot_product_i16_exact versions equal") {
+        unsigned reps = 100;
+        // Not a multiple of the number of values in a vector.
+        unsigned dims = 75;
+        Dataset<UnitVectorFormat> dataset(dims);
+
+        for (unsigned i=0; i < reps; i++) {
+            auto a = UnitVectorFormat::generate_random(dims);
+            auto b = (i == 0 ? a : UnitVectorFormat::generate_random(dims));
+            auto sa = to_stored_type<UnitVectorFormat>(a, dataset.get_description());
+            auto sb = to_stored_type<UnitVectorFormat>(b, dataset.get_description());
+
+            // Values are normalized when stored.
+            float dot = 0, norm_a = 0, norm_b = 0;
+            for (unsigned j=0; j < dims; j++) {
+                dot += a[j]*b[j];
+                norm_a += a[j]*a[j];
+                norm_b += b[j]*b[j];
+            }
+            dot /= std::sqrt(norm_a*norm_b);
+            int16_t simple = dot_product_i16_exact_simple(sa.get(), sb.get(), dims);
+            REQUIRE(UnitVectorFormat::from_16bit_fixed_point(simple) == Approx(dot).margin(0.001));
+            REQUIRE(simple == dot_product_i16_exact(sa.get(), sb.get(), dims));
+            #ifdef PUFFINN_RUNTIME_DISPATCH
+                if (__builtin_cpu_supports("avx2")) {
+                    REQUIRE(simple == dot_product_i16_exact_avx2(sa.get(), sb.get(), dims));
+                }
+                if (__builtin_cpu_supports("avx512bw")) {
+                    REQUIRE(simple == dot_product_i16_exact_avx512(sa.get(), sb.get(), dims));
+                }
+                if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+                    REQUIRE(simple == dot_product_i16_exact_vnni(sa.get(), sb.get(), dims));
+                }
+            #endif
+        }
+    }
+
+    TEST_CASE("dot_product_i16_exact_signs_x16 versions equal") {
+        unsigned dims = 75;
+        // Fewer than 16 vectors, so some are missing.
+        unsigned num_vectors = 13;
+        Dataset<UnitVectorFormat> dataset(dims);
+        for (unsigned i=0; i < num_vectors+4; i++) {
+            dataset.insert(UnitVectorFormat::generate_random(dims));
+        }
+        auto storage_len = dataset.get_description().storage_len;
+
+        const int16_t* vectors[16];
+        for (unsigned j=0; j < num_vectors; j++) {
+            vectors[j] = dataset[j];
+        }
+        std::vector<int16_t> interleaved(16*storage_len);
+        interleave_i16_x16(vectors, num_vectors, storage_len, interleaved.data());
+        const int16_t* lhs[4];
+        for (unsigned l=0; l < 4; l++) {
+            lhs[l] = dataset[num_vectors+l];
+        }
+
+        uint16_t simple[4];
+        dot_product_i16_exact_signs_x16_simple(lhs, interleaved.data(), storage_len, simple);
+        for (unsigned l=0; l < 4; l++) {
+            for (unsigned j=0; j < 16; j++) {
+                bool expected = j >= num_vectors ||
+                    dot_product_i16_exact_simple(lhs[l], vectors[j], storage_len) >= 0;
+                REQUIRE(((simple[l] >> j) & 1) == expected);
+            }
+        }
+
+        uint16_t res[4];
+        dot_product_i16_exact_signs_x16(lhs, interleaved.data(), storage_len, res);
+        REQUIRE(std::equal(res, res+4, simple));
+        #ifdef PUFFINN_RUNTIME_DISPATCH
+            if (__builtin_cpu_supports("avx2")) {
+                dot_product_i16_exact_signs_x16_avx2(lhs, interleaved.data(), storage_len, res);
+                REQUIRE(std::equal(res, res+4, simple));
+            }
+            if (__builtin_cpu_supports("avx512bw")) {
+                dot_product_i16_exact_signs_x16_avx512(lhs, interleaved.data(), storage_len, res);
+                REQUIRE(std::equal(res, res+4, simple));
+            }
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni")) {
+                dot_product_i16_exact_signs_x16_vnni(lhs, interleaved.data(), storage_len, res);
+                REQUIRE(std::equal(res, res+4, simple));
+            }
+        #endif
+    }
+
+    TEST_CASE("dot_product_i8 versions equal") {
+        unsigned reps = 100;
+        // Not a multiple of the number of values in a vector.
+        unsigned dims = 75;
+        Dataset<QuantizedUnitVectorFormat> dataset(dims);
+
+        for (unsigned i=0; i < reps; i++) {
+            auto a = QuantizedUnitVectorFormat::generate_random(dims);
+            auto b = (i == 0 ? a : QuantizedUnitVectorFormat::generate_random(dims));
+            auto sa = to_stored_type<QuantizedUnitVectorFormat>(a, dataset.get_description());
+            auto sb = to_stored_type<QuantizedUnitVectorFormat>(b, dataset.get_description());
+
+            int32_t simple = dot_product_i8_simple(sa.get(), sb.get(), dims);
+            REQUIRE(simple == dot_product_i8(sa.get(), sb.get(), dims));
+            #ifdef PUFFINN_RUNTIME_DISPATCH
+                if (__builtin_cpu_supports("avx2")) {
+                    REQUIRE(simple == dot_product_i8_avx2(sa.get(), sb.get(), dims));
+                }
+                if (__builtin_cpu_supports("avx512bw")) {
+                    REQUIRE(simple == dot_product_i8_avx512(sa.get(), sb.get(), dims));
+                }
+            #endif
+        }
+    }
+
     TEST_CASE("l2_distance_float versions equal") {
         unsigned reps = 100;
         unsigned dims = 100;
@@ -48,4 +171,76 @@ namespace math {
             #endif
         }
     }
+
+    TEST_CASE("dot_product_float versions equal") {
+        unsigned reps = 100;
+        unsigned dims = 100;
+        Dataset<RealVectorFormat> dataset(dims);
+
+        for (unsigned i=0; i < reps; i++) {
+            auto a = RealVectorFormat::generate_random(dims);
+            auto b = RealVectorFormat::generate_random(dims);
+            auto sa = to_stored_type<RealVectorFormat>(a, dataset.get_description());
+            auto sb = to_stored_type<RealVectorFormat>(b, dataset.get_description());
+
+            float simple = dot_product_float_simple(sa.get(), sb.get(), dims);
+            #ifdef __AVX__
+                float avx = dot_product_float_avx(sa.get(), sb.get(), dims);
+                // Order of operations differ, so small error is accetable.
+                REQUIRE(simple == Approx(avx).epsilon(0.0001).margin(0.0001));
+            #endif
+        }
+    }
+
+    TEST_CASE("intersection_size versions equal") {
+        auto& rng = get_default_random_generator();
+        // Lengths around the block sizes of the kernels and with skewed ratios.
+        std::vector<std::pair<size_t, size_t>> lengths = {
+            {0, 10}, {1, 1}, {3, 5}, {8, 8}, {13, 29}, {100, 100},
+            {5, 300}, {20, 1000}, {64, 65}, {1, 1000}
+        };
+        for (auto len : lengths) {
+            for (unsigned universe : {64u, 2000u}) {
+                for (int rep=0; rep < 20; rep++) {
+                    auto random_set = [&](size_t n) {
+                        std::uniform_int_distribution<uint32_t> dist(0, universe-1);
+                        std::vector<uint32_t> res;
+                        for (size_t i=0; i < n; i++) {
+                            res.push_back(dist(rng));
+                        }
+                        std::sort(res.begin(), res.end());
+                        res.erase(std::unique(res.begin(), res.end()), res.end());
+                        return res;
+                    };
+                    auto a = random_set(len.first);
+                    auto b = random_set(len.second);
+
+                    size_t simple = intersection_size_merge_simple(
+                        a.data(), a.size(), b.data(), b.size());
+                    REQUIRE(simple == intersection_size_merge(
+                        a.data(), a.size(), b.data(), b.size()));
+                    REQUIRE(simple == intersection_size_merge(
+                        b.data(), b.size(), a.data(), a.size()));
+                    REQUIRE(simple == intersection_size_gallop(
+                        a.data(), a.size(), b.data(), b.size()));
+                    REQUIRE(simple == intersection_size_gallop_simple(
+                        a.data(), a.size(), b.data(), b.size()));
+                    #ifdef PUFFINN_RUNTIME_DISPATCH
+                        if (__builtin_cpu_supports("sse2")) {
+                            REQUIRE(simple == intersection_size_merge_sse(
+                                a.data(), a.size(), b.data(), b.size()));
+                            REQUIRE(simple == intersection_size_gallop_sse(
+                                a.data(), a.size(), b.data(), b.size()));
+                        }
+                        if (__builtin_cpu_supports("avx2")) {
+                            REQUIRE(simple == intersection_size_merge_avx2(
+                                a.data(), a.size(), b.data(), b.size()));
+                            REQUIRE(simple == intersection_size_gallop_avx2(
+                                a.data(), a.size(), b.data(), b.size()));
+                        }
+                    #endif
+                }
+            }
+        }
+    }
 }
@@ -116,4 +116,32 @@ namespace puffinn {
         });
     }
 
+
+    TEST_CASE("Concurrent inserts") {
+        const size_t n = 50;
+        const size_t k = 5;
+        MaxBufferCollection buffer;
+        buffer.init(n, k);
+        // Every pair is inserted several times from different threads.
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < 4*n*n; i++) {
+            uint32_t a = (i/n)%n;
+            uint32_t b = i%n;
+            buffer.insert(a, b, static_cast<float>((a*7+b*13)%97)/97);
+        }
+        for (uint32_t a = 0; a < n; a++) {
+            std::vector<MaxBufferCollection::ResultPair> expected;
+            for (uint32_t b = 0; b < n; b++) {
+                expected.push_back({b, static_cast<float>((a*7+b*13)%97)/97});
+            }
+            std::sort(expected.begin(), expected.end(), [](auto l, auto r) {
+                return l.second > r.second;
+            });
+            auto best = buffer.best_entries(a);
+            REQUIRE(best.size() == k);
+            for (size_t j = 0; j < k; j++) {
+                REQUIRE(best[j].second == expected[j].second);
+            }
+        }
+    }
 }
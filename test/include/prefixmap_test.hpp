@@ -1,7 +1,198 @@
 #include "catch.hpp"
 #include "puffinn/prefixmap.hpp"
+#include "puffinn/hash/simhash.hpp"
+
+#include <random>
 
 using namespace puffinn;
 
 namespace prefixmap {
+    TEST_CASE("PrefixMap::rebuild merges new values") {
+        PrefixMap<SimHash> map(MAX_HASHBITS);
+
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<LshDatatype> hash_distribution(0, (1 << MAX_HASHBITS)-1);
+        // Every inserted pair, in insertion order.
+        std::vector<std::pair<LshDatatype, uint32_t>> inserted;
+
+        uint32_t next_idx = 0;
+        for (size_t batch_size : { 0, 1000, 1, 0, 5000, 30 }) {
+            for (size_t i=0; i < batch_size; i++) {
+                // Use few distinct hashes to also check the order of equal hashes.
+                auto hash = hash_distribution(rng) & 0xfff0f0;
+                map.insert(0, next_idx, hash);
+                inserted.push_back({ hash, next_idx });
+                next_idx++;
+            }
+            map.rebuild();
+
+            auto expected = inserted;
+            std::stable_sort(expected.begin(), expected.end(),
+                [](const std::pair<LshDatatype, uint32_t>& a, const std::pair<LshDatatype, uint32_t>& b) {
+                    return a.first < b.first;
+                });
+
+            REQUIRE(map.hashes.size() == expected.size()+2*SEGMENT_SIZE);
+            REQUIRE(map.indices.size() == expected.size()+2*SEGMENT_SIZE);
+            for (size_t i=0; i < expected.size(); i++) {
+                REQUIRE(map.hashes[SEGMENT_SIZE+i] == expected[i].first);
+                REQUIRE(map.indices[SEGMENT_SIZE+i] == expected[i].second);
+            }
+
+            // The prefix index points to the first value with at least the given prefix.
+            const unsigned int PREFIX_BITS = map.prefix_index_bits;
+            REQUIRE(map.prefix_index.size() == (1u << PREFIX_BITS)+1);
+            size_t first = 0;
+            for (uint32_t prefix=0; prefix <= (1u << PREFIX_BITS); prefix++) {
+                while (
+                    first < expected.size() &&
+                    (expected[first].first >> (MAX_HASHBITS-PREFIX_BITS)) < prefix
+                ) {
+                    first++;
+                }
+                REQUIRE(map.prefix_index[prefix] == SEGMENT_SIZE+first);
+            }
+        }
+    }
+
+    TEST_CASE("PrefixMap::rebuild from another map") {
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<LshDatatype> hash_distribution(0, (1 << MAX_HASHBITS)-1);
+
+        PrefixMap<SimHash> base(MAX_HASHBITS);
+        PrefixMap<SimHash> all(MAX_HASHBITS);
+        for (uint32_t idx=0; idx < 3000; idx++) {
+            auto hash = hash_distribution(rng) & 0xfff0f0;
+            base.insert(0, idx, hash);
+            all.insert(0, idx, hash);
+        }
+        base.rebuild();
+        std::vector<LshDatatype> base_hashes(base.hashes.begin(), base.hashes.end());
+
+        PrefixMap<SimHash> next(MAX_HASHBITS);
+        for (uint32_t idx=3000; idx < 4000; idx++) {
+            auto hash = hash_distribution(rng) & 0xfff0f0;
+            next.insert(0, idx, hash);
+            all.insert(0, idx, hash);
+        }
+        next.rebuild(base);
+        all.rebuild();
+
+        // The base is not modified.
+        REQUIRE(std::vector<LshDatatype>(base.hashes.begin(), base.hashes.end()) == base_hashes);
+        REQUIRE(next.hashes.size() == all.hashes.size());
+        for (size_t i=0; i < all.hashes.size(); i++) {
+            REQUIRE(next.hashes[i] == all.hashes[i]);
+            REQUIRE(next.indices[i] == all.indices[i]);
+        }
+        REQUIRE(next.prefix_index_bits == all.prefix_index_bits);
+        for (size_t i=0; i < all.prefix_index.size(); i++) {
+            REQUIRE(next.prefix_index[i] == all.prefix_index[i]);
+        }
+
+        // Without new values the contents of the base are copied.
+        PrefixMap<SimHash> copy(MAX_HASHBITS);
+        copy.rebuild(base);
+        REQUIRE(std::vector<LshDatatype>(copy.hashes.begin(), copy.hashes.end()) == base_hashes);
+    }
+
+    TEST_CASE("PrefixMap prefix index grows with the size") {
+        PrefixMap<SimHash> map(MAX_HASHBITS);
+        auto initial_bits = map.prefix_index_bits;
+
+        std::mt19937 rng(2345);
+        std::uniform_int_distribution<LshDatatype> hash_distribution(0, (1 << MAX_HASHBITS)-1);
+        std::vector<LshDatatype> sorted;
+        for (uint32_t idx=0; idx < (1 << 19); idx++) {
+            auto hash = hash_distribution(rng);
+            map.insert(0, idx, hash);
+            sorted.push_back(hash);
+        }
+        map.rebuild();
+        std::sort(sorted.begin(), sorted.end());
+
+        REQUIRE(map.prefix_index_bits > initial_bits);
+        REQUIRE(map.prefix_index.size() == (1u << map.prefix_index_bits)+1);
+        REQUIRE(((sorted.size() >> map.prefix_index_bits) <= 16));
+
+        // Queries start at the first hash that is not smaller than the query.
+        for (int i=0; i < 10000; i++) {
+            auto hash = hash_distribution(rng);
+            auto query = map.create_query(hash);
+            auto expected = std::lower_bound(sorted.begin(), sorted.end(), hash)-sorted.begin();
+            REQUIRE(query.prefix_start == SEGMENT_SIZE+expected);
+        }
+    }
+
+    TEST_CASE("PrefixMap find_positions") {
+        PrefixMap<SimHash> map(MAX_HASHBITS);
+
+        std::mt19937 rng(3456);
+        std::uniform_int_distribution<LshDatatype> hash_distribution(0, (1 << MAX_HASHBITS)-1);
+        for (uint32_t idx=0; idx < 20000; idx++) {
+            map.insert(0, idx, hash_distribution(rng));
+        }
+        map.rebuild();
+
+        // Include equal hashes and hashes outside the range of the stored ones.
+        std::vector<std::pair<LshDatatype, uint32_t>> sorted;
+        for (uint32_t q=0; q < 1000; q++) {
+            sorted.push_back(std::make_pair(hash_distribution(rng) & 0xfffff0, q));
+        }
+        sorted.push_back(std::make_pair(0, 1000));
+        sorted.push_back(std::make_pair((1 << MAX_HASHBITS)-1, 1001));
+        std::sort(sorted.begin(), sorted.end());
+
+        const size_t STRIDE = 3;
+        std::vector<uint32_t> positions(STRIDE*sorted.size());
+        map.find_positions(sorted, positions.data(), STRIDE);
+        for (auto& entry : sorted) {
+            auto query = map.create_query(entry.first);
+            REQUIRE(positions[entry.second*STRIDE] == query.prefix_start);
+        }
+    }
+
+    TEST_CASE("PrefixMap splits") {
+        PrefixMap<SimHash> map(MAX_HASHBITS);
+
+        std::mt19937 rng(4321);
+        std::uniform_int_distribution<LshDatatype> hash_distribution(0, (1 << MAX_HASHBITS)-1);
+        for (uint32_t idx=0; idx < 3000; idx++) {
+            map.insert(0, idx, hash_distribution(rng) & 0xff0ff0);
+        }
+        map.rebuild();
+
+        uint32_t real_begin = SEGMENT_SIZE;
+        uint32_t real_end = map.hashes.size()-SEGMENT_SIZE;
+        size_t num_boundaries = 0;
+        for (auto pos = real_begin+1; pos < real_end; pos++) {
+            if (map.hashes[pos] != map.hashes[pos-1]) {
+                num_boundaries++;
+            }
+        }
+
+        size_t num_splits = 0;
+        REQUIRE(map.splits_begin(MAX_HASHBITS) == map.splits_end(MAX_HASHBITS));
+        for (unsigned int depth=0; depth < MAX_HASHBITS; depth++) {
+            auto shift = MAX_HASHBITS-depth;
+            for (auto j = map.splits_begin(depth); j < map.splits_end(depth); j++) {
+                auto split = map.get_split(depth, j);
+                num_splits++;
+                REQUIRE(real_begin <= split.begin);
+                REQUIRE(split.begin < split.split);
+                REQUIRE(split.split < split.end);
+                REQUIRE(split.end <= real_end);
+                auto prefix = map.hashes[split.split] >> shift;
+                for (auto pos = split.begin; pos < split.end; pos++) {
+                    REQUIRE((map.hashes[pos] >> shift) == prefix);
+                    // The next bit after the prefix separates the two sides.
+                    REQUIRE(((map.hashes[pos] >> (shift-1)) & 1) == (pos >= split.split ? 1u : 0u));
+                }
+                // The sides cannot be extended.
+                REQUIRE((split.begin == real_begin || (map.hashes[split.begin-1] >> shift) != prefix));
+                REQUIRE((split.end == real_end || (map.hashes[split.end] >> shift) != prefix));
+            }
+        }
+        REQUIRE(num_splits == num_boundaries);
+    }
 }
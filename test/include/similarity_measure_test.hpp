@@ -5,6 +5,7 @@
 #include "puffinn/format/generic.hpp"
 #include "puffinn/similarity_measure/cosine.hpp"
 #include "puffinn/similarity_measure/l2.hpp"
+#include "puffinn/similarity_measure/quantized_cosine.hpp"
 #include "puffinn/similarity_measure/jaccard.hpp"
 
 namespace similarity_measure {
@@ -41,6 +42,28 @@ namespace similarity_measure {
         REQUIRE(std::abs(res64-expected) <= 1e-4);
     }
 
+    TEST_CASE("QuantizedCosineSimilarity::compute_similarity") {
+        Dataset<QuantizedCosineSimilarity::Format> dataset(100);
+        auto desc = dataset.get_description();
+        for (int i=0; i < 20; i++) {
+            auto v1 = UnitVectorFormat::generate_random(100);
+            auto v2 = UnitVectorFormat::generate_random(100);
+            // Values are normalized when stored.
+            float dot = 0.0, norm_1 = 0.0, norm_2 = 0.0;
+            for (size_t d=0; d < 100; d++) {
+                dot += v1[d]*v2[d];
+                norm_1 += v1[d]*v1[d];
+                norm_2 += v2[d]*v2[d];
+            }
+            dot /= std::sqrt(norm_1*norm_2);
+            auto stored_1 = to_stored_type<QuantizedCosineSimilarity::Format>(v1, desc);
+            auto stored_2 = to_stored_type<QuantizedCosineSimilarity::Format>(v2, desc);
+            float res = QuantizedCosineSimilarity::compute_similarity(
+                stored_1.get(), stored_2.get(), desc);
+            REQUIRE(std::abs(res-(dot+1)/2) <= 1e-2);
+        }
+    }
+
     TEST_CASE("L2Distance::compute_similarity") {
         Dataset<RealVectorFormat> dataset(32);
         auto v1 = allocate_storage<RealVectorFormat>(1, 32);
@@ -67,7 +90,7 @@ namespace similarity_measure {
         Dataset<SetFormat> dataset(100);
         auto d = dataset.get_description();
 
-        std::vector<uint32_t> a, b;
+        SetFormat::Type a, b;
         SetFormat::store({}, &a, d);
         SetFormat::store({}, &b, d);
         REQUIRE(JaccardSimilarity::compute_similarity_linear(&a, &b) == 0);
@@ -110,6 +133,73 @@ namespace similarity_measure {
             JaccardSimilarity::compute_similarity_gallop(&a, &b)
             == Approx(2.0/7.0));
     }
-}
 
+    template <typename T>
+    void test_compute_similarity_batch(typename T::Format::Args args) {
+        Dataset<typename T::Format> dataset(args);
+        for (int i=0; i < 50; i++) {
+            dataset.insert(T::Format::generate_random(args));
+        }
+        auto query = to_stored_type<typename T::Format>(
+            T::Format::generate_random(args),
+            dataset.get_description());
+
+        // Includes repeated ids and a length that is not a multiple of 4.
+        std::vector<uint32_t> ids;
+        for (uint32_t i=0; i < 50; i += 2) {
+            ids.push_back(i);
+            ids.push_back(49-i);
+        }
+        ids.push_back(7);
+        std::vector<float> sims(ids.size());
+        T::compute_similarity_batch(query.get(), dataset, ids.data(), ids.size(), sims.data());
+        for (size_t i=0; i < ids.size(); i++) {
+            REQUIRE(sims[i] == T::compute_similarity(
+                query.get(),
+                dataset[ids[i]],
+                dataset.get_description()));
+        }
+    }
+
+    template <typename T>
+    void test_compute_similarity_block(typename T::Format::Args args) {
+        Dataset<typename T::Format> dataset(args);
+        for (int i=0; i < 50; i++) {
+            dataset.insert(T::Format::generate_random(args));
+        }
+        std::vector<uint32_t> left = {3, 1, 4, 1, 5, 9, 2};
+        std::vector<uint32_t> right;
+        for (uint32_t i=0; i < 50; i += 3) {
+            right.push_back(i);
+        }
+        std::vector<float> sims(left.size()*right.size());
+        T::compute_similarity_block(
+            dataset,
+            left.data(), left.size(),
+            right.data(), right.size(),
+            sims.data());
+        for (size_t l=0; l < left.size(); l++) {
+            for (size_t r=0; r < right.size(); r++) {
+                REQUIRE(sims[l*right.size()+r] == T::compute_similarity(
+                    dataset[left[l]],
+                    dataset[right[r]],
+                    dataset.get_description()));
+            }
+        }
+    }
 
+    TEST_CASE("compute_similarity_block") {
+        test_compute_similarity_block<CosineSimilarity>(75);
+        test_compute_similarity_block<QuantizedCosineSimilarity>(75);
+        test_compute_similarity_block<L2Distance>(30);
+        test_compute_similarity_block<JaccardSimilarity>(100);
+    }
+
+    TEST_CASE("compute_similarity_batch") {
+        test_compute_similarity_batch<CosineSimilarity>(75);
+        test_compute_similarity_batch<CosineSimilarity>(128);
+        test_compute_similarity_batch<QuantizedCosineSimilarity>(75);
+        test_compute_similarity_batch<L2Distance>(30);
+        test_compute_similarity_batch<JaccardSimilarity>(100);
+    }
+}
@@ -53,4 +53,35 @@ namespace sorthash {
         }
     }
 
+    TEST_CASE("Sort hash value pairs with given bits") {
+        size_t n = 10000;
+        std::mt19937 generator (1234);
+
+        for (unsigned int bits : {8, 16, 24, 31}) {
+            std::uniform_int_distribution<uint32_t> distribution(0, (1u << bits)-1);
+            std::vector<uint32_t> hashes;
+            std::vector<uint32_t> indices;
+            for (size_t i = 0; i < n; i++) {
+                hashes.push_back(distribution(generator));
+                indices.push_back(i);
+            }
+            std::vector<uint32_t> original_hashes(hashes);
+            std::vector<uint32_t> hashes_out;
+            std::vector<uint32_t> indices_out;
+
+            puffinn::sort_hashes_pairs(hashes, hashes_out, indices, indices_out, bits);
+
+            std::vector<uint32_t> expected(original_hashes);
+            std::sort(expected.begin(), expected.end());
+            REQUIRE(hashes_out == expected);
+            // The sort is stable, so equal hashes keep the order of their ids.
+            for (size_t i = 0; i < n; i++) {
+                REQUIRE(hashes_out[i] == original_hashes[indices_out[i]]);
+                if (i > 0 && hashes_out[i] == hashes_out[i-1]) {
+                    REQUIRE(indices_out[i] > indices_out[i-1]);
+                }
+            }
+        }
+    }
+
 }
\ No newline at end of file